@@ -0,0 +1,327 @@
+#include "backup.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "throttle.h"
+#include "utils.h"
+
+// Range of pairs of backup_sort: sorted in place, or the two sorted runs
+// [begin, middle) and [middle, end) of src merged into dst
+typedef struct SortPart {
+    KvsPair *src;
+    KvsPair *dst;
+    size_t begin;
+    size_t middle;
+    size_t end;
+} SortPart;
+
+// Range of pairs of backup_write_text
+typedef struct TextPart {
+    int fd;
+    const KvsPair *pairs;
+    size_t count;
+    size_t size;    // Length of the text of the pairs
+    off_t offset;   // Offset of the text of the first pair
+    int failed;
+} TextPart;
+
+// Runs a function on each part, on a thread of its own except for the last
+// one, which runs on the calling thread like those whose thread could not be
+// created
+static void run_parts(void *(*function)(void *), void *parts, size_t size,
+                      size_t count) {
+    pthread_t *threads = malloc(count * sizeof(pthread_t));
+    size_t started = 0;
+    for (size_t i = 0; i < count; i++) {
+        void *part = (char *)parts + i * size;
+        if (i + 1 == count || threads == NULL ||
+            pthread_create(&threads[started], NULL, function, part) != 0) {
+            function(part);
+        } else {
+            started++;
+        }
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+size_t backup_threads(size_t count, size_t max_threads) {
+    size_t threads = count / BACKUP_MIN_PAIRS_PER_THREAD;
+    if (threads > max_threads) threads = max_threads;
+    return threads > 0 ? threads : 1;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(((const KvsPair *)a)->key, ((const KvsPair *)b)->key);
+}
+
+static void *sort_part(void *arg) {
+    SortPart *part = arg;
+    qsort(part->src + part->begin, part->end - part->begin, sizeof(KvsPair),
+          compare_pairs);
+    return NULL;
+}
+
+static void *merge_part(void *arg) {
+    SortPart *part = arg;
+    const KvsPair *src = part->src;
+    size_t left = part->begin;
+    size_t right = part->middle;
+    size_t out = part->begin;
+    while (left < part->middle && right < part->end) {
+        part->dst[out++] = strcmp(src[left].key, src[right].key) < 0
+                               ? src[left++]
+                               : src[right++];
+    }
+    memcpy(part->dst + out, src + left, (part->middle - left) * sizeof(KvsPair));
+    out += part->middle - left;
+    memcpy(part->dst + out, src + right, (part->end - right) * sizeof(KvsPair));
+    return NULL;
+}
+
+void backup_sort(KvsPair *pairs, size_t count, size_t num_threads) {
+    KvsPair *spare = NULL;
+    SortPart *parts = NULL;
+    size_t *bounds = NULL;
+    if (num_threads > 1 && count >= num_threads) {
+        spare = malloc(count * sizeof(KvsPair));
+        parts = malloc(num_threads * sizeof(SortPart));
+        bounds = malloc((num_threads + 1) * sizeof(size_t));
+    }
+    if (spare == NULL || parts == NULL || bounds == NULL) {
+        if (count > 0) qsort(pairs, count, sizeof(KvsPair), compare_pairs);
+        free(spare);
+        free(parts);
+        free(bounds);
+        return;
+    }
+
+    for (size_t i = 0; i <= num_threads; i++) {
+        bounds[i] = count * i / num_threads;
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+        parts[i] = (SortPart){pairs, NULL, bounds[i], 0, bounds[i + 1]};
+    }
+    run_parts(sort_part, parts, sizeof(SortPart), num_threads);
+
+    // Each round merges the runs two by two, a last odd run being copied
+    KvsPair *src = pairs;
+    KvsPair *dst = spare;
+    for (size_t runs = num_threads; runs > 1; runs = (runs + 1) / 2) {
+        size_t merges = 0;
+        for (size_t r = 0; r < runs; r += 2) {
+            size_t end = r + 2 <= runs ? bounds[r + 2] : bounds[r + 1];
+            size_t middle = r + 2 <= runs ? bounds[r + 1] : end;
+            parts[merges++] = (SortPart){src, dst, bounds[r], middle, end};
+        }
+        run_parts(merge_part, parts, sizeof(SortPart), merges);
+        for (size_t m = 0; m < merges; m++) bounds[m] = parts[m].begin;
+        bounds[merges] = count;
+
+        KvsPair *merged = dst;
+        dst = src;
+        src = merged;
+    }
+    if (src != pairs) memcpy(pairs, src, count * sizeof(KvsPair));
+
+    free(spare);
+    free(parts);
+    free(bounds);
+}
+
+// Length of the line of a pair, "(key, value)\n"
+static size_t text_size(const KvsPair *pair) {
+    return strlen(pair->key) + strlen(pair->value) + 5;
+}
+
+static void *size_part(void *arg) {
+    TextPart *part = arg;
+    part->size = 0;
+    for (size_t i = 0; i < part->count; i++) {
+        part->size += text_size(&part->pairs[i]);
+    }
+    return NULL;
+}
+
+static void *write_part(void *arg) {
+    TextPart *part = arg;
+    char *buffer = aligned_alloc(BACKUP_BUFFER_ALIGN, BACKUP_BUFFER_SIZE);
+    if (buffer == NULL) {
+        part->failed = 1;
+        return NULL;
+    }
+
+    size_t used = 0;
+    off_t offset = part->offset;
+    for (size_t i = 0; i < part->count; i++) {
+        const KvsPair *pair = &part->pairs[i];
+        size_t key_len = strlen(pair->key);
+        size_t value_len = strlen(pair->value);
+        if (used + key_len + value_len + 5 > BACKUP_BUFFER_SIZE) {
+            throttle_backup(used);
+            if (pwrite_fully(part->fd, buffer, used, offset) != 0) {
+                part->failed = 1;
+                break;
+            }
+            offset += (off_t)used;
+            used = 0;
+        }
+
+        char *out = buffer + used;
+        *out++ = '(';
+        memcpy(out, pair->key, key_len);
+        out += key_len;
+        *out++ = ',';
+        *out++ = ' ';
+        memcpy(out, pair->value, value_len);
+        out += value_len;
+        *out++ = ')';
+        *out++ = '\n';
+        used = (size_t)(out - buffer);
+    }
+    if (!part->failed && used > 0) {
+        throttle_backup(used);
+        if (pwrite_fully(part->fd, buffer, used, offset) != 0) part->failed = 1;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+int backup_write_text(int fd, off_t offset, const KvsPair *pairs, size_t count,
+                      size_t num_threads) {
+    if (count == 0) return 0;
+    if (num_threads > count) num_threads = count;
+    TextPart *parts = calloc(num_threads, sizeof(TextPart));
+    if (parts == NULL) return 1;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        size_t begin = count * i / num_threads;
+        size_t end = count * (i + 1) / num_threads;
+        parts[i] = (TextPart){fd, pairs + begin, end - begin, 0, 0, 0};
+    }
+    // A single range needs no offsets but its own
+    if (num_threads > 1) {
+        run_parts(size_part, parts, sizeof(TextPart), num_threads);
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+        parts[i].offset = offset;
+        offset += (off_t)parts[i].size;
+    }
+    run_parts(write_part, parts, sizeof(TextPart), num_threads);
+
+    int result = 0;
+    for (size_t i = 0; i < num_threads; i++) result |= parts[i].failed;
+    free(parts);
+    return result;
+}
+
+// A call of backup_sync_dir, waiting for a sync of its directory
+typedef struct SyncWaiter {
+    const char *dir;
+    int done;    // Set once a sync that started after the call has finished
+    int failed;  // Whether that sync failed for dir
+    struct SyncWaiter *next;
+} SyncWaiter;
+
+// State of backup_sync_dir, guarded by sync_mutex
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static SyncWaiter *sync_waiters;  // Calls not taken by a sync yet
+static int syncing;               // Set while a thread syncs
+
+static int temp_path(const char *path, char temp[PATH_MAX]) {
+    return snprintf(temp, PATH_MAX, "%s%s", path, BACKUP_TEMP_SUFFIX) >=
+           PATH_MAX;
+}
+
+int backup_open(const char *path) {
+    char temp[PATH_MAX];
+    if (temp_path(path, temp) != 0) return -1;
+    return open(temp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+}
+
+int backup_commit(int fd, const char *path) {
+    char temp[PATH_MAX];
+    return temp_path(path, temp) != 0 || fsync(fd) != 0 ||
+           rename(temp, path) != 0;
+}
+
+void backup_discard(const char *path) {
+    char temp[PATH_MAX];
+    if (temp_path(path, temp) == 0) unlink(temp);
+}
+
+static int sync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY);
+    if (fd == -1) return 1;
+    int result = fsync(fd) != 0;
+    close(fd);
+    return result;
+}
+
+int backup_sync_dir(const char *dir) {
+    SyncWaiter self = {dir, 0, 0, NULL};
+    pthread_mutex_lock(&sync_mutex);
+    self.next = sync_waiters;
+    sync_waiters = &self;
+
+    while (!self.done) {
+        if (syncing) {
+            pthread_cond_wait(&sync_cond, &sync_mutex);
+            continue;
+        }
+
+        // Backups that finish during the window join this sync
+        syncing = 1;
+        pthread_mutex_unlock(&sync_mutex);
+        struct timespec window = {0, BACKUP_SYNC_WINDOW_MS * 1000000L};
+        nanosleep(&window, NULL);
+        pthread_mutex_lock(&sync_mutex);
+        SyncWaiter *round = sync_waiters;
+        sync_waiters = NULL;
+        pthread_mutex_unlock(&sync_mutex);
+
+        // Each directory is synced once, and its result given to every call
+        // that asked for it in this round
+        for (SyncWaiter *w = round; w != NULL; w = w->next) {
+            SyncWaiter *first = round;
+            while (strcmp(first->dir, w->dir) != 0) first = first->next;
+            if (first != w) {
+                w->failed = first->failed;
+            } else if (sync_dir(w->dir) != 0) {
+                perror(w->dir);
+                w->failed = 1;
+            }
+        }
+
+        // The waiters return once they see done, after sync_mutex is released
+        pthread_mutex_lock(&sync_mutex);
+        for (SyncWaiter *w = round; w != NULL; w = w->next) w->done = 1;
+        syncing = 0;
+        pthread_cond_broadcast(&sync_cond);
+    }
+    int result = self.failed;
+    pthread_mutex_unlock(&sync_mutex);
+    return result;
+}
+
+void backup_dir(const char *path, char *dir, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        snprintf(dir, size, ".");
+    } else if (slash == path) {
+        snprintf(dir, size, "/");
+    } else {
+        snprintf(dir, size, "%.*s", (int)(slash - path), path);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+// Size of the buffers the threads of backup_write_text fill before each
+// write, and their alignment
+#define BACKUP_BUFFER_SIZE (1 << 20)
+#define BACKUP_BUFFER_ALIGN 4096
+
+// Most threads that write a backup (KVS_BACKUP_THREADS)
+#define MAX_BACKUP_THREADS 256
+
+// Fewest pairs worth a thread of their own, smaller backups use fewer
+// threads
+#define BACKUP_MIN_PAIRS_PER_THREAD 65536
+
+// Suffix of the temporary file a backup is written to, renamed to the name
+// of the backup once it is complete and synced
+#define BACKUP_TEMP_SUFFIX ".tmp"
+
+// Time the thread that syncs a directory waits for other backups in it to
+// finish, so that one sync makes all of them durable
+#define BACKUP_SYNC_WINDOW_MS 2
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "engine.h"
+
+/// Number of threads to split a backup of some pairs between.
+/// @param count Number of pairs.
+/// @param max_threads Most threads to use.
+/// @return Number of threads, at least 1.
+size_t backup_threads(size_t count, size_t max_threads);
+
+/// Sorts pairs by key like qsort would, with several threads: each sorts an
+/// equal part, then the parts are merged two by two, the merges of a round
+/// running in parallel.
+/// @param pairs Pairs to sort, with distinct keys.
+/// @param count Number of pairs.
+/// @param num_threads Number of threads, see backup_threads.
+void backup_sort(KvsPair *pairs, size_t count, size_t num_threads);
+
+/// Writes pairs as the text of SHOW with several threads, each formatting a
+/// range of pairs into large buffers that it writes with pwrite, at the
+/// offset given by the length of the text of the pairs before its range. The
+/// file holds exactly what a single writer would have written.
+/// @param fd File descriptor to write to, its offset is left unchanged.
+/// @param offset Offset of the text of the first pair.
+/// @param pairs Pairs to write, in order.
+/// @param count Number of pairs.
+/// @param num_threads Number of threads, see backup_threads.
+/// @return 0 if the pairs were written, 1 otherwise.
+int backup_write_text(int fd, off_t offset, const KvsPair *pairs, size_t count,
+                      size_t num_threads);
+
+/// Opens the temporary file of a backup, truncating it if a crash left one.
+/// @param path Path of the backup, without BACKUP_TEMP_SUFFIX.
+/// @return File descriptor open for reading and writing, -1 on failure.
+int backup_open(const char *path);
+
+/// Makes a complete backup file durable under its name: syncs its content
+/// and renames its temporary file over the name, so that the name holds
+/// either the previous file or the whole new one. The rename itself is
+/// durable once the directory is synced, see backup_sync_dir.
+/// @param fd File descriptor returned by backup_open.
+/// @param path Path of the backup, without BACKUP_TEMP_SUFFIX.
+/// @return 0 on success, 1 otherwise.
+int backup_commit(int fd, const char *path);
+
+/// Removes the temporary file of a backup that failed.
+/// @param path Path of the backup, without BACKUP_TEMP_SUFFIX.
+void backup_discard(const char *path);
+
+/// Syncs a directory, making the files created and renamed in it durable.
+/// Calls that overlap share one sync per directory: a thread syncs every
+/// directory asked for so far while the others wait for it, as in the group
+/// commit of the WAL.
+/// @param dir Path of the directory.
+/// @return 0 on success, 1 if the sync of this directory failed.
+int backup_sync_dir(const char *dir);
+
+/// Directory of a file.
+/// @param path Path of the file.
+/// @param dir Buffer to store the directory in, "." for a bare file name.
+/// @param size Size of dir.
+void backup_dir(const char *path, char *dir, size_t size);
+
+#endif  // KVS_BACKUP_H
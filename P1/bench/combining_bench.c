@@ -0,0 +1,116 @@
+// Compares flat combining with the plain rwlock path on a skewed workload:
+// 1 to 64 threads run WRITE and DELETE commands, most of them on a few hot
+// keys, so that the threads queue on the same stripes.
+// Usage: ./bench/combining_bench [ops_per_thread] [hot_keys]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "constants.h"
+#include "operations.h"
+
+#define MAX_THREADS 64
+// Keys outside the hot set
+#define COLD_KEYS 100000
+// Percentage of the commands on the hot keys
+#define HOT_PERCENT 90
+
+typedef struct {
+    size_t ops;
+    size_t hot_keys;
+    unsigned int seed;
+    int fd_out;
+} Worker;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// 80% WRITE and 20% DELETE of a single key
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    char key[1][MAX_STRING_SIZE];
+    char value[1][MAX_STRING_SIZE];
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        if (rand_r(&worker->seed) % 100 < HOT_PERCENT) {
+            snprintf(key[0], MAX_STRING_SIZE, "hot%zu",
+                     (size_t)rand_r(&worker->seed) % worker->hot_keys);
+        } else {
+            snprintf(key[0], MAX_STRING_SIZE, "cold%d",
+                     rand_r(&worker->seed) % COLD_KEYS);
+        }
+
+        if (rand_r(&worker->seed) % 5 != 0) {
+            snprintf(value[0], MAX_STRING_SIZE, "value%zu", op);
+            kvs_write(1, key, value);
+        } else {
+            kvs_delete(1, key, worker->fd_out);
+        }
+    }
+    return NULL;
+}
+
+static void run(int combining, size_t threads, size_t ops, size_t hot_keys,
+                int fd_out) {
+    kvs_config.flat_combining = combining;
+    if (kvs_init() != 0) {
+        fprintf(stderr, "Failed to initialize the KVS\n");
+        return;
+    }
+
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    double start = now_seconds();
+    for (size_t i = 0; i < threads; i++) {
+        workers[i] = (Worker){ops, hot_keys, (unsigned int)i + 1, fd_out};
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    kvs_terminate();
+    printf("%-10s %8zu %12.2f\n", combining ? "combining" : "rwlock", threads,
+           (double)(threads * ops) / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t hot_keys = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+    if (hot_keys == 0) {
+        fprintf(stderr, "Invalid number of hot keys\n");
+        return 1;
+    }
+
+    // The DELETE output of missing keys is discarded
+    int fd_out = open("/dev/null", O_WRONLY);
+    if (fd_out == -1) {
+        perror("Failed to open /dev/null");
+        return 1;
+    }
+    if (load_config() != 0) {
+        close(fd_out);
+        return 1;
+    }
+
+    printf("%zu ops per thread, %zu hot keys, %zu lock stripes, engine %s\n",
+           ops, hot_keys, kvs_config.lock_stripes, kvs_config.engine->name);
+    printf("%-10s %8s %12s\n", "mode", "threads", "Mop/s");
+    for (int combining = 0; combining <= 1; combining++) {
+        for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            run(combining, threads, ops, hot_keys, fd_out);
+        }
+    }
+
+    close(fd_out);
+    return 0;
+}
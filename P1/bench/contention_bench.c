@@ -0,0 +1,136 @@
+// Compares the engines under write contention: 1 to 64 threads run a write
+// heavy mix of commands on a shared key space through the KVS operations, so
+// that the locking of operations.c is measured along with the engine. Set
+// KVS_SHARDS to measure the shards instead.
+// Usage: ./bench/contention_bench [ops_per_thread] [number_keys]
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "constants.h"
+#include "engine.h"
+#include "operations.h"
+
+#define MAX_THREADS 64
+// Pairs of the multi-key commands
+#define BATCH_SIZE 4
+
+typedef struct {
+    size_t ops;
+    size_t num_keys;
+    unsigned int seed;
+    int fd_out;
+} Worker;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void random_keys(Worker *worker, size_t n,
+                        char keys[][MAX_STRING_SIZE]) {
+    for (size_t i = 0; i < n; i++) {
+        size_t key = (size_t)rand_r(&worker->seed) % worker->num_keys;
+        snprintf(keys[i], MAX_STRING_SIZE, "key%zu", key);
+    }
+}
+
+// 40% single WRITE, 20% WRITE of BATCH_SIZE pairs, 30% READ of BATCH_SIZE
+// keys and 10% DELETE
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    char keys[BATCH_SIZE][MAX_STRING_SIZE];
+    char values[BATCH_SIZE][MAX_STRING_SIZE];
+
+    for (size_t op = 0; op < worker->ops; op++) {
+        int kind = rand_r(&worker->seed) % 10;
+        if (kind < 6) {
+            size_t n = kind < 4 ? 1 : BATCH_SIZE;
+            random_keys(worker, n, keys);
+            for (size_t i = 0; i < n; i++) {
+                snprintf(values[i], MAX_STRING_SIZE, "value%zu", op);
+            }
+            kvs_write(n, keys, values);
+        } else if (kind < 9) {
+            random_keys(worker, BATCH_SIZE, keys);
+            kvs_read(BATCH_SIZE, keys, worker->fd_out);
+        } else {
+            random_keys(worker, 1, keys);
+            kvs_delete(1, keys, worker->fd_out);
+        }
+    }
+    return NULL;
+}
+
+static void run(const KvsEngine *engine, size_t threads, size_t ops,
+                size_t num_keys, int fd_out) {
+    kvs_config.engine = engine;
+    if (kvs_init() != 0) {
+        fprintf(stderr, "%s: failed to initialize the KVS\n", engine->name);
+        return;
+    }
+
+    // Start half full so that reads and deletes find keys
+    char key[1][MAX_STRING_SIZE];
+    char value[1][MAX_STRING_SIZE];
+    for (size_t i = 0; i < num_keys; i += 2) {
+        snprintf(key[0], MAX_STRING_SIZE, "key%zu", i);
+        snprintf(value[0], MAX_STRING_SIZE, "value%zu", i);
+        kvs_write(1, key, value);
+    }
+
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    double start = now_seconds();
+    for (size_t i = 0; i < threads; i++) {
+        workers[i] = (Worker){ops, num_keys, (unsigned int)i + 1, fd_out};
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+
+    kvs_terminate();
+    printf("%-10s %8zu %12.2f\n", engine->name, threads,
+           (double)(threads * ops) / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t num_keys = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+    if (num_keys == 0) {
+        fprintf(stderr, "Invalid number of keys\n");
+        return 1;
+    }
+
+    int fd_out = open("/dev/null", O_WRONLY);
+    if (fd_out == -1) {
+        perror("Failed to open /dev/null");
+        return 1;
+    }
+    if (load_config() != 0) {
+        close(fd_out);
+        return 1;
+    }
+
+    printf("%zu ops per thread, %zu keys, %zu lock stripes, %zu shards\n", ops,
+           num_keys, kvs_config.lock_stripes, kvs_config.shards);
+    printf("%-10s %8s %12s\n", "engine", "threads", "Mop/s");
+    const KvsEngine *engines[] = {&chained_engine, &splitorder_engine};
+    for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+        for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            run(engines[e], threads, ops, num_keys, fd_out);
+        }
+    }
+
+    close(fd_out);
+    return 0;
+}
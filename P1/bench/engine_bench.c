@@ -0,0 +1,139 @@
+// Compares the storage engines on lookup throughput, memory per key and
+// teardown time.
+// Usage: ./bench/engine_bench [number_keys]
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "epoch.h"
+#include "kvs.h"
+#include "slab.h"
+
+#define LOOKUP_ROUNDS 5
+// Lock stripes of the tables, the default on a machine with 16 cores
+#define BENCH_STRIPES 64
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t heap_in_use() {
+#ifdef __GLIBC__
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// Does the resize work operations.c does after every write
+static void maintain(const KvsEngine *engine, void *table, size_t *cursor) {
+    if (engine->rehash_pending != NULL && engine->rehash_pending(table)) {
+        engine->rehash_step(table, (*cursor)++ % BENCH_STRIPES);
+    }
+    if (engine->resize_needed != NULL && engine->resize_needed(table)) {
+        engine->resize_table(table);
+    }
+}
+
+static void run(const KvsEngine *engine, char (*keys)[MAX_STRING_SIZE],
+                size_t num_keys, const size_t *order) {
+    size_t cursor = 0;
+    size_t heap_before = heap_in_use();
+    slab_init();
+    epoch_init();
+    void *table = engine->create_table(BENCH_STRIPES);
+
+    double start = now_seconds();
+    for (size_t i = 0; i < num_keys; i++) {
+        engine->write_pair(table, keys[i], keys[num_keys - 1 - i]);
+        maintain(engine, table, &cursor);
+    }
+    double insert_time = now_seconds() - start;
+    size_t heap_after = heap_in_use();
+
+    size_t found = 0;
+    start = now_seconds();
+    for (int round = 0; round < LOOKUP_ROUNDS; round++) {
+        for (size_t i = 0; i < num_keys; i++) {
+            char *value = engine->read_pair(table, keys[order[i]]);
+            found += value != NULL;
+            slab_free(value);
+        }
+    }
+    double hit_time = now_seconds() - start;
+
+    start = now_seconds();
+    for (size_t i = 0; i < num_keys; i++) {
+        char missing[MAX_STRING_SIZE];
+        snprintf(missing, sizeof(missing), "missing-%zu", order[i]);
+        char *value = engine->read_pair(table, missing);
+        found += value != NULL;
+        slab_free(value);
+    }
+    double miss_time = now_seconds() - start;
+
+    // Same teardown as kvs_terminate
+    start = now_seconds();
+    if (engine->drop_table != NULL) {
+        engine->drop_table(table);
+    } else {
+        engine->free_table(table);
+    }
+    epoch_destroy();
+    slab_destroy();
+    double free_time = now_seconds() - start;
+
+    printf("%-10s %12.2f %12.2f %12.2f %12.1f %10.2f\n", engine->name,
+           (double)num_keys / insert_time / 1e6,
+           (double)num_keys * LOOKUP_ROUNDS / hit_time / 1e6,
+           (double)num_keys / miss_time / 1e6,
+           (double)(heap_after - heap_before) / (double)num_keys,
+           free_time * 1e3);
+
+    if (found != num_keys * LOOKUP_ROUNDS) {
+        fprintf(stderr, "%s: found %zu keys, expected %zu\n", engine->name,
+                found, num_keys * LOOKUP_ROUNDS);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_keys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    char (*keys)[MAX_STRING_SIZE] = malloc(num_keys * MAX_STRING_SIZE);
+    size_t *order = malloc(num_keys * sizeof(size_t));
+    if (keys == NULL || order == NULL) {
+        fprintf(stderr, "Failed to allocate %zu keys\n", num_keys);
+        return 1;
+    }
+
+    srand(42);
+    for (size_t i = 0; i < num_keys; i++) {
+        snprintf(keys[i], MAX_STRING_SIZE, "key-%zu-%d", i, rand() % 1000);
+        order[i] = i;
+    }
+    // Lookups in random order so that they do not follow insertion order
+    for (size_t i = num_keys - 1; i > 0; i--) {
+        size_t j = (size_t)rand() % (i + 1);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    printf("%zu keys\n", num_keys);
+    printf("%-10s %12s %12s %12s %12s %10s\n", "engine", "insert Mop/s",
+           "hit Mop/s", "miss Mop/s", "bytes/key", "free ms");
+    run(&chained_engine, keys, num_keys, order);
+    run(&swiss_engine, keys, num_keys, order);
+    run(&splitorder_engine, keys, num_keys, order);
+
+    free(keys);
+    free(order);
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Compares the inputs of the parser on one job file: the file is parsed
+// whole with each JobInput, the first reading it one byte per read as the
+// parser once did, and the commands and pairs parsed by each are checked to
+// be the same. Without a file, a job of WRITE, READ, DELETE and WAIT lines,
+// with comments and invalid lines among them, is generated first.
+// Usage: ./bench/parse_bench [job_file | number_lines]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "parser.h"
+
+#define DEFAULT_LINES 50000
+
+// Of one pass over the job, compared between the inputs
+typedef struct {
+    size_t commands;
+    size_t pairs;
+    uint64_t hash;  // FNV-1a of the commands and strings parsed
+    double seconds;
+} ParseResult;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hash_strings(uint64_t hash, char strings[][MAX_STRING_SIZE],
+                             size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        hash = hash_bytes(hash, strings[i], strlen(strings[i]) + 1);
+    }
+    return hash;
+}
+
+// Writes a job of mixed commands, mostly WRITE lines of several pairs
+static int generate_job(const char *path, size_t lines) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return 1;
+
+    unsigned int seed = 1;
+    for (size_t i = 0; i < lines; i++) {
+        int kind = rand_r(&seed) % 100;
+        int count = 1 + rand_r(&seed) % 16;
+        if (kind < 60) {
+            fputs("WRITE [", file);
+            for (int j = 0; j < count; j++) {
+                fprintf(file, "(key%d,value%d)", rand_r(&seed) % 100000,
+                        rand_r(&seed));
+            }
+            fputs("]\n", file);
+        } else if (kind < 90) {
+            fputs(kind < 75 ? "READ [" : "DELETE [", file);
+            for (int j = 0; j < count; j++) {
+                fprintf(file, "%skey%d", j > 0 ? "," : "",
+                        rand_r(&seed) % 100000);
+            }
+            fputs("]\n", file);
+        } else if (kind < 94) {
+            fprintf(file, "WAIT %d\n", rand_r(&seed) % 100);
+        } else if (kind < 97) {
+            fputs("# comment\n", file);
+        } else {
+            fputs("WRITE [(key,value) (bad)]\n", file);
+        }
+    }
+    return fclose(file) != 0;
+}
+
+// Parses a whole job with one input, as kvs_main does
+static int parse_job(const char *path, JobInput input, ParseResult *result) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 1;
+
+    double start = now_seconds();
+    JobReader *in = job_open(fd, input);
+    if (in == NULL) {
+        close(fd);
+        return 1;
+    }
+
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    *result = (ParseResult){.hash = 0xcbf29ce484222325ULL};
+    for (int done = 0; !done;) {
+        enum Command command = get_next(in);
+        size_t num_pairs = 0;
+        unsigned int delay = 0;
+
+        switch (command) {
+            case CMD_WRITE:
+                num_pairs = parse_write(in, keys, values, MAX_WRITE_SIZE,
+                                        MAX_STRING_SIZE);
+                result->hash = hash_strings(result->hash, values, num_pairs);
+                break;
+
+            case CMD_READ:
+            case CMD_DELETE:
+                num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE,
+                                              MAX_STRING_SIZE);
+                break;
+
+            case CMD_WAIT:
+                if (parse_wait(in, &delay, NULL) == -1) delay = UINT32_MAX;
+                result->hash = hash_bytes(result->hash, &delay, sizeof(delay));
+                break;
+
+            case EOC:
+                done = 1;
+                break;
+
+            case CMD_SHOW:
+            case CMD_BACKUP:
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+                break;
+        }
+
+        result->commands++;
+        result->pairs += num_pairs;
+        result->hash = hash_bytes(result->hash, &command, sizeof(command));
+        result->hash = hash_strings(result->hash, keys, num_pairs);
+    }
+    job_close(in);
+    result->seconds = now_seconds() - start;
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char path[] = "/tmp/parse_bench-XXXXXX";
+    const char *job = path;
+    int generated = 0;
+    struct stat st;
+    if (argc > 1 && stat(argv[1], &st) == 0) {
+        job = argv[1];
+    } else {
+        size_t lines = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_LINES;
+        int fd = mkstemp(path);
+        if (lines == 0 || fd == -1) {
+            fprintf(stderr, "Usage: %s [job_file | number_lines]\n", argv[0]);
+            return 1;
+        }
+        close(fd);
+        generated = 1;
+        if (generate_job(path, lines) != 0 || stat(path, &st) != 0) {
+            fprintf(stderr, "Failed to write %s\n", path);
+            unlink(path);
+            return 1;
+        }
+    }
+
+    const struct {
+        const char *name;
+        JobInput input;
+    } inputs[] = {{"bytes", JOB_INPUT_BYTES},
+                  {"buffered", JOB_INPUT_BUFFERED},
+                  {"mapped", JOB_INPUT_MAPPED}};
+    size_t num_inputs = sizeof(inputs) / sizeof(inputs[0]);
+
+    printf("%s: %lld bytes\n", job, (long long)st.st_size);
+    printf("%-10s %10s %10s %10s %10s\n", "input", "seconds", "MB/s",
+           "Mcmd/s", "speedup");
+    ParseResult results[sizeof(inputs) / sizeof(inputs[0])];
+    int failed = 0;
+    for (size_t i = 0; i < num_inputs && !failed; i++) {
+        if (parse_job(job, inputs[i].input, &results[i]) != 0) {
+            fprintf(stderr, "Failed to parse %s\n", job);
+            failed = 1;
+            break;
+        }
+        double seconds = results[i].seconds + 1e-9;
+        printf("%-10s %10.3f %10.1f %10.2f %9.1fx\n", inputs[i].name,
+               results[i].seconds, (double)st.st_size / seconds / 1e6,
+               (double)results[i].commands / seconds / 1e6,
+               results[0].seconds / seconds);
+        if (results[i].commands != results[0].commands ||
+            results[i].pairs != results[0].pairs ||
+            results[i].hash != results[0].hash) {
+            fprintf(stderr, "%s parsed different commands than %s\n",
+                    inputs[i].name, inputs[0].name);
+            failed = 1;
+        }
+    }
+    if (!failed) {
+        printf("%zu commands, %zu keys, the same with every input\n",
+               results[0].commands - 1, results[0].pairs);
+    }
+
+    if (generated) unlink(path);
+    return failed;
+}
@@ -0,0 +1,318 @@
+// Compares the sync backends on a job corpus: the .job files of a directory
+// are parsed once, then for each backend the threads replay them through the
+// KVS operations, timing every command. WAIT and BACKUP are skipped, the
+// output of READ, DELETE and SHOW is discarded.
+// Usage: ./bench/sync_bench <jobs_dir> [threads] [rounds]
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "constants.h"
+#include "operations.h"
+#include "parser.h"
+#include "sync.h"
+#include "utils.h"
+
+#define MAX_THREADS 64
+
+// Command of a job, ready to be replayed
+typedef struct {
+    enum Command type;
+    size_t num_pairs;
+    char (*keys)[MAX_STRING_SIZE];
+    char (*values)[MAX_STRING_SIZE];
+} JobCommand;
+
+typedef struct {
+    JobCommand *commands;
+    size_t num_commands;
+} Job;
+
+typedef struct {
+    Job *jobs;
+    size_t num_jobs;
+    size_t index;  // The worker runs the jobs index, index + threads, ...
+    size_t threads;
+    size_t rounds;
+    int fd_out;
+    double *latencies;  // Of each command run, in microseconds
+    size_t num_latencies;
+} Worker;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static char (*copy_strings(char strings[][MAX_STRING_SIZE],
+                           size_t count))[MAX_STRING_SIZE] {
+    char(*copy)[MAX_STRING_SIZE] = malloc(count * MAX_STRING_SIZE);
+    if (copy != NULL) memcpy(copy, strings, count * MAX_STRING_SIZE);
+    return copy;
+}
+
+// Parses the commands of a job file, as kvs_main does
+static int load_job(const char *path, Job *job) {
+    int fd = open(path, O_RDONLY);
+    JobReader *in = fd != -1 ? job_open(fd, JOB_INPUT_MAPPED) : NULL;
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        if (fd != -1) close(fd);
+        return 1;
+    }
+
+    size_t capacity = 64;
+    job->commands = malloc(capacity * sizeof(JobCommand));
+    job->num_commands = 0;
+    if (job->commands == NULL) {
+        job_close(in);
+        close(fd);
+        return 1;
+    }
+
+    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+    for (int done = 0; !done;) {
+        JobCommand command = {.type = get_next(in)};
+        unsigned int delay, thread_id;
+        memset(keys, 0, sizeof(keys));
+        memset(values, 0, sizeof(values));
+
+        switch (command.type) {
+            case CMD_WRITE:
+                command.num_pairs = parse_write(in, keys, values,
+                                                MAX_WRITE_SIZE,
+                                                MAX_STRING_SIZE);
+                if (command.num_pairs == 0) continue;
+                sortPairs(command.num_pairs, keys, values);
+                command.values = copy_strings(values, command.num_pairs);
+                break;
+
+            case CMD_READ:
+            case CMD_DELETE:
+                command.num_pairs = parse_read_delete(in, keys, MAX_WRITE_SIZE,
+                                                      MAX_STRING_SIZE);
+                if (command.num_pairs == 0) continue;
+                sortPairs(command.num_pairs, keys, values);
+                break;
+
+            case CMD_SHOW:
+                break;
+
+            case CMD_WAIT:
+                parse_wait(in, &delay, &thread_id);
+                continue;
+
+            case EOC:
+                done = 1;
+                continue;
+
+            case CMD_BACKUP:
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+                continue;
+        }
+
+        command.keys = copy_strings(keys, command.num_pairs);
+        if (job->num_commands == capacity) {
+            capacity *= 2;
+            JobCommand *grown =
+                realloc(job->commands, capacity * sizeof(JobCommand));
+            if (grown == NULL) {
+                job_close(in);
+                close(fd);
+                return 1;
+            }
+            job->commands = grown;
+        }
+        job->commands[job->num_commands++] = command;
+    }
+
+    job_close(in);
+    close(fd);
+    return 0;
+}
+
+static void free_job(Job *job) {
+    for (size_t i = 0; i < job->num_commands; i++) {
+        free(job->commands[i].keys);
+        free(job->commands[i].values);
+    }
+    free(job->commands);
+}
+
+static void *run_worker(void *arg) {
+    Worker *worker = arg;
+    for (size_t round = 0; round < worker->rounds; round++) {
+        for (size_t j = worker->index; j < worker->num_jobs;
+             j += worker->threads) {
+            Job *job = &worker->jobs[j];
+            for (size_t c = 0; c < job->num_commands; c++) {
+                JobCommand *command = &job->commands[c];
+                double start = now_seconds();
+                switch (command->type) {
+                    case CMD_WRITE:
+                        kvs_write(command->num_pairs, command->keys,
+                                  command->values);
+                        break;
+                    case CMD_READ:
+                        kvs_read(command->num_pairs, command->keys,
+                                 worker->fd_out);
+                        break;
+                    case CMD_DELETE:
+                        kvs_delete(command->num_pairs, command->keys,
+                                   worker->fd_out);
+                        break;
+                    default:
+                        kvs_show(worker->fd_out);
+                        break;
+                }
+                worker->latencies[worker->num_latencies++] =
+                    (now_seconds() - start) * 1e6;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t index = (size_t)(p * (double)(count - 1));
+    return sorted[index];
+}
+
+static void run(const SyncBackend *backend, Job *jobs, size_t num_jobs,
+                size_t threads, size_t rounds, int fd_out) {
+    sync_backend = backend;
+    if (kvs_init() != 0) {
+        fprintf(stderr, "Failed to initialize the KVS\n");
+        return;
+    }
+
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    for (size_t i = 0; i < threads; i++) {
+        size_t commands = 0;
+        for (size_t j = i; j < num_jobs; j += threads) {
+            commands += jobs[j].num_commands;
+        }
+        workers[i] = (Worker){jobs, num_jobs, i, threads, rounds, fd_out,
+                              malloc((commands * rounds + 1) * sizeof(double)),
+                              0};
+        if (workers[i].latencies == NULL) {
+            fprintf(stderr, "Failed to allocate the latencies\n");
+            exit(1);
+        }
+    }
+
+    double start = now_seconds();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    kvs_terminate();
+
+    size_t total = 0;
+    for (size_t i = 0; i < threads; i++) {
+        total += workers[i].num_latencies;
+    }
+    double *latencies = malloc((total + 1) * sizeof(double));
+    if (latencies == NULL) {
+        fprintf(stderr, "Failed to allocate the latencies\n");
+        exit(1);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < threads; i++) {
+        memcpy(latencies + count, workers[i].latencies,
+               workers[i].num_latencies * sizeof(double));
+        count += workers[i].num_latencies;
+        free(workers[i].latencies);
+    }
+
+    if (total == 0) {
+        printf("%-10s no commands\n", backend->name);
+    } else {
+        qsort(latencies, total, sizeof(double), compare_doubles);
+        printf("%-10s %12.3f %10.2f %10.2f %10.2f\n", backend->name,
+               (double)total / elapsed / 1e6,
+               percentile(latencies, total, 0.5),
+               percentile(latencies, total, 0.99),
+               percentile(latencies, total, 0.999));
+    }
+    free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <jobs_dir> [threads] [rounds]\n", argv[0]);
+        return 1;
+    }
+    size_t threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+    size_t rounds = argc > 3 ? strtoul(argv[3], NULL, 10) : 10;
+    if (threads == 0 || threads > MAX_THREADS) {
+        fprintf(stderr, "Invalid number of threads, expected 1 to %d\n",
+                MAX_THREADS);
+        return 1;
+    }
+
+    DIR *dir = opendir(argv[1]);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open directory\n");
+        return 1;
+    }
+    int job_count = 0;
+    char **paths = getJobs(&job_count, dir, argv[1]);
+
+    size_t num_jobs = (size_t)job_count;
+    Job *jobs = calloc(num_jobs + 1, sizeof(Job));
+    int failed = jobs == NULL;
+    for (size_t i = 0; !failed && i < num_jobs; i++) {
+        failed = load_job(paths[i], &jobs[i]);
+    }
+    for (int i = 0; i < job_count; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+
+    // The output of the commands is discarded
+    int fd_out = open("/dev/null", O_WRONLY);
+    if (failed || fd_out == -1 || load_config() != 0) {
+        fprintf(stderr, "Failed to prepare the benchmark\n");
+        failed = 1;
+    }
+
+    if (!failed) {
+        printf("%zu jobs, %zu threads, %zu rounds, engine %s\n", num_jobs,
+               threads, rounds, kvs_config.engine->name);
+        printf("%-10s %12s %10s %10s %10s\n", "backend", "Mcmd/s", "p50 us",
+               "p99 us", "p99.9 us");
+        size_t count;
+        const SyncBackend *const *backends = list_sync_backends(&count);
+        for (size_t i = 0; i < count; i++) {
+            run(backends[i], jobs, num_jobs, threads, rounds, fd_out);
+        }
+    }
+
+    if (fd_out != -1) close(fd_out);
+    for (size_t i = 0; jobs != NULL && i < num_jobs; i++) {
+        free_job(&jobs[i]);
+    }
+    free(jobs);
+    return failed;
+}
@@ -0,0 +1,74 @@
+#ifndef KVS_DUMP_H
+#define KVS_DUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "constants.h"
+#include "engine.h"
+
+// Largest payload of a segment, a segment is closed before a pair would make
+// it larger
+#define DUMP_SEGMENT_SIZE (1 << 20)
+
+// First bytes of a binary snapshot (see dump.c)
+#define DUMP_MAGIC "KVSDUMP1"
+
+/// Restores a batch of pairs read by dump_load. Called by several threads at
+/// once, with pairs of different segments, so never twice for the same key.
+/// @return 0 on success, 1 to stop the load.
+typedef int (*DumpApply)(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                         char values[][MAX_STRING_SIZE]);
+
+/// Writes bytes of a snapshot to its destination, a file or an LzWriter.
+/// @return 0 on success, 1 otherwise.
+typedef int (*DumpSink)(void *ctx, const char *data, size_t size);
+
+/// Writes pairs in the binary snapshot format: a header, then segments of
+/// length-prefixed pairs, each checksummed on its own so that they can be
+/// loaded in parallel. Each segment is given to the sink at once.
+/// @param sink Function that writes the bytes.
+/// @param ctx Argument of the sink.
+/// @param pairs Pairs to write.
+/// @param count Number of pairs.
+/// @param wal_offset Position of the KVS_WAL the pairs are at, from which
+/// the log is replayed after them, 0 if unknown.
+/// @return 0 if the pairs were written, 1 otherwise.
+int dump_write(DumpSink sink, void *ctx, const KvsPair *pairs,
+               size_t count, uint64_t wal_offset);
+
+/// Writes the same bytes as dump_write, with several threads that each
+/// encode whole segments and write them with pwrite. The segments are split
+/// first, from the length of the pairs, which gives the offset of each.
+/// @param fd File descriptor to write to, its offset is left unchanged.
+/// @param offset Offset of the snapshot in the file.
+/// @param pairs Pairs to write.
+/// @param count Number of pairs.
+/// @param num_threads Number of threads that write segments.
+/// @param wal_offset Position of the KVS_WAL the pairs are at, see
+/// dump_write.
+/// @return 0 if the pairs were written, 1 otherwise.
+int dump_write_at(int fd, off_t offset, const KvsPair *pairs, size_t count,
+                  size_t num_threads, uint64_t wal_offset);
+
+/// Reads the number of pairs of a binary snapshot from its header. Like
+/// dump_load, it also reads snapshots compressed by an LzWriter.
+/// @param path Path of the snapshot.
+/// @param wal_offset Pointer to store the position of the KVS_WAL of the
+/// snapshot in, 0 for snapshots written before it was recorded. May be NULL.
+/// @return Number of pairs, -1 if the file is not a snapshot.
+long dump_count(const char *path, uint64_t *wal_offset);
+
+/// Loads a binary snapshot, with several threads that each read whole
+/// segments and restore their pairs. Fails without restoring anything if the
+/// file is not a snapshot or is truncated, but a corrupted segment is only
+/// found when it is read, after other segments may have been restored. A
+/// snapshot compressed by an LzWriter is decompressed into memory first.
+/// @param path Path of the snapshot.
+/// @param num_threads Number of threads that read segments.
+/// @param apply Function that restores each batch of pairs.
+/// @return Number of pairs restored, -1 on failure.
+long dump_load(const char *path, size_t num_threads, DumpApply apply);
+
+#endif  // KVS_DUMP_H
@@ -0,0 +1,125 @@
+#ifndef KVS_ENGINE_H
+#define KVS_ENGINE_H
+
+// Upper bound of the number of lock stripes (KVS_LOCK_STRIPES)
+#define MAX_LOCK_STRIPES 4096
+
+#include <stddef.h>
+
+#include "constants.h"
+
+/// Key value pair stored in a table. The strings belong to the table and are
+/// only valid while the locks of the table are held.
+typedef struct KvsPair {
+    const char *key;
+    const char *value;
+} KvsPair;
+
+/// Storage engine used by the KVS. Engines are not thread safe by themselves:
+/// the caller holds the lock stripe of the key (see lock_index, with the
+/// number of stripes the table was created with) for every call, for writing
+/// when the call modifies the table, and htMutex for writing when listing or
+/// resizing the whole table.
+typedef struct KvsEngine {
+    // Name used to select the engine (KVS_ENGINE)
+    const char *name;
+
+    /// Creates a new table protected by the given number of lock stripes, a
+    /// power of two.
+    /// @return Newly created table, NULL on failure.
+    void *(*create_table)(size_t stripes);
+
+    /// Writes a pair, replacing the value if the key already exists.
+    /// @return 0 if the pair was written successfully, 1 otherwise.
+    int (*write_pair)(void *table, const char *key, const char *value);
+
+    /// Reads the value of a key.
+    /// @return Copy of the value to be freed by the caller with slab_free,
+    /// NULL if missing.
+    char *(*read_pair)(void *table, const char *key);
+
+    /// Deletes a key.
+    /// @return 0 if the key was deleted, 1 if it did not exist.
+    int (*delete_pair)(void *table, const char *key);
+
+    /// Checks if a resize is moving buckets. May be NULL.
+    /// The caller must hold htMutex.
+    int (*rehash_pending)(void *table);
+
+    /// Moves some buckets of a stripe during a resize. May be NULL.
+    void (*rehash_step)(void *table, size_t lock);
+
+    /// Checks if resize_table must be called. May be NULL.
+    /// The caller must hold htMutex.
+    int (*resize_needed)(void *table);
+
+    /// Starts or finishes a resize. May be NULL.
+    void (*resize_table)(void *table);
+
+    /// Sizes an empty table for a number of pairs before a bulk load, for
+    /// engines that otherwise fall behind while growing. May be NULL.
+    /// The caller must hold htMutex for writing.
+    /// @return 0 if the table was sized, 1 otherwise.
+    int (*reserve)(void *table, size_t count);
+
+    /// Lists every pair of the table, in no particular order.
+    /// @return Array of pairs to be freed by the caller, NULL if empty.
+    KvsPair *(*list_pairs)(void *table, size_t *count);
+
+    /// Lists the pairs protected by one lock stripe, in no particular order,
+    /// with htMutex and the stripe held. May be NULL, snapshots then copy the
+    /// whole table at once.
+    /// @return Array of pairs to be freed by the caller, NULL if empty.
+    KvsPair *(*list_stripe)(void *table, size_t lock, size_t *count);
+
+    /// Frees the table.
+    void (*free_table)(void *table);
+
+    /// Frees the table but not the pairs it holds, which are left to
+    /// slab_destroy. May be NULL, free_table is used instead.
+    void (*drop_table)(void *table);
+
+    /// Blocks a writer while the table is too far behind on its background
+    /// work, called after each write or delete with no lock held. May be
+    /// NULL.
+    void (*throttle_writes)(void *table);
+
+    // 1 if read_pair may be called without any lock from inside an epoch
+    // (see epoch_enter), 0 if it needs the lock stripe of the key. Engines
+    // that also lock stripes to write only do so with KVS_LOCKFREE_READS.
+    int lockfree_reads;
+
+    // 1 if writes and deletes need no lock stripe, only htMutex for reading
+    // so that they do not run during a listing. Such engines provide
+    // write_batch.
+    int lockfree_writes;
+
+    /// Writes several pairs so that readers see either none or all of them.
+    /// May be NULL if lockfree_writes is 0, the stripes provide that then.
+    /// @return 0 if every pair was written, 1 if none was.
+    int (*write_batch)(void *table, size_t num_pairs,
+                       char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE]);
+} KvsEngine;
+
+// Chained hash table (kvs.c)
+extern const KvsEngine chained_engine;
+
+// Open addressing table probed with SSE2 (swiss.c)
+extern const KvsEngine swiss_engine;
+
+// Lock-free split-ordered list (splitorder.c)
+extern const KvsEngine splitorder_engine;
+
+// Chained hash table in a memory-mapped file (mapped.c)
+extern const KvsEngine mapped_engine;
+
+// Log-structured merge tree of sorted run files (lsm.c)
+extern const KvsEngine lsm_engine;
+
+/// Finds an engine by name.
+/// @param name Name of the engine, NULL for the default one.
+/// @return The engine, NULL if there is no engine with that name.
+const KvsEngine *get_engine(const char *name);
+
+#endif  // KVS_ENGINE_H
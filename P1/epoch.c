@@ -0,0 +1,191 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bit of EpochRecord.state set while the thread is in a critical section
+#define ACTIVE 1
+
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+} Retired;
+
+// Objects retired by one thread in one epoch
+typedef struct Limbo {
+    size_t epoch;
+    Retired *objects;
+    size_t count;
+    size_t capacity;
+} Limbo;
+
+// State of a thread. Records are never freed before epoch_destroy, a thread
+// that exits hands its record (and the objects it retired) to the next one.
+typedef struct EpochRecord {
+    _Alignas(64) atomic_size_t state;  // (epoch << 1) | ACTIVE
+    atomic_int in_use;
+    struct EpochRecord *next;
+    size_t retired;  // Objects retired since the last advance attempt
+    Limbo limbo[EPOCH_LISTS];
+} EpochRecord;
+
+static atomic_size_t global_epoch;
+static _Atomic(EpochRecord *) records = NULL;
+
+// Bumped by epoch_destroy, so that threads drop their freed records
+static atomic_ulong generation;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static _Thread_local EpochRecord *thread_record = NULL;
+static _Thread_local unsigned long thread_generation;
+
+// Releases the record of an exiting thread
+static void record_destructor(void *arg) {
+    EpochRecord *rec = arg;
+    if (thread_generation != atomic_load(&generation)) return;
+
+    atomic_store(&rec->state, 0);
+    atomic_store_explicit(&rec->in_use, 0, memory_order_release);
+}
+
+static void create_record_key() {
+    pthread_key_create(&record_key, record_destructor);
+}
+
+// Returns the record of the calling thread, taking a free one or creating
+// one on first use
+static EpochRecord *get_record() {
+    unsigned long current = atomic_load(&generation);
+    if (thread_record != NULL && thread_generation == current) {
+        return thread_record;
+    }
+
+    EpochRecord *rec;
+    for (rec = atomic_load(&records); rec != NULL; rec = rec->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&rec->in_use, &expected, 1)) break;
+    }
+
+    if (rec == NULL) {
+        rec = aligned_alloc(_Alignof(EpochRecord), sizeof(EpochRecord));
+        if (rec == NULL) return NULL;
+        memset(rec, 0, sizeof(EpochRecord));
+        atomic_init(&rec->state, 0);
+        atomic_init(&rec->in_use, 1);
+
+        rec->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &rec->next, rec)) {
+        }
+    }
+
+    thread_record = rec;
+    thread_generation = current;
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+// Advances the global epoch if every thread in a critical section has seen
+// the current one
+static void try_advance() {
+    size_t epoch = atomic_load(&global_epoch);
+    for (EpochRecord *rec = atomic_load(&records); rec != NULL;
+         rec = rec->next) {
+        size_t state = atomic_load(&rec->state);
+        if ((state & ACTIVE) && (state >> 1) != epoch) return;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+static void free_limbo(Limbo *limbo) {
+    for (size_t i = 0; i < limbo->count; i++) {
+        limbo->objects[i].free_fn(limbo->objects[i].ptr);
+    }
+    limbo->count = 0;
+}
+
+// Frees the objects of a record that no critical section can see anymore
+static void reclaim(EpochRecord *rec) {
+    size_t epoch = atomic_load(&global_epoch);
+    for (int i = 0; i < EPOCH_LISTS; i++) {
+        if (rec->limbo[i].count > 0 && rec->limbo[i].epoch + 2 <= epoch) {
+            free_limbo(&rec->limbo[i]);
+        }
+    }
+}
+
+void epoch_init() {
+    pthread_once(&key_once, create_record_key);
+    atomic_init(&global_epoch, 0);
+    atomic_store(&records, NULL);
+}
+
+int epoch_enter() {
+    EpochRecord *rec = get_record();
+    if (rec == NULL) return 1;
+
+    // Announce an epoch that is still current once announced, otherwise an
+    // advance could miss this thread and free what it is about to read
+    size_t epoch;
+    do {
+        epoch = atomic_load(&global_epoch);
+        atomic_store(&rec->state, (epoch << 1) | ACTIVE);
+    } while (atomic_load(&global_epoch) != epoch);
+
+    return 0;
+}
+
+void epoch_exit() {
+    atomic_store_explicit(&thread_record->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    // The object was unlinked before the epoch is read, so no critical
+    // section that starts in a later epoch can reach it
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t epoch = atomic_load(&global_epoch);
+
+    // An object that cannot be recorded is leaked rather than freed after a
+    // grace period: the caller may be in a critical section of this epoch,
+    // which would keep the grace period from ever ending
+    EpochRecord *rec = get_record();
+    if (rec == NULL) return;
+
+    // A list still holding an older epoch is at least 3 epochs old
+    Limbo *limbo = &rec->limbo[epoch % EPOCH_LISTS];
+    if (limbo->count > 0 && limbo->epoch != epoch) free_limbo(limbo);
+    limbo->epoch = epoch;
+
+    if (limbo->count == limbo->capacity) {
+        size_t capacity = limbo->capacity == 0 ? 16 : limbo->capacity * 2;
+        Retired *objects = realloc(limbo->objects, capacity * sizeof(Retired));
+        if (objects == NULL) return;
+        limbo->objects = objects;
+        limbo->capacity = capacity;
+    }
+    limbo->objects[limbo->count++] = (Retired){ptr, free_fn};
+
+    if (++rec->retired >= EPOCH_RETIRE_BATCH) {
+        rec->retired = 0;
+        try_advance();
+        reclaim(rec);
+    }
+}
+
+void epoch_destroy() {
+    EpochRecord *rec = atomic_load(&records);
+    while (rec != NULL) {
+        EpochRecord *next = rec->next;
+        for (int i = 0; i < EPOCH_LISTS; i++) {
+            free_limbo(&rec->limbo[i]);
+            free(rec->limbo[i].objects);
+        }
+        free(rec);
+        rec = next;
+    }
+    atomic_store(&records, NULL);
+
+    atomic_fetch_add(&generation, 1);
+}
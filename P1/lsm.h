@@ -0,0 +1,172 @@
+#ifndef KVS_LSM_H
+#define KVS_LSM_H
+
+// Writes and deletes a memtable takes before it is flushed to a run when
+// KVS_LSM_MEMTABLE is not set
+#define LSM_DEFAULT_MEMTABLE 262144
+
+// Largest block of a run, the unit read from disk and kept in the cache
+#define LSM_BLOCK_SIZE 4096
+
+// Runs flushed to level 0 before they are compacted into level 1, and the
+// most it holds while the compaction runs, flushes waiting for it then
+#define LSM_L0_RUNS 4
+#define LSM_L0_MAX_RUNS 8
+
+// Writers wait for the flush of the immutable memtable once the active one
+// took this many times memtable_size writes and deletes
+#define LSM_STALL_MEMTABLES 2
+
+// Each level below level 1 holds up to this many times more pairs than the
+// level above it
+#define LSM_LEVEL_RATIO 10
+
+// Number of levels, the last one is never full
+#define LSM_MAX_LEVELS 8
+
+// Bits of the bloom filter of a run per pair, about 1% false positives
+#define LSM_BLOOM_BITS 10
+
+// Blocks of runs kept in memory by a table, and the number of locks guarding
+// them
+#define LSM_CACHE_BLOCKS 1024
+#define LSM_CACHE_LOCKS 64
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "swiss.h"
+#include "sync.h"
+
+// In-memory table of the latest writes. Deleted keys are kept in their own
+// table, so that they hide the older values of the runs.
+typedef struct LsmMemtable {
+    SwissTable *pairs;
+    SwissTable *deleted;
+} LsmMemtable;
+
+// Immutable file of pairs sorted by key, split in blocks of up to
+// LSM_BLOCK_SIZE bytes. A block holds for each pair the length of the key
+// (1 byte), its bytes, the length of the value (1 byte, LSM_TOMBSTONE for a
+// deleted key) and its bytes. Only the blocks are in the file, which is
+// unlinked once created: the bloom filter and the first key of each block
+// (fence pointers) stay in memory, so that a lookup reads at most one block.
+typedef struct LsmRun {
+    int fd;
+    uint64_t id;       // Unique among the runs of the process, tags the cache
+    size_t num_pairs;  // Number of pairs, deleted keys included
+    size_t num_blocks;
+    char (*fences)[MAX_STRING_SIZE];  // First key of each block
+    uint64_t *offsets;  // Offset of each block, and the size of the file
+    uint64_t *bloom;
+    size_t bloom_bits;
+} LsmRun;
+
+// Block of a run kept in memory
+typedef struct LsmCachedBlock {
+    uint64_t run;  // Id of the run, 0 if the entry is empty
+    size_t block;
+    size_t size;
+    char data[LSM_BLOCK_SIZE];
+} LsmCachedBlock;
+
+// Log-structured merge tree. The active memtable is protected by the lock
+// stripes like any other table. When it is full resize_table makes it the
+// immutable memtable, unless the previous one is still being flushed, and
+// the table thread flushes it to a new level 0 run and compacts full levels
+// into the next one, each level below 0 being a single run. The immutable memtable and the runs are only replaced by that
+// thread, with version_lock held for writing, so that readers never see a
+// run that is being freed.
+typedef struct LsmTable {
+    LsmMemtable *active;
+    atomic_size_t updates;  // Writes and deletes of the active memtable
+    size_t memtable_size;   // Updates that fill a memtable
+    size_t stripes;
+    char *dir;  // Directory of the run files
+
+    KvsRwlock version_lock;
+    LsmMemtable *immutable;  // NULL when there is nothing to flush
+    atomic_int flushing;     // Set while immutable is not NULL
+    LsmRun *l0[LSM_L0_MAX_RUNS];  // Newest first
+    size_t num_l0;
+    LsmRun *levels[LSM_MAX_LEVELS];  // Run of level i, NULL if empty. The
+                                     // runs of level 0 are in l0.
+
+    pthread_t thread;
+    pthread_mutex_t mutex;  // Protects the fields below and immutable
+    pthread_cond_t work;     // Signaled when there is a memtable to flush
+    pthread_cond_t flushed;  // Signaled when the immutable memtable is gone
+    int stop;
+    atomic_int failed;  // Set when a run could not be written, which stops
+                        // flushes and compactions
+
+    LsmCachedBlock *cache;
+    KvsMutex cache_locks[LSM_CACHE_LOCKS];  // Lock of block i is i % count
+
+    // Keys and values of the last listing, one after the other
+    char (*listing)[MAX_STRING_SIZE];
+} LsmTable;
+
+/// Creates a new empty table, whose runs are created in a directory and
+/// removed when it is freed, and starts its thread.
+/// @param dir Directory of the run files.
+/// @param memtable_size Writes and deletes before a memtable is flushed.
+/// @param stripes Number of lock stripes, a power of two.
+/// @return Newly created table, NULL on failure.
+LsmTable *lsm_create_table(const char *dir, size_t memtable_size,
+                           size_t stripes);
+
+/// Writes a pair to the active memtable.
+/// @param lt Table to be modified.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @return 0 if the pair was written successfully, 1 otherwise.
+int lsm_write_pair(LsmTable *lt, const char *key, const char *value);
+
+/// Reads the value of a key from the memtables, then from the runs from the
+/// newest to the oldest.
+/// @param lt Table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value to be freed with slab_free, NULL if the key does
+/// not exist.
+char *lsm_read_pair(LsmTable *lt, const char *key);
+
+/// Deletes a key, marking it deleted in the active memtable.
+/// @param lt Table to delete from.
+/// @param key Key of the pair to be deleted.
+/// @return 0 if the key was deleted, 1 if it did not exist.
+int lsm_delete_pair(LsmTable *lt, const char *key);
+
+/// Checks if the active memtable is full and the previous one was flushed.
+/// @param lt Table to check.
+/// @return 1 if lsm_rotate must be called, 0 otherwise.
+int lsm_rotate_needed(LsmTable *lt);
+
+/// Hands the active memtable over to the table thread to be flushed. Never
+/// waits for the previous one, the active memtable taking the writes until
+/// it is flushed. The caller must hold htMutex for writing.
+/// @param lt Table whose memtable is full.
+void lsm_rotate(LsmTable *lt);
+
+/// Waits for the flush of the immutable memtable while the active one holds
+/// more than LSM_STALL_MEMTABLES times memtable_size updates, so that
+/// writers do not outrun the table thread. The caller must hold no lock.
+/// @param lt Table written to.
+void lsm_throttle(LsmTable *lt);
+
+/// Lists every pair of the table, merging the memtables and the runs.
+/// @param lt Table to list.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs sorted by key, to be freed by the caller. The
+/// strings belong to the table until the next listing. NULL if empty.
+KvsPair *lsm_list_pairs(LsmTable *lt, size_t *count);
+
+/// Stops the thread of the table and frees it with its runs.
+/// @param lt Table to be deleted.
+void lsm_free_table(LsmTable *lt);
+
+#endif  // KVS_LSM_H
@@ -8,24 +8,27 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "config.h"
 #include "constants.h"
 #include "operations.h"
 #include "parser.h"
+#include "throttle.h"
 #include "utils.h"
 
-int active_backups = 0;
 int max_backups;
-pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void kvs_main(char *job_name) {
     // flag used to control the loop
     int flag = 1;
     int num_backup_name = 0;
 
-    int file_in = open(job_name, O_RDONLY);
+    int fd_in = open(job_name, O_RDONLY);
+    JobReader *file_in =
+        fd_in != -1 ? job_open(fd_in, JOB_INPUT_MAPPED) : NULL;
 
-    if (file_in == -1) {
+    if (file_in == NULL) {
         fprintf(stderr, "Failed to open file\n");
+        if (fd_in != -1) close(fd_in);
         return;
     }
 
@@ -38,7 +41,8 @@ void kvs_main(char *job_name) {
 
     if (file_out == -1) {
         fprintf(stderr, "Failed to open file\n");
-        free(job_out_path);
+        job_close(file_in);
+        close(fd_in);
         return;
     }
 
@@ -48,6 +52,9 @@ void kvs_main(char *job_name) {
         unsigned int delay;
         size_t num_pairs;
 
+        // Backups back off while the jobs run commands
+        throttle_foreground();
+
         switch (get_next(file_in)) {
             case CMD_WRITE:
                 num_pairs = parse_write(file_in, keys, values, MAX_WRITE_SIZE,
@@ -119,26 +126,12 @@ void kvs_main(char *job_name) {
             case CMD_BACKUP:
                 num_backup_name++;
 
-                while (1) {
-                    mutex_lock(&backup_mutex);
-                    if (active_backups < max_backups) {
-                        active_backups++;
-
-                        mutex_unlock(&backup_mutex);
-                        break;
-                    }
-                    mutex_unlock(&backup_mutex);
-                }
-
+                // Queued behind the backups being written, if there are
+                // max_backups of them, while the job goes on
                 if (kvs_backup(job_name, num_backup_name)) {
                     fprintf(stderr, "Failed to perform backup.\n");
                     num_backup_name--;
                 }
-
-                mutex_lock(&backup_mutex);
-                active_backups--;
-                mutex_unlock(&backup_mutex);
-
                 break;
 
             case CMD_INVALID:
@@ -166,7 +159,8 @@ void kvs_main(char *job_name) {
                 break;
         }
     }
-    close(file_in);
+    job_close(file_in);
+    close(fd_in);
     close(file_out);
 
     return;
@@ -226,6 +220,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (load_config()) {
+        closedir(dir);
+        return 1;
+    }
+    kvs_set_max_backups((size_t)max_backups);
+
+    // kvs_init recovers the state (KVS_RESTORE and KVS_WAL) before the job
+    // threads start
     if (kvs_init()) {
         fprintf(stderr, "Failed to initialize KVS\n");
         closedir(dir);
@@ -261,7 +263,6 @@ int main(int argc, char *argv[]) {
     free(jobs);
 
     mutex_destroy(&data.mutex);
-    mutex_destroy(&backup_mutex);
 
     return 0;
 }
@@ -1,22 +1,220 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "constants.h"
 
-static int read_string(int fd, char *buffer, size_t max) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+// find_delimiters_avx2 is compiled for any x86 and used if the CPU has AVX2
+#define SCAN_AVX2 1
+#endif
+
+// Bytes whose delimiters are found at once, see find_delimiters
+#define SCAN_BLOCK 64
+
+// Bit i of the result is set if byte i of the block ends a string of a
+// WRITE, READ or DELETE list: ',', ')', ']' or a space, which makes it
+// invalid. The bytes are compared 16 at a time with SSE2 when the compiler
+// targets it.
+static uint64_t find_delimiters(const char *block) {
+#if defined(__SSE2__)
+    uint64_t mask = 0;
+    for (int i = 0; i < SCAN_BLOCK; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(',')),
+                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8(')'))),
+            _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(']')),
+                         _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '))));
+        mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(hits) << i;
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < SCAN_BLOCK; i++) {
+        char ch = block[i];
+        if (ch == ',' || ch == ')' || ch == ']' || ch == ' ') {
+            mask |= (uint64_t)1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+#ifdef SCAN_AVX2
+// find_delimiters comparing 32 bytes at a time, whatever the compiler targets
+__attribute__((target("avx2"))) static uint64_t find_delimiters_avx2(
+    const char *block) {
+    uint64_t mask = 0;
+    for (int i = 0; i < SCAN_BLOCK; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + i));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(',')),
+                            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(')'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(']')),
+                            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' '))));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(hits) << i;
+    }
+    return mask;
+}
+#endif
+
+struct JobReader {
+    int fd;
+    JobInput input;
+    const char *data;  // The mapped file, or buffer
+    char *buffer;      // Bytes read from the file, NULL if it is mapped
+    size_t pos;        // Next byte of data to parse
+    size_t end;        // End of the bytes of data
+    size_t block;      // Offset in data of the last block scanned
+    uint64_t delimiters;  // Delimiters of that block
+    uint64_t (*find)(const char *block);  // find_delimiters for this CPU
+};
+
+// Marks that no block of data was scanned since it was last filled
+#define NO_BLOCK SIZE_MAX
+
+JobReader *job_open(int fd, JobInput input) {
+    JobReader *in = malloc(sizeof(JobReader));
+    if (in == NULL) return NULL;
+    *in = (JobReader){.fd = fd, .input = input, .block = NO_BLOCK,
+                      .find = find_delimiters};
+#ifdef SCAN_AVX2
+    if (__builtin_cpu_supports("avx2")) in->find = find_delimiters_avx2;
+#endif
+
+    struct stat st;
+    if (input == JOB_INPUT_MAPPED && fstat(fd, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data =
+            mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // Read once from start to end
+            posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->data = data;
+            in->end = (size_t)st.st_size;
+            return in;
+        }
+    }
+
+    // Files that cannot be mapped, such as pipes, are read in blocks
+    if (input == JOB_INPUT_MAPPED) in->input = JOB_INPUT_BUFFERED;
+    in->buffer = malloc(in->input == JOB_INPUT_BYTES ? 1 : JOB_BUFFER_SIZE);
+    if (in->buffer == NULL) {
+        free(in);
+        return NULL;
+    }
+    in->data = in->buffer;
+    return in;
+}
+
+void job_close(JobReader *in) {
+    if (in == NULL) return;
+    if (in->buffer == NULL && in->end > 0) {
+        munmap((void *)in->data, in->end);
+    }
+    free(in->buffer);
+    free(in);
+}
+
+// Reads the next bytes of a file that is not mapped into the buffer
+// @return 1 if bytes were read, 0 at the end of the file or on error.
+static int fill(JobReader *in) {
+    if (in->buffer == NULL) return 0;
+    size_t size = in->input == JOB_INPUT_BYTES ? 1 : JOB_BUFFER_SIZE;
     ssize_t bytes_read;
+    do {
+        bytes_read = read(in->fd, in->buffer, size);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read <= 0) return 0;
+    in->pos = 0;
+    in->end = (size_t)bytes_read;
+    in->block = NO_BLOCK;
+    return 1;
+}
+
+// Reads the next byte of a job file
+// @return 1 if a byte was read, 0 at the end of the file or on error.
+static int next_char(JobReader *in, char *ch) {
+    if (in->pos == in->end && !fill(in)) return 0;
+    *ch = in->data[in->pos++];
+    return 1;
+}
+
+// Reads up to size bytes, fewer only at the end of the file
+// @return Number of bytes read.
+static size_t read_chars(JobReader *in, char *buffer, size_t size) {
+    size_t i = 0;
+    while (i < size && next_char(in, &buffer[i])) i++;
+    return i;
+}
+
+// Finds the first delimiter of data in [from, limit), scanning each block
+// of SCAN_BLOCK bytes once however many strings it holds
+// @return Its offset, limit if there is none.
+static size_t next_delimiter(JobReader *in, size_t from, size_t limit) {
+    while (from < limit) {
+        size_t block = from - from % SCAN_BLOCK;
+        if (block != in->block) {
+            if (in->end - block >= SCAN_BLOCK) {
+                in->delimiters = in->find(in->data + block);
+            } else {
+                // The last bytes, which may end a mapping
+                char tail[SCAN_BLOCK] = {0};
+                memcpy(tail, in->data + block, in->end - block);
+                in->delimiters = in->find(tail);
+            }
+            in->block = block;
+        }
+
+        uint64_t found = in->delimiters & (~(uint64_t)0 << (from - block));
+        if (found != 0) {
+            size_t at = block + (size_t)__builtin_ctzll(found);
+            return at < limit ? at : limit;
+        }
+        from = block + SCAN_BLOCK;
+    }
+    return limit;
+}
+
+// Reads a string of a list, up to max - 1 bytes and the delimiter after it
+// @return 0 if it ends at ',', 1 at ')', 2 at ']', -1 at a space, if it is
+// too long or at the end of the file.
+static int read_string(JobReader *in, char *buffer, size_t max) {
+    // With the next max bytes in memory, or the rest of a mapped file, the
+    // string is found by its delimiter and copied at once
+    if (in->buffer == NULL || in->end - in->pos >= max) {
+        size_t start = in->pos;
+        size_t limit = in->end - start < max ? in->end : start + max;
+        size_t at = next_delimiter(in, start, limit);
+        if (at == limit) {
+            in->pos = limit;
+            return -1;
+        }
+
+        in->pos = at + 1;
+        if (in->data[at] == ' ') {
+            return -1;
+        }
+        memcpy(buffer, in->data + start, at - start);
+        buffer[at - start] = '\0';
+        return in->data[at] == ',' ? 0 : (in->data[at] == ')' ? 1 : 2);
+    }
+
     char ch;
     size_t i = 0;
     int value = -1;
 
     while (i < max) {
-        bytes_read = read(fd, &ch, 1);
-
-        if (bytes_read <= 0) {
+        if (!next_char(in, &ch)) {
             return -1;
         }
 
@@ -38,34 +236,38 @@ static int read_string(int fd, char *buffer, size_t max) {
         buffer[i++] = ch;
     }
 
-    buffer[i] = '\0';
+    // A string of max bytes is too long, and not terminated
+    if (value >= 0) {
+        buffer[i] = '\0';
+    }
 
     return value;
 }
 
-static int read_uint(int fd, unsigned int *value, char *next) {
-    char buf[16];
+// Reads the digits of a number and the character after them, '\0' at the
+// end of the file. No digits read as 0.
+static int read_uint(JobReader *in, unsigned int *value, char *next) {
+    unsigned long ul = 0;
+    int overflow = 0;
 
-    int i = 0;
     while (1) {
-        if (read(fd, buf + i, 1) == 0) {
+        if (!next_char(in, next)) {
             *next = '\0';
             break;
         }
 
-        *next = buf[i];
-
-        if (buf[i] > '9' || buf[i] < '0') {
-            buf[i] = '\0';
+        if (*next > '9' || *next < '0') {
             break;
         }
 
-        i++;
+        ul = ul * 10 + (unsigned long)(*next - '0');
+        if (ul > UINT_MAX) {
+            overflow = 1;
+            ul = 0;
+        }
     }
 
-    unsigned long ul = strtoul(buf, NULL, 10);
-
-    if (ul > UINT_MAX) {
+    if (overflow) {
         return 1;
     }
 
@@ -74,23 +276,31 @@ static int read_uint(int fd, unsigned int *value, char *next) {
     return 0;
 }
 
-static void cleanup(int fd) {
-    char ch;
-    while (read(fd, &ch, 1) == 1 && ch != '\n');
+static void cleanup(JobReader *in) {
+    // Up to the next newline, skipped with memchr when it is in memory
+    while (in->pos < in->end || fill(in)) {
+        const char *newline =
+            memchr(in->data + in->pos, '\n', in->end - in->pos);
+        if (newline != NULL) {
+            in->pos = (size_t)(newline - in->data) + 1;
+            return;
+        }
+        in->pos = in->end;
+    }
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(JobReader *in) {
     char buf[16];
-    if (read(fd, buf, 1) != 1) {
+    if (!next_char(in, buf)) {
         return EOC;
     }
 
     switch (buf[0]) {
         case 'W':
-            if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-                if (read(fd, buf + 5, 1) != 1 ||
+            if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+                if (read_chars(in, buf + 5, 1) != 1 ||
                     strncmp(buf, "WRITE ", 6) != 0) {
-                    cleanup(fd);
+                    cleanup(in);
                     return CMD_INVALID;
                 }
                 return CMD_WRITE;
@@ -99,116 +309,114 @@ enum Command get_next(int fd) {
             return CMD_WAIT;
 
         case 'R':
-            if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-                cleanup(fd);
+            if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
             return CMD_READ;
 
         case 'D':
-            if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-                cleanup(fd);
+            if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
             return CMD_DELETE;
 
         case 'S':
-            if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-                cleanup(fd);
+            if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
-            if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-                cleanup(fd);
+            if (read_chars(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
             return CMD_SHOW;
 
         case 'B':
-            if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-                cleanup(fd);
+            if (read_chars(in, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
-            if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-                cleanup(fd);
+            if (read_chars(in, buf + 6, 1) != 0 && buf[6] != '\n') {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
             return CMD_BACKUP;
 
         case 'H':
-            if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-                cleanup(fd);
+            if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
-            if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-                cleanup(fd);
+            if (read_chars(in, buf + 4, 1) != 0 && buf[4] != '\n') {
+                cleanup(in);
                 return CMD_INVALID;
             }
 
             return CMD_HELP;
 
         case '#':
-            cleanup(fd);
+            cleanup(in);
             return CMD_EMPTY;
 
         case '\n':
             return CMD_EMPTY;
 
         default:
-            cleanup(fd);
+            cleanup(in);
             return CMD_INVALID;
     }
 }
 
-int parse_pair(int fd, char *key, char *value) {
-    if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-        cleanup(fd);
+static int parse_pair(JobReader *in, char *key, char *value) {
+    if (read_string(in, key, MAX_STRING_SIZE) != 0) {
+        cleanup(in);
         return 0;
     }
 
-    if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-        cleanup(fd);
+    if (read_string(in, value, MAX_STRING_SIZE) != 1) {
+        cleanup(in);
         return 0;
     }
 
     return 1;
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
+size_t parse_write(JobReader *in, char keys[][MAX_STRING_SIZE],
                    char values[][MAX_STRING_SIZE], size_t max_pairs,
                    size_t max_string_size) {
     char ch;
 
-    if (read(fd, &ch, 1) != 1 || ch != '[') {
-        cleanup(fd);
+    if (!next_char(in, &ch) || ch != '[') {
+        cleanup(in);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || ch != '(') {
-        cleanup(fd);
+    if (!next_char(in, &ch) || ch != '(') {
+        cleanup(in);
         return 0;
     }
 
+    (void)max_string_size;  // Pairs are read into the arrays themselves
+
     size_t num_pairs = 0;
-    char key[max_string_size];
-    char value[max_string_size];
     while (num_pairs < max_pairs) {
-        if (parse_pair(fd, key, value) == 0) {
-            cleanup(fd);
+        if (parse_pair(in, keys[num_pairs], values[num_pairs]) == 0) {
+            cleanup(in);
             return 0;
         }
+        num_pairs++;
 
-        strcpy(keys[num_pairs], key);
-        strcpy(values[num_pairs++], value);
-
-        if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-            cleanup(fd);
+        if (!next_char(in, &ch) || (ch != '(' && ch != ']')) {
+            cleanup(in);
             return 0;
         }
 
@@ -218,72 +426,74 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE],
     }
 
     if (num_pairs == max_pairs) {
-        cleanup(fd);
+        cleanup(in);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-        cleanup(fd);
+    if (!next_char(in, &ch) || (ch != '\n' && ch != '\0')) {
+        cleanup(in);
         return 0;
     }
 
     return num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
+size_t parse_read_delete(JobReader *in, char keys[][MAX_STRING_SIZE], size_t max_keys,
                          size_t max_string_size) {
     char ch;
 
-    if (read(fd, &ch, 1) != 1 || ch != '[') {
-        cleanup(fd);
+    if (!next_char(in, &ch) || ch != '[') {
+        cleanup(in);
         return 0;
     }
 
+    // Keys are read into the array itself, which holds MAX_STRING_SIZE bytes
+    if (max_string_size > MAX_STRING_SIZE) {
+        max_string_size = MAX_STRING_SIZE;
+    }
+
     size_t num_keys = 0;
-    char key[max_string_size];
     while (num_keys < max_keys) {
-        int output = read_string(fd, key, max_string_size);
+        int output = read_string(in, keys[num_keys++], max_string_size);
         if (output < 0 || output == 1) {
-            cleanup(fd);
+            cleanup(in);
             return 0;
         }
 
-        strcpy(keys[num_keys++], key);
-
         if (output == 2) {
             break;
         }
     }
 
     if (num_keys == max_keys) {
-        cleanup(fd);
+        cleanup(in);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-        cleanup(fd);
+    if (!next_char(in, &ch) || (ch != '\n' && ch != '\0')) {
+        cleanup(in);
         return 0;
     }
 
     return num_keys;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(JobReader *in, unsigned int *delay, unsigned int *thread_id) {
     char ch;
 
-    if (read_uint(fd, delay, &ch) != 0) {
-        cleanup(fd);
+    if (read_uint(in, delay, &ch) != 0) {
+        cleanup(in);
         return -1;
     }
 
     if (ch == ' ') {
         if (thread_id == NULL) {
-            cleanup(fd);
+            cleanup(in);
             return 0;
         }
 
-        if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-            cleanup(fd);
+        if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+            cleanup(in);
             return -1;
         }
 
@@ -291,7 +501,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
     } else if (ch == '\n' || ch == '\0') {
         return 0;
     } else {
-        cleanup(fd);
+        cleanup(in);
         return -1;
     }
 }
@@ -0,0 +1,578 @@
+#include "splitorder.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+#include "kvs.h"
+#include "slab.h"
+
+// Low bit of SoNode.next, set once the node is deleted
+#define MARK ((uintptr_t)1)
+
+// Value of deleted keys. It is final: a deleted node is unlinked and a later
+// write of the key inserts a new node.
+static SoValue tombstone;
+
+// Returned by install when the key holds a value of another batch that has
+// not committed yet. Never stored in a node.
+static SoValue pending;
+
+// Entry of a multi-key write, see so_write_batch
+typedef struct BatchEntry {
+    size_t so_key;
+    size_t hash;
+    const char *key;
+    size_t index;     // Position in the command, later duplicates win
+    SoValue *value;   // Value to install
+    SoNode *spare;    // Node to insert if the key is absent
+    int superseded;   // Replaced by a later duplicate of the key
+} BatchEntry;
+
+static SoNode *node_of(uintptr_t link) { return (SoNode *)(link & ~MARK); }
+
+static size_t reverse_bits(size_t x) {
+    uint64_t v = __builtin_bswap64((uint64_t)x);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    return (size_t)v;
+}
+
+// Regular keys have an odd so_key, sentinels an even one, so that a
+// sentinel is placed before every key of its bucket
+static size_t regular_key(size_t h) { return reverse_bits(h) | 1; }
+
+static size_t sentinel_key(size_t bucket) { return reverse_bits(bucket); }
+
+// Bucket a bucket is split from, bucket with its highest bit cleared
+static size_t parent_bucket(size_t bucket) {
+    return bucket & ~((size_t)1 << (63 - __builtin_clzll(bucket)));
+}
+
+// Compares a node with (so_key, key), key being NULL for sentinels
+static int compare(const SoNode *node, size_t so_key, const char *key) {
+    if (node->so_key != so_key) return node->so_key < so_key ? -1 : 1;
+    if (key == NULL) return 0;
+    return strcmp(node->key, key);
+}
+
+// Finds the first node not smaller than (so_key, key) after start, unlinking
+// the deleted nodes on the way. Stores in *link the link that points to it.
+static SoNode *find(SoNode *start, size_t so_key, const char *key,
+                    _Atomic(uintptr_t) **link) {
+    int restart;
+    _Atomic(uintptr_t) *prev;
+    SoNode *cur;
+
+    do {
+        restart = 0;
+        prev = &start->next;
+        cur = node_of(atomic_load_explicit(prev, memory_order_acquire));
+
+        while (cur != NULL) {
+            uintptr_t next =
+                atomic_load_explicit(&cur->next, memory_order_acquire);
+            if (next & MARK) {
+                // Only the thread that unlinks a node retires it
+                uintptr_t expected = (uintptr_t)cur;
+                if (!atomic_compare_exchange_strong(prev, &expected,
+                                                    next & ~MARK)) {
+                    restart = 1;  // prev changed or was deleted
+                    break;
+                }
+                epoch_retire(cur, slab_free);
+                cur = node_of(next);
+                continue;
+            }
+            if (compare(cur, so_key, key) >= 0) break;
+            prev = &cur->next;
+            cur = node_of(next);
+        }
+    } while (restart);
+
+    *link = prev;
+    return cur;
+}
+
+// Sets the mark of a node, after which no node can be linked after it
+static void mark_deleted(SoNode *node) {
+    uintptr_t next = atomic_load(&node->next);
+    while (!(next & MARK) &&
+           !atomic_compare_exchange_weak(&node->next, &next, next | MARK)) {
+    }
+}
+
+// Returns the sentinel slot of a bucket, allocating its segment if create
+// is set. NULL if the segment is missing.
+static _Atomic(SoNode *) *bucket_slot(SoTable *st, size_t bucket,
+                                      int create) {
+    _Atomic(_Atomic(SoNode *) *) *dir = &st->segments[bucket / SO_SEGMENT_SIZE];
+    _Atomic(SoNode *) *segment =
+        atomic_load_explicit(dir, memory_order_acquire);
+
+    if (segment == NULL) {
+        if (!create) return NULL;
+        _Atomic(SoNode *) *fresh =
+            calloc(SO_SEGMENT_SIZE, sizeof(_Atomic(SoNode *)));
+        if (fresh == NULL) return NULL;
+        if (atomic_compare_exchange_strong(dir, &segment, fresh)) {
+            segment = fresh;
+        } else {
+            free(fresh);  // Another thread installed it first
+        }
+    }
+    return &segment[bucket % SO_SEGMENT_SIZE];
+}
+
+// Returns the sentinel of an initialized bucket or, if it is not, of the
+// nearest initialized ancestor, which holds the nodes of the bucket too
+static SoNode *read_sentinel(SoTable *st, size_t bucket) {
+    for (;;) {
+        _Atomic(SoNode *) *slot = bucket_slot(st, bucket, 0);
+        SoNode *sentinel =
+            slot ? atomic_load_explicit(slot, memory_order_acquire) : NULL;
+        if (sentinel != NULL) return sentinel;
+        bucket = parent_bucket(bucket);  // Bucket 0 is always initialized
+    }
+}
+
+// Returns the sentinel of a bucket, inserting it after the sentinel of its
+// parent if needed. NULL on allocation failure.
+static SoNode *get_sentinel(SoTable *st, size_t bucket) {
+    _Atomic(SoNode *) *slot = bucket_slot(st, bucket, 1);
+    if (slot == NULL) return NULL;
+    SoNode *sentinel = atomic_load_explicit(slot, memory_order_acquire);
+    if (sentinel != NULL) return sentinel;
+
+    SoNode *start = get_sentinel(st, parent_bucket(bucket));
+    if (start == NULL) return NULL;
+
+    SoNode *fresh = slab_alloc(sizeof(SoNode));
+    if (fresh == NULL) return NULL;
+    fresh->so_key = sentinel_key(bucket);
+    fresh->key[0] = '\0';
+    atomic_init(&fresh->value, NULL);
+
+    for (;;) {
+        _Atomic(uintptr_t) *link;
+        SoNode *cur = find(start, fresh->so_key, NULL, &link);
+        if (cur != NULL && cur->so_key == fresh->so_key) {
+            slab_free(fresh);  // Inserted by another thread
+            sentinel = cur;
+            break;
+        }
+
+        atomic_store_explicit(&fresh->next, (uintptr_t)cur,
+                              memory_order_relaxed);
+        uintptr_t expected = (uintptr_t)cur;
+        if (atomic_compare_exchange_strong(link, &expected,
+                                           (uintptr_t)fresh)) {
+            sentinel = fresh;
+            break;
+        }
+    }
+
+    atomic_store_explicit(slot, sentinel, memory_order_release);
+    return sentinel;
+}
+
+// Returns the node to start searching a hash from. If the bucket cannot be
+// initialized an ancestor is used instead, so this never fails.
+static SoNode *start_of(SoTable *st, size_t h) {
+    size_t bucket = h & (atomic_load(&st->size) - 1);
+    SoNode *sentinel = get_sentinel(st, bucket);
+    return sentinel != NULL ? sentinel : read_sentinel(st, bucket);
+}
+
+// Doubles the bucket count if the load factor is exceeded. The new buckets
+// are initialized on first use.
+static void maybe_grow(SoTable *st, size_t count) {
+    size_t size = atomic_load(&st->size);
+    if (count > size * SO_LOAD_FACTOR &&
+        size * 2 <= (size_t)SO_SEGMENT_SIZE * SO_SEGMENTS) {
+        atomic_compare_exchange_strong(&st->size, &size, size * 2);
+    }
+}
+
+// Checks if a value was installed by a batch that has not committed yet
+static int uncommitted(SoValue *value) {
+    SoBatch *batch = atomic_load_explicit(&value->batch, memory_order_acquire);
+    return batch != NULL &&
+           !atomic_load_explicit(&batch->committed, memory_order_acquire);
+}
+
+// Waits for another batch to commit outside the critical section, which
+// must not block, so that the wait does not hold back reclamation. The
+// caller's own uncommitted values are only retired by itself.
+static void yield_epoch() {
+    epoch_exit();
+    sched_yield();
+    // The thread already has a record, so entering again cannot fail
+    epoch_enter();
+}
+
+// Returns the value readers see in a node, NULL if the key is absent
+static SoValue *visible_value(SoNode *node) {
+    SoValue *value = atomic_load_explicit(&node->value, memory_order_acquire);
+    if (value == &tombstone) return NULL;
+
+    SoBatch *batch = atomic_load_explicit(&value->batch, memory_order_acquire);
+    if (batch != NULL &&
+        !atomic_load_explicit(&batch->committed, memory_order_acquire)) {
+        return value->prev;
+    }
+    return value;
+}
+
+static SoValue *new_value(const char *str, SoBatch *batch) {
+    SoValue *value = slab_alloc(sizeof(SoValue));
+    if (value == NULL) return NULL;
+    atomic_init(&value->batch, batch);
+    value->prev = NULL;
+    strcpy(value->value, str);
+    return value;
+}
+
+static SoNode *new_node(const char *key, size_t h) {
+    SoNode *node = slab_alloc(sizeof(SoNode));
+    if (node == NULL) return NULL;
+    node->so_key = regular_key(h);
+    strcpy(node->key, key);
+    return node;
+}
+
+// Makes value the value of key, inserting *spare (and setting it to NULL)
+// if the key is absent. Must be called inside an epoch.
+// Returns the replaced value, NULL if the key was absent, &pending if the
+// key holds a value of another uncommitted batch, see yield_epoch.
+static SoValue *install(SoTable *st, const char *key, size_t h,
+                        SoValue *value, SoNode **spare) {
+    size_t so_key = regular_key(h);
+    SoBatch *batch = atomic_load_explicit(&value->batch, memory_order_relaxed);
+    SoNode *start = start_of(st, h);
+
+    for (;;) {
+        _Atomic(uintptr_t) *link;
+        SoNode *cur = find(start, so_key, key, &link);
+
+        if (cur != NULL && compare(cur, so_key, key) == 0) {
+            SoValue *old = atomic_load_explicit(&cur->value,
+                                                memory_order_acquire);
+            if (old == &tombstone) {
+                // Deleted but still linked, unlink it and insert a new node
+                mark_deleted(cur);
+                continue;
+            }
+
+            if (batch != NULL && atomic_load(&old->batch) == batch) {
+                value->prev = old->prev;  // Duplicate key in the batch
+            } else {
+                if (uncommitted(old)) return &pending;
+                if (batch != NULL) value->prev = old;
+            }
+            if (atomic_compare_exchange_strong(&cur->value, &old, value)) {
+                return old;
+            }
+            continue;
+        }
+
+        SoNode *node = *spare;
+        value->prev = NULL;
+        atomic_init(&node->value, value);
+        atomic_store_explicit(&node->next, (uintptr_t)cur,
+                              memory_order_relaxed);
+        uintptr_t expected = (uintptr_t)cur;
+        if (atomic_compare_exchange_strong(link, &expected, (uintptr_t)node)) {
+            *spare = NULL;
+            return NULL;
+        }
+    }
+}
+
+SoTable *so_create_table() {
+    SoTable *st = malloc(sizeof(SoTable));
+    if (!st) return NULL;
+
+    for (size_t i = 0; i < SO_SEGMENTS; i++) {
+        atomic_init(&st->segments[i], NULL);
+    }
+    atomic_init(&st->size, 1);
+    atomic_init(&st->count, 0);
+    atomic_init(&st->head.next, 0);
+    atomic_init(&st->head.value, NULL);
+    st->head.so_key = sentinel_key(0);
+    st->head.key[0] = '\0';
+
+    _Atomic(SoNode *) *slot = bucket_slot(st, 0, 1);
+    if (slot == NULL) {
+        free(st);
+        return NULL;
+    }
+    atomic_store(slot, &st->head);
+    return st;
+}
+
+int so_write_pair(SoTable *st, const char *key, const char *value) {
+    if (strlen(key) >= MAX_STRING_SIZE || strlen(value) >= MAX_STRING_SIZE) {
+        return 1;
+    }
+
+    size_t h = hash(key);
+    SoValue *fresh = new_value(value, NULL);
+    SoNode *spare = new_node(key, h);
+    if (fresh == NULL || spare == NULL || epoch_enter() != 0) {
+        slab_free(fresh);
+        slab_free(spare);
+        return 1;
+    }
+
+    SoValue *old;
+    while ((old = install(st, key, h, fresh, &spare)) == &pending) {
+        yield_epoch();
+    }
+    if (old != NULL) {
+        epoch_retire(old, slab_free);
+    } else {
+        maybe_grow(st, atomic_fetch_add(&st->count, 1) + 1);
+    }
+
+    epoch_exit();
+    slab_free(spare);  // Unused if the key existed
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const BatchEntry *ea = a;
+    const BatchEntry *eb = b;
+    if (ea->so_key != eb->so_key) return ea->so_key < eb->so_key ? -1 : 1;
+    int cmp = strcmp(ea->key, eb->key);
+    if (cmp != 0) return cmp;
+    return ea->index < eb->index ? -1 : 1;
+}
+
+int so_write_batch(SoTable *st, size_t num_pairs,
+                   char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE]) {
+    if (num_pairs == 1) return so_write_pair(st, keys[0], values[0]);
+    if (num_pairs == 0 || num_pairs > MAX_WRITE_SIZE) return num_pairs != 0;
+
+    BatchEntry entries[MAX_WRITE_SIZE];
+    SoBatch *batch = slab_alloc(sizeof(SoBatch));
+    if (batch == NULL) return 1;
+    atomic_init(&batch->committed, 0);
+
+    // Allocate everything first, so that a failure leaves the table as is
+    int failed = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+        BatchEntry *e = &entries[i];
+        e->hash = hash(keys[i]);
+        e->so_key = regular_key(e->hash);
+        e->key = keys[i];
+        e->index = i;
+        e->superseded = 0;
+        e->value = new_value(values[i], batch);
+        e->spare = new_node(keys[i], e->hash);
+        failed |= e->value == NULL || e->spare == NULL;
+    }
+    if (failed || epoch_enter() != 0) {
+        for (size_t i = 0; i < num_pairs; i++) {
+            slab_free(entries[i].value);
+            slab_free(entries[i].spare);
+        }
+        slab_free(batch);
+        return 1;
+    }
+
+    // Every batch installs in the same order, so batches that wait for each
+    // other cannot form a cycle
+    qsort(entries, num_pairs, sizeof(BatchEntry), compare_entries);
+
+    size_t added = 0;
+    for (size_t i = 0; i < num_pairs; i++) {
+        BatchEntry *e = &entries[i];
+        SoValue *old;
+        while ((old = install(st, e->key, e->hash, e->value, &e->spare)) ==
+               &pending) {
+            yield_epoch();
+        }
+        if (old == NULL) {
+            added++;
+        } else if (atomic_load(&old->batch) == batch) {
+            // Duplicates are adjacent after sorting
+            entries[i - 1].superseded = 1;
+            epoch_retire(old, slab_free);
+        }
+    }
+
+    // Every value becomes visible here at once
+    atomic_store_explicit(&batch->committed, 1, memory_order_release);
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        BatchEntry *e = &entries[i];
+        if (!e->superseded) {
+            atomic_store_explicit(&e->value->batch, NULL,
+                                  memory_order_release);
+            if (e->value->prev != NULL) epoch_retire(e->value->prev, slab_free);
+        }
+        slab_free(e->spare);
+    }
+    epoch_retire(batch, slab_free);
+    if (added > 0) maybe_grow(st, atomic_fetch_add(&st->count, added) + added);
+
+    epoch_exit();
+    return 0;
+}
+
+char *so_read_pair(SoTable *st, const char *key) {
+    size_t h = hash(key);
+    size_t so_key = regular_key(h);
+
+    SoNode *sentinel = read_sentinel(st, h & (atomic_load(&st->size) - 1));
+    SoNode *cur = node_of(atomic_load_explicit(&sentinel->next,
+                                               memory_order_acquire));
+
+    // Deleted nodes are walked over, their value is the tombstone
+    while (cur != NULL) {
+        int cmp = compare(cur, so_key, key);
+        if (cmp == 0) {
+            SoValue *value = visible_value(cur);
+            return value != NULL ? slab_strdup(value->value) : NULL;
+        }
+        if (cmp > 0) break;
+        cur = node_of(atomic_load_explicit(&cur->next, memory_order_acquire));
+    }
+
+    return NULL;
+}
+
+int so_delete_pair(SoTable *st, const char *key) {
+    size_t h = hash(key);
+    size_t so_key = regular_key(h);
+    if (epoch_enter() != 0) return 1;
+
+    SoNode *start = start_of(st, h);
+    int result = 1;
+
+    for (;;) {
+        _Atomic(uintptr_t) *link;
+        SoNode *cur = find(start, so_key, key, &link);
+        if (cur == NULL || compare(cur, so_key, key) != 0) break;
+
+        SoValue *old = atomic_load_explicit(&cur->value, memory_order_acquire);
+        if (old == &tombstone) break;  // Deleted by another thread
+
+        if (uncommitted(old)) {
+            yield_epoch();
+            continue;
+        }
+        if (atomic_compare_exchange_strong(&cur->value, &old, &tombstone)) {
+            epoch_retire(old, slab_free);
+            mark_deleted(cur);
+            find(start, so_key, key, &link);  // Unlinks the node
+            atomic_fetch_sub(&st->count, 1);
+            result = 0;
+            break;
+        }
+    }
+
+    epoch_exit();
+    return result;
+}
+
+KvsPair *so_list_pairs(SoTable *st, size_t *count) {
+    *count = 0;
+    size_t total = atomic_load(&st->count);
+    if (total == 0) return NULL;
+
+    KvsPair *pairs = malloc(total * sizeof(KvsPair));
+    if (pairs == NULL) return NULL;
+
+    SoNode *cur = node_of(atomic_load(&st->head.next));
+    for (; cur != NULL && *count < total;
+         cur = node_of(atomic_load(&cur->next))) {
+        if (!(cur->so_key & 1)) continue;  // Sentinel
+
+        SoValue *value = visible_value(cur);
+        if (value == NULL) continue;
+        pairs[*count].key = cur->key;
+        pairs[*count].value = value->value;
+        (*count)++;
+    }
+
+    return pairs;
+}
+
+void so_free_table(SoTable *st) {
+    SoNode *cur = node_of(atomic_load(&st->head.next));
+    while (cur != NULL) {
+        SoNode *next = node_of(atomic_load(&cur->next));
+        SoValue *value = atomic_load(&cur->value);
+        if (value != NULL && value != &tombstone) slab_free(value);
+        slab_free(cur);
+        cur = next;
+    }
+    so_drop_table(st);
+}
+
+void so_drop_table(SoTable *st) {
+    for (size_t i = 0; i < SO_SEGMENTS; i++) {
+        free(atomic_load(&st->segments[i]));
+    }
+    free(st);
+}
+
+static void *so_engine_create_table(size_t stripes) {
+    (void)stripes;  // Writers take no stripes
+    return so_create_table();
+}
+
+static int so_engine_write_pair(void *table, const char *key,
+                                const char *value) {
+    return so_write_pair(table, key, value);
+}
+
+static int so_engine_write_batch(void *table, size_t num_pairs,
+                                 char keys[][MAX_STRING_SIZE],
+                                 char values[][MAX_STRING_SIZE]) {
+    return so_write_batch(table, num_pairs, keys, values);
+}
+
+static char *so_engine_read_pair(void *table, const char *key) {
+    return so_read_pair(table, key);
+}
+
+static int so_engine_delete_pair(void *table, const char *key) {
+    return so_delete_pair(table, key);
+}
+
+static KvsPair *so_engine_list_pairs(void *table, size_t *count) {
+    return so_list_pairs(table, count);
+}
+
+static void so_engine_free_table(void *table) { so_free_table(table); }
+
+static void so_engine_drop_table(void *table) { so_drop_table(table); }
+
+// Buckets are split lazily by the operations themselves, so there are no
+// table wide resizes
+const KvsEngine splitorder_engine = {
+    .name = "splitorder",
+    .create_table = so_engine_create_table,
+    .write_pair = so_engine_write_pair,
+    .read_pair = so_engine_read_pair,
+    .delete_pair = so_engine_delete_pair,
+    .rehash_pending = NULL,
+    .rehash_step = NULL,
+    .resize_needed = NULL,
+    .resize_table = NULL,
+    .list_pairs = so_engine_list_pairs,
+    .list_stripe = NULL,
+    .free_table = so_engine_free_table,
+    .drop_table = so_engine_drop_table,
+    .throttle_writes = NULL,
+    .lockfree_reads = 1,
+    .lockfree_writes = 1,
+    .write_batch = so_engine_write_batch,
+};
@@ -0,0 +1,292 @@
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "sha256.h"
+#include "throttle.h"
+#include "utils.h"
+
+// Bits of the gear hash that must be zero at the end of a chunk, the high
+// ones, which depend on the last 64 bytes
+#define CUT_MASK (~(UINT64_MAX >> STORE_CHUNK_BITS))
+
+// Longest line of a manifest after the path of the store
+#define LINE_SIZE (SHA256_HEX_SIZE + 32)
+
+// Fills the gear table with fixed pseudorandom values (splitmix64), so that
+// every run cuts the same bytes into the same chunks
+static void fill_gear(uint64_t gear[256]) {
+    uint64_t seed = 0x4b56534348554e4bULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk that starts the data
+static size_t cut_chunk(const uint64_t gear[256], const unsigned char *data,
+                        size_t size) {
+    if (size > STORE_MAX_CHUNK) size = STORE_MAX_CHUNK;
+    uint64_t hash = 0;
+    for (size_t i = STORE_MIN_CHUNK; i < size; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CUT_MASK) == 0) return i + 1;
+    }
+    return size;
+}
+
+// Adds a file named by the SHA-256 of its content to a directory of the
+// store, unless it is there already. The content is written to a temporary
+// file that is synced and then linked under its name, so that readers never
+// see a partial file and concurrent backups of the same content add it once.
+// @return 0 on success, 1 otherwise.
+static int add_file(const char *dir, const char *data, size_t size,
+                    char path[PATH_MAX], int *added) {
+    uint8_t digest[SHA256_SIZE];
+    char hex[SHA256_HEX_SIZE + 1];
+    sha256(data, size, digest);
+    sha256_hex(digest, hex);
+    *added = 0;
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, hex) >= PATH_MAX) return 1;
+    if (access(path, F_OK) == 0) return 0;
+
+    char temp[PATH_MAX];
+    if (snprintf(temp, PATH_MAX, "%s/.tmp-XXXXXX", dir) >= PATH_MAX) return 1;
+    int fd = mkstemp(temp);
+    if (fd == -1) return 1;
+    // mkstemp creates the file private, but backups are readable by all
+    throttle_backup(size);
+    int result = fchmod(fd, 0644) != 0 || write_fully(fd, data, size) != 0 ||
+                 fsync(fd) != 0;
+    result |= close(fd) != 0;
+    if (result == 0 && link(temp, path) != 0 && errno != EEXIST) result = 1;
+    *added = result == 0;
+    unlink(temp);
+    return result;
+}
+
+// Absolute path of a directory, which manifests record so that they are read
+// from anywhere
+static char *absolute_path(const char *dir) {
+    char cwd[PATH_MAX];
+    char *path = malloc(PATH_MAX);
+    if (path == NULL) return NULL;
+    if ((dir[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) ||
+        snprintf(path, PATH_MAX, "%s%s%s", dir[0] != '/' ? cwd : "",
+                 dir[0] != '/' ? "/" : "", dir) >= PATH_MAX) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+int store_init(const char *dir) {
+    char path[PATH_MAX];
+    const char *subdirs[] = {"", "/chunks", "/manifests"};
+    for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+        if (snprintf(path, sizeof(path), "%s%s", dir, subdirs[i]) >=
+                (int)sizeof(path) ||
+            (mkdir(path, 0777) != 0 && errno != EEXIST)) {
+            fprintf(stderr, "Failed to create the backup store %s\n", path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int store_backup(const char *dir, int fd, char manifest[PATH_MAX],
+                 StoreStats *stats) {
+    char *root = absolute_path(dir);
+    char *buffer = malloc(STORE_MAX_CHUNK);
+    // The chunk lines are appended after room for the first two lines
+    size_t header_size = LINE_SIZE + (root != NULL ? strlen(root) + 1 : 0);
+    size_t capacity = header_size + LINE_SIZE * 64;
+    char *text = malloc(capacity);
+    char chunks[PATH_MAX];
+    char manifests[PATH_MAX];
+    int result = root == NULL || buffer == NULL || text == NULL ||
+                 snprintf(chunks, PATH_MAX, "%s/chunks", root) >= PATH_MAX ||
+                 snprintf(manifests, PATH_MAX, "%s/manifests", root) >=
+                     PATH_MAX;
+
+    uint64_t gear[256];
+    fill_gear(gear);
+    StoreStats counters = {0};
+    size_t used = header_size;
+    size_t have = 0;
+    off_t offset = 0;
+    int eof = 0;
+    while (result == 0) {
+        while (!eof && have < STORE_MAX_CHUNK) {
+            ssize_t got = pread(fd, buffer + have, STORE_MAX_CHUNK - have,
+                                offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0) result = 1;
+            if (got <= 0) {
+                eof = 1;
+                break;
+            }
+            have += (size_t)got;
+            offset += got;
+        }
+        if (result != 0 || have == 0) break;
+
+        size_t size = cut_chunk(gear, (unsigned char *)buffer, have);
+        char path[PATH_MAX];
+        int added;
+        if (add_file(chunks, buffer, size, path, &added) != 0) {
+            result = 1;
+            break;
+        }
+        counters.bytes += size;
+        counters.chunks++;
+        if (added) {
+            counters.new_chunks++;
+            counters.new_bytes += size;
+        }
+
+        if (capacity - used < LINE_SIZE) {
+            char *bigger = realloc(text, capacity * 2);
+            if (bigger == NULL) {
+                result = 1;
+                break;
+            }
+            text = bigger;
+            capacity *= 2;
+        }
+        used += (size_t)sprintf(text + used, "%s %zu\n",
+                                strrchr(path, '/') + 1, size);
+        memmove(buffer, buffer + size, have - size);
+        have -= size;
+    }
+
+    // The chunks must be durable before a manifest names them
+    if (result == 0 && counters.new_chunks > 0) {
+        result = backup_sync_dir(chunks);
+    }
+    if (result == 0) {
+        // The first two lines are moved right before the chunk lines
+        char header[LINE_SIZE];
+        int len = sprintf(header, "%s%llu %zu\n", STORE_MAGIC,
+                          (unsigned long long)counters.bytes, counters.chunks);
+        size_t start = header_size - (size_t)len - strlen(root) - 1;
+        memcpy(text + start, header, (size_t)len);
+        memcpy(text + start + (size_t)len, root, strlen(root));
+        text[header_size - 1] = '\n';
+        result = add_file(manifests, text + start, used - start, manifest,
+                          &counters.new_manifest);
+    }
+    if (result == 0 && counters.new_manifest) {
+        result = backup_sync_dir(manifests);
+    }
+    if (stats != NULL) *stats = counters;
+
+    free(root);
+    free(buffer);
+    free(text);
+    return result;
+}
+
+int store_link(const char *manifest, const char *path) {
+    char temp[PATH_MAX];
+    if (snprintf(temp, PATH_MAX, "%s.link", path) >= PATH_MAX) return 1;
+    unlink(temp);
+    if (link(manifest, temp) != 0) return 1;
+    if (rename(temp, path) != 0) {
+        unlink(temp);
+        return 1;
+    }
+    return 0;
+}
+
+int store_is_manifest(int fd) {
+    char magic[sizeof(STORE_MAGIC) - 1];
+    return pread_fully(fd, magic, sizeof(magic), 0) == 0 &&
+           memcmp(magic, STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+// Reads a chunk, checking that its content matches its name
+static int read_chunk(const char *root, const char *hex, size_t size,
+                      char *data) {
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/chunks/%s", root, hex) >= PATH_MAX) {
+        return 1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return 1;
+    struct stat st;
+    int result = fstat(fd, &st) != 0 || st.st_size != (off_t)size ||
+                 pread_fully(fd, data, size, 0) != 0;
+    close(fd);
+    if (result != 0) return 1;
+
+    uint8_t digest[SHA256_SIZE];
+    char actual[SHA256_HEX_SIZE + 1];
+    sha256(data, size, digest);
+    sha256_hex(digest, actual);
+    return strcmp(actual, hex) != 0;
+}
+
+char *store_read(int fd, size_t limit, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+    char *text = malloc((size_t)st.st_size + 1);
+    if (text == NULL) return NULL;
+    if (pread_fully(fd, text, (size_t)st.st_size, 0) != 0) {
+        free(text);
+        return NULL;
+    }
+    text[st.st_size] = '\0';
+
+    unsigned long long total;
+    size_t count;
+    char *root = strchr(text, '\n');
+    char *line = root != NULL ? strchr(root + 1, '\n') : NULL;
+    // No chunk is larger than STORE_MAX_CHUNK, and a larger total would
+    // overflow the size of the buffer
+    if (line == NULL ||
+        sscanf(text, STORE_MAGIC "%llu %zu", &total, &count) != 2 ||
+        count > (SIZE_MAX - STORE_MAX_CHUNK) / STORE_MAX_CHUNK ||
+        total > (unsigned long long)count * STORE_MAX_CHUNK) {
+        free(text);
+        return NULL;
+    }
+    *line++ = '\0';
+    root++;
+
+    size_t capacity = total < limit ? (size_t)total : limit;
+    char *data = malloc(capacity + STORE_MAX_CHUNK);
+    size_t used = 0;
+    int result = data == NULL;
+    for (size_t i = 0; i < count && used < limit && result == 0; i++) {
+        char hex[SHA256_HEX_SIZE + 1];
+        size_t chunk_size;
+        int consumed;
+        if (sscanf(line, "%64s %zu\n%n", hex, &chunk_size, &consumed) != 2 ||
+            chunk_size > STORE_MAX_CHUNK || chunk_size > total - used) {
+            result = 1;
+            break;
+        }
+        line += consumed;
+        result = read_chunk(root, hex, chunk_size, data + used);
+        used += chunk_size;
+    }
+    if (result == 0 && used < limit && used != total) result = 1;
+
+    free(text);
+    if (result != 0) {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    return data;
+}
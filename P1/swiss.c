@@ -0,0 +1,294 @@
+#include "swiss.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SWISS_EMPTY ((int8_t)-128)
+#define SWISS_DELETED ((int8_t)-2)
+
+// Bit i of the result is set if byte i of the group is equal to value
+static unsigned int match_byte(const int8_t *group, int8_t value) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+        if (group[i] == value) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i of the result is set if slot i of the group is empty or deleted
+static unsigned int match_free(const int8_t *group) {
+#ifdef __SSE2__
+    // Free slots are the only ones with the sign bit set
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (unsigned int)_mm_movemask_epi8(ctrl);
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < SWISS_GROUP_SIZE; i++) {
+        if (group[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Returns the slot index of key in the shard, or capacity if missing.
+// Groups are probed in triangular order, which visits every group once.
+static size_t find_slot(SwissShard *shard, const char *key, size_t h) {
+    if (shard->capacity == 0) return shard->capacity;
+
+    size_t mask = shard->capacity / SWISS_GROUP_SIZE - 1;
+    size_t group = (h >> 7) & mask;
+    int8_t tag = (int8_t)(h & 0x7f);
+
+    for (size_t probe = 1; probe <= mask + 1; probe++) {
+        const int8_t *ctrl = shard->ctrl + group * SWISS_GROUP_SIZE;
+
+        for (unsigned int m = match_byte(ctrl, tag); m != 0; m &= m - 1) {
+            size_t index =
+                group * SWISS_GROUP_SIZE + (size_t)__builtin_ctz(m);
+            if (strcmp(shard->slots[index].key, key) == 0) {
+                return index;
+            }
+        }
+
+        // A lookup never continues past a group with an empty slot
+        if (match_byte(ctrl, SWISS_EMPTY) != 0) break;
+
+        group = (group + probe) & mask;
+    }
+
+    return shard->capacity;
+}
+
+// Returns the first empty or deleted slot on the probe sequence of h
+static size_t find_free_slot(SwissShard *shard, size_t h) {
+    size_t mask = shard->capacity / SWISS_GROUP_SIZE - 1;
+    size_t group = (h >> 7) & mask;
+
+    for (size_t probe = 1;; probe++) {
+        unsigned int m = match_free(shard->ctrl + group * SWISS_GROUP_SIZE);
+        if (m != 0) {
+            return group * SWISS_GROUP_SIZE + (size_t)__builtin_ctz(m);
+        }
+        group = (group + probe) & mask;
+    }
+}
+
+// Moves every pair of the shard to new arrays with the given capacity,
+// dropping the deleted slots
+static int resize_shard(SwissShard *shard, size_t capacity,
+                        unsigned int shift) {
+    int8_t *ctrl = aligned_alloc(SWISS_GROUP_SIZE, capacity);
+    SwissSlot *slots = malloc(capacity * sizeof(SwissSlot));
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return 1;
+    }
+    memset(ctrl, SWISS_EMPTY, capacity);
+
+    SwissShard resized = {ctrl, slots, capacity, shard->count, 0};
+    for (size_t i = 0; i < shard->capacity; i++) {
+        if (shard->ctrl[i] < 0) continue;
+
+        size_t h = hash(shard->slots[i].key) >> shift;
+        size_t index = find_free_slot(&resized, h);
+        ctrl[index] = shard->ctrl[i];
+        slots[index] = shard->slots[i];
+    }
+
+    free(shard->ctrl);
+    free(shard->slots);
+    *shard = resized;
+    return 0;
+}
+
+SwissTable *swiss_create_table(size_t stripes) {
+    SwissTable *st = malloc(sizeof(SwissTable) + stripes * sizeof(SwissShard));
+    if (!st) return NULL;
+    st->num_shards = stripes;
+    st->shift = (unsigned int)__builtin_ctzll(stripes);
+    for (size_t i = 0; i < stripes; i++) {
+        st->shards[i] = (SwissShard){NULL, NULL, 0, 0, 0};
+    }
+    return st;
+}
+
+int swiss_write_pair(SwissTable *st, const char *key, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE) {
+        return 1;
+    }
+
+    size_t full_hash = hash(key);
+    SwissShard *shard = &st->shards[full_hash & (st->num_shards - 1)];
+    size_t h = full_hash >> st->shift;
+
+    size_t index = find_slot(shard, key, h);
+    if (index < shard->capacity) {
+        memcpy(shard->slots[index].value, value, value_len + 1);
+        return 0;
+    }
+
+    // Keep at most 7/8 of the slots used or deleted
+    if ((shard->count + shard->deleted + 1) * 8 > shard->capacity * 7) {
+        size_t capacity = SWISS_GROUP_SIZE;
+        while ((shard->count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        if (resize_shard(shard, capacity, st->shift) != 0) return 1;
+    }
+
+    index = find_free_slot(shard, h);
+    if (shard->ctrl[index] == SWISS_DELETED) shard->deleted--;
+    shard->ctrl[index] = (int8_t)(h & 0x7f);
+    memcpy(shard->slots[index].key, key, key_len + 1);
+    memcpy(shard->slots[index].value, value, value_len + 1);
+    shard->count++;
+
+    return 0;
+}
+
+char *swiss_read_pair(SwissTable *st, const char *key) {
+    size_t full_hash = hash(key);
+    SwissShard *shard = &st->shards[full_hash & (st->num_shards - 1)];
+
+    size_t index = find_slot(shard, key, full_hash >> st->shift);
+    if (index >= shard->capacity) return NULL;
+
+    return slab_strdup(shard->slots[index].value);
+}
+
+int swiss_delete_pair(SwissTable *st, const char *key) {
+    size_t full_hash = hash(key);
+    SwissShard *shard = &st->shards[full_hash & (st->num_shards - 1)];
+
+    size_t index = find_slot(shard, key, full_hash >> st->shift);
+    if (index >= shard->capacity) return 1;
+
+    // If the group still has an empty slot no lookup goes past it, so the
+    // slot can be emptied instead of leaving a tombstone
+    const int8_t *group =
+        shard->ctrl + index / SWISS_GROUP_SIZE * SWISS_GROUP_SIZE;
+    if (match_byte(group, SWISS_EMPTY) != 0) {
+        shard->ctrl[index] = SWISS_EMPTY;
+    } else {
+        shard->ctrl[index] = SWISS_DELETED;
+        shard->deleted++;
+    }
+    shard->count--;
+
+    return 0;
+}
+
+KvsPair *swiss_list_pairs(SwissTable *st, size_t *count) {
+    size_t total = 0;
+    for (size_t i = 0; i < st->num_shards; i++) {
+        total += st->shards[i].count;
+    }
+
+    *count = 0;
+    if (total == 0) return NULL;
+
+    KvsPair *pairs = malloc(total * sizeof(KvsPair));
+    if (pairs == NULL) return NULL;
+
+    for (size_t i = 0; i < st->num_shards; i++) {
+        SwissShard *shard = &st->shards[i];
+        for (size_t j = 0; j < shard->capacity; j++) {
+            if (shard->ctrl[j] < 0) continue;
+            pairs[*count].key = shard->slots[j].key;
+            pairs[*count].value = shard->slots[j].value;
+            (*count)++;
+        }
+    }
+
+    return pairs;
+}
+
+KvsPair *swiss_list_stripe(SwissTable *st, size_t lock, size_t *count) {
+    SwissShard *shard = &st->shards[lock];
+    *count = 0;
+    if (shard->count == 0) return NULL;
+
+    KvsPair *pairs = malloc(shard->count * sizeof(KvsPair));
+    if (pairs == NULL) return NULL;
+
+    for (size_t j = 0; j < shard->capacity; j++) {
+        if (shard->ctrl[j] < 0) continue;
+        pairs[*count].key = shard->slots[j].key;
+        pairs[*count].value = shard->slots[j].value;
+        (*count)++;
+    }
+    return pairs;
+}
+
+void swiss_free_table(SwissTable *st) {
+    for (size_t i = 0; i < st->num_shards; i++) {
+        free(st->shards[i].ctrl);
+        free(st->shards[i].slots);
+    }
+    free(st);
+}
+
+static void *swiss_engine_create_table(size_t stripes) {
+    return swiss_create_table(stripes);
+}
+
+static int swiss_engine_write_pair(void *table, const char *key,
+                                   const char *value) {
+    return swiss_write_pair(table, key, value);
+}
+
+static char *swiss_engine_read_pair(void *table, const char *key) {
+    return swiss_read_pair(table, key);
+}
+
+static int swiss_engine_delete_pair(void *table, const char *key) {
+    return swiss_delete_pair(table, key);
+}
+
+static KvsPair *swiss_engine_list_pairs(void *table, size_t *count) {
+    return swiss_list_pairs(table, count);
+}
+
+static KvsPair *swiss_engine_list_stripe(void *table, size_t lock,
+                                         size_t *count) {
+    return swiss_list_stripe(table, lock, count);
+}
+
+static void swiss_engine_free_table(void *table) { swiss_free_table(table); }
+
+// Shards grow inside swiss_write_pair under their lock stripe, so there are
+// no table wide resizes
+const KvsEngine swiss_engine = {
+    .name = "swiss",
+    .create_table = swiss_engine_create_table,
+    .write_pair = swiss_engine_write_pair,
+    .read_pair = swiss_engine_read_pair,
+    .delete_pair = swiss_engine_delete_pair,
+    .rehash_pending = NULL,
+    .rehash_step = NULL,
+    .resize_needed = NULL,
+    .resize_table = NULL,
+    .list_pairs = swiss_engine_list_pairs,
+    .list_stripe = swiss_engine_list_stripe,
+    .free_table = swiss_engine_free_table,
+    .drop_table = NULL,
+    .throttle_writes = NULL,
+    .lockfree_reads = 0,
+    .lockfree_writes = 0,
+    .write_batch = NULL,
+};
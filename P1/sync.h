@@ -0,0 +1,114 @@
+#ifndef KVS_SYNC_H
+#define KVS_SYNC_H
+
+// Backend used when KVS_SYNC is not set, can be changed when building with
+// make SYNC=<name>
+#ifndef KVS_DEFAULT_SYNC
+#define KVS_DEFAULT_SYNC "pthread"
+#endif
+
+// Polls of a busy lock before the thread yields its core (ticket and MCS) or
+// sleeps on a futex (adaptive and rwpref)
+#define SYNC_SPIN 100
+
+// MCS queue nodes each thread keeps, enough for every stripe of a command
+// plus htMutex. More are allocated if a thread holds more locks.
+#define SYNC_MCS_NODES 264
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Mutex that sleeps on a futex: 0 unlocked, 1 locked, 2 locked with waiters
+typedef struct FutexMutex {
+    atomic_int state;
+} FutexMutex;
+
+// Threads take a ticket and wait for it to be served, in arrival order
+typedef struct TicketLock {
+    atomic_uint next;
+    atomic_uint owner;
+} TicketLock;
+
+// Node of a waiting thread in an MCS queue, which spins on its own node
+typedef struct McsNode {
+    _Atomic(struct McsNode *) next;
+    atomic_int locked;
+    int heap;  // Allocated because the thread had no free node
+} McsNode;
+
+typedef struct McsLock {
+    _Atomic(McsNode *) tail;
+    McsNode *owner;  // Node of the holder, only used by the holder
+} McsLock;
+
+/// Mutex of the selected backend, initialized with mutex_init.
+typedef union KvsMutex {
+    pthread_mutex_t pthread;
+    FutexMutex futex;
+    TicketLock ticket;
+    McsLock mcs;
+} KvsMutex;
+
+// Readers-writer lock built on a mutex of the backend, which gives the
+// arrival order: readers hold it only to register, writers until unlock
+typedef struct MutexRwlock {
+    KvsMutex order;
+    atomic_int readers;
+    atomic_int writer;         // Set once a writer holds the lock
+    atomic_int writer_waiting; // Set while a writer waits for the readers
+} MutexRwlock;
+
+// Readers-writer lock that holds new readers back while a writer waits
+typedef struct PrefRwlock {
+    atomic_int state;  // Number of readers, or PREF_WRITER
+    atomic_int writers_waiting;
+    atomic_int seq;  // Futex word, bumped whenever waiters may proceed
+} PrefRwlock;
+
+/// Readers-writer lock of the selected backend, initialized with rwl_init.
+typedef union KvsRwlock {
+    pthread_rwlock_t pthread;
+    MutexRwlock mutex;
+    PrefRwlock pref;
+} KvsRwlock;
+
+/// Implementation of the locks behind the mutex_* and rwl_* wrappers of
+/// utils.h. Every function returns 0 on success and an error number
+/// otherwise.
+typedef struct SyncBackend {
+    // Name used to select the backend (KVS_SYNC)
+    const char *name;
+
+    int (*mutex_init)(KvsMutex *mutex);
+    int (*mutex_lock)(KvsMutex *mutex);
+    /// @return 0 if the mutex was taken, EBUSY if it is held.
+    int (*mutex_trylock)(KvsMutex *mutex);
+    int (*mutex_unlock)(KvsMutex *mutex);
+    int (*mutex_destroy)(KvsMutex *mutex);
+
+    int (*rwl_init)(KvsRwlock *rwl);
+    int (*rwl_rdlock)(KvsRwlock *rwl);
+    int (*rwl_wrlock)(KvsRwlock *rwl);
+    /// @return 0 if the lock was taken for writing, EBUSY if it is held.
+    int (*rwl_trywrlock)(KvsRwlock *rwl);
+    /// Releases a read or write hold.
+    int (*rwl_unlock)(KvsRwlock *rwl);
+    int (*rwl_destroy)(KvsRwlock *rwl);
+} SyncBackend;
+
+// Backend in use, selected before any lock is initialized
+extern const SyncBackend *sync_backend;
+
+/// Finds a backend by name: "pthread", "adaptive" (spin then sleep on a
+/// futex), "ticket", "mcs" or "rwpref" (writer-preferring readers-writer
+/// locks).
+/// @param name Name of the backend.
+/// @return The backend, NULL if there is no backend with that name.
+const SyncBackend *get_sync_backend(const char *name);
+
+/// Lists the backends.
+/// @param count Pointer to store the number of backends in.
+/// @return Array of the backends.
+const SyncBackend *const *list_sync_backends(size_t *count);
+
+#endif  // KVS_SYNC_H
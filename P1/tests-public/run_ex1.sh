@@ -9,9 +9,38 @@ kvs_binary=$1
 
 test_dir="tests-public/jobs"
 results_dir="tests-public/results"
+materialize="tools/materialize"
 
+# Writes the pairs of a backup as SHOW would: binary snapshots are loaded with
+# KVS_RESTORE and shown, text backups, full or delta, compressed or in a
+# backup store, are rebuilt by tools/materialize
+backup_text() {
+    local base=$1
+    local snap
+    for snap in "$base.snap" "$base.snap.lz"; do
+        if [ -f "$snap" ]; then
+            local show_dir
+            show_dir=$(mktemp -d)
+            echo "SHOW" > "$show_dir/show.job"
+            KVS_RESTORE="$snap" ./$kvs_binary "$show_dir" 1 1 &> /dev/null
+            cat "$show_dir/show.out"
+            rm -rf "$show_dir"
+            return
+        fi
+    done
+
+    local backup="$base.bck"
+    if [ ! -f "$backup" ]; then
+        backup="$base.bck.lz"
+    fi
+    "./$materialize" "$backup" 2> /dev/null
+}
+
+# Runs a job on its own with the KVS_* settings given, in which {} stands
+# for the directory of the run, and checks its output and its backups
 run_test() {
     local file=$1
+    local settings=$2
     local filename
     filename=$(basename "$file" .job)
     local temp_dir
@@ -21,7 +50,7 @@ run_test() {
 
     local cmd="$kvs_binary $temp_dir 1 1" #single threaded
 
-    eval "./$cmd" &> /dev/null
+    eval "env ${settings//\{\}/$temp_dir} ./$cmd" &> /dev/null
 
     local output_file
     output_file="${temp_dir}/${filename}.out"
@@ -41,17 +70,105 @@ run_test() {
         echo -e "\e[31mOutput file $output_file not found\e[0m"
     fi
 
+    for backup_result in "$results_dir/$filename"-*.bck; do
+        [ -f "$backup_result" ] || continue
+        local backup
+        backup=$(basename "$backup_result" .bck)
+        if diff <(backup_text "$temp_dir/$backup") "$backup_result"; then
+            echo -e "\e[32mTest passed for backup $backup\e[0m"
+        else
+            echo -e "\e[31mTest failed for backup $backup\e[0m"
+        fi
+    done
+
     cp "$temp_dir"/"$filename".out "$test_dir"/"$filename".out
     rm -rf "$temp_dir"
 }
 
+# Runs a job whose only output is a final SHOW, kills the KVS once the job is
+# done and restarts it with the recovery settings on a job that only shows
+# the pairs, which must be the same
+run_crash_test() {
+    local file=$1
+    local settings=$2
+    local recovery=$3
+    local filename
+    filename=$(basename "$file" .job)
+    local temp_dir
+    temp_dir=$(mktemp -d)
+    mkdir "$temp_dir/jobs" "$temp_dir/recover"
+
+    # The WAIT keeps the KVS running until it is killed
+    cp "$file" "$temp_dir/jobs"
+    printf "\nWAIT 600000\n" >> "$temp_dir/jobs/$filename.job"
+    eval "env ${settings//\{\}/$temp_dir} ./$kvs_binary $temp_dir/jobs 1 1" &> /dev/null &
+    local pid=$!
+    local tries=0
+    until [ "$(tail -n 1 "$temp_dir/jobs/$filename.out" 2> /dev/null)" = "Waiting..." ]; do
+        if ! kill -0 "$pid" 2> /dev/null || ((++tries > 300)); then
+            break
+        fi
+        sleep 0.1
+    done
+    kill -9 "$pid" 2> /dev/null
+    wait "$pid" 2> /dev/null
+
+    echo "SHOW" > "$temp_dir/recover/$filename.job"
+    eval "env ${recovery//\{\}/$temp_dir} ./$kvs_binary $temp_dir/recover 1 1" &> /dev/null
+
+    local output_file="$temp_dir/recover/$filename.out"
+    local result_file="${results_dir}/${filename}.result"
+    if [ -f "$output_file" ] && diff "$output_file" "$result_file"; then
+        echo -e "\e[32mTest passed for $filename after a crash\e[0m"
+    else
+        echo -e "\e[31mTest failed for $filename after a crash\e[0m"
+    fi
+    rm -rf "$temp_dir"
+}
+
 export -f run_test
 export test_dir results_dir ems_binary ems_args
 
-# Loop through each .job file in the tests directory and run tests in parallel
-for file in "$test_dir"/*.job; do
-    run_test "$file"
+if [ ! -x "$materialize" ]; then
+    echo -e "\e[33m$materialize not found, backups are checked after make tools\e[0m"
+    materialize="/bin/false"
+fi
+
+# Each job on its own, once with the default settings and once more with
+# each engine and backup format
+runs=(
+    ""
+    "KVS_ENGINE=swiss"
+    "KVS_ENGINE=splitorder"
+    "KVS_ENGINE=mapped KVS_MAP_FILE={}/kvs.map KVS_MAP_SIZE=1"
+    "KVS_ENGINE=lsm KVS_LSM_DIR={} KVS_LSM_MEMTABLE=16"
+    "KVS_SHARDS=2"
+    "KVS_BACKUP_FORMAT=binary"
+    "KVS_BACKUP_FORMAT=binary KVS_BACKUP_COMPRESS=1"
+    "KVS_BACKUP_COMPRESS=1"
+    "KVS_BACKUP_DELTA=2 KVS_LOCK_STRIPES=64"
+    "KVS_BACKUP_DELTA=2 KVS_BACKUP_COMPRESS=1"
+    "KVS_BACKUP_STORE={}/store"
+)
+for settings in "${runs[@]}"; do
+    if [ -n "$settings" ]; then
+        echo -e "\e[34mRunning with $settings\e[0m"
+    fi
+
+    # Loop through each .job file in the tests directory
+    for file in "$test_dir"/*.job; do
+        run_test "$file" "$settings"
+    done
 done
 
+# Recovery from the write-ahead log alone, from the last binary backup and
+# the log after it, and from the file of the mapped engine
+echo -e "\e[34mRunning crash tests\e[0m"
+run_crash_test "$test_dir/13.job" "KVS_WAL={}/kvs.wal" "KVS_WAL={}/kvs.wal"
+run_crash_test "$test_dir/13.job" "KVS_WAL={}/kvs.wal KVS_BACKUP_FORMAT=binary" \
+    "KVS_WAL={}/kvs.wal KVS_RESTORE={}/jobs"
+run_crash_test "$test_dir/13.job" "KVS_ENGINE=mapped KVS_MAP_FILE={}/kvs.map KVS_MAP_SIZE=1" \
+    "KVS_ENGINE=mapped KVS_MAP_FILE={}/kvs.map KVS_MAP_SIZE=1"
+
 # Wait for all background processes to complete
 wait
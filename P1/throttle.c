@@ -0,0 +1,72 @@
+#include "throttle.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000ULL
+
+static pthread_mutex_t bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Set before any backup starts, read without the mutex
+static uint64_t rate;
+
+// Guarded by bucket_mutex. tokens goes below 0 while writers wait for the
+// bytes they took in advance.
+static double tokens;
+static uint64_t refilled_ns;
+
+static _Atomic uint64_t foreground_ns;
+static _Atomic uint64_t throttled_ns;
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NS_PER_SECOND + (uint64_t)now.tv_nsec;
+}
+
+void throttle_init(uint64_t bytes_per_second) {
+    rate = bytes_per_second;
+    refilled_ns = now_ns();
+    tokens = (double)rate * THROTTLE_BURST_MS / 1000;
+    atomic_store(&foreground_ns, 0);
+    atomic_store(&throttled_ns, 0);
+}
+
+void throttle_backup(size_t size) {
+    if (rate == 0) return;
+
+    pthread_mutex_lock(&bucket_mutex);
+    uint64_t now = now_ns();
+    uint64_t foreground = atomic_load_explicit(&foreground_ns,
+                                               memory_order_relaxed);
+    double current = (double)rate;
+    if (foreground != 0 && now - foreground < THROTTLE_BUSY_MS * 1000000ULL) {
+        current /= THROTTLE_BUSY_SHARE;
+    }
+    tokens += (double)(now - refilled_ns) * current / NS_PER_SECOND;
+    double burst = current * THROTTLE_BURST_MS / 1000;
+    if (tokens > burst) tokens = burst;
+    refilled_ns = now;
+    tokens -= (double)size;
+    uint64_t wait_ns =
+        tokens < 0 ? (uint64_t)(-tokens / current * NS_PER_SECOND) : 0;
+    pthread_mutex_unlock(&bucket_mutex);
+
+    if (wait_ns == 0) return;
+    atomic_fetch_add_explicit(&throttled_ns, wait_ns, memory_order_relaxed);
+    struct timespec delay = {(time_t)(wait_ns / NS_PER_SECOND),
+                             (long)(wait_ns % NS_PER_SECOND)};
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+}
+
+void throttle_foreground() {
+    if (rate == 0) return;
+    atomic_store_explicit(&foreground_ns, now_ns(), memory_order_relaxed);
+}
+
+double throttle_seconds() {
+    return (double)atomic_load(&throttled_ns) / NS_PER_SECOND;
+}
@@ -0,0 +1,103 @@
+// Decompresses a file written with KVS_BACKUP_COMPRESS, one frame at a time,
+// checking the CRC-32C of each block. The result is the backup as it would
+// have been written uncompressed: the text of SHOW, a delta backup or a
+// binary snapshot.
+//
+// Usage: decompress <file> [output]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "lz.h"
+
+static int read_exact(FILE *in, void *data, size_t size) {
+    return fread(data, 1, size, in) == size ? 0 : 1;
+}
+
+// Decompresses the frames of a file to an output
+static int decompress(FILE *in, FILE *out, const char *path) {
+    LzFileHeader header;
+    if (read_exact(in, &header, sizeof(header)) != 0 ||
+        memcmp(header.magic, LZ_MAGIC, sizeof(header.magic)) != 0 ||
+        header.block_size == 0 || header.block_size > LZ_BLOCK_SIZE) {
+        fprintf(stderr, "%s is not a compressed KVS file\n", path);
+        return 1;
+    }
+
+    char *frame = malloc(LZ_BOUND(LZ_BLOCK_SIZE));
+    char *block = malloc(LZ_BLOCK_SIZE);
+    int result = frame == NULL || block == NULL;
+    unsigned long long number = 0;
+    LzFrameHeader frame_header;
+    size_t got;
+    while (result == 0 &&
+           (got = fread(&frame_header, 1, sizeof(frame_header), in)) > 0) {
+        number++;
+        if (got < sizeof(frame_header) ||
+            frame_header.raw_size > header.block_size ||
+            frame_header.size > LZ_BOUND(header.block_size) ||
+            read_exact(in, frame, frame_header.size) != 0) {
+            fprintf(stderr, "Truncated frame %llu of %s\n", number, path);
+            result = 1;
+            break;
+        }
+
+        long size = frame_header.raw_size;
+        if (frame_header.size == frame_header.raw_size) {
+            memcpy(block, frame, frame_header.size);
+        } else {
+            size = lz_decompress(frame, frame_header.size, block,
+                                 frame_header.raw_size);
+        }
+        if (size != (long)frame_header.raw_size ||
+            crc32c(0, block, frame_header.raw_size) != frame_header.crc) {
+            fprintf(stderr, "Corrupted frame %llu of %s\n", number, path);
+            result = 1;
+            break;
+        }
+        if (fwrite(block, 1, (size_t)size, out) != (size_t)size) {
+            perror("Failed to write the output");
+            result = 1;
+        }
+    }
+    if (result == 0 && ferror(in)) {
+        perror(path);
+        result = 1;
+    }
+
+    free(frame);
+    free(block);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <file> [output]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (argc == 3) {
+        out = fopen(argv[2], "wb");
+        if (out == NULL) {
+            perror(argv[2]);
+            fclose(in);
+            return 1;
+        }
+    }
+
+    int result = decompress(in, out, argv[1]);
+    fclose(in);
+    if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+        perror("Failed to write the output");
+        result = 1;
+    }
+    return result;
+}
@@ -0,0 +1,253 @@
+// Rebuilds the full state of the KVS from a delta backup (KVS_BACKUP_DELTA):
+// follows the chain of previous backups back to a full one, which must be in
+// the same directory, applies the deltas from the oldest to the newest and
+// writes the pairs as a full backup, the text of SHOW. Backups compressed
+// with KVS_BACKUP_COMPRESS are decompressed as they are read, and those of a
+// KVS_BACKUP_STORE are read from the chunks of their manifest.
+//
+// Usage: materialize <backup> [output]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "kvs.h"
+#include "lz.h"
+#include "store.h"
+
+// Longest chain of backups followed, which also stops a chain that loops
+#define MAX_CHAIN 4096
+
+// Pair of a backup
+typedef struct Pair {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} Pair;
+
+// Backup read by read_backup
+typedef struct Backup {
+    int delta;           // 0 for a full backup
+    size_t num_stripes;  // Lock stripes of the KVS that wrote a delta
+    unsigned char *changed;  // Whether each stripe is in the delta
+    char base[MAX_JOB_FILE_NAME_SIZE];  // File name of the previous backup
+    Pair *pairs;
+    size_t count;
+    size_t capacity;
+} Backup;
+
+static void free_backup(Backup *backup) {
+    free(backup->changed);
+    free(backup->pairs);
+    free(backup);
+}
+
+static int add_pair(Backup *backup, const char *key, const char *value) {
+    if (backup->count == backup->capacity) {
+        size_t capacity = backup->capacity > 0 ? backup->capacity * 2 : 1024;
+        Pair *pairs = realloc(backup->pairs, capacity * sizeof(Pair));
+        if (pairs == NULL) return 1;
+        backup->pairs = pairs;
+        backup->capacity = capacity;
+    }
+    strcpy(backup->pairs[backup->count].key, key);
+    strcpy(backup->pairs[backup->count].value, value);
+    backup->count++;
+    return 0;
+}
+
+// Reads the stripes line of a delta, "STRIPES <count> <stripe>..."
+static int read_stripes(Backup *backup, char *line) {
+    backup->changed = calloc(backup->num_stripes, 1);
+    if (backup->changed == NULL || strncmp(line, "STRIPES ", 8) != 0) return 1;
+
+    char *next;
+    unsigned long count = strtoul(line + 8, &next, 10);
+    for (unsigned long i = 0; i < count; i++) {
+        char *end;
+        unsigned long stripe = strtoul(next, &end, 10);
+        if (end == next || stripe >= backup->num_stripes) return 1;
+        backup->changed[stripe] = 1;
+        next = end;
+    }
+    return *next == '\n' || *next == '\0' ? 0 : 1;
+}
+
+// Reads a pair line, "(key, value)"
+static int read_pair_line(Backup *backup, char *line) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+    char *comma = strchr(line, ',');
+    if (line[0] != '(' || len < 4 || line[len - 1] != ')' || comma == NULL ||
+        comma[1] != ' ') {
+        return 1;
+    }
+
+    *comma = '\0';
+    line[len - 1] = '\0';
+    const char *key = line + 1;
+    const char *value = comma + 2;
+    if (strlen(key) >= MAX_STRING_SIZE || strlen(value) >= MAX_STRING_SIZE) {
+        return 1;
+    }
+    return add_pair(backup, key, value);
+}
+
+// Opens a backup as a stream, from memory if it was compressed or is a
+// manifest of a backup store
+static FILE *open_backup(const char *path, char **data) {
+    *data = NULL;
+    int fd = open(path, O_RDONLY);
+    int compressed = fd != -1 && lz_is_compressed(fd);
+    if (fd == -1 || (!compressed && !store_is_manifest(fd))) {
+        if (fd != -1) close(fd);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) perror(path);
+        return file;
+    }
+
+    size_t size;
+    *data = compressed ? lz_read(fd, SIZE_MAX, &size)
+                       : store_read(fd, SIZE_MAX, &size);
+    close(fd);
+    if (*data == NULL) {
+        fprintf(stderr, "Corrupted %s %s\n",
+                compressed ? "compressed backup" : "backup or store", path);
+        return NULL;
+    }
+    // fmemopen needs a buffer of at least one byte, an empty backup is read
+    // from its end
+    FILE *file = fmemopen(*data, size > 0 ? size : 1, "r");
+    if (file == NULL) {
+        perror(path);
+    } else if (size == 0) {
+        fseek(file, 0, SEEK_END);
+    }
+    return file;
+}
+
+// Reads a full or delta backup
+// @return The backup, NULL on failure.
+static Backup *read_backup(const char *path) {
+    char *data;
+    FILE *file = open_backup(path, &data);
+    if (file == NULL) {
+        free(data);
+        return NULL;
+    }
+    Backup *backup = calloc(1, sizeof(Backup));
+
+    char *line = NULL;
+    size_t size = 0;
+    size_t number = 0;
+    int result = backup == NULL;
+    while (result == 0 && getline(&line, &size, file) != -1) {
+        number++;
+        if (number == 1 && strncmp(line, "KVSDELTA ", 9) == 0) {
+            backup->delta = 1;
+            char format[32];
+            snprintf(format, sizeof(format), "KVSDELTA %%zu %%%ds",
+                     MAX_JOB_FILE_NAME_SIZE - 1);
+            result = sscanf(line, format, &backup->num_stripes,
+                            backup->base) != 2 ||
+                     backup->num_stripes == 0;
+        } else if (number == 2 && backup->delta) {
+            result = read_stripes(backup, line);
+        } else {
+            result = read_pair_line(backup, line);
+        }
+    }
+    if (result == 0 && backup->delta && number < 2) result = 1;
+    if (result != 0) fprintf(stderr, "Malformed backup %s:%zu\n", path, number);
+
+    free(line);
+    fclose(file);
+    free(data);
+    if (result != 0 && backup != NULL) {
+        free_backup(backup);
+        return NULL;
+    }
+    return backup;
+}
+
+// Replaces the pairs of the stripes of a delta in the state by its own
+static int apply_delta(Backup *state, const Backup *delta) {
+    size_t kept = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        size_t stripe = lock_index(state->pairs[i].key, delta->num_stripes);
+        if (!delta->changed[stripe]) state->pairs[kept++] = state->pairs[i];
+    }
+    state->count = kept;
+
+    for (size_t i = 0; i < delta->count; i++) {
+        if (add_pair(state, delta->pairs[i].key, delta->pairs[i].value) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(((const Pair *)a)->key, ((const Pair *)b)->key);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <backup> [output]\n", argv[0]);
+        return 1;
+    }
+
+    // Directory of the backup, where the previous ones are looked for
+    const char *slash = strrchr(argv[1], '/');
+    int dir_len = slash != NULL ? (int)(slash - argv[1] + 1) : 0;
+
+    Backup **chain = malloc(MAX_CHAIN * sizeof(Backup *));
+    if (chain == NULL) return 1;
+    size_t length = 0;
+    chain[length] = read_backup(argv[1]);
+    while (chain[length] != NULL && chain[length]->delta) {
+        char path[2 * MAX_JOB_FILE_NAME_SIZE];
+        snprintf(path, sizeof(path), "%.*s%s", dir_len, argv[1],
+                 chain[length]->base);
+        if (++length == MAX_CHAIN) {
+            fprintf(stderr, "Chain of backups longer than %d\n", MAX_CHAIN);
+            break;
+        }
+        chain[length] = read_backup(path);
+    }
+
+    int result = length == MAX_CHAIN || chain[length] == NULL;
+    Backup *state = result == 0 ? chain[length] : NULL;
+    for (size_t i = length; i > 0 && result == 0; i--) {
+        result = apply_delta(state, chain[i - 1]);
+    }
+
+    FILE *out = stdout;
+    if (result == 0 && argc == 3) {
+        out = fopen(argv[2], "w");
+        if (out == NULL) {
+            perror(argv[2]);
+            result = 1;
+        }
+    }
+    if (result == 0) {
+        qsort(state->pairs, state->count, sizeof(Pair), compare_pairs);
+        for (size_t i = 0; i < state->count; i++) {
+            fprintf(out, "(%s, %s)\n", state->pairs[i].key,
+                    state->pairs[i].value);
+        }
+        if (out != stdout && fclose(out) != 0) {
+            perror(argv[2]);
+            result = 1;
+        }
+    }
+
+    for (size_t i = 0; i <= length && i < MAX_CHAIN; i++) {
+        if (chain[i] != NULL) free_backup(chain[i]);
+    }
+    free(chain);
+    return result;
+}
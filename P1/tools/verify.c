@@ -0,0 +1,205 @@
+// Checks that backup files are whole without restoring them. Binary
+// snapshots are read by the threads of dump_load, which check the CRC-32C of
+// every segment and the number of pairs of the header. Text backups, full or
+// delta, are parsed line by line: each pair must be whole and the keys in
+// increasing order, as SHOW writes them. Compressed backups are checked
+// frame by frame as they are decompressed, and the chunks of the manifests
+// of a KVS_BACKUP_STORE against their SHA-256.
+//
+// A text backup has no checksum, so only a file cut in the middle of a line
+// or damaged in its syntax is found. Since backups are renamed to their name
+// once complete and synced, a shorter file can only come from outside.
+//
+// Usage: verify <backup>...
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "dump.h"
+#include "lz.h"
+#include "store.h"
+#include "utils.h"
+
+// Reads a backup into memory, decompressed or from the chunks of the store,
+// followed by a null character
+static char *read_backup(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+
+    char *data;
+    if (lz_is_compressed(fd)) {
+        data = lz_read(fd, SIZE_MAX, size);
+        if (data == NULL) printf("%s: corrupted compressed frame\n", path);
+    } else if (store_is_manifest(fd)) {
+        data = store_read(fd, SIZE_MAX, size);
+        if (data == NULL) printf("%s: missing or corrupted chunk\n", path);
+    } else {
+        struct stat st;
+        data = fstat(fd, &st) == 0 ? malloc((size_t)st.st_size + 1) : NULL;
+        if (data == NULL || pread_fully(fd, data, (size_t)st.st_size, 0) != 0) {
+            perror(path);
+            free(data);
+            data = NULL;
+        } else {
+            *size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+
+    char *terminated = data != NULL ? realloc(data, *size + 1) : NULL;
+    if (terminated == NULL) {
+        free(data);
+        return NULL;
+    }
+    terminated[*size] = '\0';
+    return terminated;
+}
+
+static int ignore_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]) {
+    (void)num_pairs;
+    (void)keys;
+    (void)values;
+    return 0;
+}
+
+// Checks the header lines of a delta backup
+// @return Offset of the first pair, 0 if the header is malformed.
+static size_t check_delta(const char *data, size_t size) {
+    const char *end = memchr(data, '\n', size);
+    if (end == NULL) return 0;
+    const char *stripes = end + 1;
+    end = memchr(stripes, '\n', size - (size_t)(stripes - data));
+    size_t num_stripes;
+    size_t changed;
+    char base[MAX_JOB_FILE_NAME_SIZE];
+    char format[32];
+    snprintf(format, sizeof(format), "KVSDELTA %%zu %%%ds",
+             MAX_JOB_FILE_NAME_SIZE - 1);
+    if (end == NULL || sscanf(data, format, &num_stripes, base) != 2 ||
+        sscanf(stripes, "STRIPES %zu", &changed) != 1) {
+        return 0;
+    }
+
+    // The changed stripes, each once and in increasing order
+    const char *pos = strchr(stripes, ' ') + 1;
+    pos = strchr(pos, ' ');
+    size_t count = 0;
+    long previous = -1;
+    while (pos != NULL && pos < end) {
+        char *next;
+        long stripe = strtol(pos + 1, &next, 10);
+        if (next == pos + 1 || stripe <= previous ||
+            (size_t)stripe >= num_stripes) {
+            return 0;
+        }
+        previous = stripe;
+        count++;
+        pos = next < end && *next == ' ' ? next : NULL;
+    }
+    return count == changed ? (size_t)(end + 1 - data) : 0;
+}
+
+// Checks the pairs of a text backup, one "(key, value)" per line
+// @return Number of pairs, -1 if a line is malformed, with its number.
+static long check_pairs(const char *data, size_t size, size_t *line) {
+    const char *previous = NULL;
+    size_t previous_len = 0;
+    long count = 0;
+    for (size_t pos = 0; pos < size; (*line)++) {
+        const char *start = data + pos;
+        const char *end = memchr(start, '\n', size - pos);
+        if (end == NULL) return -1;
+        const char *comma = memchr(start, ',', (size_t)(end - start));
+        size_t key_len = comma != NULL ? (size_t)(comma - start) - 1 : 0;
+        if (*start != '(' || comma == NULL || comma[1] != ' ' ||
+            end[-1] != ')' || end - 1 < comma + 2 || key_len == 0 ||
+            key_len >= MAX_STRING_SIZE ||
+            (size_t)(end - 1 - (comma + 2)) >= MAX_STRING_SIZE) {
+            return -1;
+        }
+
+        // Keys are written sorted by strcmp, each once
+        const char *key = start + 1;
+        if (previous != NULL) {
+            size_t common = key_len < previous_len ? key_len : previous_len;
+            int order = memcmp(previous, key, common);
+            if (order > 0 || (order == 0 && previous_len >= key_len)) {
+                return -1;
+            }
+        }
+        previous = key;
+        previous_len = key_len;
+        count++;
+        pos = (size_t)(end + 1 - data);
+    }
+    return count;
+}
+
+// Checks a backup and prints the result
+// @return 0 if the backup is whole, 1 otherwise.
+static int verify(const char *path) {
+    size_t size;
+    char *data = read_backup(path, &size);
+    if (data == NULL) return 1;
+
+    long pairs;
+    if (size >= sizeof(DUMP_MAGIC) - 1 &&
+        memcmp(data, DUMP_MAGIC, sizeof(DUMP_MAGIC) - 1) == 0) {
+        free(data);
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        uint64_t wal_offset;
+        pairs = dump_count(path, &wal_offset);
+        if (pairs < 0 ||
+            dump_load(path, cores > 0 ? (size_t)cores : 1, ignore_pairs) !=
+                pairs) {
+            printf("%s: corrupted binary snapshot\n", path);
+            return 1;
+        }
+        printf("%s: ok, binary snapshot of %ld pairs at WAL position %llu\n",
+               path, pairs, (unsigned long long)wal_offset);
+        return 0;
+    }
+
+    size_t start = 0;
+    size_t line = 1;
+    int delta = size >= 9 && memcmp(data, "KVSDELTA ", 9) == 0;
+    if (delta) {
+        start = check_delta(data, size);
+        line = 3;
+    }
+    if (delta && start == 0) {
+        pairs = -1;
+        line = 1;
+    } else {
+        pairs = check_pairs(data + start, size - start, &line);
+    }
+    free(data);
+    if (pairs < 0) {
+        printf("%s: malformed at line %zu\n", path, line);
+        return 1;
+    }
+    printf("%s: ok, %s backup of %ld pairs\n", path, delta ? "delta" : "full",
+           pairs);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <backup>...\n", argv[0]);
+        return 1;
+    }
+
+    int result = 0;
+    for (int i = 1; i < argc; i++) result |= verify(argv[i]);
+    return result;
+}
@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +7,7 @@
 #include <unistd.h>
 
 #include "constants.h"
+#include "sync.h"
 
 // function that will read the files from a directory and add them to the list
 // if they are .job files
@@ -75,64 +77,114 @@ void tryWrite(int fd, const char *buffer, size_t size) {
     }
 }
 
-void rwl_wrlock(pthread_rwlock_t *rwl) {
-    if (pthread_rwlock_wrlock(rwl) != 0) {
+int write_fully(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+int pwrite_fully(int fd, const char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        data += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+int pread_fully(int fd, char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t got = pread(fd, data, size, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        data += got;
+        size -= (size_t)got;
+        offset += got;
+    }
+    return 0;
+}
+
+void rwl_wrlock(KvsRwlock *rwl) {
+    if (sync_backend->rwl_wrlock(rwl) != 0) {
         perror("Failed to lock RWlock");
         exit(EXIT_FAILURE);
     }
 }
 
-void rwl_rdlock(pthread_rwlock_t *rwl) {
-    if (pthread_rwlock_rdlock(rwl) != 0) {
+void rwl_rdlock(KvsRwlock *rwl) {
+    if (sync_backend->rwl_rdlock(rwl) != 0) {
         perror("Failed to lock RWlock");
         exit(EXIT_FAILURE);
     }
 }
 
-void rwl_unlock(pthread_rwlock_t *rwl) {
-    if (pthread_rwlock_unlock(rwl) != 0) {
+void rwl_unlock(KvsRwlock *rwl) {
+    if (sync_backend->rwl_unlock(rwl) != 0) {
         perror("Failed to unlock RWlock");
         exit(EXIT_FAILURE);
     }
 }
 
-void rwl_init(pthread_rwlock_t *rwl) {
-    if (pthread_rwlock_init(rwl, NULL) != 0) {
+int rwl_trywrlock(KvsRwlock *rwl) {
+    int err = sync_backend->rwl_trywrlock(rwl);
+    if (err == EBUSY) return 1;
+    if (err != 0) {
+        errno = err;
+        perror("Failed to lock RWlock");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+void rwl_init(KvsRwlock *rwl) {
+    if (sync_backend->rwl_init(rwl) != 0) {
         perror("Failed to init RWlock");
         exit(EXIT_FAILURE);
     }
 }
 
-void rwl_destroy(pthread_rwlock_t *rwl) {
-    if (pthread_rwlock_destroy(rwl) != 0) {
+void rwl_destroy(KvsRwlock *rwl) {
+    if (sync_backend->rwl_destroy(rwl) != 0) {
         perror("Failed to destroy RWlock");
         exit(EXIT_FAILURE);
     }
 }
 
-void mutex_lock(pthread_mutex_t *mutex) {
-    if (pthread_mutex_lock(mutex) != 0) {
+void mutex_lock(KvsMutex *mutex) {
+    if (sync_backend->mutex_lock(mutex) != 0) {
         perror("Failed to lock Mutex");
         exit(EXIT_FAILURE);
     }
 }
 
-void mutex_unlock(pthread_mutex_t *mutex) {
-    if (pthread_mutex_unlock(mutex) != 0) {
+void mutex_unlock(KvsMutex *mutex) {
+    if (sync_backend->mutex_unlock(mutex) != 0) {
         perror("Failed to unlock Mutex");
         exit(EXIT_FAILURE);
     }
 }
 
-void mutex_init(pthread_mutex_t *mutex) {
-    if (pthread_mutex_init(mutex, NULL) != 0) {
+void mutex_init(KvsMutex *mutex) {
+    if (sync_backend->mutex_init(mutex) != 0) {
         perror("Failed to init Mutex");
         exit(EXIT_FAILURE);
     }
 }
 
-void mutex_destroy(pthread_mutex_t *mutex) {
-    if (pthread_mutex_destroy(mutex) != 0) {
+void mutex_destroy(KvsMutex *mutex) {
+    if (sync_backend->mutex_destroy(mutex) != 0) {
         perror("Failed to destroy Mutex");
         exit(EXIT_FAILURE);
     }
@@ -5,15 +5,17 @@
 #include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "constants.h"
+#include "sync.h"
 
 /// Struct to hold the data for the threads.
 typedef struct {
     char **file_paths;
     int num_files;
     int current_file;
-    pthread_mutex_t mutex;
+    KvsMutex mutex;
 } ThreadData;
 
 /// Returns a list of all .job files in the given directory.
@@ -36,39 +38,69 @@ void sortPairs(size_t num_pairs, char keys[][MAX_STRING_SIZE],
 /// @param size Size of the buffer.
 void tryWrite(int fd, const char *buffer, size_t size);
 
+/// Writes a whole buffer to a file descriptor, retrying interrupted and
+/// short writes. Unlike tryWrite, a failure is returned to the caller.
+/// @param fd File descriptor to write to.
+/// @param data Bytes to write.
+/// @param size Number of bytes.
+/// @return 0 if every byte was written, 1 otherwise.
+int write_fully(int fd, const char *data, size_t size);
+
+/// Writes a whole buffer at an offset of a file, as write_fully.
+/// @param fd File descriptor to write to.
+/// @param data Bytes to write.
+/// @param size Number of bytes.
+/// @param offset Offset of the first byte in the file.
+/// @return 0 if every byte was written, 1 otherwise.
+int pwrite_fully(int fd, const char *data, size_t size, off_t offset);
+
+/// Reads bytes at an offset of a file, retrying interrupted and short reads.
+/// @param fd File descriptor to read from.
+/// @param data Buffer to store the bytes in.
+/// @param size Number of bytes.
+/// @param offset Offset of the first byte in the file.
+/// @return 0 if every byte was read, 1 on failure or if the file ends first.
+int pread_fully(int fd, char *data, size_t size, off_t offset);
+
 /// Locks the rwlock to write-read.
 /// Exits with failure if unsuccessful.
-void rwl_wrlock(pthread_rwlock_t *rwl);
+void rwl_wrlock(KvsRwlock *rwl);
 
 /// Locks the rwlock to read-only.
 /// Exits with failure if unsuccessful.
-void rwl_rdlock(pthread_rwlock_t *rwl);
+void rwl_rdlock(KvsRwlock *rwl);
+
+/// Tries to lock the rwlock to write-read, without waiting.
+/// Exits with failure if unsuccessful for another reason than the rwlock
+/// being held.
+/// @return 0 if the rwlock was locked, 1 if it is held.
+int rwl_trywrlock(KvsRwlock *rwl);
 
 /// Unlocks the rwlock.
 /// Exits with failure if unsuccessful.
-void rwl_unlock(pthread_rwlock_t *rwl);
+void rwl_unlock(KvsRwlock *rwl);
 
 /// Initializes the rwlock.
 /// Exits with failure if unsuccessful.
-void rwl_init(pthread_rwlock_t *rwl);
+void rwl_init(KvsRwlock *rwl);
 
 /// Destroys the rwlock.
 /// Exits with failure if unsuccessful.
-void rwl_destroy(pthread_rwlock_t *rwl);
+void rwl_destroy(KvsRwlock *rwl);
 
 /// Locks the mutex.
 /// Exits with failure if unsuccessful.
-void mutex_lock(pthread_mutex_t *mutex);
+void mutex_lock(KvsMutex *mutex);
 
 /// Unlocks the mutex.
 /// Exits with failure if unsuccessful.
-void mutex_unlock(pthread_mutex_t *mutex);
+void mutex_unlock(KvsMutex *mutex);
 
 /// Initializes the mutex.
 /// Exits with failure if unsuccessful.
-void mutex_init(pthread_mutex_t *mutex);
+void mutex_init(KvsMutex *mutex);
 
 /// Destroys the mutex.
 /// Exits with failure if unsuccessful.
-void mutex_destroy(pthread_mutex_t *mutex);
+void mutex_destroy(KvsMutex *mutex);
 #endif  // UTILS_H
\ No newline at end of file
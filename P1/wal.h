@@ -0,0 +1,84 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+// Values of KVS_WAL_SYNC besides an interval in milliseconds
+#define WAL_SYNC_ALWAYS 0
+#define WAL_SYNC_NEVER -1
+
+// Most threads a replay uses
+#define WAL_MAX_THREADS 64
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+typedef enum { WAL_WRITE = 'W', WAL_DELETE = 'D' } WalOp;
+
+/// Applies a logged command during wal_replay.
+/// @return 0 on success, 1 to stop the replay.
+typedef int (*WalApply)(WalOp op, size_t num_pairs,
+                        char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]);
+
+/// Maps a key to its partition of the table, such as its lock stripe. Keys of
+/// one partition are replayed by one thread.
+typedef size_t (*WalPartition)(const char *key);
+
+/// Replays the commands of a log from a position, in the order they were
+/// logged. With several threads the log is read by the calling thread, which
+/// splits each command between the threads by the partitions of its keys, so
+/// the commands on a key are applied in order but those on different keys
+/// in any order. Stops at the first incomplete or corrupted record, left by a
+/// crash in the middle of a write, and truncates the log there. A missing log
+/// is empty.
+/// @param path Path of the log.
+/// @param offset Position of the first command to replay, as returned by
+/// wal_position. The whole log is replayed if no record starts there.
+/// @param num_threads Number of threads that apply commands.
+/// @param partition Function that maps keys to partitions.
+/// @param apply Function that applies each command, or each part of one.
+/// @return Number of commands replayed, -1 on failure.
+long wal_replay(const char *path, uint64_t offset, size_t num_threads,
+                WalPartition partition, WalApply apply);
+
+/// Opens a log for appending, creating it if needed.
+/// @param path Path of the log.
+/// @param sync_ms WAL_SYNC_ALWAYS to sync before wal_commit returns,
+/// WAL_SYNC_NEVER to leave syncing to the system, or an interval in
+/// milliseconds between syncs by a background thread.
+/// @return 0 if the log was opened, 1 otherwise.
+int wal_open(const char *path, int sync_ms);
+
+/// Checks if a log is open, so that callers can skip preparing commands.
+/// @return 1 if a log is open, 0 otherwise.
+int wal_enabled();
+
+/// Returns the position in the log after the last command appended, which a
+/// snapshot that holds every command appended so far records so that only
+/// the commands after it are replayed.
+/// @return Position in the log, 0 if no log is open.
+uint64_t wal_position();
+
+/// Appends a command to the log buffer. Called with the locks of the keys
+/// held, so that the commands on a key are logged in the order they were
+/// applied. Does nothing if no log is open.
+/// @param op Type of the command.
+/// @param num_pairs Number of keys.
+/// @param keys Keys of the command.
+/// @param values Values of a WAL_WRITE, NULL for a WAL_DELETE.
+void wal_append(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE]);
+
+/// Makes the commands appended so far durable according to the sync policy.
+/// Called without locks held: the threads that commit at the same time share
+/// one write and one sync (group commit). With an interval policy it returns
+/// at once.
+/// @return 0 on success, 1 if the log could not be written.
+int wal_commit();
+
+/// Writes and syncs what is left in the buffer and closes the log. No command
+/// may be running.
+void wal_close();
+
+#endif  // KVS_WAL_H
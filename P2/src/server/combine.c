@@ -0,0 +1,138 @@
+#include "combine.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "utils.h"
+
+// Size of a cache line, each slot has its own so that publishing a request
+// does not invalidate the slot of another thread
+#define CACHE_LINE_SIZE 64
+
+typedef struct CombineSlot {
+    // lock_id + 1 of the published request, 0 once it has been applied. A
+    // single word, so that a combiner cannot mistake the request of another
+    // lock for one of its own.
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t pending;
+    CombineRequest *request;
+    int in_use;  // Protected by slot_mutex
+} CombineSlot;
+
+static CombineSlot slots[COMBINE_MAX_THREADS];
+// Slots below this one may have been used, combiners only scan those
+static atomic_size_t slots_used;
+// Only taken when a thread gets or releases its slot, so it is a plain
+// pthread mutex rather than one of the sync backend
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Bumped by combine_destroy, so that threads drop their released slots
+static atomic_ulong generation;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static _Thread_local CombineSlot *thread_slot = NULL;
+static _Thread_local unsigned long thread_generation;
+
+// Releases the slot of an exiting thread
+static void slot_destructor(void *arg) {
+    CombineSlot *slot = arg;
+    if (thread_generation != atomic_load(&generation)) return;
+
+    pthread_mutex_lock(&slot_mutex);
+    slot->in_use = 0;
+    pthread_mutex_unlock(&slot_mutex);
+}
+
+static void create_slot_key() {
+    pthread_key_create(&slot_key, slot_destructor);
+}
+
+// Returns the slot of the calling thread, taking a free one on first use.
+// NULL if every slot is taken.
+static CombineSlot *get_slot() {
+    unsigned long current = atomic_load(&generation);
+    if (thread_slot != NULL && thread_generation == current) {
+        return thread_slot;
+    }
+
+    pthread_mutex_lock(&slot_mutex);
+    size_t index;
+    for (index = 0; index < COMBINE_MAX_THREADS; index++) {
+        if (!slots[index].in_use) break;
+    }
+    if (index == COMBINE_MAX_THREADS) {
+        pthread_mutex_unlock(&slot_mutex);
+        return NULL;
+    }
+    slots[index].in_use = 1;
+    if (index + 1 > atomic_load(&slots_used)) {
+        atomic_store(&slots_used, index + 1);
+    }
+    pthread_mutex_unlock(&slot_mutex);
+
+    thread_slot = &slots[index];
+    thread_generation = current;
+    pthread_setspecific(slot_key, thread_slot);
+    return thread_slot;
+}
+
+// Applies the requests published for a lock, which the caller holds
+static void combine(size_t lock_id, void (*apply)(CombineRequest *)) {
+    for (int pass = 0; pass < COMBINE_PASSES; pass++) {
+        int applied = 0;
+        size_t used = atomic_load(&slots_used);
+        for (size_t i = 0; i < used; i++) {
+            CombineSlot *slot = &slots[i];
+            if (atomic_load_explicit(&slot->pending, memory_order_acquire) !=
+                lock_id + 1) {
+                continue;
+            }
+
+            apply(slot->request);
+            atomic_store_explicit(&slot->pending, 0, memory_order_release);
+            applied = 1;
+        }
+        if (!applied) break;
+    }
+}
+
+void combine_init() {
+    pthread_once(&key_once, create_slot_key);
+    atomic_store(&slots_used, 0);
+    for (size_t i = 0; i < COMBINE_MAX_THREADS; i++) {
+        atomic_init(&slots[i].pending, 0);
+        slots[i].in_use = 0;
+    }
+}
+
+int combine_execute(KvsRwlock *lock, size_t lock_id,
+                    CombineRequest *request,
+                    void (*apply)(CombineRequest *)) {
+    CombineSlot *slot = get_slot();
+    if (slot == NULL) return 1;
+
+    slot->request = request;
+    atomic_store_explicit(&slot->pending, lock_id + 1, memory_order_release);
+
+    for (int spin = 0;
+         atomic_load_explicit(&slot->pending, memory_order_acquire) != 0;
+         spin++) {
+        if (rwl_trywrlock(lock) == 0) {
+            combine(lock_id, apply);
+            rwl_unlock(lock);
+        } else if (spin < COMBINE_SPIN) {
+            sched_yield();
+        } else {
+            // The lock is held for long, by readers or by commands that are
+            // not combined, so wait for it instead of polling
+            rwl_wrlock(lock);
+            combine(lock_id, apply);
+            rwl_unlock(lock);
+        }
+    }
+
+    return 0;
+}
+
+void combine_destroy() { atomic_fetch_add(&generation, 1); }
@@ -0,0 +1,50 @@
+#ifndef KVS_COMBINE_H
+#define KVS_COMBINE_H
+
+// Threads that can publish requests at the same time, the others take the
+// lock themselves
+#define COMBINE_MAX_THREADS 256
+
+// Polls of an unfinished request before trying the lock again, and tries
+// before waiting for the lock
+#define COMBINE_SPIN 32
+
+// Passes over the published requests a combiner makes before releasing the
+// lock, so that a thread does not combine for others forever
+#define COMBINE_PASSES 3
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "sync.h"
+
+/// Command that modifies the keys protected by one lock.
+typedef struct CombineRequest {
+    size_t num_keys;
+    char (*keys)[MAX_STRING_SIZE];
+    char (*values)[MAX_STRING_SIZE];  // NULL for a DELETE
+    int *failed;                      // Set for each key by apply
+} CombineRequest;
+
+/// Prepares flat combining. Must be called before any other function.
+void combine_init();
+
+/// Runs a request with a lock held for writing, using flat combining: the
+/// request is published in a slot of the calling thread, and whichever thread
+/// gets the lock applies every request published for it in one pass, so that
+/// threads on a busy lock do not each pay a handoff. A thread has at most one
+/// request published, so its requests run in the order it makes them.
+/// @param lock Lock that protects the keys of the request.
+/// @param lock_id Number that identifies the lock among the combined ones.
+/// @param request Request to run.
+/// @param apply Function that applies a request, called with the lock held.
+/// @return 0 if the request ran, 1 if the thread could not get a slot and
+/// must take the lock itself.
+int combine_execute(KvsRwlock *lock, size_t lock_id,
+                    CombineRequest *request,
+                    void (*apply)(CombineRequest *));
+
+/// Releases the slots of every thread. No request may be running.
+void combine_destroy();
+
+#endif  // KVS_COMBINE_H
@@ -0,0 +1,313 @@
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backup.h"
+#include "lsm.h"
+#include "mapped.h"
+#include "shard.h"
+#include "sync.h"
+#include "wal.h"
+
+// Stripes per online core when KVS_LOCK_STRIPES is not set, so that writers
+// on different cores rarely share a stripe
+#define STRIPES_PER_CORE 4
+#define MIN_DEFAULT_STRIPES 32
+
+KvsConfig kvs_config = {
+    .engine = &chained_engine,
+    .alloc_stats = 0,
+    .lock_stripes = MIN_DEFAULT_STRIPES,
+    .shards = 0,
+    .flat_combining = 0,
+    .lockfree_reads = 0,
+    .wal_path = NULL,
+    .wal_sync_ms = WAL_SYNC_ALWAYS,
+    .binary_backups = 0,
+    .backup_deltas = 0,
+    .compress_backups = 0,
+    .backup_threads = 1,
+    .backup_rate = 0,
+    .backup_store = NULL,
+    .restore_path = NULL,
+    .recovery_threads = 1,
+    .map_path = NULL,
+    .map_size = (size_t)MAPPED_DEFAULT_SIZE_MB << 20,
+    .lsm_dir = NULL,
+    .lsm_memtable = LSM_DEFAULT_MEMTABLE,
+};
+
+// Smallest power of two with at least STRIPES_PER_CORE stripes per core
+static size_t default_lock_stripes() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t stripes = MIN_DEFAULT_STRIPES;
+    while (cores > 0 && stripes < (size_t)cores * STRIPES_PER_CORE &&
+           stripes < MAX_LOCK_STRIPES) {
+        stripes *= 2;
+    }
+    return stripes;
+}
+
+int load_config() {
+    const char *engine = getenv("KVS_ENGINE");
+    if (engine != NULL) {
+        kvs_config.engine = get_engine(engine);
+        if (kvs_config.engine == NULL) {
+            fprintf(stderr, "Unknown storage engine %s\n", engine);
+            return 1;
+        }
+    }
+
+    const char *alloc_stats = getenv("KVS_ALLOC_STATS");
+    if (alloc_stats != NULL) {
+        if (strcmp(alloc_stats, "0") != 0 && strcmp(alloc_stats, "1") != 0) {
+            fprintf(stderr, "Invalid KVS_ALLOC_STATS %s\n", alloc_stats);
+            return 1;
+        }
+        kvs_config.alloc_stats = alloc_stats[0] == '1';
+    }
+
+    const char *stripes = getenv("KVS_LOCK_STRIPES");
+    if (stripes != NULL) {
+        char *end;
+        unsigned long value = strtoul(stripes, &end, 10);
+        if (*stripes == '\0' || *end != '\0' || value == 0 ||
+            value > MAX_LOCK_STRIPES || (value & (value - 1)) != 0) {
+            fprintf(stderr,
+                    "Invalid KVS_LOCK_STRIPES %s, expected a power of two up "
+                    "to %d\n",
+                    stripes, MAX_LOCK_STRIPES);
+            return 1;
+        }
+        kvs_config.lock_stripes = value;
+    } else {
+        kvs_config.lock_stripes = default_lock_stripes();
+    }
+
+    const char *shards = getenv("KVS_SHARDS");
+    if (shards != NULL) {
+        char *end;
+        unsigned long value = strtoul(shards, &end, 10);
+        if (*shards == '\0' || *end != '\0' || value > MAX_SHARDS) {
+            fprintf(stderr, "Invalid KVS_SHARDS %s, expected 0 to %d\n",
+                    shards, MAX_SHARDS);
+            return 1;
+        }
+        kvs_config.shards = value;
+    }
+
+    const char *combining = getenv("KVS_FLAT_COMBINING");
+    if (combining != NULL) {
+        if (strcmp(combining, "0") != 0 && strcmp(combining, "1") != 0) {
+            fprintf(stderr, "Invalid KVS_FLAT_COMBINING %s\n", combining);
+            return 1;
+        }
+        kvs_config.flat_combining = combining[0] == '1';
+    }
+
+    const char *lockfree = getenv("KVS_LOCKFREE_READS");
+    if (lockfree != NULL) {
+        if (strcmp(lockfree, "0") != 0 && strcmp(lockfree, "1") != 0) {
+            fprintf(stderr, "Invalid KVS_LOCKFREE_READS %s\n", lockfree);
+            return 1;
+        }
+        kvs_config.lockfree_reads = lockfree[0] == '1';
+    }
+
+    const char *wal = getenv("KVS_WAL");
+    if (wal != NULL) {
+        if (*wal == '\0') {
+            fprintf(stderr, "Invalid KVS_WAL, expected a path\n");
+            return 1;
+        }
+        kvs_config.wal_path = wal;
+    }
+
+    const char *wal_sync = getenv("KVS_WAL_SYNC");
+    if (wal_sync != NULL) {
+        char *end;
+        unsigned long value = strtoul(wal_sync, &end, 10);
+        if (strcmp(wal_sync, "always") == 0) {
+            kvs_config.wal_sync_ms = WAL_SYNC_ALWAYS;
+        } else if (strcmp(wal_sync, "never") == 0) {
+            kvs_config.wal_sync_ms = WAL_SYNC_NEVER;
+        } else if (*wal_sync != '\0' && *end == '\0' && value > 0 &&
+                   value <= INT_MAX) {
+            kvs_config.wal_sync_ms = (int)value;
+        } else {
+            fprintf(stderr,
+                    "Invalid KVS_WAL_SYNC %s, expected always, never or a "
+                    "number of milliseconds\n",
+                    wal_sync);
+            return 1;
+        }
+    }
+
+    const char *format = getenv("KVS_BACKUP_FORMAT");
+    if (format != NULL) {
+        if (strcmp(format, "text") != 0 && strcmp(format, "binary") != 0) {
+            fprintf(stderr, "Invalid KVS_BACKUP_FORMAT %s\n", format);
+            return 1;
+        }
+        kvs_config.binary_backups = format[0] == 'b';
+    }
+
+    const char *deltas = getenv("KVS_BACKUP_DELTA");
+    if (deltas != NULL) {
+        char *end;
+        long value = strtol(deltas, &end, 10);
+        if (*deltas == '\0' || *end != '\0' || value < 0 ||
+            value > INT_MAX) {
+            fprintf(stderr, "Invalid KVS_BACKUP_DELTA %s\n", deltas);
+            return 1;
+        }
+        kvs_config.backup_deltas = (int)value;
+    }
+    if (kvs_config.backup_deltas > 0 && kvs_config.binary_backups) {
+        fprintf(stderr, "KVS_BACKUP_DELTA needs text backups\n");
+        return 1;
+    }
+
+    const char *compress = getenv("KVS_BACKUP_COMPRESS");
+    if (compress != NULL) {
+        if (strcmp(compress, "0") != 0 && strcmp(compress, "1") != 0) {
+            fprintf(stderr, "Invalid KVS_BACKUP_COMPRESS %s\n", compress);
+            return 1;
+        }
+        kvs_config.compress_backups = compress[0] == '1';
+    }
+
+    const char *backup_threads = getenv("KVS_BACKUP_THREADS");
+    if (backup_threads != NULL) {
+        char *end;
+        unsigned long value = strtoul(backup_threads, &end, 10);
+        if (*backup_threads == '\0' || *end != '\0' || value == 0 ||
+            value > MAX_BACKUP_THREADS) {
+            fprintf(stderr,
+                    "Invalid KVS_BACKUP_THREADS %s, expected 1 to %d\n",
+                    backup_threads, MAX_BACKUP_THREADS);
+            return 1;
+        }
+        kvs_config.backup_threads = value;
+    } else {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        kvs_config.backup_threads =
+            cores > MAX_BACKUP_THREADS ? MAX_BACKUP_THREADS
+                                       : (cores > 0 ? (size_t)cores : 1);
+    }
+
+    const char *rate = getenv("KVS_BACKUP_RATE");
+    if (rate != NULL) {
+        char *end;
+        errno = 0;
+        unsigned long long value = strtoull(rate, &end, 10);
+        if (*rate == '\0' || *rate == '-' || *end != '\0' || errno != 0) {
+            fprintf(stderr,
+                    "Invalid KVS_BACKUP_RATE %s, expected a number of bytes "
+                    "per second\n",
+                    rate);
+            return 1;
+        }
+        kvs_config.backup_rate = (uint64_t)value;
+    }
+
+    const char *store = getenv("KVS_BACKUP_STORE");
+    if (store != NULL) {
+        if (*store == '\0') {
+            fprintf(stderr, "Invalid KVS_BACKUP_STORE, expected a path\n");
+            return 1;
+        }
+        kvs_config.backup_store = store;
+    }
+    if (kvs_config.backup_store != NULL && kvs_config.compress_backups) {
+        fprintf(stderr, "KVS_BACKUP_STORE needs uncompressed backups\n");
+        return 1;
+    }
+
+    const char *restore = getenv("KVS_RESTORE");
+    if (restore != NULL) {
+        if (*restore == '\0') {
+            fprintf(stderr, "Invalid KVS_RESTORE, expected a path\n");
+            return 1;
+        }
+        kvs_config.restore_path = restore;
+    }
+
+    const char *recovery = getenv("KVS_RECOVERY_THREADS");
+    if (recovery != NULL) {
+        char *end;
+        unsigned long value = strtoul(recovery, &end, 10);
+        if (*recovery == '\0' || *end != '\0' || value == 0 ||
+            value > WAL_MAX_THREADS) {
+            fprintf(stderr,
+                    "Invalid KVS_RECOVERY_THREADS %s, expected 1 to %d\n",
+                    recovery, WAL_MAX_THREADS);
+            return 1;
+        }
+        kvs_config.recovery_threads = value;
+    } else {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        kvs_config.recovery_threads =
+            cores > WAL_MAX_THREADS ? WAL_MAX_THREADS
+                                    : (cores > 0 ? (size_t)cores : 1);
+    }
+
+    const char *map = getenv("KVS_MAP_FILE");
+    if (map != NULL && *map != '\0') kvs_config.map_path = map;
+
+    const char *map_size = getenv("KVS_MAP_SIZE");
+    if (map_size != NULL) {
+        char *end;
+        unsigned long value = strtoul(map_size, &end, 10);
+        if (*map_size == '\0' || *end != '\0' || value == 0 ||
+            value > (SIZE_MAX >> 20)) {
+            fprintf(stderr, "Invalid KVS_MAP_SIZE %s, expected MiB\n",
+                    map_size);
+            return 1;
+        }
+        kvs_config.map_size = (size_t)value << 20;
+    }
+
+    // The file holds a single table, shards would each open their own
+    if (kvs_config.engine == &mapped_engine &&
+        (kvs_config.map_path == NULL || kvs_config.shards > 0)) {
+        fprintf(stderr,
+                "The mapped engine needs KVS_MAP_FILE and no KVS_SHARDS\n");
+        return 1;
+    }
+
+    const char *lsm_dir = getenv("KVS_LSM_DIR");
+    if (lsm_dir != NULL && *lsm_dir != '\0') kvs_config.lsm_dir = lsm_dir;
+
+    const char *memtable = getenv("KVS_LSM_MEMTABLE");
+    if (memtable != NULL) {
+        char *end;
+        unsigned long value = strtoul(memtable, &end, 10);
+        if (*memtable == '\0' || *end != '\0' || value == 0) {
+            fprintf(stderr, "Invalid KVS_LSM_MEMTABLE %s\n", memtable);
+            return 1;
+        }
+        kvs_config.lsm_memtable = value;
+    }
+
+    if (kvs_config.engine == &lsm_engine && kvs_config.lsm_dir == NULL) {
+        fprintf(stderr, "The lsm engine needs KVS_LSM_DIR\n");
+        return 1;
+    }
+
+    const char *sync = getenv("KVS_SYNC");
+    if (sync == NULL) sync = KVS_DEFAULT_SYNC;
+    sync_backend = get_sync_backend(sync);
+    if (sync_backend == NULL) {
+        fprintf(stderr, "Unknown sync backend %s\n", sync);
+        return 1;
+    }
+
+    return 0;
+}
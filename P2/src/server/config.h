@@ -0,0 +1,90 @@
+#ifndef KVS_CONFIG_H
+#define KVS_CONFIG_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+/// Runtime options, read from the environment when the KVS starts.
+typedef struct {
+    // KVS_ENGINE: storage engine ("chained", "swiss", "splitorder", "mapped"
+    // or "lsm")
+    const KvsEngine *engine;
+    // KVS_ALLOC_STATS: print the allocator counters on exit ("0" or "1")
+    int alloc_stats;
+    // KVS_LOCK_STRIPES: number of lock stripes, a power of two up to
+    // MAX_LOCK_STRIPES. Defaults to 4 per online core, at least 32.
+    size_t lock_stripes;
+    // KVS_SHARDS: number of shards, each owned by a thread pinned to a core
+    // that executes every operation on its keys, up to MAX_SHARDS. 0 (the
+    // default) shares one table between the worker threads.
+    size_t shards;
+    // KVS_FLAT_COMBINING: let the thread that holds a stripe apply the WRITE
+    // and DELETE commands waiting for it ("0" or "1")
+    int flat_combining;
+    // KVS_LOCKFREE_READS: read without locks, inside an epoch, with engines
+    // that allow it but lock stripes to write ("0" or "1"). A READ of several
+    // keys may then see part of a WRITE of several keys.
+    int lockfree_reads;
+    // KVS_WAL: path of a write-ahead log of the WRITE and DELETE commands,
+    // replayed when the KVS starts. NULL (the default) disables it.
+    const char *wal_path;
+    // KVS_WAL_SYNC: when the log is synced, "always" (the default, before
+    // each command returns), "never" or every given number of milliseconds
+    int wal_sync_ms;
+    // KVS_BACKUP_FORMAT: format of the BACKUP files, "text" (the default,
+    // the output of SHOW in a .bck file) or "binary" (a snapshot that
+    // KVS_RESTORE loads, in a .snap file, see dump.h)
+    int binary_backups;
+    // KVS_BACKUP_DELTA: number of text backups after each full one that only
+    // hold the lock stripes changed since the previous backup (see
+    // tools/materialize.c). 0 (the default) makes every backup full.
+    int backup_deltas;
+    // KVS_BACKUP_COMPRESS: compress the BACKUP files with the LZ codec of
+    // lz.h while they are written, adding ".lz" to their names ("0" or "1",
+    // see tools/decompress.c)
+    int compress_backups;
+    // KVS_BACKUP_THREADS: threads that sort and write each uncompressed
+    // BACKUP file, up to MAX_BACKUP_THREADS (see backup.h). Defaults to the
+    // number of online cores.
+    size_t backup_threads;
+    // KVS_BACKUP_RATE: bytes per second all the backups write together,
+    // fewer while the jobs are running commands (see throttle.h). 0 (the
+    // default) does not limit them.
+    uint64_t backup_rate;
+    // KVS_BACKUP_STORE: directory of a content-addressed store that keeps
+    // each chunk of the uncompressed BACKUP files once, the files becoming
+    // hard links to manifests of their chunks (see store.h). NULL (the
+    // default) writes every backup in full.
+    const char *backup_store;
+    // KVS_RESTORE: path of a binary snapshot loaded when the KVS starts,
+    // before the WAL is replayed from the position the snapshot holds, or of
+    // a directory whose newest valid .snap file is loaded. NULL (the
+    // default) starts empty.
+    const char *restore_path;
+    // KVS_RECOVERY_THREADS: threads that load the snapshot of KVS_RESTORE
+    // and replay the WAL, up to WAL_MAX_THREADS (see wal.h). Defaults to the
+    // number of online cores.
+    size_t recovery_threads;
+    // KVS_MAP_FILE: file of the "mapped" engine, which requires it
+    const char *map_path;
+    // KVS_MAP_SIZE: size in MiB of a new file of the "mapped" engine
+    size_t map_size;
+    // KVS_LSM_DIR: directory of the run files of the "lsm" engine, which
+    // requires it
+    const char *lsm_dir;
+    // KVS_LSM_MEMTABLE: writes and deletes the memtable of the "lsm" engine
+    // takes before it is flushed to a run
+    size_t lsm_memtable;
+} KvsConfig;
+
+extern KvsConfig kvs_config;
+
+/// Reads the options from the KVS_* environment variables. Unset variables
+/// keep their default value. KVS_SYNC selects sync_backend (see sync.h),
+/// KVS_DEFAULT_SYNC if unset, so this must run before any lock is
+/// initialized.
+/// @return 0 if every option is valid, 1 otherwise.
+int load_config();
+
+#endif  // KVS_CONFIG_H
@@ -0,0 +1,57 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, so that eight
+// bytes are folded with eight lookups and no dependency between them
+// (slicing-by-8)
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = table[k - 1][i];
+            table[k][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+        }
+    }
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&table_once, init_table);
+
+    const unsigned char *bytes = data;
+    crc = ~crc;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^
+              table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^
+              table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+#endif
+
+    for (size_t i = 0; i < size; i++) {
+        crc = table[0][(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,15 @@
+#ifndef KVS_CRC32C_H
+#define KVS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Computes the CRC-32C (Castagnoli) of a buffer, continuing from a previous
+/// value so that a checksum can be built from several pieces.
+/// @param crc CRC of the preceding data, 0 for the first piece.
+/// @param data Buffer to checksum.
+/// @param size Size of the buffer.
+/// @return CRC of the preceding data followed by the buffer.
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+#endif  // KVS_CRC32C_H
@@ -0,0 +1,501 @@
+#include "dump.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "lz.h"
+#include "store.h"
+#include "throttle.h"
+#include "utils.h"
+
+// A snapshot is a DumpHeader followed by segments. A segment is a
+// SegmentHeader followed by its payload: for each pair the length of the key
+// (1 byte), its bytes, the length of the value (1 byte) and its bytes.
+// Integers are stored in the byte order of the machine. Version 1 headers
+// end before wal_offset.
+#define DUMP_VERSION 2
+
+_Static_assert(MAX_STRING_SIZE <= 256, "string lengths must fit in a byte");
+
+typedef struct DumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t segment_size;  // DUMP_SEGMENT_SIZE of the writer
+    uint64_t num_pairs;
+    uint64_t wal_offset;  // Position of the KVS_WAL the pairs are at
+} DumpHeader;
+
+// Size of the header of a snapshot of a given version
+#define HEADER_SIZE(version) \
+    ((version) == 1 ? offsetof(DumpHeader, wal_offset) : sizeof(DumpHeader))
+
+typedef struct SegmentHeader {
+    uint32_t size;   // Size of the payload
+    uint32_t count;  // Number of pairs
+    uint32_t crc;    // CRC-32C of the payload
+} SegmentHeader;
+
+// Largest record of a pair
+#define MAX_RECORD_SIZE (2 * MAX_STRING_SIZE)
+
+// Segment found by dump_load
+typedef struct Segment {
+    off_t offset;  // Offset of the payload
+    SegmentHeader header;
+} Segment;
+
+// Segment planned by dump_write_at
+typedef struct PlannedSegment {
+    size_t first;  // Index of its first pair
+    size_t count;
+    size_t size;   // Size of the payload
+    off_t offset;  // Offset of its header
+} PlannedSegment;
+
+// State shared by the threads of dump_write_at
+typedef struct Writer {
+    int fd;
+    const KvsPair *pairs;
+    const PlannedSegment *segments;
+    size_t num_segments;
+    atomic_size_t next;  // Next segment to write
+    atomic_int failed;
+} Writer;
+
+// Snapshot being loaded, read from its file or, when it was compressed or is
+// a manifest of a backup store, from memory
+typedef struct DumpFile {
+    int fd;
+    char *data;  // NULL when read from the file
+    off_t size;
+} DumpFile;
+
+// State shared by the threads of dump_load
+typedef struct Loader {
+    const DumpFile *file;
+    const Segment *segments;
+    size_t num_segments;
+    size_t max_size;  // Size of the largest payload
+    DumpApply apply;
+    atomic_size_t next;  // Next segment to read
+    atomic_int failed;
+} Loader;
+
+static int read_file(const DumpFile *file, char *data, size_t size,
+                     off_t offset) {
+    if (file->data == NULL) return pread_fully(file->fd, data, size, offset);
+    if (offset + (off_t)size > file->size) return 1;
+    memcpy(data, file->data + offset, size);
+    return 0;
+}
+
+// Opens a snapshot, reading into memory up to limit bytes of a compressed one
+// or of one in a backup store
+static int open_file(const char *path, size_t limit, DumpFile *file) {
+    file->data = NULL;
+    file->fd = open(path, O_RDONLY);
+    if (file->fd == -1) {
+        perror("Failed to open the snapshot");
+        return 1;
+    }
+
+    if (lz_is_compressed(file->fd)) {
+        size_t size;
+        file->data = lz_read(file->fd, limit, &size);
+        file->size = (off_t)size;
+        if (file->data == NULL) {
+            fprintf(stderr, "Corrupted compressed snapshot\n");
+            close(file->fd);
+            return 1;
+        }
+        return 0;
+    }
+    if (store_is_manifest(file->fd)) {
+        size_t size;
+        file->data = store_read(file->fd, limit, &size);
+        file->size = (off_t)size;
+        if (file->data == NULL) {
+            fprintf(stderr, "Missing or corrupted chunks of the snapshot\n");
+            close(file->fd);
+            return 1;
+        }
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(file->fd, &st) != 0) {
+        perror("Failed to read the snapshot");
+        close(file->fd);
+        return 1;
+    }
+    file->size = st.st_size;
+    return 0;
+}
+
+static void close_file(DumpFile *file) {
+    free(file->data);
+    close(file->fd);
+}
+
+static void put_string(char *payload, size_t *pos, const char *str) {
+    size_t len = strnlen(str, MAX_STRING_SIZE - 1);
+    payload[*pos] = (char)len;
+    memcpy(payload + *pos + 1, str, len);
+    *pos += 1 + len;
+}
+
+// Writes a segment whose payload follows room for its header
+static int write_segment(DumpSink sink, void *ctx, char *segment,
+                         size_t size, size_t count) {
+    char *payload = segment + sizeof(SegmentHeader);
+    SegmentHeader header = {(uint32_t)size, (uint32_t)count,
+                            crc32c(0, payload, size)};
+    memcpy(segment, &header, sizeof(header));
+    return sink(ctx, segment, sizeof(header) + size);
+}
+
+int dump_write(DumpSink sink, void *ctx, const KvsPair *pairs,
+               size_t count, uint64_t wal_offset) {
+    DumpHeader header = {.version = DUMP_VERSION,
+                         .segment_size = DUMP_SEGMENT_SIZE,
+                         .num_pairs = count,
+                         .wal_offset = wal_offset};
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    if (sink(ctx, (const char *)&header, sizeof(header)) != 0) return 1;
+
+    char *segment = malloc(sizeof(SegmentHeader) + DUMP_SEGMENT_SIZE);
+    if (segment == NULL) return 1;
+    char *payload = segment + sizeof(SegmentHeader);
+
+    size_t size = 0;
+    size_t in_segment = 0;
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        if (size + MAX_RECORD_SIZE > DUMP_SEGMENT_SIZE) {
+            result = write_segment(sink, ctx, segment, size, in_segment);
+            size = 0;
+            in_segment = 0;
+        }
+        put_string(payload, &size, pairs[i].key);
+        put_string(payload, &size, pairs[i].value);
+        in_segment++;
+    }
+    if (result == 0 && in_segment > 0) {
+        result = write_segment(sink, ctx, segment, size, in_segment);
+    }
+
+    free(segment);
+    return result;
+}
+
+// Size of the record of a pair, as written by put_string
+static size_t record_size(const KvsPair *pair) {
+    return 2 + strnlen(pair->key, MAX_STRING_SIZE - 1) +
+           strnlen(pair->value, MAX_STRING_SIZE - 1);
+}
+
+// Splits pairs into segments where dump_write would, so that both write the
+// same file
+// @return Array of segments to be freed by the caller, NULL on failure.
+static PlannedSegment *plan_segments(const KvsPair *pairs, size_t count,
+                                     off_t offset, size_t *num_segments) {
+    size_t capacity = 16;
+    PlannedSegment *segments = malloc(capacity * sizeof(PlannedSegment));
+    if (segments == NULL) return NULL;
+
+    *num_segments = 0;
+    offset += (off_t)sizeof(DumpHeader);
+    PlannedSegment current = {0, 0, 0, offset};
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && current.size + MAX_RECORD_SIZE <= DUMP_SEGMENT_SIZE) {
+            current.size += record_size(&pairs[i]);
+            current.count++;
+            continue;
+        }
+        if (current.count == 0) break;
+
+        if (*num_segments == capacity) {
+            capacity *= 2;
+            PlannedSegment *grown =
+                realloc(segments, capacity * sizeof(PlannedSegment));
+            if (grown == NULL) {
+                free(segments);
+                return NULL;
+            }
+            segments = grown;
+        }
+        segments[(*num_segments)++] = current;
+        offset += (off_t)(sizeof(SegmentHeader) + current.size);
+        current = (PlannedSegment){i, 0, 0, offset};
+        if (i < count) {
+            current.size = record_size(&pairs[i]);
+            current.count = 1;
+        }
+    }
+    return segments;
+}
+
+static void *write_thread(void *arg) {
+    Writer *writer = arg;
+    char *segment = malloc(sizeof(SegmentHeader) + DUMP_SEGMENT_SIZE);
+    if (segment == NULL) atomic_store(&writer->failed, 1);
+    char *payload = segment + sizeof(SegmentHeader);
+
+    while (!atomic_load(&writer->failed)) {
+        size_t i = atomic_fetch_add(&writer->next, 1);
+        if (i >= writer->num_segments) break;
+        const PlannedSegment *planned = &writer->segments[i];
+
+        size_t size = 0;
+        for (size_t j = 0; j < planned->count; j++) {
+            put_string(payload, &size, writer->pairs[planned->first + j].key);
+            put_string(payload, &size,
+                       writer->pairs[planned->first + j].value);
+        }
+        SegmentHeader header = {(uint32_t)size, (uint32_t)planned->count,
+                                crc32c(0, payload, size)};
+        memcpy(segment, &header, sizeof(header));
+        throttle_backup(sizeof(header) + size);
+        if (pwrite_fully(writer->fd, segment, sizeof(header) + size,
+                         planned->offset) != 0) {
+            atomic_store(&writer->failed, 1);
+        }
+    }
+
+    free(segment);
+    return NULL;
+}
+
+int dump_write_at(int fd, off_t offset, const KvsPair *pairs, size_t count,
+                  size_t num_threads, uint64_t wal_offset) {
+    DumpHeader header = {.version = DUMP_VERSION,
+                         .segment_size = DUMP_SEGMENT_SIZE,
+                         .num_pairs = count,
+                         .wal_offset = wal_offset};
+    memcpy(header.magic, DUMP_MAGIC, sizeof(header.magic));
+    throttle_backup(sizeof(header));
+    if (pwrite_fully(fd, (const char *)&header, sizeof(header), offset) != 0) {
+        return 1;
+    }
+
+    size_t num_segments;
+    PlannedSegment *segments =
+        plan_segments(pairs, count, offset, &num_segments);
+    if (segments == NULL) return 1;
+
+    Writer writer = {.fd = fd,
+                     .pairs = pairs,
+                     .segments = segments,
+                     .num_segments = num_segments};
+    atomic_init(&writer.next, 0);
+    atomic_init(&writer.failed, 0);
+
+    // The calling thread writes segments too
+    if (num_threads > num_segments) num_threads = num_segments;
+    size_t extra = num_threads > 1 ? num_threads - 1 : 0;
+    pthread_t *threads = malloc((extra > 0 ? extra : 1) * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads != NULL && started < extra &&
+           pthread_create(&threads[started], NULL, write_thread, &writer) ==
+               0) {
+        started++;
+    }
+    write_thread(&writer);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(segments);
+    return atomic_load(&writer.failed);
+}
+
+static int get_string(const char *payload, size_t size, size_t *pos,
+                      char *dest) {
+    if (*pos + 1 > size) return 1;
+    size_t len = (unsigned char)payload[*pos];
+    *pos += 1;
+    if (len >= MAX_STRING_SIZE || *pos + len > size) return 1;
+
+    memcpy(dest, payload + *pos, len);
+    dest[len] = '\0';
+    *pos += len;
+    return 0;
+}
+
+// Checks and restores the pairs of a segment, MAX_WRITE_SIZE at a time
+static int load_segment(Loader *loader, const Segment *segment, char *payload,
+                        char keys[][MAX_STRING_SIZE],
+                        char values[][MAX_STRING_SIZE]) {
+    size_t size = segment->header.size;
+    if (read_file(loader->file, payload, size, segment->offset) != 0 ||
+        crc32c(0, payload, size) != segment->header.crc) {
+        fprintf(stderr, "Corrupted snapshot segment at offset %lld\n",
+                (long long)segment->offset);
+        return 1;
+    }
+
+    size_t pos = 0;
+    size_t batch = 0;
+    for (uint32_t i = 0; i < segment->header.count; i++) {
+        if (get_string(payload, size, &pos, keys[batch]) != 0 ||
+            get_string(payload, size, &pos, values[batch]) != 0) {
+            fprintf(stderr, "Malformed snapshot segment at offset %lld\n",
+                    (long long)segment->offset);
+            return 1;
+        }
+        if (++batch == MAX_WRITE_SIZE) {
+            if (loader->apply(batch, keys, values) != 0) return 1;
+            batch = 0;
+        }
+    }
+    if (batch > 0 && loader->apply(batch, keys, values) != 0) return 1;
+    return pos == size ? 0 : 1;
+}
+
+static void *load_thread(void *arg) {
+    Loader *loader = arg;
+    char *payload = malloc(loader->max_size);
+    char(*keys)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+    char(*values)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+    if (payload == NULL || keys == NULL || values == NULL) {
+        atomic_store(&loader->failed, 1);
+    }
+
+    while (!atomic_load(&loader->failed)) {
+        size_t i = atomic_fetch_add(&loader->next, 1);
+        if (i >= loader->num_segments) break;
+        if (load_segment(loader, &loader->segments[i], payload, keys,
+                         values) != 0) {
+            atomic_store(&loader->failed, 1);
+        }
+    }
+
+    free(payload);
+    free(keys);
+    free(values);
+    return NULL;
+}
+
+// Reads and checks the header of a snapshot
+static int read_header(const DumpFile *file, DumpHeader *header) {
+    memset(header, 0, sizeof(*header));
+    if (read_file(file, (char *)header, HEADER_SIZE(1), 0) != 0 ||
+        memcmp(header->magic, DUMP_MAGIC, sizeof(header->magic)) != 0 ||
+        (header->version != 1 && header->version != DUMP_VERSION) ||
+        (header->version != 1 &&
+         read_file(file, (char *)header, sizeof(*header), 0) != 0)) {
+        fprintf(stderr, "Not a KVS snapshot\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Finds the segments of a snapshot by reading their headers
+// @return Array of segments to be freed by the caller, NULL on failure.
+static Segment *find_segments(const DumpFile *file, size_t *num_segments,
+                              size_t *max_size) {
+    DumpHeader header;
+    if (read_header(file, &header) != 0) return NULL;
+
+    size_t capacity = 16;
+    Segment *segments = malloc(capacity * sizeof(Segment));
+    if (segments == NULL) return NULL;
+
+    *num_segments = 0;
+    *max_size = 1;
+    uint64_t pairs = 0;
+    off_t offset = (off_t)HEADER_SIZE(header.version);
+    while (offset < file->size) {
+        SegmentHeader segment;
+        if (read_file(file, (char *)&segment, sizeof(segment), offset) != 0 ||
+            segment.size > header.segment_size || segment.count == 0 ||
+            offset + (off_t)(sizeof(segment) + segment.size) > file->size) {
+            break;
+        }
+        if (*num_segments == capacity) {
+            capacity *= 2;
+            Segment *grown = realloc(segments, capacity * sizeof(Segment));
+            if (grown == NULL) {
+                free(segments);
+                return NULL;
+            }
+            segments = grown;
+        }
+        offset += (off_t)sizeof(segment);
+        segments[(*num_segments)++] = (Segment){offset, segment};
+        if (segment.size > *max_size) *max_size = segment.size;
+        pairs += segment.count;
+        offset += segment.size;
+    }
+
+    if (offset != file->size || pairs != header.num_pairs) {
+        fprintf(stderr, "Truncated KVS snapshot\n");
+        free(segments);
+        return NULL;
+    }
+    return segments;
+}
+
+long dump_count(const char *path, uint64_t *wal_offset) {
+    DumpFile file;
+    if (open_file(path, sizeof(DumpHeader), &file) != 0) return -1;
+    DumpHeader header;
+    long count =
+        read_header(&file, &header) == 0 ? (long)header.num_pairs : -1;
+    if (count >= 0 && wal_offset != NULL) *wal_offset = header.wal_offset;
+    close_file(&file);
+    return count;
+}
+
+long dump_load(const char *path, size_t num_threads, DumpApply apply) {
+    DumpFile file;
+    if (open_file(path, SIZE_MAX, &file) != 0) return -1;
+
+    size_t num_segments;
+    size_t max_size;
+    Segment *segments = find_segments(&file, &num_segments, &max_size);
+    if (segments == NULL) {
+        close_file(&file);
+        return -1;
+    }
+
+    Loader loader = {.file = &file,
+                     .segments = segments,
+                     .num_segments = num_segments,
+                     .max_size = max_size,
+                     .apply = apply};
+    atomic_init(&loader.next, 0);
+    atomic_init(&loader.failed, 0);
+
+    // The calling thread reads segments too
+    if (num_threads > num_segments) num_threads = num_segments;
+    size_t extra = num_threads > 1 ? num_threads - 1 : 0;
+    pthread_t *threads = malloc((extra > 0 ? extra : 1) * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads != NULL && started < extra &&
+           pthread_create(&threads[started], NULL, load_thread, &loader) ==
+               0) {
+        started++;
+    }
+    load_thread(&loader);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    long loaded = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        loaded += (long)segments[i].header.count;
+    }
+    free(segments);
+    close_file(&file);
+    return atomic_load(&loader.failed) ? -1 : loaded;
+}
@@ -0,0 +1,19 @@
+#include "engine.h"
+
+#include <string.h>
+
+// Available engines, the first one is the default
+static const KvsEngine *engines[] = {&chained_engine, &swiss_engine,
+                                     &splitorder_engine, &mapped_engine,
+                                     &lsm_engine};
+
+const KvsEngine *get_engine(const char *name) {
+    if (name == NULL) return engines[0];
+
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        if (strcmp(engines[i]->name, name) == 0) {
+            return engines[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Number of objects a thread retires between attempts to advance the global
+// epoch and free what is no longer reachable
+#define EPOCH_RETIRE_BATCH 64
+
+// Retired objects are kept in one list per epoch, an object retired in epoch
+// e is freed once the global epoch reaches e + 2
+#define EPOCH_LISTS 3
+
+/// Initializes epoch based reclamation. Must be called before any other
+/// function.
+void epoch_init();
+
+/// Enters a read-side critical section. Objects reachable from shared
+/// structures when it starts are not freed until epoch_exit. Critical sections
+/// cannot be nested and must not block.
+/// @return 0 on success, 1 if the thread could not be registered.
+int epoch_enter();
+
+/// Leaves the read-side critical section of the calling thread.
+void epoch_exit();
+
+/// Retires an object already unlinked from every shared structure. It is
+/// freed with free_fn once no critical section can still see it. May be
+/// called inside a critical section and never blocks: if the object cannot
+/// be recorded for lack of memory, it is leaked.
+/// @param ptr Object to be freed.
+/// @param free_fn Function that frees the object.
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/// Frees every retired object and the state of every thread. No thread may be
+/// inside a critical section.
+void epoch_destroy();
+
+#endif  // KVS_EPOCH_H
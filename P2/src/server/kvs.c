@@ -1,123 +1,588 @@
 #include "kvs.h"
 
-#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "epoch.h"
+#include "slab.h"
 #include "string.h"
-#include "subscriptions.h"
 #include "utils.h"
 
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;  // FNV offset basis
+    for (const unsigned char *c = (const unsigned char *)key; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;  // FNV prime
     }
-    return -1;  // Invalid index for non-alphabetic or number strings
+    return (size_t)h;
 }
 
-struct HashTable *create_hash_table() {
+size_t lock_index(const char *key, size_t stripes) {
+    return hash(key) & (stripes - 1);
+}
+
+// Length byte of the strings stored on the heap
+#define HEAP_STRING UCHAR_MAX
+
+// Stores str in the node buffer when it fits and on the heap otherwise.
+// Returns where str was stored, NULL on failure.
+static char *store_string(char *buffer, unsigned char *len, const char *str) {
+    size_t str_len = strlen(str);
+
+    if (str_len < MAX_STRING_SIZE) {
+        memcpy(buffer, str, str_len + 1);
+        *len = (unsigned char)str_len;
+        return buffer;
+    }
+
+    *len = HEAP_STRING;
+    return slab_strdup(str);
+}
+
+// Frees the strings of a node that did not fit inline, and the node itself
+static void free_node(void *ptr) {
+    KeyNode *keyNode = ptr;
+    if (keyNode->key != keyNode->key_buf) slab_free(keyNode->key);
+    if (keyNode->value != keyNode->value_buf) slab_free(keyNode->value);
+    slab_free(keyNode);
+}
+
+// Allocates an unlinked node holding copies of key and value
+static KeyNode *new_node(const char *key, const char *value, size_t h) {
+    KeyNode *keyNode = slab_alloc(sizeof(KeyNode));
+    if (keyNode == NULL) return NULL;
+    keyNode->key = store_string(keyNode->key_buf, &keyNode->key_len, key);
+    keyNode->value =
+        store_string(keyNode->value_buf, &keyNode->value_len, value);
+    if (keyNode->key == NULL || keyNode->value == NULL) {
+        free_node(keyNode);
+        return NULL;
+    }
+    keyNode->hash = h;
+    atomic_init(&keyNode->next, NULL);
+    atomic_init(&keyNode->version, 0);
+    return keyNode;
+}
+
+// Overwrites the value of a linked node in place. A heap value may still be
+// copied by a reader, so it is retired rather than freed.
+static int overwrite_value(KeyNode *keyNode, const char *value) {
+    size_t value_len = strlen(value);
+    char *copy = NULL;
+    if (value_len >= MAX_STRING_SIZE) {
+        copy = slab_strdup(value);
+        if (copy == NULL) return 1;
+    }
+    char *old = keyNode->value != keyNode->value_buf ? keyNode->value : NULL;
+
+    unsigned version =
+        atomic_load_explicit(&keyNode->version, memory_order_relaxed);
+    atomic_store_explicit(&keyNode->version, version + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (copy != NULL) {
+        keyNode->value = copy;
+        keyNode->value_len = HEAP_STRING;
+    } else {
+        memcpy(keyNode->value_buf, value, value_len + 1);
+        keyNode->value = keyNode->value_buf;
+        keyNode->value_len = (unsigned char)value_len;
+    }
+    atomic_store_explicit(&keyNode->version, version + 2,
+                          memory_order_release);
+
+    if (old != NULL) epoch_retire(old, slab_free);
+    return 0;
+}
+
+// Copies the value of a node, again if a writer overwrote it meanwhile. The
+// copy races with the writer by design, the version telling whether it is
+// valid, so it is left out of ThreadSanitizer.
+__attribute__((no_sanitize("thread"))) static char *copy_value(
+    KeyNode *keyNode) {
+    for (;;) {
+        unsigned version =
+            atomic_load_explicit(&keyNode->version, memory_order_acquire);
+        if (version % 2 != 0) continue;
+
+        unsigned char len = keyNode->value_len;
+        char *heap = keyNode->value;
+        // The length byte saves a strlen on inline values
+        char *value = len != HEAP_STRING ? slab_alloc(len + 1u) : NULL;
+        if (value != NULL) memcpy(value, keyNode->value_buf, len + 1u);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&keyNode->version, memory_order_relaxed) ==
+            version) {
+            // Heap values are never changed, only replaced
+            return len == HEAP_STRING ? slab_strdup(heap) : value;
+        }
+        if (value != NULL) slab_free(value);
+    }
+}
+
+// Checks if a node holds a key with the given hash and length
+static int key_matches(KeyNode *keyNode, const char *key, size_t h,
+                       size_t len) {
+    if (keyNode->hash != h) return 0;
+    if (keyNode->key_len == HEAP_STRING) {
+        return strcmp(keyNode->key, key) == 0;
+    }
+    return keyNode->key_len == len && memcmp(keyNode->key, key, len) == 0;
+}
+
+// Allocates a state with the given arrays and no bucket migrated
+static TableState *new_state(HashTable *ht, Bucket *table, size_t size,
+                             Bucket *old_table, size_t old_size) {
+    TableState *state =
+        malloc(sizeof(TableState) + ht->stripes * sizeof(atomic_size_t));
+    if (state == NULL) return NULL;
+    state->table = table;
+    state->size = size;
+    state->old_table = old_table;
+    state->old_size = old_size;
+    for (size_t i = 0; i < ht->stripes; i++) {
+        atomic_init(&state->migrated[i], 0);
+    }
+    return state;
+}
+
+// Checks if an old bucket was already copied to the new array
+static int migrated(HashTable *ht, TableState *state, size_t index) {
+    size_t done = atomic_load_explicit(
+        &state->migrated[index & (ht->stripes - 1)], memory_order_acquire);
+    return index / ht->stripes < done;
+}
+
+// Returns the bucket that holds a hash. While a resize is in progress the old
+// buckets that were not copied yet are still the authoritative ones.
+static Bucket *get_bucket(HashTable *ht, TableState *state, size_t h) {
+    if (state->old_table != NULL) {
+        size_t index = h & (state->old_size - 1);
+        if (!migrated(ht, state, index)) return &state->old_table[index];
+    }
+    return &state->table[h & (state->size - 1)];
+}
+
+// Returns the state of the table. Writers hold a lock stripe, so the state
+// is only replaced under them by resize_table, which excludes them.
+static TableState *get_state(HashTable *ht) {
+    return atomic_load_explicit(&ht->state, memory_order_acquire);
+}
+
+struct HashTable *create_hash_table(size_t stripes) {
     HashTable *ht = malloc(sizeof(HashTable));
     if (!ht) return NULL;
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        ht->table[i] = NULL;
+    ht->stripes = stripes;
+
+    Bucket *table = calloc(stripes, sizeof(Bucket));
+    TableState *state = table ? new_state(ht, table, stripes, NULL, 0) : NULL;
+    if (!state) {
+        free(table);
+        free(ht);
+        return NULL;
     }
+    atomic_init(&ht->state, state);
+    atomic_init(&ht->pending, 0);
+    atomic_init(&ht->count, 0);
+    ht->min_size = stripes;
     return ht;
 }
 
 int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+    size_t h = hash(key);
+    size_t len = strlen(key);
+
+    rehash_step(ht, h & (ht->stripes - 1));
 
-    KeyNode *keyNode = ht->table[index];
+    Bucket *bucket = get_bucket(ht, get_state(ht), h);
+    KeyNode *keyNode = atomic_load_explicit(bucket, memory_order_relaxed);
 
     // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            notify_subscribers(key, value);
-            return 0;
+        if (key_matches(keyNode, key, h, len)) {
+            // Overwrite the value in place, readers copying it retry
+            return overwrite_value(keyNode, value);
         }
-        keyNode = keyNode->next;  // Move to the next node
+        // Move to the next node
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
     }
 
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key);        // Allocate memory for the key
-    keyNode->value = strdup(value);    // Allocate memory for the value
-    keyNode->next = ht->table[index];  // Link to existing nodes
-    ht->table[index] = keyNode;  // Place new key node at the start of the list
-
-    notify_subscribers(key, value);
+    // Key not found, place a new node at the start of the list
+    KeyNode *newNode = new_node(key, value, h);
+    if (newNode == NULL) return 1;
+    atomic_init(&newNode->next,
+                atomic_load_explicit(bucket, memory_order_relaxed));
+    atomic_store_explicit(bucket, newNode, memory_order_release);
+    atomic_fetch_add(&ht->count, 1);
 
     return 0;
 }
 
 char *read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+    size_t h = hash(key);
+    size_t len = strlen(key);
 
-    KeyNode *keyNode = ht->table[index];
-    char *value;
+    Bucket *bucket = get_bucket(ht, get_state(ht), h);
+    KeyNode *keyNode = atomic_load_explicit(bucket, memory_order_acquire);
 
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-
-            return value;  // Return copy of the value if found
+        if (key_matches(keyNode, key, h, len)) {
+            return copy_value(keyNode);  // Return copy of the value if found
         }
-        keyNode = keyNode->next;  // Move to the next node
+        // Move to the next node
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
     }
 
     return NULL;  // Key not found
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+    size_t h = hash(key);
+    size_t len = strlen(key);
 
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    rehash_step(ht, h & (ht->stripes - 1));
+
+    Bucket *link = get_bucket(ht, get_state(ht), h);
+    KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
 
     // Search for the key node
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] =
-                    keyNode
-                        ->next;  // Update the table to point to the next node
-            } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next =
-                    keyNode->next;  // Link the previous node to the next node
-            }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode);  // Free the key node itself
-
-            notify_subscribers(key, "DELETED");
+        KeyNode *next = atomic_load_explicit(&keyNode->next,
+                                             memory_order_relaxed);
+        if (key_matches(keyNode, key, h, len)) {
+            // Key found; bypass it, readers on it can still move on to next
+            atomic_store_explicit(link, next, memory_order_release);
+            epoch_retire(keyNode, free_node);
+            atomic_fetch_sub(&ht->count, 1);
 
             return 0;  // Exit the function
         }
-        prevNode = keyNode;       // Move prevNode to current node
-        keyNode = keyNode->next;  // Move to the next node
+        link = &keyNode->next;
+        keyNode = next;  // Move to the next node
     }
 
     return 1;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
+void rehash_step(HashTable *ht, size_t lock) {
+    TableState *state = get_state(ht);
+    if (state->old_table == NULL) return;
+
+    // Old buckets of this stripe are lock, lock + stripes, ... and both
+    // halves of a split (or merge) land on buckets of the same stripe.
+    size_t per_lock = state->old_size / ht->stripes;
+    for (int step = 0; step < REHASH_STEP; step++) {
+        size_t done =
+            atomic_load_explicit(&state->migrated[lock], memory_order_relaxed);
+        if (done >= per_lock) return;
+        size_t index = lock + done * ht->stripes;
+
+        // Readers may still be walking the old chain, so its nodes are
+        // copied instead of moved, and all of them before any is linked so
+        // that a failed allocation leaves the bucket untouched
+        KeyNode *copies = NULL;
+        KeyNode *keyNode = atomic_load_explicit(&state->old_table[index],
+                                                memory_order_relaxed);
+        for (; keyNode != NULL;
+             keyNode = atomic_load_explicit(&keyNode->next,
+                                            memory_order_relaxed)) {
+            KeyNode *copy = new_node(keyNode->key, keyNode->value,
+                                     keyNode->hash);
+            if (copy == NULL) {
+                while (copies != NULL) {
+                    KeyNode *next = atomic_load(&copies->next);
+                    free_node(copies);
+                    copies = next;
+                }
+                return;  // Retried by the next write on this stripe
+            }
+            atomic_init(&copy->next, copies);
+            copies = copy;
+        }
+
+        while (copies != NULL) {
+            KeyNode *next = atomic_load_explicit(&copies->next,
+                                                 memory_order_relaxed);
+            Bucket *bucket = &state->table[copies->hash & (state->size - 1)];
+            atomic_init(&copies->next,
+                        atomic_load_explicit(bucket, memory_order_relaxed));
+            atomic_store_explicit(bucket, copies, memory_order_release);
+            copies = next;
+        }
+
+        // From here on readers use the copies, the old chain is left intact
+        // for the ones still on it
+        atomic_store_explicit(&state->migrated[lock], done + 1,
+                              memory_order_release);
+        keyNode = atomic_load_explicit(&state->old_table[index],
+                                       memory_order_relaxed);
         while (keyNode != NULL) {
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            KeyNode *next = atomic_load_explicit(&keyNode->next,
+                                                 memory_order_relaxed);
+            epoch_retire(keyNode, free_node);
+            keyNode = next;
         }
+        atomic_fetch_sub(&ht->pending, 1);
+    }
+}
+
+int rehash_pending(HashTable *ht) { return get_state(ht)->old_table != NULL; }
+
+int resize_needed(HashTable *ht) {
+    TableState *state = get_state(ht);
+    if (state->old_table != NULL) {
+        return atomic_load(&ht->pending) == 0;
+    }
+
+    size_t count = atomic_load(&ht->count);
+    return count > state->size * MAX_LOAD_FACTOR ||
+           (state->size > ht->min_size &&
+            count * MIN_LOAD_FACTOR < state->size);
+}
+
+void resize_table(HashTable *ht) {
+    TableState *state = get_state(ht);
+
+    if (state->old_table != NULL) {
+        if (atomic_load(&ht->pending) != 0) return;
+
+        // Every old bucket was copied, the old array can go once no reader
+        // is left on it
+        TableState *finished =
+            new_state(ht, state->table, state->size, NULL, 0);
+        if (finished == NULL) return;  // Retry later
+        atomic_store_explicit(&ht->state, finished, memory_order_release);
+        epoch_retire(state->old_table, free);
+        epoch_retire(state, free);
+        state = finished;
+    }
+
+    size_t count = atomic_load(&ht->count);
+    size_t new_size;
+    if (count > state->size * MAX_LOAD_FACTOR) {
+        new_size = state->size * 2;
+    } else if (state->size > ht->min_size &&
+               count * MIN_LOAD_FACTOR < state->size) {
+        new_size = state->size / 2;
+    } else {
+        return;
+    }
+
+    // Keep the current size and retry later on failure
+    Bucket *new_table = calloc(new_size, sizeof(Bucket));
+    if (new_table == NULL) return;
+    TableState *resized =
+        new_state(ht, new_table, new_size, state->table, state->size);
+    if (resized == NULL) {
+        free(new_table);
+        return;
     }
+
+    // The nodes are copied lazily by rehash_step
+    atomic_store(&ht->pending, state->size);
+    atomic_store_explicit(&ht->state, resized, memory_order_release);
+    epoch_retire(state, free);
+}
+
+int reserve_table(HashTable *ht, size_t count) {
+    TableState *state = get_state(ht);
+    if (state->old_table != NULL || atomic_load(&ht->count) != 0) return 1;
+
+    size_t size = state->size;
+    while (size * MAX_LOAD_FACTOR < count) size *= 2;
+    if (size == state->size) return 0;
+
+    Bucket *table = calloc(size, sizeof(Bucket));
+    TableState *reserved =
+        table != NULL ? new_state(ht, table, size, NULL, 0) : NULL;
+    if (reserved == NULL) {
+        free(table);
+        return 1;
+    }
+    atomic_store_explicit(&ht->state, reserved, memory_order_release);
+    epoch_retire(state->table, free);
+    epoch_retire(state, free);
+    ht->min_size = size;
+    return 0;
+}
+
+// Calls fn on every node of the table, skipping old buckets that were
+// already copied. The caller must exclude every writer.
+static void for_each_node(HashTable *ht, void (*fn)(KeyNode *, void *),
+                          void *arg) {
+    TableState *state = get_state(ht);
+    for (size_t i = 0; i < state->size + state->old_size; i++) {
+        Bucket *bucket;
+        if (i < state->size) {
+            bucket = &state->table[i];
+        } else if (!migrated(ht, state, i - state->size)) {
+            bucket = &state->old_table[i - state->size];
+        } else {
+            continue;
+        }
+
+        KeyNode *keyNode = atomic_load(bucket);
+        while (keyNode != NULL) {
+            KeyNode *next = atomic_load(&keyNode->next);
+            fn(keyNode, arg);
+            keyNode = next;
+        }
+    }
+}
+
+typedef struct PairList {
+    KvsPair *pairs;
+    size_t count;
+} PairList;
+
+static void append_pair(KeyNode *keyNode, void *arg) {
+    PairList *list = arg;
+    list->pairs[list->count].key = keyNode->key;
+    list->pairs[list->count].value = keyNode->value;
+    list->count++;
+}
+
+KvsPair *list_pairs(HashTable *ht, size_t *count) {
+    *count = 0;
+    size_t total = atomic_load(&ht->count);
+    if (total == 0) return NULL;
+
+    PairList list = {malloc(total * sizeof(KvsPair)), 0};
+    if (list.pairs == NULL) return NULL;
+
+    for_each_node(ht, append_pair, &list);
+
+    *count = list.count;
+    return list.pairs;
+}
+
+// Calls fn on every node of the buckets of a lock stripe. The caller holds
+// the stripe, so that rehash_step does not move its nodes meanwhile.
+static void for_each_stripe_node(HashTable *ht, size_t lock,
+                                 void (*fn)(KeyNode *, void *), void *arg) {
+    TableState *state = get_state(ht);
+    for (size_t i = lock; i < state->size + state->old_size;
+         i += ht->stripes) {
+        Bucket *bucket;
+        if (i < state->size) {
+            bucket = &state->table[i];
+        } else if (!migrated(ht, state, i - state->size)) {
+            bucket = &state->old_table[i - state->size];
+        } else {
+            continue;
+        }
+
+        for (KeyNode *keyNode = atomic_load(bucket); keyNode != NULL;
+             keyNode = atomic_load(&keyNode->next)) {
+            fn(keyNode, arg);
+        }
+    }
+}
+
+static void count_node(KeyNode *keyNode, void *arg) {
+    (void)keyNode;
+    (*(size_t *)arg)++;
+}
+
+KvsPair *list_stripe(HashTable *ht, size_t lock, size_t *count) {
+    size_t total = 0;
+    for_each_stripe_node(ht, lock, count_node, &total);
+
+    *count = 0;
+    if (total == 0) return NULL;
+
+    PairList list = {malloc(total * sizeof(KvsPair)), 0};
+    if (list.pairs == NULL) return NULL;
+
+    for_each_stripe_node(ht, lock, append_pair, &list);
+
+    *count = list.count;
+    return list.pairs;
+}
+
+static void free_each_node(KeyNode *keyNode, void *arg) {
+    (void)arg;
+    free_node(keyNode);
+}
+
+void free_table(HashTable *ht) {
+    for_each_node(ht, free_each_node, NULL);
+    drop_table(ht);
+}
+
+void drop_table(HashTable *ht) {
+    TableState *state = get_state(ht);
+    free(state->table);
+    free(state->old_table);
+    free(state);
     free(ht);
-}
\ No newline at end of file
+}
+
+static void *chained_create_table(size_t stripes) {
+    return create_hash_table(stripes);
+}
+
+static int chained_write_pair(void *table, const char *key,
+                              const char *value) {
+    return write_pair(table, key, value);
+}
+
+static char *chained_read_pair(void *table, const char *key) {
+    return read_pair(table, key);
+}
+
+static int chained_delete_pair(void *table, const char *key) {
+    return delete_pair(table, key);
+}
+
+static int chained_rehash_pending(void *table) {
+    return rehash_pending(table);
+}
+
+static void chained_rehash_step(void *table, size_t lock) {
+    rehash_step(table, lock);
+}
+
+static int chained_resize_needed(void *table) { return resize_needed(table); }
+
+static void chained_resize_table(void *table) { resize_table(table); }
+
+static int chained_reserve(void *table, size_t count) {
+    return reserve_table(table, count);
+}
+
+static KvsPair *chained_list_pairs(void *table, size_t *count) {
+    return list_pairs(table, count);
+}
+
+static KvsPair *chained_list_stripe(void *table, size_t lock,
+                                    size_t *count) {
+    return list_stripe(table, lock, count);
+}
+
+static void chained_free_table(void *table) { free_table(table); }
+
+static void chained_drop_table(void *table) { drop_table(table); }
+
+const KvsEngine chained_engine = {
+    .name = "chained",
+    .create_table = chained_create_table,
+    .write_pair = chained_write_pair,
+    .read_pair = chained_read_pair,
+    .delete_pair = chained_delete_pair,
+    .rehash_pending = chained_rehash_pending,
+    .rehash_step = chained_rehash_step,
+    .resize_needed = chained_resize_needed,
+    .resize_table = chained_resize_table,
+    .reserve = chained_reserve,
+    .list_pairs = chained_list_pairs,
+    .list_stripe = chained_list_stripe,
+    .free_table = chained_free_table,
+    .drop_table = chained_drop_table,
+    .throttle_writes = NULL,
+    .lockfree_reads = 1,
+    .lockfree_writes = 0,
+    .write_batch = NULL,
+};
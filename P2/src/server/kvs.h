@@ -1,55 +1,167 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+// The table grows when it holds more than MAX_LOAD_FACTOR keys per bucket and
+// shrinks when it holds less than one key per MIN_LOAD_FACTOR buckets.
+#define MAX_LOAD_FACTOR 1
+#define MIN_LOAD_FACTOR 8
 
-#include <pthread.h>
+// Number of old buckets moved to the new array by each write or delete while
+// a resize is in progress.
+#define REHASH_STEP 2
+
+#include <stdatomic.h>
 #include <stddef.h>
 
+#include "constants.h"
+#include "engine.h"
+
+// Strings shorter than MAX_STRING_SIZE (every key and value accepted by the
+// parser) are stored inside the node, longer ones on the heap. key and value
+// point to whichever buffer holds the string.
+// Readers walk the chains without locks, so unlinked nodes and replaced heap
+// values are freed through epoch_retire. Writers overwrite a value in place,
+// making version odd meanwhile, and readers retry a copy that overlapped a
+// change of version.
 typedef struct KeyNode {
     char *key;
     char *value;
-    struct KeyNode *next;
+    size_t hash;  // Cached hash of the key
+    _Atomic(struct KeyNode *) next;
+    atomic_uint version;      // Odd while the value is being overwritten
+    unsigned char key_len;    // Length of the key, if stored inline
+    unsigned char value_len;  // Length of the value, if stored inline
+    char key_buf[MAX_STRING_SIZE];
+    char value_buf[MAX_STRING_SIZE];
 } KeyNode;
 
+typedef _Atomic(KeyNode *) Bucket;
+
+// Bucket arrays of the table. A resize publishes a new state instead of
+// modifying the current one, so that a reader always sees a consistent pair
+// of arrays.
+typedef struct TableState {
+    // Current bucket array
+    Bucket *table;
+    size_t size;
+    // Bucket array being drained during a resize, NULL otherwise
+    Bucket *old_table;
+    size_t old_size;
+    // Number of old buckets already copied to table, per stripe
+    atomic_size_t migrated[];
+} TableState;
+
+// The initial (and minimum) number of buckets is the number of lock stripes:
+// bucket i is protected by stripe i % stripes, and since the bucket count is
+// always stripes * 2^k a bucket never changes stripe when the table is
+// resized.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    // Locks for each bucket
-    pthread_rwlock_t mutex[TABLE_SIZE];
-    // Lock for the whole table
-    pthread_rwlock_t htMutex;
+    // Number of lock stripes, a power of two
+    size_t stripes;
+    _Atomic(TableState *) state;
+    // Number of old buckets still to be moved
+    atomic_size_t pending;
+    // Number of keys stored
+    atomic_size_t count;
+    // Size below which the table does not shrink, see reserve_table
+    size_t min_size;
 } HashTable;
 
 /// Creates a new event hash table.
+/// @param stripes Number of lock stripes, a power of two.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(size_t stripes);
 
-/// Hash function based on key initial.
-/// @param key Lowercase alphabetical string.
+/// Hash function over the whole key (64-bit FNV-1a).
+/// @param key Key to be hashed.
 /// @return hash.
-int hash(const char *key);
+size_t hash(const char *key);
+
+/// Index of the lock stripe that protects a key.
+/// @param key Key to be locked.
+/// @param stripes Number of lock stripes, a power of two.
+/// @return Stripe index, between 0 and stripes - 1.
+size_t lock_index(const char *key, size_t stripes);
 
 /// Appends a new key value pair to the hash table.
+/// The caller must hold the lock stripe of the key for writing.
 /// @param ht Hash table to be modified.
 /// @param key Key of the pair to be written.
 /// @param value Value of the pair to be written.
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
+/// Reads the value of given key.
+/// The caller must hold the lock stripe of the key or be inside an epoch
+/// (see epoch_enter).
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value to be freed with slab_free, NULL if the key does
+/// not exist.
+char *read_pair(HashTable *ht, const char *key);
+
 /// Deletes the value of given key.
+/// The caller must hold the lock stripe of the key for writing.
 /// @param ht Hash table to delete from.
 /// @param key Key of the pair to be deleted.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-char *read_pair(HashTable *ht, const char *key);
-
-/// Appends a new node to the list.
-/// @param list Event list to be modified.
-/// @param key Key of the pair to read.
-/// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
-/// Frees the hashtable.
+/// Checks if a resize is moving buckets.
+/// The caller must hold htMutex.
+/// @param ht Hash table to check.
+/// @return 1 if old buckets remain to be moved, 0 otherwise.
+int rehash_pending(HashTable *ht);
+
+/// Moves up to REHASH_STEP old buckets of a stripe to the new bucket array.
+/// The caller must hold the given lock stripe for writing.
+/// @param ht Hash table being resized.
+/// @param lock Index of the lock stripe held.
+void rehash_step(HashTable *ht, size_t lock);
+
+/// Checks if the table must start or finish a resize.
+/// The caller must hold htMutex.
+/// @param ht Hash table to check.
+/// @return 1 if resize_table should be called, 0 otherwise.
+int resize_needed(HashTable *ht);
+
+/// Starts a resize if the load factor is out of bounds, or releases the old
+/// bucket array once every bucket was moved. Only allocates, never rehashes.
+/// The caller must hold htMutex for writing.
+/// @param ht Hash table to resize.
+void resize_table(HashTable *ht);
+
+/// Grows an empty table to hold a number of keys without resizing, for a
+/// bulk load, and keeps it from shrinking below that size.
+/// The caller must hold htMutex for writing.
+/// @param ht Hash table to grow.
+/// @param count Number of keys expected.
+/// @return 0 if the table was grown, 1 if it is not empty or on failure.
+int reserve_table(HashTable *ht, size_t count);
+
+/// Lists every pair of the table, in no particular order.
+/// The caller must hold htMutex for writing.
+/// @param ht Hash table to list.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *list_pairs(HashTable *ht, size_t *count);
+
+/// Lists the pairs of the buckets of a lock stripe, in no particular order.
+/// The caller must hold htMutex and the lock stripe.
+/// @param ht Hash table to list.
+/// @param lock Index of the lock stripe held.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *list_stripe(HashTable *ht, size_t lock, size_t *count);
+
+/// Frees the hashtable. Retired objects are left to epoch_destroy.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
+/// Frees the bucket arrays of the hashtable but not its nodes, which are
+/// released all at once by slab_destroy. Retired objects are left to
+/// epoch_destroy.
+/// @param ht Hash table to be deleted.
+void drop_table(HashTable *ht);
+
 #endif  // KVS_H
@@ -0,0 +1,925 @@
+#include "lsm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "kvs.h"
+#include "slab.h"
+#include "utils.h"
+
+// Length of the value of a deleted key in a block
+#define LSM_TOMBSTONE 0xFF
+
+// Probes of the bloom filter per key, about LSM_BLOOM_BITS * ln 2
+#define LSM_BLOOM_HASHES 7
+
+_Static_assert(MAX_STRING_SIZE < LSM_TOMBSTONE,
+               "string lengths must fit in a byte below LSM_TOMBSTONE");
+
+// Largest record of a pair
+#define MAX_RECORD_SIZE (2 + 2 * MAX_STRING_SIZE)
+
+// Result of a lookup
+enum { LSM_MISSING, LSM_FOUND, LSM_DELETED };
+
+// Ids of the runs, shared by the tables of the shards
+static _Atomic uint64_t next_run_id = 1;
+
+// Sorted pairs merged by merge_sources: the pairs of a memtable or a run,
+// read one block at a time
+typedef struct Source {
+    const KvsPair *pairs;  // Pairs of a memtable, NULL for a run
+    size_t num_pairs;
+    const LsmRun *run;
+    size_t next;  // Next pair or block
+    char block[LSM_BLOCK_SIZE];
+    size_t block_size;
+    size_t pos;  // Next record in block
+    int valid;   // 0 once every pair was read
+    const char *key;
+    const char *value;  // NULL for a deleted key
+    char key_buffer[MAX_STRING_SIZE];
+    char value_buffer[MAX_STRING_SIZE];
+} Source;
+
+// Called by merge_sources for each key, with value NULL if it is deleted.
+// Returns 0 on success, 1 to stop the merge.
+typedef int (*MergeEmit)(void *ctx, const char *key, const char *value);
+
+// Run being written, one block at a time
+typedef struct RunWriter {
+    LsmRun *run;
+    size_t capacity;  // Blocks the fences and offsets have room for
+    char block[LSM_BLOCK_SIZE];
+    size_t size;  // Bytes in block
+    uint64_t offset;  // Offset of block in the file
+} RunWriter;
+
+// Keys and values collected by lsm_list_pairs
+typedef struct Listing {
+    char (*strings)[MAX_STRING_SIZE];
+    size_t count;     // Number of pairs
+    size_t capacity;  // Pairs strings has room for
+} Listing;
+
+static LsmMemtable *create_memtable(size_t stripes) {
+    LsmMemtable *mt = malloc(sizeof(LsmMemtable));
+    if (mt == NULL) return NULL;
+
+    mt->pairs = swiss_create_table(stripes);
+    mt->deleted = swiss_create_table(stripes);
+    if (mt->pairs == NULL || mt->deleted == NULL) {
+        if (mt->pairs != NULL) swiss_free_table(mt->pairs);
+        if (mt->deleted != NULL) swiss_free_table(mt->deleted);
+        free(mt);
+        return NULL;
+    }
+    return mt;
+}
+
+static void free_memtable(LsmMemtable *mt) {
+    if (mt == NULL) return;
+    swiss_free_table(mt->pairs);
+    swiss_free_table(mt->deleted);
+    free(mt);
+}
+
+// Looks a key up in a memtable, copying its value to value if found
+static int memtable_lookup(LsmMemtable *mt, const char *key, char *value) {
+    char *found = swiss_read_pair(mt->pairs, key);
+    if (found != NULL) {
+        strcpy(value, found);
+        slab_free(found);
+        return LSM_FOUND;
+    }
+
+    found = swiss_read_pair(mt->deleted, key);
+    if (found != NULL) {
+        slab_free(found);
+        return LSM_DELETED;
+    }
+    return LSM_MISSING;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(((const KvsPair *)a)->key, ((const KvsPair *)b)->key);
+}
+
+static size_t swiss_count(const SwissTable *st) {
+    size_t count = 0;
+    for (size_t i = 0; i < st->num_shards; i++) {
+        count += st->shards[i].count;
+    }
+    return count;
+}
+
+// Lists the pairs and the deleted keys of a memtable sorted by key, with a
+// NULL value for the deleted ones
+// @return Array to be freed by the caller, NULL if empty or on failure,
+// which sets failed.
+static KvsPair *sort_memtable(LsmMemtable *mt, size_t *count, int *failed) {
+    size_t num_pairs = swiss_count(mt->pairs);
+    size_t num_deleted = swiss_count(mt->deleted);
+    *count = 0;
+    if (num_pairs + num_deleted == 0) return NULL;
+
+    KvsPair *sorted = malloc((num_pairs + num_deleted) * sizeof(KvsPair));
+    size_t listed;
+    KvsPair *pairs = swiss_list_pairs(mt->pairs, &listed);
+    KvsPair *deleted = swiss_list_pairs(mt->deleted, &listed);
+    if (sorted == NULL || (num_pairs > 0 && pairs == NULL) ||
+        (num_deleted > 0 && deleted == NULL)) {
+        free(sorted);
+        free(pairs);
+        free(deleted);
+        *failed = 1;
+        return NULL;
+    }
+
+    if (num_pairs > 0) memcpy(sorted, pairs, num_pairs * sizeof(KvsPair));
+    for (size_t i = 0; i < num_deleted; i++) {
+        sorted[num_pairs + i] = (KvsPair){deleted[i].key, NULL};
+    }
+    free(pairs);
+    free(deleted);
+
+    *count = num_pairs + num_deleted;
+    qsort(sorted, *count, sizeof(KvsPair), compare_keys);
+    return sorted;
+}
+
+// Decodes the record at *pos of a block, value is empty for a deleted key
+static int decode_record(const char *data, size_t size, size_t *pos,
+                         char *key, char *value, int *deleted) {
+    if (*pos + 1 > size) return 1;
+    size_t len = (unsigned char)data[*pos];
+    if (len >= MAX_STRING_SIZE || *pos + 2 + len > size) return 1;
+    memcpy(key, data + *pos + 1, len);
+    key[len] = '\0';
+    *pos += 1 + len;
+
+    len = (unsigned char)data[*pos];
+    *pos += 1;
+    *deleted = len == LSM_TOMBSTONE;
+    if (*deleted) {
+        value[0] = '\0';
+        return 0;
+    }
+    if (len >= MAX_STRING_SIZE || *pos + len > size) return 1;
+    memcpy(value, data + *pos, len);
+    value[len] = '\0';
+    *pos += len;
+    return 0;
+}
+
+// Looks a key up in a block, whose records are sorted by key
+static int search_block(const char *data, size_t size, const char *key,
+                        char *value) {
+    char found[MAX_STRING_SIZE];
+    size_t pos = 0;
+    while (pos < size) {
+        int deleted;
+        if (decode_record(data, size, &pos, found, value, &deleted) != 0) {
+            fprintf(stderr, "Malformed LSM run block\n");
+            return LSM_MISSING;
+        }
+        int cmp = strcmp(found, key);
+        if (cmp == 0) return deleted ? LSM_DELETED : LSM_FOUND;
+        if (cmp > 0) break;
+    }
+    return LSM_MISSING;
+}
+
+// Bit i of the filter is checked or set for the i-th probe of a hash, the
+// probes being derived from its two halves (double hashing)
+static size_t bloom_bit(const LsmRun *run, uint64_t h, size_t i) {
+    uint64_t step = (h >> 32 | h << 32) | 1;
+    return (size_t)((h + i * step) % run->bloom_bits);
+}
+
+static void bloom_add(LsmRun *run, uint64_t h) {
+    for (size_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+        size_t bit = bloom_bit(run, h, i);
+        run->bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+static int bloom_contains(const LsmRun *run, uint64_t h) {
+    for (size_t i = 0; i < LSM_BLOOM_HASHES; i++) {
+        size_t bit = bloom_bit(run, h, i);
+        if (!(run->bloom[bit / 64] & ((uint64_t)1 << (bit % 64)))) return 0;
+    }
+    return 1;
+}
+
+// Looks a key up in a run: the bloom filter rules most missing keys out, and
+// the fence pointers give the only block that may hold the key, read from
+// the cache or from the file
+static int run_lookup(LsmTable *lt, const LsmRun *run, const char *key,
+                      uint64_t h, char *value) {
+    if (!bloom_contains(run, h)) return LSM_MISSING;
+
+    // First block whose first key is greater than key
+    size_t low = 0;
+    size_t high = run->num_blocks;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(run->fences[mid], key) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) return LSM_MISSING;
+    size_t block = low - 1;
+
+    size_t slot = (size_t)((run->id * 0x9E3779B97F4A7C15ULL + block) %
+                           LSM_CACHE_BLOCKS);
+    LsmCachedBlock *cached = &lt->cache[slot];
+    KvsMutex *lock = &lt->cache_locks[slot % LSM_CACHE_LOCKS];
+    mutex_lock(lock);
+    if (cached->run == run->id && cached->block == block) {
+        int result = search_block(cached->data, cached->size, key, value);
+        mutex_unlock(lock);
+        return result;
+    }
+    mutex_unlock(lock);
+
+    char data[LSM_BLOCK_SIZE];
+    size_t size = (size_t)(run->offsets[block + 1] - run->offsets[block]);
+    if (pread_fully(run->fd, data, size, (off_t)run->offsets[block]) != 0) {
+        perror("Failed to read an LSM run");
+        return LSM_MISSING;
+    }
+    int result = search_block(data, size, key, value);
+
+    mutex_lock(lock);
+    cached->run = run->id;
+    cached->block = block;
+    cached->size = size;
+    memcpy(cached->data, data, size);
+    mutex_unlock(lock);
+    return result;
+}
+
+// Finds a key in the memtables and then in the runs, newest first, copying
+// its value to value if found. The caller holds the lock stripe of the key.
+static int lookup(LsmTable *lt, const char *key, char *value) {
+    int result = memtable_lookup(lt->active, key, value);
+    if (result != LSM_MISSING) return result;
+
+    uint64_t h = hash(key);
+    rwl_rdlock(&lt->version_lock);
+    if (lt->immutable != NULL) {
+        result = memtable_lookup(lt->immutable, key, value);
+    }
+    for (size_t i = 0; i < lt->num_l0 && result == LSM_MISSING; i++) {
+        result = run_lookup(lt, lt->l0[i], key, h, value);
+    }
+    for (size_t i = 1; i < LSM_MAX_LEVELS && result == LSM_MISSING; i++) {
+        if (lt->levels[i] != NULL) {
+            result = run_lookup(lt, lt->levels[i], key, h, value);
+        }
+    }
+    rwl_unlock(&lt->version_lock);
+    return result;
+}
+
+// Moves a source to its next pair, clearing valid after the last one
+static int source_next(Source *src) {
+    if (src->pairs != NULL) {
+        if (src->next == src->num_pairs) {
+            src->valid = 0;
+            return 0;
+        }
+        src->key = src->pairs[src->next].key;
+        src->value = src->pairs[src->next].value;
+        src->next++;
+        return 0;
+    }
+
+    if (src->pos == src->block_size) {
+        const LsmRun *run = src->run;
+        if (src->next == run->num_blocks) {
+            src->valid = 0;
+            return 0;
+        }
+        src->block_size =
+            (size_t)(run->offsets[src->next + 1] - run->offsets[src->next]);
+        if (pread_fully(run->fd, src->block, src->block_size,
+                        (off_t)run->offsets[src->next]) != 0) {
+            perror("Failed to read an LSM run");
+            return 1;
+        }
+        src->next++;
+        src->pos = 0;
+    }
+
+    int deleted;
+    if (decode_record(src->block, src->block_size, &src->pos,
+                      src->key_buffer, src->value_buffer, &deleted) != 0) {
+        fprintf(stderr, "Malformed LSM run block\n");
+        return 1;
+    }
+    src->key = src->key_buffer;
+    src->value = deleted ? NULL : src->value_buffer;
+    return 0;
+}
+
+// Starts a source on sorted pairs of a memtable, or on a run if pairs is NULL
+static int open_source(Source *src, const KvsPair *pairs, size_t num_pairs,
+                       const LsmRun *run) {
+    src->pairs = pairs;
+    src->num_pairs = num_pairs;
+    src->run = run;
+    src->next = 0;
+    src->block_size = 0;
+    src->pos = 0;
+    src->valid = 1;
+    return source_next(src);
+}
+
+// Merges sorted sources, the first ones being the newest: each key is
+// emitted once, with its value in the first source that has it. Deleted keys
+// are left out if drop_deleted is set.
+static int merge_sources(Source *sources, size_t num_sources,
+                         int drop_deleted, MergeEmit emit, void *ctx) {
+    for (;;) {
+        size_t first = num_sources;
+        for (size_t i = 0; i < num_sources; i++) {
+            if (sources[i].valid &&
+                (first == num_sources ||
+                 strcmp(sources[i].key, sources[first].key) < 0)) {
+                first = i;
+            }
+        }
+        if (first == num_sources) return 0;
+
+        Source *newest = &sources[first];
+        if ((newest->value != NULL || !drop_deleted) &&
+            emit(ctx, newest->key, newest->value) != 0) {
+            return 1;
+        }
+
+        // The older values of the key are skipped before newest moves on
+        for (size_t i = first + 1; i < num_sources; i++) {
+            if (sources[i].valid && strcmp(sources[i].key, newest->key) == 0 &&
+                source_next(&sources[i]) != 0) {
+                return 1;
+            }
+        }
+        if (source_next(newest) != 0) return 1;
+    }
+}
+
+static void free_run(LsmRun *run) {
+    if (run == NULL) return;
+    close(run->fd);
+    free(run->fences);
+    free(run->offsets);
+    free(run->bloom);
+    free(run);
+}
+
+// Creates the file of a new run, unlinked at once so that it goes away with
+// its descriptor, and a bloom filter sized for max_pairs
+static LsmRun *create_run(LsmTable *lt, size_t max_pairs) {
+    LsmRun *run = calloc(1, sizeof(LsmRun));
+    if (run == NULL) return NULL;
+    run->id = atomic_fetch_add(&next_run_id, 1);
+    run->bloom_bits = (max_pairs * LSM_BLOOM_BITS + 63) / 64 * 64;
+    if (run->bloom_bits == 0) run->bloom_bits = 64;
+    run->bloom = calloc(run->bloom_bits / 64, sizeof(uint64_t));
+
+    char path[MAX_JOB_FILE_NAME_SIZE];
+    int len = snprintf(path, sizeof(path), "%s/run-%ld-%llu.lsm", lt->dir,
+                       (long)getpid(), (unsigned long long)run->id);
+    if (run->bloom == NULL || len < 0 || (size_t)len >= sizeof(path)) {
+        free(run->bloom);
+        free(run);
+        return NULL;
+    }
+
+    run->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (run->fd == -1) {
+        perror("Failed to create an LSM run");
+        free(run->bloom);
+        free(run);
+        return NULL;
+    }
+    unlink(path);
+    return run;
+}
+
+static int writer_flush(RunWriter *writer) {
+    if (writer->size == 0) return 0;
+    if (pwrite_fully(writer->run->fd, writer->block, writer->size,
+                     (off_t)writer->offset) != 0) {
+        perror("Failed to write an LSM run");
+        return 1;
+    }
+    writer->offset += writer->size;
+    writer->run->num_blocks++;
+    writer->size = 0;
+    return 0;
+}
+
+static void put_string(char *block, size_t *pos, const char *str) {
+    size_t len = strnlen(str, MAX_STRING_SIZE - 1);
+    block[*pos] = (char)len;
+    memcpy(block + *pos + 1, str, len);
+    *pos += 1 + len;
+}
+
+// Appends a pair to the run, starting a new block when it does not fit
+static int writer_add(void *ctx, const char *key, const char *value) {
+    RunWriter *writer = ctx;
+    LsmRun *run = writer->run;
+
+    if (writer->size + MAX_RECORD_SIZE > LSM_BLOCK_SIZE &&
+        writer_flush(writer) != 0) {
+        return 1;
+    }
+    if (writer->size == 0) {
+        // Room for the offset after the last block too
+        if (run->num_blocks + 2 > writer->capacity) {
+            size_t capacity = writer->capacity * 2;
+            char(*fences)[MAX_STRING_SIZE] =
+                realloc(run->fences, capacity * MAX_STRING_SIZE);
+            if (fences != NULL) run->fences = fences;
+            uint64_t *offsets =
+                realloc(run->offsets, capacity * sizeof(uint64_t));
+            if (offsets != NULL) run->offsets = offsets;
+            if (fences == NULL || offsets == NULL) return 1;
+            writer->capacity = capacity;
+        }
+        strcpy(run->fences[run->num_blocks], key);
+        run->offsets[run->num_blocks] = writer->offset;
+    }
+
+    put_string(writer->block, &writer->size, key);
+    if (value == NULL) {
+        writer->block[writer->size++] = (char)LSM_TOMBSTONE;
+    } else {
+        put_string(writer->block, &writer->size, value);
+    }
+    bloom_add(run, hash(key));
+    run->num_pairs++;
+    return 0;
+}
+
+// Writes the merge of sources to a new run
+// @return 0 on success, with run NULL if every key was left out, 1 on
+// failure.
+static int write_run(LsmTable *lt, Source *sources, size_t num_sources,
+                     size_t max_pairs, int drop_deleted, LsmRun **run) {
+    RunWriter *writer = malloc(sizeof(RunWriter));
+    if (writer == NULL) return 1;
+    writer->run = create_run(lt, max_pairs);
+    writer->capacity = 16;
+    writer->size = 0;
+    writer->offset = 0;
+    if (writer->run == NULL) {
+        free(writer);
+        return 1;
+    }
+    writer->run->fences = malloc(writer->capacity * MAX_STRING_SIZE);
+    writer->run->offsets = malloc(writer->capacity * sizeof(uint64_t));
+
+    int result = writer->run->fences == NULL ||
+                 writer->run->offsets == NULL ||
+                 merge_sources(sources, num_sources, drop_deleted,
+                               writer_add, writer) != 0 ||
+                 writer_flush(writer) != 0;
+    *run = writer->run;
+    if (result == 0) {
+        (*run)->offsets[(*run)->num_blocks] = writer->offset;
+    }
+    if (result != 0 || (*run)->num_pairs == 0) {
+        free_run(*run);
+        *run = NULL;
+    }
+    free(writer);
+    return result;
+}
+
+// Checks if no level below the given one holds a run, so that a merge into
+// it may leave the deleted keys out
+static int is_bottom(const LsmTable *lt, size_t level) {
+    for (size_t i = level + 1; i < LSM_MAX_LEVELS; i++) {
+        if (lt->levels[i] != NULL) return 0;
+    }
+    return 1;
+}
+
+// Writes the immutable memtable to a run. Only called by the table thread.
+static int flush_memtable(LsmTable *lt, LsmMemtable *mt, LsmRun **run) {
+    size_t count;
+    int failed = 0;
+    KvsPair *pairs = sort_memtable(mt, &count, &failed);
+    *run = NULL;
+    if (failed) return 1;
+    if (count == 0) return 0;
+
+    Source *src = malloc(sizeof(Source));
+    int result = src == NULL || open_source(src, pairs, count, NULL) != 0 ||
+                 write_run(lt, src, 1, count,
+                           lt->num_l0 == 0 && is_bottom(lt, 0), run) != 0;
+    free(src);
+    free(pairs);
+    return result;
+}
+
+// Level to compact into the next one, -1 if none is full
+static int full_level(const LsmTable *lt) {
+    if (lt->num_l0 >= LSM_L0_RUNS) return 0;
+
+    size_t capacity = lt->memtable_size * LSM_L0_RUNS;
+    for (size_t i = 1; i + 1 < LSM_MAX_LEVELS; i++) {
+        if (lt->levels[i] != NULL && lt->levels[i]->num_pairs > capacity) {
+            return (int)i;
+        }
+        capacity *= LSM_LEVEL_RATIO;
+    }
+    return -1;
+}
+
+// Merges a level with the next one. Level 0 is merged as a whole, its runs
+// overlapping. Only called by the table thread.
+static int compact(LsmTable *lt, size_t level) {
+    LsmRun *inputs[LSM_L0_MAX_RUNS + 1];
+    size_t num_inputs = 0;
+    if (level == 0) {
+        for (size_t i = 0; i < lt->num_l0; i++) {
+            inputs[num_inputs++] = lt->l0[i];
+        }
+    } else {
+        inputs[num_inputs++] = lt->levels[level];
+    }
+    if (lt->levels[level + 1] != NULL) {
+        inputs[num_inputs++] = lt->levels[level + 1];
+    }
+
+    Source *sources = malloc(num_inputs * sizeof(Source));
+    if (sources == NULL) return 1;
+    size_t max_pairs = 0;
+    int result = 0;
+    for (size_t i = 0; i < num_inputs && result == 0; i++) {
+        max_pairs += inputs[i]->num_pairs;
+        result = open_source(&sources[i], NULL, 0, inputs[i]);
+    }
+    LsmRun *run = NULL;
+    if (result == 0) {
+        result = write_run(lt, sources, num_inputs, max_pairs,
+                           is_bottom(lt, level + 1), &run);
+    }
+    free(sources);
+    if (result != 0) return 1;
+
+    rwl_wrlock(&lt->version_lock);
+    if (level == 0) {
+        lt->num_l0 = 0;
+    } else {
+        lt->levels[level] = NULL;
+    }
+    lt->levels[level + 1] = run;
+    rwl_unlock(&lt->version_lock);
+
+    for (size_t i = 0; i < num_inputs; i++) {
+        free_run(inputs[i]);
+    }
+    return 0;
+}
+
+// Flushes the memtables handed over by lsm_rotate and compacts the full
+// levels. A flush comes first, since writers may be waiting for it, unless
+// level 0 holds LSM_L0_MAX_RUNS runs and must be compacted first.
+static void *lsm_thread(void *arg) {
+    LsmTable *lt = arg;
+
+    pthread_mutex_lock(&lt->mutex);
+    while (!lt->stop) {
+        int failed = atomic_load(&lt->failed);
+        int level = failed ? -1 : full_level(lt);
+        if (lt->immutable != NULL && !failed &&
+            lt->num_l0 < LSM_L0_MAX_RUNS) {
+            LsmMemtable *mt = lt->immutable;
+            LsmRun *run;
+            pthread_mutex_unlock(&lt->mutex);
+            int result = flush_memtable(lt, mt, &run);
+            pthread_mutex_lock(&lt->mutex);
+
+            if (result != 0) {
+                // The memtable stays readable, the next ones are not flushed
+                fprintf(stderr, "Failed to flush an LSM memtable\n");
+                atomic_store(&lt->failed, 1);
+            } else {
+                rwl_wrlock(&lt->version_lock);
+                if (run != NULL) {
+                    memmove(&lt->l0[1], &lt->l0[0],
+                            lt->num_l0 * sizeof(LsmRun *));
+                    lt->l0[0] = run;
+                    lt->num_l0++;
+                }
+                lt->immutable = NULL;
+                rwl_unlock(&lt->version_lock);
+                atomic_store(&lt->flushing, 0);
+                free_memtable(mt);
+            }
+            pthread_cond_broadcast(&lt->flushed);
+        } else if (level >= 0) {
+            pthread_mutex_unlock(&lt->mutex);
+            int result = compact(lt, (size_t)level);
+            pthread_mutex_lock(&lt->mutex);
+            if (result != 0) {
+                fprintf(stderr, "Failed to compact LSM level %d\n", level);
+                atomic_store(&lt->failed, 1);
+                pthread_cond_broadcast(&lt->flushed);
+            }
+        } else {
+            pthread_cond_wait(&lt->work, &lt->mutex);
+        }
+    }
+    pthread_mutex_unlock(&lt->mutex);
+    return NULL;
+}
+
+LsmTable *lsm_create_table(const char *dir, size_t memtable_size,
+                           size_t stripes) {
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Invalid LSM directory %s\n", dir);
+        return NULL;
+    }
+
+    LsmTable *lt = calloc(1, sizeof(LsmTable));
+    if (lt == NULL) return NULL;
+    lt->active = create_memtable(stripes);
+    lt->dir = strdup(dir);
+    lt->cache = calloc(LSM_CACHE_BLOCKS, sizeof(LsmCachedBlock));
+    if (lt->active == NULL || lt->dir == NULL || lt->cache == NULL) {
+        free_memtable(lt->active);
+        free(lt->dir);
+        free(lt->cache);
+        free(lt);
+        return NULL;
+    }
+    atomic_init(&lt->updates, 0);
+    atomic_init(&lt->failed, 0);
+    atomic_init(&lt->flushing, 0);
+    lt->memtable_size = memtable_size;
+    lt->stripes = stripes;
+
+    rwl_init(&lt->version_lock);
+    for (size_t i = 0; i < LSM_CACHE_LOCKS; i++) {
+        mutex_init(&lt->cache_locks[i]);
+    }
+    pthread_mutex_init(&lt->mutex, NULL);
+    pthread_cond_init(&lt->work, NULL);
+    pthread_cond_init(&lt->flushed, NULL);
+
+    if (pthread_create(&lt->thread, NULL, lsm_thread, lt) != 0) {
+        fprintf(stderr, "Failed to start the LSM thread\n");
+        lt->stop = 1;
+        lsm_free_table(lt);
+        return NULL;
+    }
+    return lt;
+}
+
+int lsm_write_pair(LsmTable *lt, const char *key, const char *value) {
+    if (swiss_write_pair(lt->active->pairs, key, value) != 0) return 1;
+    swiss_delete_pair(lt->active->deleted, key);
+    atomic_fetch_add(&lt->updates, 1);
+    return 0;
+}
+
+char *lsm_read_pair(LsmTable *lt, const char *key) {
+    char value[MAX_STRING_SIZE];
+    if (lookup(lt, key, value) != LSM_FOUND) return NULL;
+    return slab_strdup(value);
+}
+
+int lsm_delete_pair(LsmTable *lt, const char *key) {
+    char value[MAX_STRING_SIZE];
+    if (lookup(lt, key, value) != LSM_FOUND) return 1;
+
+    // The key is marked before it leaves pairs, so that a failure leaves it
+    // in place
+    if (swiss_write_pair(lt->active->deleted, key, "") != 0) return 1;
+    swiss_delete_pair(lt->active->pairs, key);
+    atomic_fetch_add(&lt->updates, 1);
+    return 0;
+}
+
+int lsm_rotate_needed(LsmTable *lt) {
+    return atomic_load(&lt->updates) >= lt->memtable_size &&
+           !atomic_load(&lt->flushing) && !atomic_load(&lt->failed);
+}
+
+void lsm_rotate(LsmTable *lt) {
+    // Several threads may have found the memtable full
+    if (!lsm_rotate_needed(lt)) return;
+
+    pthread_mutex_lock(&lt->mutex);
+    LsmMemtable *mt = lt->immutable == NULL && !atomic_load(&lt->failed)
+                          ? create_memtable(lt->stripes)
+                          : NULL;
+    if (mt != NULL) {
+        rwl_wrlock(&lt->version_lock);
+        lt->immutable = lt->active;
+        lt->active = mt;
+        rwl_unlock(&lt->version_lock);
+        atomic_store(&lt->flushing, 1);
+        atomic_store(&lt->updates, 0);
+        pthread_cond_signal(&lt->work);
+    }
+    pthread_mutex_unlock(&lt->mutex);
+}
+
+// Checks if the active memtable took too many updates for the flush of the
+// immutable one to go on in the background
+static int stalled(LsmTable *lt) {
+    return atomic_load(&lt->updates) >=
+               lt->memtable_size * LSM_STALL_MEMTABLES &&
+           atomic_load(&lt->flushing) && !atomic_load(&lt->failed);
+}
+
+void lsm_throttle(LsmTable *lt) {
+    if (!stalled(lt)) return;
+
+    pthread_mutex_lock(&lt->mutex);
+    while (stalled(lt) && !lt->stop) {
+        pthread_cond_wait(&lt->flushed, &lt->mutex);
+    }
+    pthread_mutex_unlock(&lt->mutex);
+}
+
+// Appends a pair to a listing
+static int listing_add(void *ctx, const char *key, const char *value) {
+    Listing *listing = ctx;
+    if (listing->count == listing->capacity) {
+        size_t capacity = listing->capacity > 0 ? listing->capacity * 2 : 1024;
+        char(*strings)[MAX_STRING_SIZE] =
+            realloc(listing->strings, 2 * capacity * MAX_STRING_SIZE);
+        if (strings == NULL) return 1;
+        listing->strings = strings;
+        listing->capacity = capacity;
+    }
+    strcpy(listing->strings[2 * listing->count], key);
+    strcpy(listing->strings[2 * listing->count + 1], value);
+    listing->count++;
+    return 0;
+}
+
+KvsPair *lsm_list_pairs(LsmTable *lt, size_t *count) {
+    free(lt->listing);
+    lt->listing = NULL;
+    *count = 0;
+
+    // Both memtables, the runs of level 0 and one run per level below
+    Source *sources = malloc((2 + LSM_L0_MAX_RUNS + LSM_MAX_LEVELS) *
+                             sizeof(Source));
+    if (sources == NULL) return NULL;
+    KvsPair *sorted[2] = {NULL, NULL};
+    Listing listing = {NULL, 0, 0};
+    size_t num_sources = 0;
+    int failed = 0;
+
+    rwl_rdlock(&lt->version_lock);
+    LsmMemtable *memtables[2] = {lt->active, lt->immutable};
+    for (size_t i = 0; i < 2 && !failed; i++) {
+        size_t n;
+        if (memtables[i] == NULL) continue;
+        sorted[i] = sort_memtable(memtables[i], &n, &failed);
+        if (n > 0) {
+            failed = failed ||
+                     open_source(&sources[num_sources++], sorted[i], n,
+                                 NULL) != 0;
+        }
+    }
+    for (size_t i = 0; i < lt->num_l0 && !failed; i++) {
+        failed = open_source(&sources[num_sources++], NULL, 0, lt->l0[i]);
+    }
+    for (size_t i = 1; i < LSM_MAX_LEVELS && !failed; i++) {
+        if (lt->levels[i] == NULL) continue;
+        failed = open_source(&sources[num_sources++], NULL, 0, lt->levels[i]);
+    }
+    if (!failed) {
+        failed = merge_sources(sources, num_sources, 1, listing_add, &listing);
+    }
+    rwl_unlock(&lt->version_lock);
+
+    free(sorted[0]);
+    free(sorted[1]);
+    free(sources);
+    KvsPair *pairs = NULL;
+    if (!failed && listing.count > 0) {
+        pairs = malloc(listing.count * sizeof(KvsPair));
+    }
+    if (pairs == NULL) {
+        if (failed) fprintf(stderr, "Failed to list the LSM table\n");
+        free(listing.strings);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < listing.count; i++) {
+        pairs[i].key = listing.strings[2 * i];
+        pairs[i].value = listing.strings[2 * i + 1];
+    }
+    lt->listing = listing.strings;
+    *count = listing.count;
+    return pairs;
+}
+
+void lsm_free_table(LsmTable *lt) {
+    pthread_mutex_lock(&lt->mutex);
+    int started = !lt->stop;
+    lt->stop = 1;
+    pthread_cond_signal(&lt->work);
+    pthread_mutex_unlock(&lt->mutex);
+    if (started) pthread_join(lt->thread, NULL);
+
+    free_memtable(lt->active);
+    free_memtable(lt->immutable);
+    for (size_t i = 0; i < lt->num_l0; i++) {
+        free_run(lt->l0[i]);
+    }
+    for (size_t i = 1; i < LSM_MAX_LEVELS; i++) {
+        free_run(lt->levels[i]);
+    }
+
+    rwl_destroy(&lt->version_lock);
+    for (size_t i = 0; i < LSM_CACHE_LOCKS; i++) {
+        mutex_destroy(&lt->cache_locks[i]);
+    }
+    pthread_mutex_destroy(&lt->mutex);
+    pthread_cond_destroy(&lt->work);
+    pthread_cond_destroy(&lt->flushed);
+    free(lt->cache);
+    free(lt->listing);
+    free(lt->dir);
+    free(lt);
+}
+
+static void *lsm_engine_create_table(size_t stripes) {
+    return lsm_create_table(kvs_config.lsm_dir, kvs_config.lsm_memtable,
+                            stripes);
+}
+
+static int lsm_engine_write_pair(void *table, const char *key,
+                                 const char *value) {
+    return lsm_write_pair(table, key, value);
+}
+
+static char *lsm_engine_read_pair(void *table, const char *key) {
+    return lsm_read_pair(table, key);
+}
+
+static int lsm_engine_delete_pair(void *table, const char *key) {
+    return lsm_delete_pair(table, key);
+}
+
+static int lsm_engine_rotate_needed(void *table) {
+    return lsm_rotate_needed(table);
+}
+
+static void lsm_engine_rotate(void *table) { lsm_rotate(table); }
+
+static void lsm_engine_throttle(void *table) { lsm_throttle(table); }
+
+static KvsPair *lsm_engine_list_pairs(void *table, size_t *count) {
+    return lsm_list_pairs(table, count);
+}
+
+static void lsm_engine_free_table(void *table) { lsm_free_table(table); }
+
+// A full memtable is handed to the table thread by resize_table, under
+// htMutex so that no call sees it change, and writers wait for the table
+// thread in throttle_writes, without any lock. Listing merges every run, so
+// snapshots copy the whole table.
+const KvsEngine lsm_engine = {
+    .name = "lsm",
+    .create_table = lsm_engine_create_table,
+    .write_pair = lsm_engine_write_pair,
+    .read_pair = lsm_engine_read_pair,
+    .delete_pair = lsm_engine_delete_pair,
+    .rehash_pending = NULL,
+    .rehash_step = NULL,
+    .resize_needed = lsm_engine_rotate_needed,
+    .resize_table = lsm_engine_rotate,
+    .reserve = NULL,
+    .list_pairs = lsm_engine_list_pairs,
+    .list_stripe = NULL,
+    .free_table = lsm_engine_free_table,
+    .drop_table = NULL,
+    .throttle_writes = lsm_engine_throttle,
+    .lockfree_reads = 0,
+    .lockfree_writes = 0,
+    .write_batch = NULL,
+};
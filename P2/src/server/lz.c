@@ -0,0 +1,376 @@
+#include "lz.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "throttle.h"
+#include "utils.h"
+
+// Shortest match worth a sequence
+#define LZ_MIN_MATCH 4
+
+// Positions remembered by lz_compress, 2^LZ_HASH_BITS of them
+#define LZ_HASH_BITS 13
+
+struct LzWriter {
+    int fd;
+    pthread_t thread;
+    struct timespec start;
+
+    // Protects every field below. The caller fills blocks[fill] while the
+    // thread compresses the full blocks that follow blocks[next].
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char *blocks[LZ_WRITER_BUFFERS];
+    size_t sizes[LZ_WRITER_BUFFERS];
+    size_t fill;
+    size_t next;
+    size_t full;  // Number of full blocks
+    int closing;
+    atomic_int failed;  // Also read by lz_write without the mutex
+    LzStats stats;
+};
+
+static uint32_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length as its bytes of 255 and a last smaller byte
+static char *put_length(char *out, size_t length) {
+    for (; length >= 255; length -= 255) *out++ = (char)255;
+    *out++ = (char)length;
+    return out;
+}
+
+// Writes a sequence, a match_len of 0 ending the block with the literals
+static char *put_sequence(char *out, const char *literals, size_t num_literals,
+                          size_t offset, size_t match_len) {
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *out++ = (char)((num_literals < 15 ? num_literals : 15) << 4 |
+                    (match_code < 15 ? match_code : 15));
+    if (num_literals >= 15) out = put_length(out, num_literals - 15);
+    memcpy(out, literals, num_literals);
+    out += num_literals;
+    if (match_len == 0) return out;
+
+    *out++ = (char)(offset & 0xff);
+    *out++ = (char)(offset >> 8);
+    if (match_code >= 15) out = put_length(out, match_code - 15);
+    return out;
+}
+
+size_t lz_compress(const char *src, size_t size, char *dst) {
+    // Position + 1 of the last 4 bytes with each hash, 0 if none
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    char *out = dst;
+    size_t anchor = 0;  // First literal of the next sequence
+    size_t pos = 0;
+    size_t misses = 0;
+
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t bytes = read32(src + pos);
+        uint32_t hash = hash32(bytes);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)(pos + 1);
+
+        if (candidate == 0 || read32(src + candidate - 1) != bytes) {
+            // Skip faster through data that does not compress
+            pos += 1 + (misses++ >> 5);
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t len = LZ_MIN_MATCH;
+        while (pos + len < size && src[match + len] == src[pos + len]) len++;
+        out = put_sequence(out, src + anchor, pos - anchor, pos - match, len);
+        pos += len;
+        anchor = pos;
+        misses = 0;
+    }
+    out = put_sequence(out, src + anchor, size - anchor, 0, 0);
+    return (size_t)(out - dst);
+}
+
+// Reads a length extended by bytes of 255
+static int get_length(const unsigned char **in, const unsigned char *end,
+                      size_t *length) {
+    unsigned char byte;
+    do {
+        if (*in == end) return 1;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+long lz_decompress(const char *src, size_t size, char *dst, size_t capacity) {
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *end = in + size;
+    size_t out = 0;
+
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && get_length(&in, end, &num_literals) != 0) {
+            return -1;
+        }
+        if (num_literals > (size_t)(end - in) ||
+            num_literals > capacity - out) {
+            return -1;
+        }
+        memcpy(dst + out, in, num_literals);
+        in += num_literals;
+        out += num_literals;
+        if (in == end) break;
+
+        if (end - in < 2) return -1;
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t len = token & 15;
+        if (len == 15 && get_length(&in, end, &len) != 0) return -1;
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || len > capacity - out) return -1;
+
+        // The match may overlap the bytes it writes
+        const char *match = dst + out - offset;
+        if (offset >= len) {
+            memcpy(dst + out, match, len);
+        } else {
+            for (size_t i = 0; i < len; i++) dst[out + i] = match[i];
+        }
+        out += len;
+    }
+    return (long)out;
+}
+
+// Compresses and writes a block as a frame
+static int write_frame(int fd, const char *block, size_t raw_size,
+                       char *compressed, uint64_t *written) {
+    LzFrameHeader header;
+    header.raw_size = (uint32_t)raw_size;
+    header.crc = crc32c(0, block, raw_size);
+    size_t size = lz_compress(block, raw_size, compressed);
+    const char *data = compressed;
+    if (size >= raw_size) {
+        size = raw_size;
+        data = block;
+    }
+    header.size = (uint32_t)size;
+
+    *written += sizeof(header) + size;
+    throttle_backup(sizeof(header) + size);
+    return write_fully(fd, (const char *)&header, sizeof(header)) != 0 ||
+           write_fully(fd, data, size) != 0;
+}
+
+static void *writer_thread(void *arg) {
+    LzWriter *writer = arg;
+    char *compressed = malloc(LZ_BOUND(LZ_BLOCK_SIZE));
+
+    pthread_mutex_lock(&writer->mutex);
+    if (compressed == NULL) writer->failed = 1;
+    for (;;) {
+        while (writer->full == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->cond, &writer->mutex);
+        }
+        if (writer->full == 0) break;
+
+        size_t index = writer->next;
+        int failed = writer->failed;
+        pthread_mutex_unlock(&writer->mutex);
+
+        // Once a write failed the blocks are only drained
+        uint64_t written = 0;
+        if (!failed) {
+            failed = write_frame(writer->fd, writer->blocks[index],
+                                 writer->sizes[index], compressed, &written);
+        }
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->failed |= failed;
+        writer->stats.compressed_bytes += written;
+        writer->next = (index + 1) % LZ_WRITER_BUFFERS;
+        writer->full--;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+
+    free(compressed);
+    return NULL;
+}
+
+LzWriter *lz_writer_open(int fd) {
+    LzWriter *writer = calloc(1, sizeof(LzWriter));
+    if (writer == NULL) return NULL;
+    writer->fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &writer->start);
+    for (size_t i = 0; i < LZ_WRITER_BUFFERS; i++) {
+        writer->blocks[i] = malloc(LZ_BLOCK_SIZE);
+        if (writer->blocks[i] == NULL) goto fail;
+    }
+
+    LzFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LZ_MAGIC, sizeof(header.magic));
+    header.block_size = LZ_BLOCK_SIZE;
+    throttle_backup(sizeof(header));
+    if (write_fully(fd, (const char *)&header, sizeof(header)) != 0) goto fail;
+    writer->stats.compressed_bytes = sizeof(header);
+
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+        pthread_cond_destroy(&writer->cond);
+        pthread_mutex_destroy(&writer->mutex);
+        goto fail;
+    }
+    return writer;
+
+fail:
+    for (size_t i = 0; i < LZ_WRITER_BUFFERS; i++) free(writer->blocks[i]);
+    free(writer);
+    return NULL;
+}
+
+// Hands the block being filled over to the thread and waits for a free one.
+// The caller must hold the mutex.
+static void hand_over_locked(LzWriter *writer) {
+    writer->full++;
+    pthread_cond_broadcast(&writer->cond);
+    while (writer->full == LZ_WRITER_BUFFERS) {
+        pthread_cond_wait(&writer->cond, &writer->mutex);
+    }
+    writer->fill = (writer->fill + 1) % LZ_WRITER_BUFFERS;
+    writer->sizes[writer->fill] = 0;
+}
+
+int lz_write(LzWriter *writer, const char *data, size_t size) {
+    // Only the caller touches the block being filled, so it is copied to
+    // without the mutex
+    size_t fill = writer->fill;
+    size_t used = writer->sizes[fill];
+    writer->stats.raw_bytes += size;
+    while (size > 0) {
+        size_t chunk = LZ_BLOCK_SIZE - used;
+        if (chunk > size) chunk = size;
+        memcpy(writer->blocks[fill] + used, data, chunk);
+        used += chunk;
+        data += chunk;
+        size -= chunk;
+        if (used < LZ_BLOCK_SIZE) break;
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->sizes[fill] = used;
+        hand_over_locked(writer);
+        fill = writer->fill;
+        used = 0;
+        pthread_mutex_unlock(&writer->mutex);
+    }
+    writer->sizes[fill] = used;
+    return writer->failed;
+}
+
+int lz_writer_close(LzWriter *writer, LzStats *stats) {
+    pthread_mutex_lock(&writer->mutex);
+    if (writer->sizes[writer->fill] > 0) {
+        writer->full++;
+    }
+    writer->closing = 1;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    writer->stats.seconds = (double)(end.tv_sec - writer->start.tv_sec) +
+                            (double)(end.tv_nsec - writer->start.tv_nsec) / 1e9;
+    if (stats != NULL) *stats = writer->stats;
+    int failed = writer->failed;
+
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->mutex);
+    for (size_t i = 0; i < LZ_WRITER_BUFFERS; i++) free(writer->blocks[i]);
+    free(writer);
+    return failed;
+}
+
+int lz_is_compressed(int fd) {
+    char magic[8];
+    return pread_fully(fd, magic, sizeof(magic), 0) == 0 &&
+           memcmp(magic, LZ_MAGIC, sizeof(magic)) == 0;
+}
+
+char *lz_read(int fd, size_t limit, size_t *size) {
+    LzFileHeader header;
+    if (pread_fully(fd, (char *)&header, sizeof(header), 0) != 0 ||
+        memcmp(header.magic, LZ_MAGIC, sizeof(header.magic)) != 0 ||
+        header.block_size == 0 || header.block_size > LZ_BLOCK_SIZE) {
+        return NULL;
+    }
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0) return NULL;
+
+    char *data = NULL;
+    size_t capacity = 0;
+    size_t used = 0;
+    char *frame = malloc(LZ_BOUND(LZ_BLOCK_SIZE));
+    off_t offset = sizeof(header);
+    int result = frame == NULL;
+    while (result == 0 && offset < end && used < limit) {
+        LzFrameHeader frame_header;
+        if (pread_fully(fd, (char *)&frame_header, sizeof(frame_header),
+                        offset) != 0 ||
+            frame_header.raw_size > header.block_size ||
+            frame_header.size > LZ_BOUND(header.block_size) ||
+            pread_fully(fd, frame, frame_header.size,
+                        offset + (off_t)sizeof(frame_header)) != 0) {
+            result = 1;
+            break;
+        }
+        offset += (off_t)(sizeof(frame_header) + frame_header.size);
+
+        if (capacity - used < frame_header.raw_size) {
+            size_t grown = capacity > 0 ? capacity * 2 : LZ_BLOCK_SIZE;
+            while (grown - used < frame_header.raw_size) grown *= 2;
+            char *bigger = realloc(data, grown);
+            if (bigger == NULL) {
+                result = 1;
+                break;
+            }
+            data = bigger;
+            capacity = grown;
+        }
+
+        long raw_size = frame_header.raw_size;
+        if (frame_header.size == frame_header.raw_size) {
+            memcpy(data + used, frame, frame_header.size);
+        } else {
+            raw_size = lz_decompress(frame, frame_header.size, data + used,
+                                     frame_header.raw_size);
+        }
+        result = raw_size != (long)frame_header.raw_size ||
+                 crc32c(0, data + used, frame_header.raw_size) !=
+                     frame_header.crc;
+        used += frame_header.raw_size;
+    }
+
+    free(frame);
+    if (result != 0) {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    // An empty file still returns a buffer, so that NULL means failure
+    return data != NULL ? data : malloc(1);
+}
@@ -0,0 +1,96 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+// Largest block compressed at once. Matches point at most this far back, so
+// that offsets fit in 16 bits.
+#define LZ_BLOCK_SIZE 65536
+
+// Largest compressed block for size bytes of input
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Blocks an LzWriter fills while its thread compresses the previous ones
+#define LZ_WRITER_BUFFERS 4
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A compressed file is an LzFileHeader followed by frames, each an
+// LzFrameHeader and a block compressed on its own, so that a block is read
+// without the previous ones. Integers are stored in the byte order of the
+// machine.
+#define LZ_MAGIC "KVSLZ001"
+
+typedef struct LzFileHeader {
+    char magic[8];
+    uint32_t block_size;  // LZ_BLOCK_SIZE of the writer
+} LzFileHeader;
+
+typedef struct LzFrameHeader {
+    uint32_t raw_size;  // Size of the block once decompressed
+    uint32_t size;      // Size in the file, raw_size if stored uncompressed
+    uint32_t crc;       // CRC-32C of the decompressed block
+} LzFrameHeader;
+
+// Counters of an LzWriter
+typedef struct LzStats {
+    uint64_t raw_bytes;         // Bytes given to lz_write
+    uint64_t compressed_bytes;  // Bytes written to the file, headers included
+    double seconds;             // From lz_writer_open to lz_writer_close
+} LzStats;
+
+typedef struct LzWriter LzWriter;
+
+/// Compresses a block. A block is a sequence of a token (the number of
+/// literals in the high 4 bits and the length of the match minus 4 in the
+/// low ones, 15 meaning that bytes of 255 and a last smaller byte follow),
+/// the literals and the 16 bit offset of the match, the last sequence having
+/// only literals.
+/// @param src Block to compress, up to LZ_BLOCK_SIZE bytes.
+/// @param size Size of the block.
+/// @param dst Buffer of at least LZ_BOUND(size) bytes.
+/// @return Size of the compressed block.
+size_t lz_compress(const char *src, size_t size, char *dst);
+
+/// Decompresses a block.
+/// @param src Compressed block.
+/// @param size Size of the compressed block.
+/// @param dst Buffer for the decompressed block.
+/// @param capacity Size of dst.
+/// @return Size of the decompressed block, -1 if it is malformed or does
+/// not fit.
+long lz_decompress(const char *src, size_t size, char *dst, size_t capacity);
+
+/// Starts compressing to a file. Blocks are compressed and written by a
+/// helper thread while the caller fills the next ones.
+/// @param fd File descriptor to write to, not closed by the writer.
+/// @return The writer, NULL on failure.
+LzWriter *lz_writer_open(int fd);
+
+/// Appends bytes to the compressed file.
+/// @param writer Writer returned by lz_writer_open.
+/// @param data Bytes to append.
+/// @param size Number of bytes.
+/// @return 0 on success, 1 if a block could not be written.
+int lz_write(LzWriter *writer, const char *data, size_t size);
+
+/// Compresses what is left, waits for the helper thread and frees the
+/// writer.
+/// @param writer Writer returned by lz_writer_open.
+/// @param stats Pointer to store the counters in, may be NULL.
+/// @return 0 if the whole file was written, 1 otherwise.
+int lz_writer_close(LzWriter *writer, LzStats *stats);
+
+/// Checks if a file starts with LZ_MAGIC.
+/// @param fd File descriptor of the file.
+/// @return 1 if the file is compressed, 0 otherwise.
+int lz_is_compressed(int fd);
+
+/// Decompresses a compressed file into memory, checking every block.
+/// @param fd File descriptor of the file.
+/// @param limit Stop once this many bytes are decompressed, SIZE_MAX for
+/// the whole file.
+/// @param size Pointer to store the number of bytes decompressed in.
+/// @return Buffer to be freed by the caller, NULL on failure.
+char *lz_read(int fd, size_t limit, size_t *size);
+
+#endif  // KVS_LZ_H
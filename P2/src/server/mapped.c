@@ -0,0 +1,436 @@
+#include "mapped.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "kvs.h"
+#include "slab.h"
+
+#define MAP_MAGIC "KVSMAP01"
+#define MAP_VERSION 2
+
+// The buckets start on the page after the header
+#define MAP_HEADER_SIZE 4096
+
+_Static_assert(sizeof(MapHeader) <= MAP_HEADER_SIZE,
+               "the header must fit before the buckets");
+
+static MapNode *node_at(MappedTable *mt, uint64_t offset) {
+    return (MapNode *)(mt->base + offset);
+}
+
+// Offset of the first node of a file with a number of buckets
+static uint64_t nodes_offset(uint64_t num_buckets) {
+    uint64_t end = MAP_HEADER_SIZE + num_buckets * sizeof(uint64_t);
+    return (end + 63) & ~(uint64_t)63;
+}
+
+static int map_file(MappedTable *mt, size_t size) {
+    void *base =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mt->fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to map the table file");
+        return 1;
+    }
+    mt->base = base;
+    mt->header = base;
+    mt->buckets = (uint64_t *)(mt->base + MAP_HEADER_SIZE);
+    return 0;
+}
+
+// Empties the file, leaving it sparse so that only the pages written take
+// space, and maps it with a new header
+static int create_file(MappedTable *mt, size_t size) {
+    if (ftruncate(mt->fd, 0) != 0 || ftruncate(mt->fd, (off_t)size) != 0) {
+        perror("Failed to size the table file");
+        return 1;
+    }
+
+    // Room for about one bucket per node that fits in the file, the pages
+    // of the buckets not in use taking no space
+    uint64_t max_buckets = MAX_LOCK_STRIPES;
+    while (max_buckets * (sizeof(MapNode) + sizeof(uint64_t)) < size) {
+        max_buckets *= 2;
+    }
+    uint64_t nodes = nodes_offset(max_buckets);
+    if (nodes + sizeof(MapNode) > size) {
+        fprintf(stderr, "The table file is too small\n");
+        return 1;
+    }
+    if (map_file(mt, size) != 0) return 1;
+
+    MapHeader *header = mt->header;
+    memcpy(header->magic, MAP_MAGIC, sizeof(header->magic));
+    header->version = MAP_VERSION;
+    header->size = size;
+    header->max_buckets = max_buckets;
+    header->num_buckets = MAX_LOCK_STRIPES;
+    header->nodes = nodes;
+    header->top = nodes;
+    header->free_list = 0;
+    atomic_init(&header->count, 0);
+    atomic_init(&header->stamp, 1);
+    return 0;
+}
+
+// Checks that the layout of the header matches the file
+static int valid_layout(const MapHeader *header, size_t size) {
+    uint64_t max = header->max_buckets;
+    uint64_t buckets = header->num_buckets;
+    return header->size == size && buckets >= MAX_LOCK_STRIPES &&
+           (buckets & (buckets - 1)) == 0 && buckets <= max &&
+           (max & (max - 1)) == 0 && header->nodes == nodes_offset(max) &&
+           header->nodes < size && header->top >= header->nodes &&
+           header->top <= size &&
+           (header->top - header->nodes) % sizeof(MapNode) == 0;
+}
+
+// Checks if a node holds a whole pair
+static int valid_node(const MapNode *node) {
+    return node->stamp != 0 &&
+           memchr(node->key, '\0', MAX_STRING_SIZE) != NULL &&
+           memchr(node->value, '\0', MAX_STRING_SIZE) != NULL &&
+           node->hash == hash(node->key);
+}
+
+// Rebuilds the chains from the stamped nodes and the free list from the
+// others, in time in the number of nodes ever allocated. A node is stamped
+// once filled and its stamp cleared when it is freed, so after a crash a
+// stamped node holds a whole pair, and two stamped nodes of a key are an old
+// one that was replaced and the newer one that replaced it.
+static void rebuild_table(MappedTable *mt) {
+    MapHeader *header = mt->header;
+    size_t num_nodes = (header->top - header->nodes) / sizeof(MapNode);
+    memset(mt->buckets, 0, header->num_buckets * sizeof(uint64_t));
+
+    uint64_t count = 0;
+    uint64_t stamp = 0;
+    for (size_t i = 0; i < num_nodes; i++) {
+        uint64_t offset = header->nodes + i * sizeof(MapNode);
+        MapNode *node = node_at(mt, offset);
+        if (!valid_node(node)) {
+            node->stamp = 0;
+            continue;
+        }
+        if (node->stamp > stamp) stamp = node->stamp;
+
+        uint64_t *link = &mt->buckets[node->hash & (header->num_buckets - 1)];
+        while (*link != 0 && strcmp(node_at(mt, *link)->key, node->key) != 0) {
+            link = &node_at(mt, *link)->next;
+        }
+        MapNode *other = *link != 0 ? node_at(mt, *link) : NULL;
+        if (other == NULL) {
+            node->next = 0;
+            *link = offset;
+            count++;
+        } else if (other->stamp < node->stamp) {
+            node->next = other->next;
+            *link = offset;
+            other->stamp = 0;
+        } else {
+            node->stamp = 0;
+        }
+    }
+
+    header->free_list = 0;
+    for (size_t i = num_nodes; i-- > 0;) {
+        uint64_t offset = header->nodes + i * sizeof(MapNode);
+        if (node_at(mt, offset)->stamp != 0) continue;
+        node_at(mt, offset)->next = header->free_list;
+        header->free_list = offset;
+    }
+    atomic_store(&header->count, count);
+    atomic_store(&header->stamp, stamp + 1);
+}
+
+// Maps an existing file, checking it if it was not closed cleanly
+static int open_file(MappedTable *mt, const char *path, size_t size) {
+    MapHeader header;
+    if (pread(mt->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        memcmp(header.magic, MAP_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MAP_VERSION) {
+        fprintf(stderr, "%s is not a table file\n", path);
+        return 1;
+    }
+    if (map_file(mt, size) != 0) return 1;
+
+    if (valid_layout(mt->header, size)) {
+        if (mt->header->clean) return 0;
+        rebuild_table(mt);
+        printf("Rebuilt %s after an unclean shutdown\n", path);
+        return 0;
+    }
+
+    fprintf(stderr, "Discarding %s, inconsistent after an unclean shutdown\n",
+            path);
+    munmap(mt->base, size);
+    return create_file(mt, size);
+}
+
+MappedTable *mapped_open_table(const char *path, size_t size, size_t stripes) {
+    MappedTable *mt = malloc(sizeof(MappedTable));
+    if (mt == NULL) return NULL;
+    mt->stripes = stripes;
+
+    mt->fd = open(path, O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if (mt->fd == -1 || fstat(mt->fd, &st) != 0) {
+        perror("Failed to open the table file");
+        if (mt->fd != -1) close(mt->fd);
+        free(mt);
+        return NULL;
+    }
+
+    int result = st.st_size == 0 ? create_file(mt, size)
+                                 : open_file(mt, path, (size_t)st.st_size);
+    if (result != 0) {
+        close(mt->fd);
+        free(mt);
+        return NULL;
+    }
+
+    // Cleared on disk before any change, so that a crash is noticed by the
+    // next start
+    mt->header->clean = 0;
+    msync(mt->base, MAP_HEADER_SIZE, MS_SYNC);
+    pthread_mutex_init(&mt->alloc_mutex, NULL);
+    return mt;
+}
+
+// Takes a node from the free list, or from the unused end of the file
+// @return Offset of the node, 0 if the file is full.
+static uint64_t alloc_node(MappedTable *mt) {
+    MapHeader *header = mt->header;
+    pthread_mutex_lock(&mt->alloc_mutex);
+    uint64_t offset = header->free_list;
+    if (offset != 0) {
+        header->free_list = node_at(mt, offset)->next;
+    } else if (header->top + sizeof(MapNode) <= header->size) {
+        offset = header->top;
+        header->top += sizeof(MapNode);
+    }
+    pthread_mutex_unlock(&mt->alloc_mutex);
+    return offset;
+}
+
+// Returns an unlinked node to the free list
+static void free_node(MappedTable *mt, uint64_t offset) {
+    node_at(mt, offset)->stamp = 0;
+    pthread_mutex_lock(&mt->alloc_mutex);
+    node_at(mt, offset)->next = mt->header->free_list;
+    mt->header->free_list = offset;
+    pthread_mutex_unlock(&mt->alloc_mutex);
+}
+
+// Returns the link that points to the node of a key, or the null link at the
+// end of its chain if the key is missing
+static uint64_t *find_link(MappedTable *mt, const char *key, uint64_t h) {
+    uint64_t *link = &mt->buckets[h & (mt->header->num_buckets - 1)];
+    while (*link != 0) {
+        MapNode *node = node_at(mt, *link);
+        if (node->hash == h && strcmp(node->key, key) == 0) break;
+        link = &node->next;
+    }
+    return link;
+}
+
+int mapped_write_pair(MappedTable *mt, const char *key, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    if (key_len >= MAX_STRING_SIZE || value_len >= MAX_STRING_SIZE) return 1;
+
+    uint64_t h = hash(key);
+    uint64_t *link = find_link(mt, key, h);
+    uint64_t offset = alloc_node(mt);
+    if (offset == 0) return 1;
+
+    MapNode *node = node_at(mt, offset);
+    node->hash = h;
+    memcpy(node->key, key, key_len + 1);
+    memcpy(node->value, value, value_len + 1);
+    node->stamp = atomic_fetch_add(&mt->header->stamp, 1);
+
+    // The node is only linked once complete, and the old one only freed once
+    // it is unlinked
+    uint64_t old = *link;
+    if (old != 0) {
+        node->next = node_at(mt, old)->next;
+        *link = offset;
+        free_node(mt, old);
+    } else {
+        node->next = 0;
+        *link = offset;
+        atomic_fetch_add(&mt->header->count, 1);
+    }
+    return 0;
+}
+
+char *mapped_read_pair(MappedTable *mt, const char *key) {
+    uint64_t *link = find_link(mt, key, hash(key));
+    if (*link == 0) return NULL;
+    return slab_strdup(node_at(mt, *link)->value);
+}
+
+int mapped_delete_pair(MappedTable *mt, const char *key) {
+    uint64_t *link = find_link(mt, key, hash(key));
+    uint64_t offset = *link;
+    if (offset == 0) return 1;
+
+    // Cleared before the node is unlinked, so a rebuild never brings it back
+    node_at(mt, offset)->stamp = 0;
+    *link = node_at(mt, offset)->next;
+    free_node(mt, offset);
+    atomic_fetch_sub(&mt->header->count, 1);
+    return 0;
+}
+
+// Appends the pairs of the buckets in use first, first + step, ... to an
+// array
+static KvsPair *list_buckets(MappedTable *mt, uint64_t first, uint64_t step,
+                             size_t *count) {
+    KvsPair *pairs = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    for (uint64_t b = first; b < mt->header->num_buckets; b += step) {
+        for (uint64_t offset = mt->buckets[b]; offset != 0;) {
+            MapNode *node = node_at(mt, offset);
+            if (*count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                KvsPair *grown = realloc(pairs, capacity * sizeof(KvsPair));
+                if (grown == NULL) {
+                    free(pairs);
+                    *count = 0;
+                    return NULL;
+                }
+                pairs = grown;
+            }
+            pairs[*count].key = node->key;
+            pairs[*count].value = node->value;
+            (*count)++;
+            offset = node->next;
+        }
+    }
+    return pairs;
+}
+
+KvsPair *mapped_list_pairs(MappedTable *mt, size_t *count) {
+    return list_buckets(mt, 0, 1, count);
+}
+
+KvsPair *mapped_list_stripe(MappedTable *mt, size_t lock, size_t *count) {
+    // Buckets of a stripe are those whose low bits are the stripe, as the
+    // buckets are at least as many as the stripes
+    return list_buckets(mt, lock, mt->stripes, count);
+}
+
+int mapped_grow_needed(MappedTable *mt) {
+    const MapHeader *header = mt->header;
+    uint64_t count = atomic_load(&header->count);
+    return count > header->num_buckets * MAX_LOAD_FACTOR &&
+           header->num_buckets < header->max_buckets;
+}
+
+void mapped_grow(MappedTable *mt) {
+    // Several threads may have found the table full
+    if (!mapped_grow_needed(mt)) return;
+
+    // Set first, so that a crash midway rebuilds the chains with the new
+    // buckets, which were never used and hold no offset
+    uint64_t old_buckets = mt->header->num_buckets;
+    mt->header->num_buckets = old_buckets * 2;
+    for (uint64_t b = 0; b < old_buckets; b++) {
+        uint64_t *link = &mt->buckets[b];
+        while (*link != 0) {
+            MapNode *node = node_at(mt, *link);
+            if ((node->hash & old_buckets) == 0) {
+                link = &node->next;
+                continue;
+            }
+            uint64_t offset = *link;
+            *link = node->next;
+            node->next = mt->buckets[b + old_buckets];
+            mt->buckets[b + old_buckets] = offset;
+        }
+    }
+}
+
+void mapped_close_table(MappedTable *mt) {
+    size_t size = mt->header->size;
+    if (msync(mt->base, size, MS_SYNC) == 0) {
+        mt->header->clean = 1;
+        msync(mt->base, MAP_HEADER_SIZE, MS_SYNC);
+    } else {
+        perror("Failed to write the table file");
+    }
+    munmap(mt->base, size);
+    close(mt->fd);
+    pthread_mutex_destroy(&mt->alloc_mutex);
+    free(mt);
+}
+
+static void *mapped_engine_create_table(size_t stripes) {
+    return mapped_open_table(kvs_config.map_path, kvs_config.map_size,
+                             stripes);
+}
+
+static int mapped_engine_write_pair(void *table, const char *key,
+                                    const char *value) {
+    return mapped_write_pair(table, key, value);
+}
+
+static char *mapped_engine_read_pair(void *table, const char *key) {
+    return mapped_read_pair(table, key);
+}
+
+static int mapped_engine_delete_pair(void *table, const char *key) {
+    return mapped_delete_pair(table, key);
+}
+
+static KvsPair *mapped_engine_list_pairs(void *table, size_t *count) {
+    return mapped_list_pairs(table, count);
+}
+
+static KvsPair *mapped_engine_list_stripe(void *table, size_t lock,
+                                          size_t *count) {
+    return mapped_list_stripe(table, lock, count);
+}
+
+static int mapped_engine_grow_needed(void *table) {
+    return mapped_grow_needed(table);
+}
+
+static void mapped_engine_grow(void *table) { mapped_grow(table); }
+
+static void mapped_engine_free_table(void *table) {
+    mapped_close_table(table);
+}
+
+// The buckets in use are doubled by resize_table, at once since it excludes
+// every other call, and values are replaced under the stripe so reads take
+// it too
+const KvsEngine mapped_engine = {
+    .name = "mapped",
+    .create_table = mapped_engine_create_table,
+    .write_pair = mapped_engine_write_pair,
+    .read_pair = mapped_engine_read_pair,
+    .delete_pair = mapped_engine_delete_pair,
+    .rehash_pending = NULL,
+    .rehash_step = NULL,
+    .resize_needed = mapped_engine_grow_needed,
+    .resize_table = mapped_engine_grow,
+    .reserve = NULL,
+    .list_pairs = mapped_engine_list_pairs,
+    .list_stripe = mapped_engine_list_stripe,
+    .free_table = mapped_engine_free_table,
+    .drop_table = NULL,
+    .throttle_writes = NULL,
+    .lockfree_reads = 0,
+    .lockfree_writes = 0,
+    .write_batch = NULL,
+};
@@ -0,0 +1,119 @@
+#ifndef KVS_MAPPED_H
+#define KVS_MAPPED_H
+
+// Size of the file when KVS_MAP_SIZE is not set, in MiB
+#define MAPPED_DEFAULT_SIZE_MB 256
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+
+// Chained hash table stored in a memory-mapped file, so that a restart maps
+// the file and serves the pairs at once, its pages read on demand. The file
+// is a MapHeader, room for max_buckets buckets and then the nodes. Only the
+// first num_buckets buckets are used, about one per pair, so that listing
+// the table takes time in the number of pairs rather than the size of the
+// file. Everything links by offset from the start of the file, 0 being the
+// null offset, so the file may be mapped anywhere.
+typedef struct MapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clean;  // Set on a clean shutdown, cleared while mapped
+    uint64_t size;   // Size of the file
+    uint64_t max_buckets;    // Buckets the file has room for
+    uint64_t num_buckets;    // Buckets in use, doubled as pairs are added
+    uint64_t nodes;          // Offset of the first node
+    uint64_t top;            // Offset after the last node ever allocated
+    uint64_t free_list;      // First free node, linked by next
+    _Atomic uint64_t count;  // Number of pairs
+    _Atomic uint64_t stamp;  // Stamp of the next node written
+} MapHeader;
+
+// Node of a chain. Nodes are never changed once linked: a write links a new
+// node in place of the old one, so that a crash never leaves a torn pair.
+// A node is stamped once filled, and the stamp is cleared when it is freed,
+// so that the chains can be rebuilt from the stamped nodes after a crash.
+typedef struct MapNode {
+    uint64_t next;
+    uint64_t hash;
+    uint64_t stamp;  // Order in which the nodes were written, 0 if free
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} MapNode;
+
+// Table of a mapped file. Chains are protected by the lock stripes, like
+// those of kvs.c, and the node allocator by alloc_mutex.
+typedef struct MappedTable {
+    int fd;
+    char *base;  // Start of the mapping
+    MapHeader *header;
+    uint64_t *buckets;
+    size_t stripes;  // Number of lock stripes, see lock_index
+    pthread_mutex_t alloc_mutex;
+} MappedTable;
+
+/// Maps a table file, creating it if it does not exist. After an unclean
+/// shutdown the chains and the free list are rebuilt from the stamped nodes;
+/// if the header is inconsistent the file is emptied, to be filled again by
+/// KVS_RESTORE or the WAL.
+/// @param path Path of the file.
+/// @param size Size of a new file in bytes, an existing file keeps its own.
+/// @param stripes Number of lock stripes, a power of two.
+/// @return Newly mapped table, NULL on failure.
+MappedTable *mapped_open_table(const char *path, size_t size, size_t stripes);
+
+/// Writes a pair, linking a new node in place of the old one if the key
+/// already exists.
+/// @param mt Table to be modified.
+/// @param key Key of the pair.
+/// @param value Value of the pair.
+/// @return 0 if the pair was written, 1 if it is too long or the file is
+/// full.
+int mapped_write_pair(MappedTable *mt, const char *key, const char *value);
+
+/// Reads the value of a key.
+/// @param mt Table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value to be freed with slab_free, NULL if the key does
+/// not exist.
+char *mapped_read_pair(MappedTable *mt, const char *key);
+
+/// Deletes a key.
+/// @param mt Table to delete from.
+/// @param key Key of the pair to be deleted.
+/// @return 0 if the key was deleted, 1 if it did not exist.
+int mapped_delete_pair(MappedTable *mt, const char *key);
+
+/// Lists every pair of the table, in no particular order.
+/// @param mt Table to list.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, pointing into the mapping, to be freed by the
+/// caller. NULL if empty.
+KvsPair *mapped_list_pairs(MappedTable *mt, size_t *count);
+
+/// Lists the pairs of the buckets of a lock stripe, in no particular order.
+/// @param mt Table to list.
+/// @param lock Index of the lock stripe.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *mapped_list_stripe(MappedTable *mt, size_t lock, size_t *count);
+
+/// Checks if the table holds more pairs than buckets in use.
+/// @param mt Table to check.
+/// @return 1 if mapped_grow should be called, 0 otherwise.
+int mapped_grow_needed(MappedTable *mt);
+
+/// Doubles the buckets in use, splitting each chain in two, unless the file
+/// has no room for more. The caller must hold htMutex for writing.
+/// @param mt Table to grow.
+void mapped_grow(MappedTable *mt);
+
+/// Writes the table back to its file, marks it clean and unmaps it.
+/// @param mt Table to close.
+void mapped_close_table(MappedTable *mt);
+
+#endif  // KVS_MAPPED_H
@@ -1,16 +1,152 @@
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "backup.h"
+#include "combine.h"
+#include "config.h"
 #include "constants.h"
+#include "dump.h"
+#include "engine.h"
+#include "epoch.h"
 #include "kvs.h"
+#include "lz.h"
+#include "operations.h"
+#include "shard.h"
+#include "slab.h"
+#include "subscriptions.h"
+#include "snapshot.h"
+#include "store.h"
+#include "throttle.h"
 #include "utils.h"
+#include "wal.h"
 
-static struct HashTable* kvs_table = NULL;
+static const KvsEngine* kvs_engine = NULL;
+static void* kvs_table = NULL;
+// Set when the pairs live in shards (KVS_SHARDS), kvs_table is then NULL
+static int sharded = 0;
+
+// Size of a cache line, the lock stripes are aligned to it
+#define CACHE_LINE_SIZE 64
+
+// Lock stripe, alone in its cache line so that taking a stripe does not
+// invalidate the line of its neighbours on other cores
+typedef struct LockStripe {
+    _Alignas(CACHE_LINE_SIZE) KvsRwlock lock;
+} LockStripe;
+
+// Set of lock stripes, one bit per stripe
+typedef struct StripeSet {
+    uint64_t words[MAX_LOCK_STRIPES / 64];
+} StripeSet;
+
+// Lock stripes of the buckets, see lock_index
+static LockStripe* bucket_mutex = NULL;
+static size_t num_stripes;
+// Lock for the whole table
+static KvsRwlock htMutex;
+// Next lock stripe helped by release_table during a resize
+static atomic_size_t rehash_cursor;
+
+// Snapshots of kvs_show and kvs_backup that may still have unsaved stripes.
+// Changed with htMutex held for writing, so writers, which hold it for
+// reading, can walk the list without another lock.
+static Snapshot* active_snapshots = NULL;
+
+// Backup generation in which each stripe was last modified, written by
+// writers with the stripe held for writing, and the current generation, one
+// more with each backup. Read and changed with htMutex held for writing.
+static uint64_t* stripe_generations = NULL;
+static uint64_t backup_generation = 1;
+
+// Backups restored from the same full backup, each delta (KVS_BACKUP_DELTA)
+// from the previous backup of the chain. A delta is committed only once the
+// previous backup is, and a failure breaks the chain, so that the deltas
+// after it fail too and the next backup starts a new chain. Guarded by
+// backups_mutex.
+typedef struct BackupChain {
+    int started;   // Backups of the chain, the full one first
+    int finished;  // Backups written or failed, in the order they started
+    int taken;     // Backups taken by a backup thread, in the same order
+    int broken;    // Set once a backup of the chain failed
+    int refs;      // current_chain and the backups of the chain
+} BackupChain;
+
+// File name of the last backup and the chain a delta would continue, NULL
+// before the first backup, changed with htMutex held for writing
+static char last_backup[MAX_JOB_FILE_NAME_SIZE];
+static BackupChain* current_chain = NULL;
+
+// Number of WRITE and DELETE commands applied, incremented with htMutex held
+// for reading, so that it cannot change while htMutex is held for writing.
+// Tells a backup whether the state changed since the previous one.
+static _Atomic uint64_t state_version = 1;
+
+// Backups waiting for a thread, oldest first, and the threads writing them,
+// at most max_backups. Each thread writes backups from the queue until it is
+// empty. Protected by backups_mutex.
+static struct BackupJob* pending_head = NULL;
+static struct BackupJob* pending_tail = NULL;
+static size_t running_backups = 0;
+static size_t max_backups = 1;
+static pthread_mutex_t backups_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backups_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t chain_finished = PTHREAD_COND_INITIALIZER;
+
+// Where kvs_delete writes the missing keys while the WAL is replayed
+static int replay_fd = -1;
+
+// Delta backup: the stripes changed since the previous backup, the only ones
+// in its snapshot
+typedef struct Delta {
+    StripeSet changed;
+    char base[MAX_JOB_FILE_NAME_SIZE];  // File name of the previous backup
+} Delta;
+
+// File of a later backup merged into a pending one
+typedef struct BackupCopy {
+    int fd;
+    char* path;
+} BackupCopy;
+
+// Backup written by backup_thread
+typedef struct BackupJob {
+    Snapshot* snapshot;
+    int fd;
+    char* path;    // Path of the backup file
+    int binary;    // Written with dump_write rather than as text
+    Delta* delta;  // NULL for a full backup
+    int compress;  // Written through an LzWriter (KVS_BACKUP_COMPRESS)
+    char* name;    // File name of the backup, for its statistics
+    uint64_t version;  // state_version of the snapshot, 0 if unknown
+    BackupChain* chain;  // NULL if the backup is in no chain
+    int link;            // Position of the backup in its chain
+    BackupCopy* copies;  // Later backups merged into this one
+    size_t num_copies;
+    struct BackupJob* next;  // Next pending backup
+} BackupJob;
+
+// Destination of a snapshot: its file, or an LzWriter that compresses the
+// bytes on a helper thread before they reach the file
+typedef struct Output {
+    int fd;
+    LzWriter* lz;    // NULL to write to fd directly
+    size_t threads;  // Threads that write the pairs at offsets of fd, after
+                     // what it already holds, 0 to write them in order
+    int throttled;   // Whether writes to fd go through throttle_backup
+} Output;
+
+// Size of the buffer the text of a snapshot is written through
+#define SHOW_BUFFER_SIZE 65536
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -21,167 +157,1314 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 
 // function to verify if key exists in the hash table
 int key_exists(const char* key) {
-    int hash_key = hash(key);
+    if (sharded) {
+        char keys[1][MAX_STRING_SIZE];
+        char* value;
+        snprintf(keys[0], MAX_STRING_SIZE, "%s", key);
+        if (shard_read(1, keys, &value) != 0) return 0;
 
-    rwl_rdlock(&kvs_table->mutex[hash_key]);
+        int exists = value != NULL;
+        slab_free(value);
+        return exists;
+    }
 
-    KeyNode* keyNode = kvs_table->table[hash_key];
+    size_t lock = lock_index(key, num_stripes);
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            rwl_unlock(&kvs_table->mutex[hash_key]);
-            return 1;
+    int lockfree = kvs_engine->lockfree_reads &&
+                   (kvs_engine->lockfree_writes ||
+                    kvs_config.lockfree_reads) &&
+                   epoch_enter() == 0;
+    if (!lockfree) {
+        rwl_rdlock(&htMutex);
+        rwl_rdlock(&bucket_mutex[lock].lock);
+    }
+
+    char* value = kvs_engine->read_pair(kvs_table, key);
+    int exists = value != NULL;
+
+    if (lockfree) {
+        epoch_exit();
+    } else {
+        rwl_unlock(&bucket_mutex[lock].lock);
+        rwl_unlock(&htMutex);
+    }
+
+    slab_free(value);
+    return exists;
+}
+
+/// Helps an ongoing resize on the next lock stripe in round-robin order, so
+/// that stripes without writes also make progress, then releases htMutex,
+/// starts or finishes a resize if needed and lets the engine hold the writer
+/// back. Must be called with htMutex held for reading and no lock stripe held.
+static void release_table() {
+    if (kvs_engine->rehash_pending != NULL &&
+        kvs_engine->rehash_pending(kvs_table)) {
+        size_t lock = atomic_fetch_add(&rehash_cursor, 1) & (num_stripes - 1);
+        rwl_wrlock(&bucket_mutex[lock].lock);
+        kvs_engine->rehash_step(kvs_table, lock);
+        rwl_unlock(&bucket_mutex[lock].lock);
+    }
+
+    int resize = kvs_engine->resize_needed != NULL &&
+                 kvs_engine->resize_needed(kvs_table);
+    rwl_unlock(&htMutex);
+
+    if (resize) {
+        rwl_wrlock(&htMutex);
+        kvs_engine->resize_table(kvs_table);
+        rwl_unlock(&htMutex);
+    }
+    if (kvs_engine->throttle_writes != NULL) {
+        kvs_engine->throttle_writes(kvs_table);
+    }
+}
+
+/// Builds the set of stripes that protect some keys.
+/// @param set Set to fill.
+/// @param num_keys Number of keys.
+/// @param keys Keys to be locked.
+static void get_stripes(StripeSet* set, size_t num_keys,
+                        char keys[][MAX_STRING_SIZE]) {
+    memset(set->words, 0, (num_stripes + 63) / 64 * sizeof(uint64_t));
+    for (size_t i = 0; i < num_keys; i++) {
+        size_t stripe = lock_index(keys[i], num_stripes);
+        set->words[stripe / 64] |= (uint64_t)1 << (stripe % 64);
+    }
+}
+
+/// Locks a set of stripes in ascending order, so that concurrent commands
+/// cannot deadlock.
+/// @param set Stripes to lock.
+/// @param write 1 to lock for writing, 0 for reading.
+static void lock_stripes(const StripeSet* set, int write) {
+    for (size_t w = 0; w < (num_stripes + 63) / 64; w++) {
+        for (uint64_t bits = set->words[w]; bits != 0; bits &= bits - 1) {
+            size_t stripe = w * 64 + (size_t)__builtin_ctzll(bits);
+            if (write) {
+                rwl_wrlock(&bucket_mutex[stripe].lock);
+            } else {
+                rwl_rdlock(&bucket_mutex[stripe].lock);
+            }
+        }
+    }
+}
+
+/// Unlocks a set of stripes locked by lock_stripes.
+/// @param set Stripes to unlock.
+static void unlock_stripes(const StripeSet* set) {
+    for (size_t w = 0; w < (num_stripes + 63) / 64; w++) {
+        for (uint64_t bits = set->words[w]; bits != 0; bits &= bits - 1) {
+            size_t stripe = w * 64 + (size_t)__builtin_ctzll(bits);
+            rwl_unlock(&bucket_mutex[stripe].lock);
+        }
+    }
+}
+
+/// Saves a stripe in the active snapshots that did not save it yet, before it
+/// is modified. Must be called with htMutex held for reading and the stripe
+/// for writing.
+/// @param stripe Index of the stripe.
+static void save_stripe(size_t stripe) {
+    KvsPair* pairs = NULL;
+    size_t count = 0;
+    int listed = 0;
+    for (Snapshot* snapshot = active_snapshots; snapshot != NULL;
+         snapshot = snapshot->next) {
+        if (snapshot->stripes[stripe].saved) continue;
+
+        if (!listed) {
+            pairs = kvs_engine->list_stripe(kvs_table, stripe, &count);
+            listed = 1;
+        }
+        snapshot_save(snapshot, stripe, pairs, count);
+    }
+    free(pairs);
+}
+
+/// Saves a set of stripes in the active snapshots, see save_stripe, and
+/// records that they changed since the last backup.
+/// @param set Stripes held for writing.
+static void save_stripes(const StripeSet* set) {
+    for (size_t w = 0; w < (num_stripes + 63) / 64; w++) {
+        for (uint64_t bits = set->words[w]; bits != 0; bits &= bits - 1) {
+            size_t stripe = w * 64 + (size_t)__builtin_ctzll(bits);
+            stripe_generations[stripe] = backup_generation;
+            if (active_snapshots != NULL) save_stripe(stripe);
+        }
+    }
+}
+
+/// Compares two pairs by key, for qsort.
+static int compare_pairs(const void* a, const void* b) {
+    return strcmp(((const KvsPair*)a)->key, ((const KvsPair*)b)->key);
+}
+
+/// Prints the pairs a WRITE could not write.
+/// @param num_pairs Number of pairs.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @param failed Whether each pair could not be written.
+static void report_failed_writes(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                                 char values[][MAX_STRING_SIZE],
+                                 const int failed[]) {
+    for (size_t i = 0; i < num_pairs; i++) {
+        if (failed[i]) {
+            fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i],
+                    values[i]);
+        }
+    }
+}
+
+/// Writes the keys a DELETE did not find.
+/// @param fd_out File descriptor to write the output.
+/// @param num_keys Number of keys.
+/// @param keys Keys of the DELETE.
+/// @param failed Whether each key was missing.
+static void write_missing(int fd_out, size_t num_keys,
+                          char keys[][MAX_STRING_SIZE], const int failed[]) {
+    int missing = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        if (failed[i]) {
+            if (!missing) {
+                tryWrite(fd_out, "[", 1);
+                missing = 1;
+            }
+            char buffer[MAX_STRING_SIZE * 2 + 12];
+            sprintf(buffer, "(%s,KVSMISSING)", keys[i]);
+            tryWrite(fd_out, buffer, strlen(buffer));
+        }
+    }
+    if (missing) {
+        tryWrite(fd_out, "]\n", 2);
+    }
+}
+
+/// Applies a WRITE or DELETE published for flat combining. Runs on the thread
+/// that holds the stripe of its keys.
+/// @param request Request to apply.
+static void apply_request(CombineRequest* request) {
+    size_t stripe = lock_index(request->keys[0], num_stripes);
+    stripe_generations[stripe] = backup_generation;
+    if (active_snapshots != NULL) save_stripe(stripe);
+
+    for (size_t i = 0; i < request->num_keys; i++) {
+        if (request->values == NULL) {
+            request->failed[i] =
+                kvs_engine->delete_pair(kvs_table, request->keys[i]) != 0;
+            if (!request->failed[i]) {
+                notify_subscribers(request->keys[i], "DELETED");
+            }
+        } else {
+            request->failed[i] =
+                kvs_engine->write_pair(kvs_table, request->keys[i],
+                                       request->values[i]) != 0;
+            if (!request->failed[i]) {
+                notify_subscribers(request->keys[i], request->values[i]);
+            }
+        }
+    }
+    wal_append(request->values == NULL ? WAL_DELETE : WAL_WRITE,
+               request->num_keys, request->keys, request->values);
+}
+
+/// Runs a WRITE or DELETE with flat combining, when it is enabled and every
+/// key is on the same stripe. Must be called with htMutex held for reading.
+/// @param num_keys Number of keys.
+/// @param keys Keys of the command.
+/// @param values Values of a WRITE, NULL for a DELETE.
+/// @param failed Set for each key that could not be written or deleted.
+/// @return 0 if the command ran, 1 if the caller must lock the stripes.
+static int combine_command(size_t num_keys, char keys[][MAX_STRING_SIZE],
+                           char values[][MAX_STRING_SIZE], int failed[]) {
+    if (!kvs_config.flat_combining || num_keys == 0) return 1;
+
+    size_t stripe = lock_index(keys[0], num_stripes);
+    for (size_t i = 1; i < num_keys; i++) {
+        if (lock_index(keys[i], num_stripes) != stripe) return 1;
+    }
+
+    CombineRequest request = {num_keys, keys, values, failed};
+    return combine_execute(&bucket_mutex[stripe].lock, stripe, &request,
+                           apply_request);
+}
+
+/// Checks if snapshots are copied one stripe at a time as the table changes,
+/// rather than all at once when they are taken.
+static int copy_on_write() {
+    return !sharded && kvs_engine->list_stripe != NULL;
+}
+
+/// Drops a reference to a chain of backups. Must be called with
+/// backups_mutex held.
+/// @param chain Chain of backups, may be NULL.
+static void release_chain(BackupChain* chain) {
+    if (chain != NULL && --chain->refs == 0) free(chain);
+}
+
+/// Starts a new chain of backups, or continues the current one with a delta
+/// of the stripes changed since the previous backup, leaving the other
+/// stripes out of the snapshot. Must be called with htMutex held for
+/// writing, before writers may save stripes into the snapshot.
+/// @param snapshot Snapshot of the backup.
+/// @param job Backup, whose delta, chain and link are set here.
+static void start_backup(Snapshot* snapshot, BackupJob* job) {
+    Delta* delta = NULL;
+    pthread_mutex_lock(&backups_mutex);
+    BackupChain* chain = current_chain;
+    if (chain != NULL && !chain->broken &&
+        chain->started <= kvs_config.backup_deltas) {
+        delta = malloc(sizeof(Delta));
+    }
+    if (delta == NULL) {
+        // Without a chain the next backup is full as well
+        release_chain(current_chain);
+        chain = calloc(1, sizeof(BackupChain));
+        if (chain != NULL) chain->refs = 1;
+        current_chain = chain;
+    }
+    if (chain != NULL) {
+        job->link = chain->started++;
+        chain->refs++;
+    }
+    job->chain = chain;
+    pthread_mutex_unlock(&backups_mutex);
+
+    if (delta != NULL) {
+        memset(&delta->changed, 0, sizeof(delta->changed));
+        for (size_t i = 0; i < num_stripes; i++) {
+            if (stripe_generations[i] == backup_generation) {
+                delta->changed.words[i / 64] |= (uint64_t)1 << (i % 64);
+            } else {
+                snapshot_skip(snapshot, i);
+            }
+        }
+        strcpy(delta->base, last_backup);
+    }
+    job->delta = delta;
+
+    backup_generation++;
+    snprintf(last_backup, sizeof(last_backup), "%s", job->name);
+}
+
+/// Takes a snapshot of the table. With copy_on_write this only registers the
+/// snapshot, so writers are held back for a moment whatever the size of the
+/// table. Otherwise the pairs are copied while the shards are paused or
+/// htMutex is held for writing. Either way the snapshot records the position
+/// of the WAL, which every command it holds was appended before.
+/// @param job Backup the snapshot is for, NULL for SHOW. Its delta, NULL for
+/// a full backup, and its chain are set here, only copy_on_write snapshots
+/// making deltas, and its version is set to the state_version of the
+/// snapshot, 0 with shards, whose state it does not follow.
+/// @return The snapshot, to be written with write_snapshot. NULL on
+/// failure.
+static Snapshot* take_snapshot(BackupJob* job) {
+    Snapshot* snapshot = snapshot_create(copy_on_write() ? num_stripes : 1);
+    if (job != NULL) {
+        job->delta = NULL;
+        job->chain = NULL;
+        job->version = 0;
+    }
+    if (snapshot == NULL) return NULL;
+
+    if (copy_on_write()) {
+        rwl_wrlock(&htMutex);
+        snapshot->next = active_snapshots;
+        active_snapshots = snapshot;
+        if (job != NULL) {
+            start_backup(snapshot, job);
+            job->version = atomic_load(&state_version);
+        }
+        snapshot->wal_offset = wal_position();
+        rwl_unlock(&htMutex);
+        return snapshot;
+    }
+
+    size_t count;
+    KvsPair* pairs;
+    if (sharded) {
+        shard_pause();
+        pairs = shard_list_pairs(&count);
+        snapshot_save(snapshot, 0, pairs, count);
+        snapshot->wal_offset = wal_position();
+        shard_resume();
+    } else {
+        rwl_wrlock(&htMutex);
+        pairs = kvs_engine->list_pairs(kvs_table, &count);
+        snapshot_save(snapshot, 0, pairs, count);
+        if (job != NULL) job->version = atomic_load(&state_version);
+        snapshot->wal_offset = wal_position();
+        rwl_unlock(&htMutex);
+    }
+    free(pairs);
+    return snapshot;
+}
+
+/// Saves the stripes of a snapshot that no writer saved, one at a time while
+/// the others are written, then stops writers from saving into it.
+/// @param snapshot Snapshot returned by take_snapshot.
+static void finish_snapshot(Snapshot* snapshot) {
+    if (!copy_on_write()) return;
+
+    for (size_t i = 0; i < num_stripes; i++) {
+        rwl_rdlock(&htMutex);
+        rwl_rdlock(&bucket_mutex[i].lock);
+        if (!snapshot->stripes[i].saved) {
+            size_t count;
+            KvsPair* pairs = kvs_engine->list_stripe(kvs_table, i, &count);
+            snapshot_save(snapshot, i, pairs, count);
+            free(pairs);
+        }
+        rwl_unlock(&bucket_mutex[i].lock);
+        rwl_unlock(&htMutex);
+    }
+
+    rwl_wrlock(&htMutex);
+    Snapshot** link = &active_snapshots;
+    while (*link != snapshot) link = &(*link)->next;
+    *link = snapshot->next;
+    rwl_unlock(&htMutex);
+}
+
+/// Writes bytes to an output, as a DumpSink.
+/// @param ctx Output to write to.
+/// @param data Bytes to write.
+/// @param size Number of bytes.
+/// @return 0 if the bytes were written, 1 otherwise.
+static int write_output(void* ctx, const char* data, size_t size) {
+    Output* out = ctx;
+    if (out->lz != NULL) return lz_write(out->lz, data, size);
+    if (out->throttled) throttle_backup(size);
+    return write_fully(out->fd, data, size);
+}
+
+/// Writes pairs as the text of SHOW, sorted by key, buffering the output so
+/// that it takes one write per SHOW_BUFFER_SIZE bytes rather than per pair.
+/// @param pairs Pairs to write, sorted here.
+/// @param count Number of pairs.
+/// @param out Output to write to.
+/// @return 0 if the pairs were written, 1 otherwise.
+static int write_text(KvsPair* pairs, size_t count, Output* out) {
+    // Buckets are ordered by hash, so the pairs are sorted by key to keep the
+    // output independent of the engine and of the table size
+    if (count > 0) qsort(pairs, count, sizeof(KvsPair), compare_pairs);
+
+    char* buffer = malloc(SHOW_BUFFER_SIZE);
+    char line[MAX_STRING_SIZE * 2 + 12];
+    size_t used = 0;
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        int len = sprintf(line, "(%s, %s)\n", pairs[i].key, pairs[i].value);
+        if (buffer == NULL) {
+            result = write_output(out, line, (size_t)len);
+            continue;
+        }
+        if (used + (size_t)len > SHOW_BUFFER_SIZE) {
+            result = write_output(out, buffer, used);
+            used = 0;
+        }
+        memcpy(buffer + used, line, (size_t)len);
+        used += (size_t)len;
+    }
+    if (result == 0 && used > 0) result = write_output(out, buffer, used);
+    free(buffer);
+    return result;
+}
+
+/// Completes a snapshot and writes its pairs.
+/// @param snapshot Snapshot returned by take_snapshot, freed here.
+/// @param out Output to write to.
+/// @param binary Whether to write a binary snapshot (see dump.h) rather than
+/// the text of SHOW.
+/// @return 0 if the pairs were written, 1 if the snapshot is incomplete or
+/// could not be written.
+static int write_snapshot(Snapshot* snapshot, Output* out, int binary) {
+    finish_snapshot(snapshot);
+    if (atomic_load(&snapshot->failed)) {
+        snapshot_free(snapshot);
+        return 1;
+    }
+
+    size_t count;
+    KvsPair* pairs;
+    int result;
+    if (snapshot_pairs(snapshot, &pairs, &count) != 0) {
+        // An empty backup would look like a complete one of an empty table
+        result = 1;
+    } else if (out->threads > 0) {
+        size_t threads = backup_threads(count, out->threads);
+        off_t offset = lseek(out->fd, 0, SEEK_CUR);
+        if (!binary) backup_sort(pairs, count, threads);
+        result = offset < 0 ||
+                 (binary ? dump_write_at(out->fd, offset, pairs, count,
+                                         threads, snapshot->wal_offset)
+                         : backup_write_text(out->fd, offset, pairs, count,
+                                             threads));
+    } else {
+        result = binary ? dump_write(write_output, out, pairs, count,
+                                     snapshot->wal_offset)
+                        : write_text(pairs, count, out);
+    }
+    free(pairs);
+    snapshot_free(snapshot);
+    return result;
+}
+
+/// Writes a delta backup: a line with the number of stripes and the file
+/// name of the previous backup, a line with the changed stripes, and then
+/// their pairs as the text of SHOW.
+/// @param snapshot Snapshot of the changed stripes, freed here.
+/// @param delta Delta of the backup.
+/// @param out Output to write the backup to.
+/// @return 0 if the backup was written, 1 otherwise.
+static int write_delta(Snapshot* snapshot, const Delta* delta, Output* out) {
+    // Up to 5 digits and a space per stripe
+    char* header = malloc(sizeof(delta->base) + 64 + num_stripes * 6);
+    if (header == NULL) {
+        finish_snapshot(snapshot);
+        snapshot_free(snapshot);
+        return 1;
+    }
+
+    size_t changed = 0;
+    for (size_t w = 0; w < (num_stripes + 63) / 64; w++) {
+        changed += (size_t)__builtin_popcountll(delta->changed.words[w]);
+    }
+    int len = sprintf(header, "KVSDELTA %zu %s\nSTRIPES %zu", num_stripes,
+                      delta->base, changed);
+    for (size_t w = 0; w < (num_stripes + 63) / 64; w++) {
+        for (uint64_t bits = delta->changed.words[w]; bits != 0;
+             bits &= bits - 1) {
+            len += sprintf(header + len, " %zu",
+                           w * 64 + (size_t)__builtin_ctzll(bits));
+        }
+    }
+    header[len++] = '\n';
+    int result = write_output(out, header, (size_t)len);
+    free(header);
+
+    // The snapshot is completed even if the header failed, so that writers
+    // stop saving stripes into it
+    return write_snapshot(snapshot, out, 0) != 0 || result != 0;
+}
+
+/// Copies a backup file to the files of the backups merged into it.
+/// @param job Backup whose file is written.
+/// @return 0 if every copy was written, 1 otherwise.
+static int copy_backup(const BackupJob* job) {
+    char* buffer = malloc(BACKUP_BUFFER_SIZE);
+    if (buffer == NULL) return 1;
+
+    int result = 0;
+    off_t offset = 0;
+    for (;;) {
+        ssize_t size = pread(job->fd, buffer, BACKUP_BUFFER_SIZE, offset);
+        if (size < 0) result = 1;
+        if (size <= 0) break;
+        for (size_t i = 0; i < job->num_copies && result == 0; i++) {
+            throttle_backup((size_t)size);
+            result = write_fully(job->copies[i].fd, buffer, (size_t)size);
+        }
+        if (result != 0) break;
+        offset += size;
+    }
+    free(buffer);
+    return result;
+}
+
+/// Makes the files of a backup and of the backups merged into it durable
+/// under their names.
+/// @param job Backup whose files are written.
+/// @return 0 on success, 1 otherwise.
+static int commit_files(const BackupJob* job) {
+    int result = backup_commit(job->fd, job->path);
+    for (size_t i = 0; i < job->num_copies; i++) {
+        result |= backup_commit(job->copies[i].fd, job->copies[i].path);
+    }
+    return result;
+}
+
+/// Syncs the directories of a backup and of the backups merged into it,
+/// each once.
+/// @param job Backup whose files are committed.
+/// @return 0 on success, 1 otherwise.
+static int sync_dirs(const BackupJob* job) {
+    char dir[PATH_MAX];
+    char other[PATH_MAX];
+    backup_dir(job->path, dir, sizeof(dir));
+    int result = backup_sync_dir(dir);
+    for (size_t i = 0; i < job->num_copies; i++) {
+        backup_dir(job->copies[i].path, other, sizeof(other));
+        if (strcmp(other, dir) != 0) result |= backup_sync_dir(other);
+    }
+    return result;
+}
+
+/// Adds a backup file to KVS_BACKUP_STORE and replaces it, and the backups
+/// merged into it, by hard links to its manifest, printing how much of it
+/// the store did not hold yet.
+/// @param job Backup whose file is written.
+/// @return 0 if every file was replaced, 1 otherwise.
+static int store_files(const BackupJob* job) {
+    char manifest[PATH_MAX];
+    StoreStats stats;
+    if (store_backup(kvs_config.backup_store, job->fd, manifest, &stats) !=
+        0) {
+        return 1;
+    }
+    int result = store_link(manifest, job->path);
+    for (size_t i = 0; i < job->num_copies; i++) {
+        result |= store_link(manifest, job->copies[i].path);
+    }
+    if (result == 0) {
+        printf("Backup %s: %llu bytes in %zu chunks, %zu new (%llu bytes "
+               "stored)%s\n",
+               job->name, (unsigned long long)stats.bytes, stats.chunks,
+               stats.new_chunks, (unsigned long long)stats.new_bytes,
+               stats.new_manifest ? "" : ", same as an earlier backup");
+    }
+    return result;
+}
+
+/// Waits until the backups before a backup in its chain are committed or
+/// have failed, so that a delta is never committed before its base.
+/// @param job Backup about to be committed.
+/// @return 1 if one of them failed, 0 otherwise.
+static int wait_chain(const BackupJob* job) {
+    if (job->chain == NULL) return 0;
+    pthread_mutex_lock(&backups_mutex);
+    while (job->chain->finished < job->link) {
+        pthread_cond_wait(&chain_finished, &backups_mutex);
+    }
+    int broken = job->chain->broken;
+    pthread_mutex_unlock(&backups_mutex);
+    return broken;
+}
+
+/// Records that a backup was committed or failed, a failure breaking its
+/// chain, and drops its reference to the chain.
+/// @param job Backup written by write_backup.
+/// @param result 0 if the backup was committed, 1 otherwise.
+static void finish_chain(const BackupJob* job, int result) {
+    if (job->chain == NULL) return;
+    pthread_mutex_lock(&backups_mutex);
+    job->chain->finished++;
+    job->chain->broken |= result;
+    release_chain(job->chain);
+    pthread_cond_broadcast(&chain_finished);
+    pthread_mutex_unlock(&backups_mutex);
+}
+
+/// Writes a backup file, copies it to the backups merged into it and closes
+/// them. A compressed backup is written through an LzWriter, whose
+/// statistics are printed once it is complete; if the writer cannot be
+/// started the backup is written uncompressed, which every reader of
+/// compressed backups also accepts. An uncompressed backup is sorted and
+/// written by KVS_BACKUP_THREADS threads. With KVS_BACKUP_STORE the files
+/// become links to a manifest in the store rather than copies. Files are
+/// written to temporary files and renamed once synced, so a crash never
+/// leaves a partial backup under the name of a complete one.
+/// @param job Backup to write, freed here.
+static void write_backup(BackupJob* job) {
+    Output out = {job->fd, job->compress ? lz_writer_open(job->fd) : NULL, 0,
+                  1};
+    if (out.lz == NULL) out.threads = kvs_config.backup_threads;
+    int result = job->delta != NULL
+                     ? write_delta(job->snapshot, job->delta, &out)
+                     : write_snapshot(job->snapshot, &out, job->binary);
+    if (out.lz != NULL) {
+        LzStats stats;
+        result |= lz_writer_close(out.lz, &stats);
+        if (result == 0) {
+            // compressed_bytes includes the file header, so it is never 0
+            printf("Backup %s: %llu bytes compressed to %llu (%.2fx) at "
+                   "%.1f MB/s\n",
+                   job->name, (unsigned long long)stats.raw_bytes,
+                   (unsigned long long)stats.compressed_bytes,
+                   (double)stats.raw_bytes / (double)stats.compressed_bytes,
+                   (double)stats.raw_bytes / (stats.seconds + 1e-9) / 1e6);
+        }
+    }
+    if (wait_chain(job) != 0) result = 1;
+    if (result == 0 && kvs_config.backup_store != NULL) {
+        result = store_files(job);
+    } else if (result == 0) {
+        if (job->num_copies > 0) result = copy_backup(job);
+        if (result == 0) result = commit_files(job);
+    }
+    if (result == 0) result = sync_dirs(job);
+    if (result != 0) {
+        fprintf(stderr, "Failed to write backup\n");
+    }
+    finish_chain(job, result);
+    // Removes the temporary files left by a failure or by the store
+    close(job->fd);
+    backup_discard(job->path);
+    for (size_t i = 0; i < job->num_copies; i++) {
+        close(job->copies[i].fd);
+        backup_discard(job->copies[i].path);
+        free(job->copies[i].path);
+    }
+    free(job->copies);
+    free(job->delta);
+    free(job->path);
+    free(job->name);
+    free(job);
+}
+
+/// Takes the oldest pending backup whose previous backup in its chain was
+/// taken already. wait_chain then never waits for a backup that no thread
+/// writes, and the first pending backup of a chain can always be taken.
+/// Must be called with backups_mutex held.
+/// @return The backup, NULL if none are pending.
+static BackupJob* take_backup() {
+    BackupJob* prev = NULL;
+    BackupJob* job = pending_head;
+    while (job != NULL && job->chain != NULL &&
+           job->chain->taken < job->link) {
+        prev = job;
+        job = job->next;
+    }
+    if (job == NULL) return NULL;
+
+    if (prev != NULL) {
+        prev->next = job->next;
+    } else {
+        pending_head = job->next;
+    }
+    if (pending_tail == job) pending_tail = prev;
+    if (job->chain != NULL) job->chain->taken++;
+    return job;
+}
+
+/// Writes pending backups until there are none left.
+/// @param arg Unused.
+static void* backup_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&backups_mutex);
+    BackupJob* job;
+    while ((job = take_backup()) != NULL) {
+        pthread_mutex_unlock(&backups_mutex);
+
+        write_backup(job);
+        pthread_mutex_lock(&backups_mutex);
+    }
+    if (--running_backups == 0) pthread_cond_broadcast(&backups_done);
+    pthread_mutex_unlock(&backups_mutex);
+    return NULL;
+}
+
+/// Adds a backup file to the last pending backup, when nothing changed since
+/// its snapshot was taken, so that both get the same file and the state is
+/// only written once.
+/// @param fd File descriptor of the backup file.
+/// @param path Path of the backup file, owned by the pending backup if it
+/// was merged.
+/// @return 1 if the backup was merged, 0 otherwise.
+static int merge_backup(int fd, char* path) {
+    if (sharded) return 0;
+
+    rwl_wrlock(&htMutex);
+    pthread_mutex_lock(&backups_mutex);
+    BackupJob* job = pending_tail;
+    int merged = job != NULL && job->version != 0 &&
+                 job->version == atomic_load(&state_version);
+    if (merged) {
+        BackupCopy* copies =
+            realloc(job->copies, (job->num_copies + 1) * sizeof(BackupCopy));
+        if (copies != NULL) {
+            copies[job->num_copies++] = (BackupCopy){fd, path};
+            job->copies = copies;
+        } else {
+            merged = 0;
         }
-        keyNode = keyNode->next;
     }
+    pthread_mutex_unlock(&backups_mutex);
+    rwl_unlock(&htMutex);
+    return merged;
+}
+
+/// Queues a backup, starting a thread to write it unless max_backups
+/// threads are already writing backups, one of which will write it next.
+/// @param job Backup to write.
+static void queue_backup(BackupJob* job) {
+    pthread_mutex_lock(&backups_mutex);
+    job->next = NULL;
+    if (pending_tail != NULL) {
+        pending_tail->next = job;
+    } else {
+        pending_head = job;
+    }
+    pending_tail = job;
+    int start = running_backups < max_backups;
+    if (start) running_backups++;
+    pthread_mutex_unlock(&backups_mutex);
+    if (!start) return;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, backup_thread, NULL) != 0) {
+        // Write the backups on this thread instead
+        backup_thread(NULL);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/// Starts the shards, each table with an equal part of the lock stripes.
+/// @return 0 if the shards were started, 1 otherwise.
+static int init_shards() {
+    size_t stripes = 1;
+    while (stripes * 2 * kvs_config.shards <= kvs_config.lock_stripes) {
+        stripes *= 2;
+    }
+
+    slab_init();
+    epoch_init();
+    kvs_engine = kvs_config.engine;
+    if (shard_init(kvs_engine, kvs_config.shards, stripes) != 0) {
+        epoch_destroy();
+        slab_destroy();
+        return 1;
+    }
+    sharded = 1;
+    return 0;
+}
+
+/// Applies a command of the WAL, see wal_replay.
+static int replay_command(WalOp op, size_t num_pairs,
+                          char keys[][MAX_STRING_SIZE],
+                          char values[][MAX_STRING_SIZE]) {
+    if (op == WAL_WRITE) return kvs_write(num_pairs, keys, values);
+    return kvs_delete(num_pairs, keys, replay_fd);
+}
+
+/// Partition of a key for wal_replay: its lock stripe, so that the threads
+/// of a replay rarely take the same stripes.
+static size_t replay_partition(const char* key) {
+    return lock_index(key, kvs_config.lock_stripes);
+}
 
-    rwl_unlock(&kvs_table->mutex[hash_key]);
+// Pairs written by restore_pairs, which tell whether a snapshot that failed
+// to load left pairs in the table
+static atomic_long restored_pairs;
+
+/// Restores a batch of pairs of a snapshot, see dump_load.
+static int restore_pairs(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                         char values[][MAX_STRING_SIZE]) {
+    if (kvs_write(num_pairs, keys, values) != 0) return 1;
+    atomic_fetch_add(&restored_pairs, (long)num_pairs);
+    return 0;
+}
+
+// Snapshot file found by list_snapshots
+typedef struct SnapshotFile {
+    char* path;
+    struct timespec mtime;
+} SnapshotFile;
+
+/// Orders snapshot files newest first, by name when written at once.
+static int compare_snapshots(const void* a, const void* b) {
+    const SnapshotFile* x = a;
+    const SnapshotFile* y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? 1 : -1;
+    }
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? 1 : -1;
+    }
+    return strcmp(y->path, x->path);
+}
+
+/// Checks if a file name is that of a binary backup, compressed or not.
+static int is_snapshot_name(const char* name) {
+    size_t len = strlen(name);
+    return (len > 5 && strcmp(name + len - 5, ".snap") == 0) ||
+           (len > 8 && strcmp(name + len - 8, ".snap.lz") == 0);
+}
+
+/// Lists the snapshots of KVS_RESTORE, which is a snapshot or a directory
+/// of .snap and .snap.lz files.
+/// @param count Pointer to store the number of snapshots in.
+/// @return Array of snapshots, newest first, to be freed with their paths by
+/// the caller. NULL on failure.
+static SnapshotFile* list_snapshots(size_t* count) {
+    const char* restore = kvs_config.restore_path;
+    struct stat st;
+    DIR* dir = stat(restore, &st) == 0 && S_ISDIR(st.st_mode)
+                   ? opendir(restore)
+                   : NULL;
+    size_t capacity = 16;
+    SnapshotFile* files = malloc(capacity * sizeof(SnapshotFile));
+    *count = 0;
+    if (files == NULL) {
+        if (dir != NULL) closedir(dir);
+        return NULL;
+    }
+    if (dir == NULL) {
+        files[0] = (SnapshotFile){strdup(restore), {0, 0}};
+        if (files[0].path == NULL) {
+            free(files);
+            return NULL;
+        }
+        *count = 1;
+        return files;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        if (!is_snapshot_name(entry->d_name) ||
+            snprintf(path, sizeof(path), "%s/%s", restore, entry->d_name) >=
+                (int)sizeof(path) ||
+            stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (*count == capacity) {
+            SnapshotFile* grown =
+                realloc(files, capacity * 2 * sizeof(SnapshotFile));
+            if (grown == NULL) break;
+            files = grown;
+            capacity *= 2;
+        }
+        files[*count] = (SnapshotFile){strdup(path), st.st_mtim};
+        if (files[*count].path != NULL) (*count)++;
+    }
+    closedir(dir);
+    qsort(files, *count, sizeof(SnapshotFile), compare_snapshots);
+    return files;
+}
+
+/// Loads a snapshot with kvs_config.recovery_threads threads.
+/// @param path Path of the snapshot.
+/// @param wal_offset Pointer to store the position of the WAL it holds in.
+/// @return Number of pairs restored, -1 on failure.
+static long load_snapshot(const char* path, uint64_t* wal_offset) {
+    // Engines that grow a little on each write would fall behind the load
+    long count = dump_count(path, wal_offset);
+    if (count < 0) return -1;
+    if (!sharded && kvs_engine->reserve != NULL) {
+        rwl_wrlock(&htMutex);
+        kvs_engine->reserve(kvs_table, (size_t)count);
+        rwl_unlock(&htMutex);
+    }
+    return dump_load(path, kvs_config.recovery_threads, restore_pairs);
+}
+
+/// Loads the snapshot of KVS_RESTORE, if one is configured. In a directory
+/// the newest snapshot is loaded, or the newest that is valid: one that is
+/// not a snapshot or is truncated fails before restoring any pair, and the
+/// next is tried. A directory without snapshots is not an error: a crash
+/// before the first backup leaves it so, and the whole WAL is replayed.
+/// @param wal_offset Pointer to store the position of the WAL from which it
+/// is replayed in, 0 without a snapshot.
+/// @param seconds Pointer to store the time of the load in.
+/// @return 0 if the snapshot was loaded or there is none, 1 otherwise.
+static int restore_snapshot(uint64_t* wal_offset, double* seconds) {
+    *wal_offset = 0;
+    *seconds = 0;
+    if (kvs_config.restore_path == NULL) return 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t count;
+    SnapshotFile* files = list_snapshots(&count);
+    if (files == NULL) return 1;
+    if (count == 0) {
+        printf("No snapshot to restore in %s\n", kvs_config.restore_path);
+        free(files);
+        return 0;
+    }
+
+    long restored = -1;
+    size_t i = 0;
+    atomic_init(&restored_pairs, 0);
+    for (; i < count && restored < 0; i++) {
+        restored = load_snapshot(files[i].path, wal_offset);
+        if (restored < 0 && atomic_load(&restored_pairs) > 0) break;
+        if (restored < 0) {
+            fprintf(stderr, "Skipping invalid snapshot %s\n", files[i].path);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = (double)(end.tv_sec - start.tv_sec) +
+               (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (restored < 0) {
+        fprintf(stderr, "Failed to restore %s\n",
+                i > 0 && i <= count ? files[i - 1].path
+                                    : kvs_config.restore_path);
+    } else {
+        printf("Restored %ld pairs from %s in %.3f s (%.0f pairs/s)\n",
+               restored, files[i - 1].path, *seconds,
+               (double)restored / (*seconds + 1e-9));
+    }
+    for (size_t j = 0; j < count; j++) free(files[j].path);
+    free(files);
+    return restored < 0;
+}
+
+/// Replays the write-ahead log into the table from a position, if one is
+/// configured, with kvs_config.recovery_threads threads, and opens it for
+/// the commands to come.
+/// @param wal_offset Position of the first command to replay.
+/// @param seconds Pointer to store the time of the replay in.
+/// @return 0 if the log was replayed and opened, 1 otherwise.
+static int open_wal(uint64_t wal_offset, double* seconds) {
+    *seconds = 0;
+    if (kvs_config.wal_path == NULL) return 0;
+
+    // The keys deleted by the log that were already missing are not reported
+    replay_fd = open("/dev/null", O_WRONLY);
+    if (replay_fd == -1) {
+        perror("Failed to open /dev/null");
+        return 1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long replayed =
+        wal_replay(kvs_config.wal_path, wal_offset,
+                   kvs_config.recovery_threads, replay_partition,
+                   replay_command);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(replay_fd);
+    replay_fd = -1;
+    *seconds = (double)(end.tv_sec - start.tv_sec) +
+               (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (replayed < 0) {
+        fprintf(stderr, "Failed to replay the WAL\n");
+        return 1;
+    }
+    if (replayed > 0) {
+        printf("Replayed %ld commands from the WAL in %.3f s (%.0f "
+               "commands/s)\n",
+               replayed, *seconds, (double)replayed / (*seconds + 1e-9));
+    }
+    return wal_open(kvs_config.wal_path, kvs_config.wal_sync_ms);
+}
+
+/// Recovers the state from the snapshot of KVS_RESTORE and the commands of
+/// the WAL after it, before any command runs, printing how long it took.
+/// @return 0 on success, 1 otherwise.
+static int recover() {
+    uint64_t wal_offset;
+    double load_seconds;
+    double replay_seconds;
+    if (restore_snapshot(&wal_offset, &load_seconds) != 0 ||
+        open_wal(wal_offset, &replay_seconds) != 0) {
+        return 1;
+    }
+    if (kvs_config.restore_path != NULL && kvs_config.wal_path != NULL) {
+        printf("Recovered in %.3f s with KVS_RECOVERY_THREADS=%zu\n",
+               load_seconds + replay_seconds, kvs_config.recovery_threads);
+    }
     return 0;
 }
 
 int kvs_init() {
-    if (kvs_table != NULL) {
+    if (kvs_table != NULL || sharded) {
         fprintf(stderr, "KVS state has already been initialized\n");
         return 1;
     }
+    throttle_init(kvs_config.backup_rate);
+    if (kvs_config.backup_store != NULL &&
+        store_init(kvs_config.backup_store) != 0) {
+        return 1;
+    }
 
-    kvs_table = create_hash_table();
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        rwl_init(&kvs_table->mutex[i]);
+    if (kvs_config.shards > 0) {
+        if (init_shards() != 0) return 1;
+        if (recover() != 0) {
+            kvs_terminate();
+            return 1;
+        }
+        return 0;
     }
-    rwl_init(&kvs_table->htMutex);
 
-    return kvs_table == NULL;
+    num_stripes = kvs_config.lock_stripes;
+    bucket_mutex =
+        aligned_alloc(CACHE_LINE_SIZE, num_stripes * sizeof(LockStripe));
+    stripe_generations = calloc(num_stripes, sizeof(uint64_t));
+    if (bucket_mutex == NULL || stripe_generations == NULL) {
+        free(bucket_mutex);
+        free(stripe_generations);
+        bucket_mutex = NULL;
+        stripe_generations = NULL;
+        return 1;
+    }
+    backup_generation = 1;
+    last_backup[0] = '\0';
+
+    slab_init();
+    epoch_init();
+    kvs_engine = kvs_config.engine;
+    kvs_table = kvs_engine->create_table(num_stripes);
+    if (kvs_table == NULL) {
+        epoch_destroy();
+        slab_destroy();
+        free(bucket_mutex);
+        free(stripe_generations);
+        bucket_mutex = NULL;
+        stripe_generations = NULL;
+        return 1;
+    }
+
+    for (size_t i = 0; i < num_stripes; i++) {
+        rwl_init(&bucket_mutex[i].lock);
+    }
+    rwl_init(&htMutex);
+    atomic_init(&rehash_cursor, 0);
+    combine_init();
+
+    if (recover() != 0) {
+        kvs_terminate();
+        return 1;
+    }
+    return 0;
 }
 
 int kvs_terminate() {
-    if (kvs_table == NULL) {
+    if (kvs_table == NULL && !sharded) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        rwl_destroy(&kvs_table->mutex[i]);
+    // Backup threads read the table until they are done
+    kvs_wait_backup();
+    pthread_mutex_lock(&backups_mutex);
+    release_chain(current_chain);
+    current_chain = NULL;
+    pthread_mutex_unlock(&backups_mutex);
+    wal_close();
+    if (kvs_config.backup_rate > 0) {
+        printf("Backups throttled for %.3f s\n", throttle_seconds());
+    }
+
+    if (sharded) {
+        if (kvs_config.alloc_stats) slab_print_stats(stderr);
+        shard_destroy();
+        epoch_destroy();
+        slab_destroy();
+        sharded = 0;
+        return 0;
     }
 
-    rwl_destroy(&kvs_table->htMutex);
+    for (size_t i = 0; i < num_stripes; i++) {
+        rwl_destroy(&bucket_mutex[i].lock);
+    }
+    free(bucket_mutex);
+    free(stripe_generations);
+    bucket_mutex = NULL;
+    stripe_generations = NULL;
 
-    free_table(kvs_table);
+    rwl_destroy(&htMutex);
+    combine_destroy();
+
+    if (kvs_config.alloc_stats) slab_print_stats(stderr);
+
+    // The pairs live in slabs, freeing those at once is cheaper than walking
+    // the table
+    if (kvs_engine->drop_table != NULL) {
+        kvs_engine->drop_table(kvs_table);
+    } else {
+        kvs_engine->free_table(kvs_table);
+    }
+    epoch_destroy();
+    slab_destroy();
+    kvs_table = NULL;
     return 0;
 }
 
 int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
               char values[][MAX_STRING_SIZE]) {
-    if (kvs_table == NULL) {
+    if (kvs_table == NULL && !sharded) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    rwl_rdlock(&kvs_table->htMutex);
+    // Each pair is written by the shard that owns the key, without locks
+    if (sharded) {
+        int failed[MAX_WRITE_SIZE];
+        if (shard_write(num_pairs, keys, values, failed) != 0) return 1;
+        for (size_t i = 0; i < num_pairs; i++) {
+            if (!failed[i]) notify_subscribers(keys[i], values[i]);
+        }
 
-    // List of int's to keep track of the locks
-    int locks[26] = {0};
+        report_failed_writes(num_pairs, keys, values, failed);
+        return wal_commit();
+    }
 
-    // lock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 0) {
-            rwl_wrlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 1;
+    rwl_rdlock(&htMutex);
+    atomic_fetch_add(&state_version, 1);
+
+    // Engines with lock-free writes make the whole batch visible at once.
+    // With a WAL they take the stripes anyway, so that the writes of a key
+    // are logged in the order they are applied.
+    if (kvs_engine->lockfree_writes) {
+        StripeSet stripes;
+        int logged = wal_enabled();
+        if (logged) {
+            get_stripes(&stripes, num_pairs, keys);
+            lock_stripes(&stripes, 1);
         }
+
+        if (kvs_engine->write_batch(kvs_table, num_pairs, keys, values) != 0) {
+            for (size_t i = 0; i < num_pairs; i++) {
+                fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i],
+                        values[i]);
+            }
+        } else {
+            for (size_t i = 0; i < num_pairs; i++) {
+                notify_subscribers(keys[i], values[i]);
+            }
+        }
+        if (logged) {
+            wal_append(WAL_WRITE, num_pairs, keys, values);
+            unlock_stripes(&stripes);
+        }
+
+        release_table();
+        return wal_commit();
     }
 
+    // A command on a single stripe can be applied by whichever thread holds
+    // the stripe, along with the other commands waiting for it
+    int failed[MAX_WRITE_SIZE];
+    if (combine_command(num_pairs, keys, values, failed) == 0) {
+        release_table();
+        report_failed_writes(num_pairs, keys, values, failed);
+        return wal_commit();
+    }
+
+    // lock the stripes that correspond to the hash of the keys
+    StripeSet stripes;
+    get_stripes(&stripes, num_pairs, keys);
+    lock_stripes(&stripes, 1);
+    save_stripes(&stripes);
+
     // Write the key-value pairs
     for (size_t i = 0; i < num_pairs; i++) {
-        if (write_pair(kvs_table, keys[i], values[i]) != 0) {
+        if (kvs_engine->write_pair(kvs_table, keys[i], values[i]) != 0) {
             fprintf(stderr, "Failed to write keypair (%s,%s)\n", keys[i],
                     values[i]);
+        } else {
+            notify_subscribers(keys[i], values[i]);
         }
     }
+    wal_append(WAL_WRITE, num_pairs, keys, values);
 
-    // unlock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 1) {
-            rwl_unlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 0;
-        }
-    }
+    unlock_stripes(&stripes);
 
-    rwl_unlock(&kvs_table->htMutex);
+    release_table();
 
-    return 0;
+    // Waits for the log to be durable without holding any lock
+    return wal_commit();
 }
 
 int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out) {
-    if (kvs_table == NULL) {
+    if (kvs_table == NULL && !sharded) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    // Its not necessary to lock the whole hasTable, since we are only reading
+    char* results[MAX_WRITE_SIZE];
+    if (sharded) {
+        // Each key is read by the shard that owns it
+        if (shard_read(num_pairs, keys, results) != 0) return 1;
+    } else {
+        // Engines with lock-free reads only need an epoch, which keeps the
+        // nodes and bucket arrays being read from being freed. Otherwise
+        // readers lock htMutex for reading, so that the bucket arrays are not
+        // swapped by a resize while they are being read, and the stripes of
+        // the keys. The stripes also keep a WRITE of several keys from being
+        // seen in part, so engines that lock them to write only skip them
+        // with KVS_LOCKFREE_READS.
+        StripeSet stripes;
+        int lockfree = kvs_engine->lockfree_reads &&
+                       (kvs_engine->lockfree_writes ||
+                        kvs_config.lockfree_reads) &&
+                       epoch_enter() == 0;
+        if (!lockfree) {
+            rwl_rdlock(&htMutex);
+            get_stripes(&stripes, num_pairs, keys);
+            lock_stripes(&stripes, 0);
+        }
 
-    // List of int's to keep track of the locks
-    int locks[26] = {0};
+        for (size_t i = 0; i < num_pairs; i++) {
+            results[i] = kvs_engine->read_pair(kvs_table, keys[i]);
+        }
 
-    // lock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 0) {
-            rwl_rdlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 1;
+        if (lockfree) {
+            epoch_exit();
+        } else {
+            unlock_stripes(&stripes);
+            rwl_unlock(&htMutex);
         }
     }
 
     tryWrite(fd_out, "[", 1);
     for (size_t i = 0; i < num_pairs; i++) {
-        char* result = read_pair(kvs_table, keys[i]);
-        if (result == NULL) {
+        if (results[i] == NULL) {
             char buffer[MAX_STRING_SIZE * 2 + 12];
             sprintf(buffer, "(%s,KVSERROR)", keys[i]);
             tryWrite(fd_out, buffer, strlen(buffer));
 
         } else {
             char buffer[MAX_STRING_SIZE * 2 + 12];  // Adjust size as needed
-            sprintf(buffer, "(%s,%s)", keys[i], result);
+            sprintf(buffer, "(%s,%s)", keys[i], results[i]);
             tryWrite(fd_out, buffer, strlen(buffer));
         }
-        free(result);
+        slab_free(results[i]);
     }
     tryWrite(fd_out, "]\n", 2);
 
-    // unlock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 1) {
-            rwl_unlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 0;
-        }
-    }
-
-    // rwl_unlock(&kvs_table->htMutex);
-
     return 0;
 }
 
 int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out) {
-    if (kvs_table == NULL) {
+    if (kvs_table == NULL && !sharded) {
         fprintf(stderr, "KVS state must be initialized\n");
         return 1;
     }
 
-    rwl_rdlock(&kvs_table->htMutex);
-    // List of int's to keep track of the locks
-    int locks[26] = {0};
-
-    // lock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 0) {
-            rwl_wrlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 1;
+    // Each key is deleted by the shard that owns it, without locks
+    if (sharded) {
+        int failed[MAX_WRITE_SIZE];
+        if (shard_delete(num_pairs, keys, failed) != 0) return 1;
+        for (size_t i = 0; i < num_pairs; i++) {
+            if (!failed[i]) notify_subscribers(keys[i], "DELETED");
         }
+
+        write_missing(fd_out, num_pairs, keys, failed);
+        return wal_commit();
+    }
+
+    rwl_rdlock(&htMutex);
+    atomic_fetch_add(&state_version, 1);
+
+    int failed[MAX_WRITE_SIZE];
+    if (!kvs_engine->lockfree_writes &&
+        combine_command(num_pairs, keys, NULL, failed) == 0) {
+        release_table();
+        write_missing(fd_out, num_pairs, keys, failed);
+        return wal_commit();
+    }
+
+    // lock the stripes that correspond to the hash of the keys, unless the
+    // engine deletes without locks (each key is then deleted atomically on
+    // its own) and there is no WAL to keep in order
+    StripeSet stripes;
+    int locked = !kvs_engine->lockfree_writes || wal_enabled();
+    if (locked) {
+        get_stripes(&stripes, num_pairs, keys);
+        lock_stripes(&stripes, 1);
+        save_stripes(&stripes);
     }
 
     int aux = 0;
 
     for (size_t i = 0; i < num_pairs; i++) {
-        if (delete_pair(kvs_table, keys[i]) != 0) {
+        if (kvs_engine->delete_pair(kvs_table, keys[i]) != 0) {
             if (!aux) {
                 tryWrite(fd_out, "[", 1);
                 aux = 1;
@@ -189,95 +1472,110 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out) {
             char buffer[MAX_STRING_SIZE * 2 + 12];
             sprintf(buffer, "(%s,KVSMISSING)", keys[i]);
             tryWrite(fd_out, buffer, strlen(buffer));
+        } else {
+            notify_subscribers(keys[i], "DELETED");
         }
     }
     if (aux) {
         tryWrite(fd_out, "]\n", 2);
     }
+    wal_append(WAL_DELETE, num_pairs, keys, NULL);
 
-    // unlock the mutex that correspond to the hash of the key
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (locks[hash(keys[i])] == 1) {
-            rwl_unlock(&kvs_table->mutex[hash(keys[i])]);
-            locks[hash(keys[i])] = 0;
-        }
-    }
+    if (locked) unlock_stripes(&stripes);
 
-    rwl_unlock(&kvs_table->htMutex);
+    release_table();
 
-    return 0;
+    return wal_commit();
 }
 
 void kvs_show(int fd_out) {
-    rwl_wrlock(&kvs_table->htMutex);
-
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode* keyNode = kvs_table->table[i];
-
-        while (keyNode != NULL) {
-            char buffer[MAX_STRING_SIZE * 2 + 12];  // Adjust size as needed
-            sprintf(buffer, "(%s, %s)\n", keyNode->key, keyNode->value);
-            tryWrite(fd_out, buffer, strlen(buffer));
-
-            keyNode = keyNode->next;  // Move to the next node
-        }
+    // The pairs are written from a snapshot, so writers are not held back
+    // while the output is written
+    Snapshot* snapshot = take_snapshot(NULL);
+    Output out = {fd_out, NULL, 0, 0};
+    if (snapshot == NULL || write_snapshot(snapshot, &out, 0) != 0) {
+        fprintf(stderr, "Failed to take a snapshot of the KVS\n");
     }
-
-    rwl_unlock(&kvs_table->htMutex);
 }
 
 int kvs_backup(char* job_name, int current_backup) {
-    pid_t pid = fork();
-
-    if (pid < 0) {
-        fprintf(stderr, "Failed to create backup process\n");
+    // create new path for backup file
+    char* backup_path = strdup(job_name);
+    if (backup_path == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
         return 1;
-    } else if (pid == 0) {
-        // Child process
-
-        // create new path for backup file
-        char* backup_path = strdup(job_name);
-        char* ponto = strrchr(backup_path, '.');
-        strcpy(ponto, "");
-
-        char buffer[10];
-        sprintf(buffer, "-%d.bck", current_backup);
-
-        char* temp =
-            realloc(backup_path, strlen(backup_path) + strlen(buffer) + 1);
-        if (temp == NULL) {
-            fprintf(stderr, "Failed to reallocate memory\n");
-            free(backup_path);
-            return 1;
-        }
-        backup_path = temp;
+    }
+    char* ponto = strrchr(backup_path, '.');
+    strcpy(ponto, "");
 
-        strcat(backup_path, buffer);
+    char buffer[24];
+    sprintf(buffer, "-%d.%s%s", current_backup,
+            kvs_config.binary_backups ? "snap" : "bck",
+            kvs_config.compress_backups ? ".lz" : "");
 
-        int backup_file = open(backup_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char* temp = realloc(backup_path, strlen(backup_path) + strlen(buffer) + 1);
+    if (temp == NULL) {
+        fprintf(stderr, "Failed to reallocate memory\n");
+        free(backup_path);
+        return 1;
+    }
+    backup_path = temp;
 
-        if (backup_file == -1) {
-            fprintf(stderr, "Failed to open backup file\n");
-            return 1;
-        }
+    strcat(backup_path, buffer);
 
-        kvs_show(backup_file);
+    // Written to a temporary file, read back to copy it to the backups
+    // merged into it. The name keeps the previous file until it is renamed,
+    // and a hard link to a manifest of the store is never truncated.
+    int backup_file = backup_open(backup_path);
+    if (backup_file == -1) {
+        fprintf(stderr, "Failed to open backup file\n");
+        free(backup_path);
+        return 1;
+    }
 
-        close(backup_file);
+    if (merge_backup(backup_file, backup_path)) return 0;
 
-        temp = NULL;
+    // The backup is the state of the table now, written by another thread
+    // while the job goes on. Deltas name the previous backup by its file
+    // name, backups being in the directory of the jobs.
+    const char* name = strrchr(backup_path, '/');
+    name = name != NULL ? name + 1 : backup_path;
+    BackupJob* job = malloc(sizeof(BackupJob));
+    char* job_file = strdup(name);
+    if (job != NULL) {
+        *job = (BackupJob){NULL, backup_file, backup_path,
+                           kvs_config.binary_backups, NULL,
+                           kvs_config.compress_backups, job_file, 0, NULL, 0,
+                           NULL, 0, NULL};
+    }
+    Snapshot* snapshot =
+        job != NULL && job_file != NULL ? take_snapshot(job) : NULL;
+    if (snapshot == NULL) {
+        fprintf(stderr, "Failed to take a snapshot of the KVS\n");
+        free(job);
+        free(job_file);
+        close(backup_file);
+        backup_discard(backup_path);
         free(backup_path);
-        backup_path = NULL;
-
-        _exit(0);
+        return 1;
+    }
+    job->snapshot = snapshot;
+    queue_backup(job);
+    return 0;
+}
 
-    } else {
-        // Parent process
+void kvs_set_max_backups(size_t max) {
+    pthread_mutex_lock(&backups_mutex);
+    max_backups = max > 0 ? max : 1;
+    pthread_mutex_unlock(&backups_mutex);
+}
 
-        return 0;
+void kvs_wait_backup() {
+    pthread_mutex_lock(&backups_mutex);
+    while (running_backups > 0) {
+        pthread_cond_wait(&backups_done, &backups_mutex);
     }
-
-    return 0;
+    pthread_mutex_unlock(&backups_mutex);
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -42,11 +42,17 @@ int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd_out);
 void kvs_show(int fd_out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
+/// backup file. The state is captured at once and written by another thread.
+/// @return 0 if the backup was started, 1 otherwise.
 int kvs_backup(char* job_name, int current_backup);
 
-/// Waits for the last backup to be called.
+/// Sets the number of backups written at once. Later backups wait in a queue,
+/// while the jobs go on, and a backup of the same state as the last one
+/// waiting is merged into it.
+/// @param max Number of backups, 0 counting as 1.
+void kvs_set_max_backups(size_t max);
+
+/// Waits for the backups being written to finish.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
@@ -17,33 +17,57 @@ enum Command {
   EOC  // End of commands
 };
 
+// Bytes a JobReader reads at a time from a file it does not map
+#define JOB_BUFFER_SIZE 65536
+
+/// How a JobReader gets the bytes of a job file.
+typedef enum {
+  JOB_INPUT_MAPPED,    // Maps the file, or reads it in blocks if it cannot
+  JOB_INPUT_BUFFERED,  // Reads JOB_BUFFER_SIZE bytes at a time
+  JOB_INPUT_BYTES      // Reads one byte per read, for comparison
+} JobInput;
+
+/// Input of the parser: a job file, tokenised from memory.
+typedef struct JobReader JobReader;
+
+/// Starts reading a job file.
+/// @param fd File descriptor of the file, at its start, left open by
+/// job_close.
+/// @param input How to get the bytes of the file.
+/// @return The reader, NULL on failure.
+JobReader *job_open(int fd, JobInput input);
+
+/// Stops reading a job file.
+/// @param in Reader returned by job_open, may be NULL.
+void job_close(JobReader *in);
+
 /// Reads a line and returns the corresponding command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(JobReader *in);
 
 /// Parses a WRITE command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param keys Array of keys to be written.
 /// @param values Array of values to be written.
 /// @param max_pairs number of pairs to be written.
 /// @param max_string_size maximum size for keys and values.
 /// @return 0 if the command was parsed successfully, 1 otherwise.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(JobReader *in, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
 
 /// Parses a READ or DELETE command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param keys Array of keys to be written.
 /// @param max_keys number of keys to be iread or deleted.
 /// @param max_string_size maximum size for keys and values.
 /// @return Number of keys read or deleted. 0 on failure.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(JobReader *in, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param in Reader to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(JobReader *in, unsigned int *delay, unsigned int *thread_id);
 
 #endif  // KVS_PARSER_H
@@ -0,0 +1,23 @@
+#ifndef KVS_SHA256_H
+#define KVS_SHA256_H
+
+// Bytes of a digest, and characters of its hexadecimal form
+#define SHA256_SIZE 32
+#define SHA256_HEX_SIZE (SHA256_SIZE * 2)
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Computes the SHA-256 digest (FIPS 180-4) of some bytes.
+/// @param data Bytes to hash.
+/// @param size Number of bytes.
+/// @param digest Buffer to store the digest in.
+void sha256(const void *data, size_t size, uint8_t digest[SHA256_SIZE]);
+
+/// Writes a digest in lowercase hexadecimal.
+/// @param digest Digest returned by sha256.
+/// @param hex Buffer of SHA256_HEX_SIZE + 1 characters, terminated here.
+void sha256_hex(const uint8_t digest[SHA256_SIZE],
+                char hex[SHA256_HEX_SIZE + 1]);
+
+#endif  // KVS_SHA256_H
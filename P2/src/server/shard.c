@@ -0,0 +1,583 @@
+// pthread_setaffinity_np and the CPU_* macros are GNU extensions
+#define _GNU_SOURCE
+
+#include "shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+#include "utils.h"
+#include "wal.h"
+
+// Size of a cache line, the ends of a queue are on different lines so that
+// the producer and the shard do not invalidate each other's line
+#define CACHE_LINE_SIZE 64
+
+// The mutexes here wait on condition variables, so they are pthread mutexes
+// whatever the sync backend of the store is
+
+_Static_assert(SHARD_QUEUE_SIZE >= MAX_WRITE_SIZE,
+               "a command must fit in the queue of each shard");
+_Static_assert((SHARD_QUEUE_SIZE & (SHARD_QUEUE_SIZE - 1)) == 0,
+               "SHARD_QUEUE_SIZE must be a power of two");
+
+typedef enum { OP_WRITE, OP_READ, OP_DELETE } ShardOpType;
+
+struct Producer;
+
+// Command split among the shards, on the stack of the producer until every
+// operation is done
+typedef struct Command {
+    atomic_size_t pending;  // Operations not done yet
+    struct Producer *producer;
+    int *failed;     // Results of writes and deletes
+    char **results;  // Results of reads
+} Command;
+
+// Operation on a single key. The strings belong to the producer, which waits
+// for the operation to be done.
+typedef struct ShardOp {
+    ShardOpType type;
+    size_t index;  // Position of the key in the command
+    uint64_t seq;  // Position of the command in the WAL, 0 if not logged
+    const char *key;
+    const char *value;
+    Command *command;
+} ShardOp;
+
+// Single-producer single-consumer ring of operations
+typedef struct ShardQueue {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;  // Written by the shard
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;  // Written by the producer
+    ShardOp ops[SHARD_QUEUE_SIZE];
+} ShardQueue;
+
+// Thread that sends commands to the shards
+typedef struct Producer {
+    // Set while a command runs, see shard_pause
+    _Alignas(CACHE_LINE_SIZE) atomic_int busy;
+    // Set while waiting for a command to be done
+    atomic_int sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // One queue per shard, allocated the first time the slot is used
+    _Atomic(ShardQueue *) queues;
+    int in_use;  // Protected by slot_mutex
+} Producer;
+
+typedef struct Shard {
+    // Set while the thread waits for operations
+    _Alignas(CACHE_LINE_SIZE) atomic_int sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    size_t index;
+    void *table;
+    size_t rehash_cursor;
+} Shard;
+
+static const KvsEngine *shard_engine;
+static Shard *shards = NULL;
+static size_t num_shards;
+static size_t shard_stripes;
+static atomic_int stopping;
+
+static Producer producers[SHARD_MAX_PRODUCERS];
+// Slots below this one may have been used, the shards only poll those
+static atomic_size_t producers_used;
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+
+// Set by shard_pause, which holds pause_mutex until shard_resume
+static atomic_int pausing;
+static pthread_mutex_t pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Bumped by shard_destroy, so that threads drop their freed slots
+static atomic_ulong generation;
+
+// With a WAL, each WRITE and DELETE is logged whole and its operations queued
+// with log_mutex held, and numbered in that order. logged is the number of
+// the last command queued, and the shards execute the commands up to it in
+// that order, so that the log holds the commands of each key in the order
+// they are applied.
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t next_seq = 1;  // Protected by log_mutex
+static _Atomic uint64_t logged;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t producer_key;
+static _Thread_local Producer *thread_producer = NULL;
+static _Thread_local unsigned long thread_generation;
+
+// Shard that owns a key. Uses the top bits of the hash, the engines index
+// their buckets with the low ones.
+static size_t shard_of(const char *key) {
+    return (size_t)(((uint64_t)hash(key) >> 48) * num_shards >> 16);
+}
+
+// Wakes a thread waiting on a sleeping flag. Called after publishing what the
+// thread waits for, the fence orders that before the flag is read.
+static void wake(atomic_int *sleeping, pthread_mutex_t *mutex,
+                 pthread_cond_t *cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(sleeping, memory_order_relaxed)) return;
+
+    pthread_mutex_lock(mutex);
+    atomic_store(sleeping, 0);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(mutex);
+}
+
+// Sleeps until woken, unless ready returns true once the flag is set
+static void park(atomic_int *sleeping, pthread_mutex_t *mutex,
+                 pthread_cond_t *cond, int (*ready)(void *), void *arg) {
+    atomic_store(sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ready(arg)) {
+        atomic_store(sleeping, 0);
+        return;
+    }
+
+    pthread_mutex_lock(mutex);
+    while (atomic_load(sleeping)) {
+        pthread_cond_wait(cond, mutex);
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+// Releases the slot of an exiting thread
+static void producer_destructor(void *arg) {
+    Producer *producer = arg;
+    if (thread_generation != atomic_load(&generation)) return;
+
+    pthread_mutex_lock(&slot_mutex);
+    producer->in_use = 0;
+    pthread_cond_signal(&slot_cond);
+    pthread_mutex_unlock(&slot_mutex);
+}
+
+static void create_producer_key() {
+    pthread_key_create(&producer_key, producer_destructor);
+}
+
+// Returns the slot of the calling thread, taking a free one on first use and
+// waiting for a thread to exit if there is none
+static Producer *get_producer() {
+    unsigned long current = atomic_load(&generation);
+    if (thread_producer != NULL && thread_generation == current) {
+        return thread_producer;
+    }
+
+    pthread_mutex_lock(&slot_mutex);
+    size_t slot;
+    for (;;) {
+        for (slot = 0; slot < SHARD_MAX_PRODUCERS; slot++) {
+            if (!producers[slot].in_use) break;
+        }
+        if (slot < SHARD_MAX_PRODUCERS) break;
+        pthread_cond_wait(&slot_cond, &slot_mutex);
+    }
+
+    Producer *producer = &producers[slot];
+    if (atomic_load(&producer->queues) == NULL) {
+        ShardQueue *queues = aligned_alloc(CACHE_LINE_SIZE,
+                                           num_shards * sizeof(ShardQueue));
+        if (queues == NULL) {
+            pthread_mutex_unlock(&slot_mutex);
+            return NULL;
+        }
+        for (size_t i = 0; i < num_shards; i++) {
+            atomic_init(&queues[i].head, 0);
+            atomic_init(&queues[i].tail, 0);
+        }
+        atomic_store_explicit(&producer->queues, queues, memory_order_release);
+    }
+    producer->in_use = 1;
+    if (slot + 1 > atomic_load(&producers_used)) {
+        atomic_store(&producers_used, slot + 1);
+    }
+    pthread_mutex_unlock(&slot_mutex);
+
+    thread_producer = producer;
+    thread_generation = current;
+    pthread_setspecific(producer_key, producer);
+    return producer;
+}
+
+// Marks the calling thread as running a command, waiting for a pause to end
+static Producer *begin_command() {
+    Producer *producer = get_producer();
+    if (producer == NULL) return NULL;
+
+    for (;;) {
+        atomic_store(&producer->busy, 1);
+        if (!atomic_load(&pausing)) return producer;
+
+        atomic_store(&producer->busy, 0);
+        pthread_mutex_lock(&pause_mutex);
+        pthread_mutex_unlock(&pause_mutex);
+    }
+}
+
+static int command_done(void *arg) {
+    return atomic_load(&((Command *)arg)->pending) == 0;
+}
+
+// Sends every key of a command to its shard and waits for all of them
+static int run_command(ShardOpType type, size_t num_keys,
+                       char keys[][MAX_STRING_SIZE],
+                       char values[][MAX_STRING_SIZE], int failed[],
+                       char *results[]) {
+    Producer *producer = begin_command();
+    if (producer == NULL) return 1;
+
+    Command command = {.producer = producer,
+                       .failed = failed,
+                       .results = results};
+    atomic_init(&command.pending, num_keys);
+
+    // The command is logged whole before any shard applies part of it
+    uint64_t seq = 0;
+    int log = type != OP_READ && wal_enabled();
+    if (log) {
+        pthread_mutex_lock(&log_mutex);
+        wal_append(type == OP_WRITE ? WAL_WRITE : WAL_DELETE, num_keys, keys,
+                   values);
+        seq = next_seq++;
+    }
+
+    ShardQueue *queues = atomic_load_explicit(&producer->queues,
+                                              memory_order_relaxed);
+    size_t owners[MAX_WRITE_SIZE];
+    for (size_t i = 0; i < num_keys; i++) {
+        owners[i] = shard_of(keys[i]);
+        ShardQueue *queue = &queues[owners[i]];
+
+        // The previous commands are done, so there is room for this one
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        queue->ops[tail & (SHARD_QUEUE_SIZE - 1)] =
+            (ShardOp){type, i, seq, keys[i],
+                      values != NULL ? values[i] : NULL, &command};
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    }
+    if (log) {
+        atomic_store_explicit(&logged, seq, memory_order_release);
+        pthread_mutex_unlock(&log_mutex);
+    }
+
+    for (size_t i = 0; i < num_keys; i++) {
+        Shard *shard = &shards[owners[i]];
+        wake(&shard->sleeping, &shard->mutex, &shard->cond);
+    }
+
+    for (int spin = 0; !command_done(&command); spin++) {
+        if (spin < SHARD_SPIN) {
+            sched_yield();
+        } else {
+            park(&producer->sleeping, &producer->mutex, &producer->cond,
+                 command_done, &command);
+        }
+    }
+
+    atomic_store_explicit(&producer->busy, 0, memory_order_release);
+    return 0;
+}
+
+// Does the resize work release_table does after every write
+static void maintain(Shard *shard) {
+    if (shard_engine->rehash_pending != NULL &&
+        shard_engine->rehash_pending(shard->table)) {
+        shard_engine->rehash_step(
+            shard->table, shard->rehash_cursor++ & (shard_stripes - 1));
+    }
+    if (shard_engine->resize_needed != NULL &&
+        shard_engine->resize_needed(shard->table)) {
+        shard_engine->resize_table(shard->table);
+    }
+    if (shard_engine->throttle_writes != NULL) {
+        shard_engine->throttle_writes(shard->table);
+    }
+}
+
+static void execute(Shard *shard, const ShardOp *op) {
+    Command *command = op->command;
+    switch (op->type) {
+        case OP_WRITE:
+            command->failed[op->index] =
+                shard_engine->write_pair(shard->table, op->key, op->value) !=
+                0;
+            maintain(shard);
+            break;
+
+        case OP_READ:
+            command->results[op->index] =
+                shard_engine->read_pair(shard->table, op->key);
+            break;
+
+        case OP_DELETE:
+            command->failed[op->index] =
+                shard_engine->delete_pair(shard->table, op->key) != 0;
+            maintain(shard);
+            break;
+    }
+
+    // Neither the table nor the command, which the producer may reuse at
+    // once, are touched once the last operation is done
+    Producer *producer = command->producer;
+    if (atomic_fetch_sub(&command->pending, 1) == 1) {
+        wake(&producer->sleeping, &producer->mutex, &producer->cond);
+    }
+}
+
+// Queue of a shard with operations to execute, all of the same command
+typedef struct Ready {
+    ShardQueue *queue;
+    uint64_t seq;
+} Ready;
+
+// Executes the operations queued for a shard. A producer waits for each
+// command to be done, so a queue holds operations of one command at a time,
+// and the queues are drained by the number of their command in the WAL.
+// Commands queued after the last one logged when the drain starts are left
+// for the next one, a command logged before them possibly not being visible
+// yet.
+// @return Number of operations executed.
+static size_t drain(Shard *shard) {
+    uint64_t last = atomic_load_explicit(&logged, memory_order_acquire);
+    Ready ready[SHARD_MAX_PRODUCERS];
+    size_t num_ready = 0;
+    size_t used = atomic_load(&producers_used);
+    for (size_t p = 0; p < used; p++) {
+        ShardQueue *queues = atomic_load_explicit(&producers[p].queues,
+                                                  memory_order_acquire);
+        if (queues == NULL) continue;
+
+        ShardQueue *queue = &queues[shard->index];
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == tail) continue;
+        uint64_t seq = queue->ops[head & (SHARD_QUEUE_SIZE - 1)].seq;
+        if (seq > last) continue;
+
+        // Insertion sort, there are few producers
+        size_t i = num_ready++;
+        for (; i > 0 && ready[i - 1].seq > seq; i--) ready[i] = ready[i - 1];
+        ready[i] = (Ready){queue, seq};
+    }
+
+    size_t executed = 0;
+    for (size_t r = 0; r < num_ready; r++) {
+        ShardQueue *queue = ready[r].queue;
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            ShardOp op = queue->ops[head & (SHARD_QUEUE_SIZE - 1)];
+            atomic_store_explicit(&queue->head, head + 1,
+                                  memory_order_release);
+            execute(shard, &op);
+            executed++;
+        }
+    }
+    return executed;
+}
+
+static int has_work(void *arg) {
+    Shard *shard = arg;
+    if (atomic_load(&stopping)) return 1;
+
+    size_t used = atomic_load(&producers_used);
+    for (size_t p = 0; p < used; p++) {
+        ShardQueue *queues = atomic_load(&producers[p].queues);
+        if (queues == NULL) continue;
+
+        ShardQueue *queue = &queues[shard->index];
+        if (atomic_load(&queue->head) != atomic_load(&queue->tail)) return 1;
+    }
+    return 0;
+}
+
+// Pins the calling thread to the n-th core it may run on, modulo their number
+static void pin_thread(size_t n) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) return;
+    size_t target = n % (size_t)count;
+    for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        return;
+    }
+#else
+    (void)n;
+#endif
+}
+
+static void *shard_thread(void *arg) {
+    Shard *shard = arg;
+    pin_thread(shard->index);
+
+    int idle = 0;
+    while (!atomic_load(&stopping)) {
+        if (drain(shard) > 0) {
+            idle = 0;
+        } else if (++idle < SHARD_SPIN) {
+            sched_yield();
+        } else {
+            idle = 0;
+            park(&shard->sleeping, &shard->mutex, &shard->cond, has_work,
+                 shard);
+        }
+    }
+    return NULL;
+}
+
+// Stops and frees the first count shards
+static void stop_shards(size_t count) {
+    atomic_store(&stopping, 1);
+    for (size_t i = 0; i < count; i++) {
+        wake(&shards[i].sleeping, &shards[i].mutex, &shards[i].cond);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(shards[i].thread, NULL);
+        // The pairs live in slabs, which kvs_terminate frees at once
+        if (shard_engine->drop_table != NULL) {
+            shard_engine->drop_table(shards[i].table);
+        } else {
+            shard_engine->free_table(shards[i].table);
+        }
+        pthread_mutex_destroy(&shards[i].mutex);
+        pthread_cond_destroy(&shards[i].cond);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+int shard_init(const KvsEngine *engine, size_t count, size_t stripes) {
+    pthread_once(&key_once, create_producer_key);
+
+    shard_engine = engine;
+    num_shards = count;
+    shard_stripes = stripes;
+    atomic_store(&stopping, 0);
+    atomic_store(&pausing, 0);
+    atomic_store(&producers_used, 0);
+
+    for (size_t i = 0; i < SHARD_MAX_PRODUCERS; i++) {
+        Producer *producer = &producers[i];
+        atomic_init(&producer->busy, 0);
+        atomic_init(&producer->sleeping, 0);
+        atomic_init(&producer->queues, NULL);
+        producer->in_use = 0;
+        pthread_mutex_init(&producer->mutex, NULL);
+        pthread_cond_init(&producer->cond, NULL);
+    }
+
+    shards = aligned_alloc(CACHE_LINE_SIZE, count * sizeof(Shard));
+    if (shards == NULL) return 1;
+
+    for (size_t i = 0; i < count; i++) {
+        Shard *shard = &shards[i];
+        atomic_init(&shard->sleeping, 0);
+        shard->index = i;
+        shard->rehash_cursor = 0;
+        shard->table = engine->create_table(stripes);
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->cond, NULL);
+
+        if (shard->table == NULL ||
+            pthread_create(&shard->thread, NULL, shard_thread, shard) != 0) {
+            fprintf(stderr, "Failed to start shard %zu\n", i);
+            if (shard->table != NULL) engine->free_table(shard->table);
+            pthread_mutex_destroy(&shard->mutex);
+            pthread_cond_destroy(&shard->cond);
+            stop_shards(i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void shard_destroy() {
+    stop_shards(num_shards);
+
+    for (size_t i = 0; i < SHARD_MAX_PRODUCERS; i++) {
+        free(atomic_load(&producers[i].queues));
+        pthread_mutex_destroy(&producers[i].mutex);
+        pthread_cond_destroy(&producers[i].cond);
+    }
+    atomic_fetch_add(&generation, 1);
+}
+
+int shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE], int failed[]) {
+    return run_command(OP_WRITE, num_pairs, keys, values, failed, NULL);
+}
+
+int shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE],
+               char *results[]) {
+    return run_command(OP_READ, num_keys, keys, NULL, NULL, results);
+}
+
+int shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE],
+                 int failed[]) {
+    return run_command(OP_DELETE, num_keys, keys, NULL, failed, NULL);
+}
+
+void shard_pause() {
+    pthread_mutex_lock(&pause_mutex);
+    atomic_store(&pausing, 1);
+
+    size_t used = atomic_load(&producers_used);
+    for (size_t p = 0; p < used; p++) {
+        while (atomic_load(&producers[p].busy)) {
+            sched_yield();
+        }
+    }
+}
+
+void shard_resume() {
+    atomic_store(&pausing, 0);
+    pthread_mutex_unlock(&pause_mutex);
+}
+
+KvsPair *shard_list_pairs(size_t *count) {
+    KvsPair *all = NULL;
+    *count = 0;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        size_t n;
+        KvsPair *pairs = shard_engine->list_pairs(shards[i].table, &n);
+        if (n == 0) {
+            free(pairs);
+            continue;
+        }
+
+        KvsPair *grown = realloc(all, (*count + n) * sizeof(KvsPair));
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to list the pairs of shard %zu\n", i);
+            free(pairs);
+            continue;
+        }
+        all = grown;
+        memcpy(all + *count, pairs, n * sizeof(KvsPair));
+        *count += n;
+        free(pairs);
+    }
+
+    return all;
+}
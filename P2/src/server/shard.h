@@ -0,0 +1,77 @@
+#ifndef KVS_SHARD_H
+#define KVS_SHARD_H
+
+// Upper bound of the number of shards (KVS_SHARDS)
+#define MAX_SHARDS 1024
+
+// Threads that can send commands to the shards at the same time, each one
+// owns a queue per shard while it is alive
+#define SHARD_MAX_PRODUCERS 256
+
+// Operations a queue holds, enough for the largest command
+#define SHARD_QUEUE_SIZE 256
+
+// Polls of an empty queue (or of an unfinished command) before the thread
+// sleeps
+#define SHARD_SPIN 64
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "engine.h"
+
+/// Starts the shards, each with its own table and a thread pinned to a core
+/// that is the only one to touch the table. Commands are split into single
+/// key operations that are sent to the shard that owns the key over a
+/// single-producer single-consumer queue, so executing them takes no lock.
+/// @param engine Engine of the tables.
+/// @param num_shards Number of shards, at most MAX_SHARDS.
+/// @param stripes Stripes each table is created with, a power of two.
+/// @return 0 if the shards were started, 1 otherwise.
+int shard_init(const KvsEngine *engine, size_t num_shards, size_t stripes);
+
+/// Stops the shard threads and frees every table. No command may be running.
+void shard_destroy();
+
+/// Writes pairs, each one on the shard that owns its key. A command is atomic
+/// for shard_pause but not for concurrent commands on other shards.
+/// @param num_pairs Number of pairs.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @param failed Set to 1 for each pair that could not be written, 0
+/// otherwise.
+/// @return 0 if the command ran, 1 if the thread could not get a queue.
+int shard_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE], int failed[]);
+
+/// Reads keys, each one from the shard that owns it.
+/// @param num_keys Number of keys.
+/// @param keys Keys to read.
+/// @param results Set to a copy of each value, to be freed with slab_free, or
+/// NULL if the key does not exist.
+/// @return 0 if the command ran, 1 if the thread could not get a queue.
+int shard_read(size_t num_keys, char keys[][MAX_STRING_SIZE],
+               char *results[]);
+
+/// Deletes keys, each one on the shard that owns it.
+/// @param num_keys Number of keys.
+/// @param keys Keys to delete.
+/// @param failed Set to 1 for each key that did not exist, 0 otherwise.
+/// @return 0 if the command ran, 1 if the thread could not get a queue.
+int shard_delete(size_t num_keys, char keys[][MAX_STRING_SIZE],
+                 int failed[]);
+
+/// Waits for the running commands to finish and holds back new ones, so that
+/// the tables can be listed. Pauses do not nest.
+void shard_pause();
+
+/// Lets the commands held back by shard_pause run.
+void shard_resume();
+
+/// Lists the pairs of every shard. The shards must be paused, or the caller
+/// must be a child forked while they were.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *shard_list_pairs(size_t *count);
+
+#endif  // KVS_SHARD_H
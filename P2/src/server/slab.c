@@ -0,0 +1,349 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Object sizes of each class, multiples of 16 to keep objects aligned
+static const size_t class_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 2048, 4096};
+
+// Class index of the slabs that hold a single large object
+#define LARGE_CLASS SLAB_CLASSES
+
+// Header at the start of every slab
+typedef struct Slab {
+    struct Slab *next;          // Next slab of the class (or large object)
+    struct Slab *prev;          // Previous large object, unused otherwise
+    struct Slab *next_partial;  // Next slab of the class with free objects
+    void *free_list;  // Free objects, linked through their first word
+    size_t free_count;
+    size_t class_index;
+} Slab;
+
+// Objects start after the header, rounded to keep them 64 byte aligned
+#define SLAB_HEADER ((sizeof(Slab) + 63) / 64 * 64)
+
+// Shared depot of a size class
+typedef struct SlabClass {
+    KvsMutex mutex;  // Protects the slabs and their free lists
+    Slab *slabs;            // Every slab of the class
+    Slab *partial;          // Slabs with at least one free object
+    atomic_size_t slabs_count;
+    atomic_size_t allocs;
+    atomic_size_t frees;
+    atomic_size_t refills;
+    atomic_size_t flushes;
+} SlabClass;
+
+// Objects cached by one thread for one class
+typedef struct Magazine {
+    void *objects[MAGAZINE_SIZE];
+    size_t count;
+    size_t allocs;  // Not yet added to the class counters
+    size_t frees;   // Not yet added to the class counters
+} Magazine;
+
+// Per thread cache, one magazine per class
+typedef struct SlabCache {
+    unsigned long generation;  // Value of generation when filled
+    Magazine magazines[SLAB_CLASSES];
+} SlabCache;
+
+static SlabClass classes[SLAB_CLASSES];
+
+// Objects larger than the biggest class, one per slab sized allocation
+static Slab *large_slabs = NULL;
+static KvsMutex large_mutex;
+static atomic_size_t large_allocs;
+
+// Bumped by slab_destroy, so that caches holding objects of freed slabs are
+// emptied instead of used
+static atomic_ulong generation;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static _Thread_local SlabCache *thread_cache = NULL;
+
+// Returns the slab that owns an object
+static Slab *slab_of(void *ptr) {
+    return (Slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+// Returns the smallest class that fits size, LARGE_CLASS if none does
+static size_t class_of(size_t size) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        if (size <= class_sizes[i]) return i;
+    }
+    return LARGE_CLASS;
+}
+
+// Adds the counters of a magazine to its class.
+static void fold_counters(Magazine *mag, SlabClass *sc) {
+    atomic_fetch_add(&sc->allocs, mag->allocs);
+    atomic_fetch_add(&sc->frees, mag->frees);
+    mag->allocs = 0;
+    mag->frees = 0;
+}
+
+// Allocates a slab of a class with every object free.
+// The class mutex must be held.
+static Slab *new_slab(size_t class_index) {
+    Slab *slab = aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+    if (slab == NULL) return NULL;
+
+    size_t size = class_sizes[class_index];
+    size_t count = (SLAB_SIZE - SLAB_HEADER) / size;
+    char *objects = (char *)slab + SLAB_HEADER;
+
+    // Linked from the end so that objects are handed out in address order
+    slab->free_list = NULL;
+    for (size_t i = count; i > 0; i--) {
+        void *obj = objects + (i - 1) * size;
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+    slab->free_count = count;
+    slab->class_index = class_index;
+    slab->prev = NULL;
+    return slab;
+}
+
+// Takes objects from the depot until the magazine is half full.
+// @return 1 if the magazine has objects, 0 if the depot ran out of memory.
+static int refill(Magazine *mag, size_t class_index) {
+    SlabClass *sc = &classes[class_index];
+
+    mutex_lock(&sc->mutex);
+    while (mag->count < MAGAZINE_SIZE / 2) {
+        Slab *slab = sc->partial;
+        if (slab == NULL) {
+            slab = new_slab(class_index);
+            if (slab == NULL) break;
+            slab->next = sc->slabs;
+            sc->slabs = slab;
+            slab->next_partial = NULL;
+            sc->partial = slab;
+            atomic_fetch_add(&sc->slabs_count, 1);
+        }
+
+        void *obj = slab->free_list;
+        slab->free_list = *(void **)obj;
+        mag->objects[mag->count++] = obj;
+        if (--slab->free_count == 0) {
+            sc->partial = slab->next_partial;
+        }
+    }
+    atomic_fetch_add(&sc->refills, 1);
+    fold_counters(mag, sc);
+    mutex_unlock(&sc->mutex);
+
+    return mag->count > 0;
+}
+
+// Returns the oldest count objects of the magazine to their owning slabs.
+static void flush(Magazine *mag, size_t class_index, size_t count) {
+    SlabClass *sc = &classes[class_index];
+
+    mutex_lock(&sc->mutex);
+    for (size_t i = 0; i < count; i++) {
+        void *obj = mag->objects[i];
+        Slab *slab = slab_of(obj);
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+        if (slab->free_count++ == 0) {
+            slab->next_partial = sc->partial;
+            sc->partial = slab;
+        }
+    }
+    atomic_fetch_add(&sc->flushes, 1);
+    fold_counters(mag, sc);
+    mutex_unlock(&sc->mutex);
+
+    memmove(mag->objects, mag->objects + count,
+            (mag->count - count) * sizeof(void *));
+    mag->count -= count;
+}
+
+// Gives the objects of an exiting thread back to the depot
+static void cache_destructor(void *arg) {
+    SlabCache *cache = arg;
+    if (cache->generation == atomic_load(&generation)) {
+        for (size_t i = 0; i < SLAB_CLASSES; i++) {
+            flush(&cache->magazines[i], i, cache->magazines[i].count);
+        }
+    }
+    free(cache);
+}
+
+static void create_cache_key() {
+    pthread_key_create(&cache_key, cache_destructor);
+}
+
+// Returns the cache of the calling thread, creating it on first use
+static SlabCache *get_cache() {
+    SlabCache *cache = thread_cache;
+    unsigned long current = atomic_load(&generation);
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(SlabCache));
+        if (cache == NULL) return NULL;
+        cache->generation = current;
+        thread_cache = cache;
+        pthread_setspecific(cache_key, cache);
+    } else if (cache->generation != current) {
+        // The cached objects belonged to slabs freed by slab_destroy
+        memset(cache->magazines, 0, sizeof(cache->magazines));
+        cache->generation = current;
+    }
+    return cache;
+}
+
+static void *large_alloc(size_t size) {
+    size_t total = (SLAB_HEADER + size + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+    Slab *slab = aligned_alloc(SLAB_SIZE, total);
+    if (slab == NULL) return NULL;
+    slab->class_index = LARGE_CLASS;
+
+    mutex_lock(&large_mutex);
+    slab->prev = NULL;
+    slab->next = large_slabs;
+    if (large_slabs != NULL) large_slabs->prev = slab;
+    large_slabs = slab;
+    mutex_unlock(&large_mutex);
+
+    atomic_fetch_add(&large_allocs, 1);
+    return (char *)slab + SLAB_HEADER;
+}
+
+static void large_free(Slab *slab) {
+    mutex_lock(&large_mutex);
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        large_slabs = slab->next;
+    }
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+    mutex_unlock(&large_mutex);
+
+    free(slab);
+}
+
+void slab_init() {
+    pthread_once(&key_once, create_cache_key);
+
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        mutex_init(&classes[i].mutex);
+        classes[i].slabs = NULL;
+        classes[i].partial = NULL;
+        atomic_init(&classes[i].slabs_count, 0);
+        atomic_init(&classes[i].allocs, 0);
+        atomic_init(&classes[i].frees, 0);
+        atomic_init(&classes[i].refills, 0);
+        atomic_init(&classes[i].flushes, 0);
+    }
+    mutex_init(&large_mutex);
+    large_slabs = NULL;
+    atomic_init(&large_allocs, 0);
+}
+
+void *slab_alloc(size_t size) {
+    size_t class_index = class_of(size);
+    if (class_index == LARGE_CLASS) return large_alloc(size);
+
+    SlabCache *cache = get_cache();
+    if (cache == NULL) return NULL;
+
+    Magazine *mag = &cache->magazines[class_index];
+    if (mag->count == 0 && !refill(mag, class_index)) return NULL;
+
+    mag->allocs++;
+    return mag->objects[--mag->count];
+}
+
+void slab_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    Slab *slab = slab_of(ptr);
+    if (slab->class_index == LARGE_CLASS) {
+        large_free(slab);
+        return;
+    }
+
+    SlabCache *cache = get_cache();
+    if (cache == NULL) {
+        // No cache for this thread, go straight to the owning slab
+        Magazine single = {.objects = {ptr}, .count = 1, .frees = 1};
+        flush(&single, slab->class_index, 1);
+        return;
+    }
+
+    Magazine *mag = &cache->magazines[slab->class_index];
+    if (mag->count == MAGAZINE_SIZE) {
+        flush(mag, slab->class_index, MAGAZINE_SIZE / 2);
+    }
+    mag->objects[mag->count++] = ptr;
+    mag->frees++;
+}
+
+char *slab_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = slab_alloc(len);
+    if (copy != NULL) memcpy(copy, str, len);
+    return copy;
+}
+
+void slab_stats(SlabStats *stats) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        SlabClassStats *cs = &stats->classes[i];
+        cs->size = class_sizes[i];
+        cs->slabs = atomic_load(&classes[i].slabs_count);
+        cs->allocs = atomic_load(&classes[i].allocs);
+        cs->frees = atomic_load(&classes[i].frees);
+        cs->refills = atomic_load(&classes[i].refills);
+        cs->flushes = atomic_load(&classes[i].flushes);
+    }
+    stats->large_allocs = atomic_load(&large_allocs);
+}
+
+void slab_print_stats(FILE *out) {
+    SlabStats stats;
+    slab_stats(&stats);
+
+    fprintf(out, "%6s %8s %12s %12s %10s %10s\n", "size", "slabs", "allocs",
+            "frees", "refills", "flushes");
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        SlabClassStats *cs = &stats.classes[i];
+        if (cs->slabs == 0) continue;
+        fprintf(out, "%6zu %8zu %12zu %12zu %10zu %10zu\n", cs->size,
+                cs->slabs, cs->allocs, cs->frees, cs->refills, cs->flushes);
+    }
+    fprintf(out, "large objects: %zu\n", stats.large_allocs);
+}
+
+void slab_destroy() {
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        Slab *slab = classes[i].slabs;
+        while (slab != NULL) {
+            Slab *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        classes[i].slabs = NULL;
+        classes[i].partial = NULL;
+        mutex_destroy(&classes[i].mutex);
+    }
+
+    while (large_slabs != NULL) {
+        Slab *next = large_slabs->next;
+        free(large_slabs);
+        large_slabs = next;
+    }
+    mutex_destroy(&large_mutex);
+
+    atomic_fetch_add(&generation, 1);
+}
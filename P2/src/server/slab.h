@@ -0,0 +1,65 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+// Size of a slab. Slabs are aligned to their size, so the slab that owns an
+// object is found by masking the object address.
+#define SLAB_SIZE 65536
+
+// Number of objects each thread keeps per size class before going to the
+// shared depot
+#define MAGAZINE_SIZE 32
+
+// Number of size classes, see slab.c for their sizes
+#define SLAB_CLASSES 12
+
+#include <stddef.h>
+#include <stdio.h>
+
+/// Counters of one size class. Allocations and frees are counted by each
+/// thread and added to these counters when its magazine goes to the depot,
+/// so they lag by at most one magazine per thread.
+typedef struct SlabClassStats {
+    size_t size;     // Object size of the class
+    size_t slabs;    // Slabs allocated
+    size_t allocs;   // Objects allocated
+    size_t frees;    // Objects freed
+    size_t refills;  // Magazines refilled from the depot
+    size_t flushes;  // Magazines flushed to the depot
+} SlabClassStats;
+
+/// Counters of the whole allocator.
+typedef struct SlabStats {
+    SlabClassStats classes[SLAB_CLASSES];
+    size_t large_allocs;  // Objects larger than the biggest class
+} SlabStats;
+
+/// Initializes the allocator. Must be called before any other function.
+void slab_init();
+
+/// Allocates an object of the given size.
+/// @param size Size of the object.
+/// @return The object, NULL on failure.
+void *slab_alloc(size_t size);
+
+/// Frees an object returned by slab_alloc or slab_strdup. NULL is ignored.
+/// @param ptr Object to be freed.
+void slab_free(void *ptr);
+
+/// Copies a string into an object of the allocator.
+/// @param str String to be copied.
+/// @return The copy, NULL on failure.
+char *slab_strdup(const char *str);
+
+/// Reads the counters of the allocator.
+/// @param stats Pointer to store the counters in.
+void slab_stats(SlabStats *stats);
+
+/// Writes the counters of the allocator in a human readable table.
+/// @param out Stream to write to.
+void slab_print_stats(FILE *out);
+
+/// Frees every slab at once, including the objects that were never freed.
+/// No object of the allocator may be used afterwards.
+void slab_destroy();
+
+#endif  // KVS_SLAB_H
@@ -0,0 +1,89 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Snapshot *snapshot_create(size_t num_stripes) {
+    Snapshot *snapshot =
+        calloc(1, sizeof(Snapshot) + num_stripes * sizeof(SnapshotStripe));
+    if (snapshot == NULL) return NULL;
+    atomic_init(&snapshot->failed, 0);
+    snapshot->num_stripes = num_stripes;
+    return snapshot;
+}
+
+int snapshot_save(Snapshot *snapshot, size_t stripe, const KvsPair *pairs,
+                  size_t count) {
+    SnapshotStripe *saved = &snapshot->stripes[stripe];
+    if (saved->saved) return 0;
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += strlen(pairs[i].key) + strlen(pairs[i].value) + 2;
+    }
+
+    char *data = NULL;
+    if (size > 0) {
+        data = malloc(size);
+        if (data == NULL) {
+            fprintf(stderr, "Failed to copy stripe %zu of a snapshot\n",
+                    stripe);
+            atomic_store(&snapshot->failed, 1);
+            saved->saved = 1;
+            return 1;
+        }
+    }
+
+    char *end = data;
+    for (size_t i = 0; i < count; i++) {
+        size_t key_len = strlen(pairs[i].key) + 1;
+        size_t value_len = strlen(pairs[i].value) + 1;
+        memcpy(end, pairs[i].key, key_len);
+        memcpy(end + key_len, pairs[i].value, value_len);
+        end += key_len + value_len;
+    }
+
+    saved->data = data;
+    saved->count = count;
+    saved->saved = 1;
+    return 0;
+}
+
+void snapshot_skip(Snapshot *snapshot, size_t stripe) {
+    snapshot->stripes[stripe].saved = 1;
+}
+
+int snapshot_pairs(const Snapshot *snapshot, KvsPair **pairs, size_t *count) {
+    size_t total = 0;
+    for (size_t i = 0; i < snapshot->num_stripes; i++) {
+        total += snapshot->stripes[i].count;
+    }
+
+    *pairs = NULL;
+    *count = 0;
+    if (total == 0) return 0;
+
+    KvsPair *listed = malloc(total * sizeof(KvsPair));
+    if (listed == NULL) return 1;
+
+    for (size_t i = 0; i < snapshot->num_stripes; i++) {
+        const char *next = snapshot->stripes[i].data;
+        for (size_t j = 0; j < snapshot->stripes[i].count; j++) {
+            listed[*count].key = next;
+            next += strlen(next) + 1;
+            listed[*count].value = next;
+            next += strlen(next) + 1;
+            (*count)++;
+        }
+    }
+    *pairs = listed;
+    return 0;
+}
+
+void snapshot_free(Snapshot *snapshot) {
+    for (size_t i = 0; i < snapshot->num_stripes; i++) {
+        free(snapshot->stripes[i].data);
+    }
+    free(snapshot);
+}
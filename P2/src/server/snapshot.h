@@ -0,0 +1,66 @@
+#ifndef KVS_SNAPSHOT_H
+#define KVS_SNAPSHOT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+// Copy of the pairs of one lock stripe, as they were when the snapshot was
+// taken. The strings are packed as "key\0value\0" one pair after the other.
+typedef struct SnapshotStripe {
+    int saved;  // Set once the pairs are copied
+    size_t count;
+    char *data;
+} SnapshotStripe;
+
+/// Point-in-time copy of a table, taken without copying anything: the pairs
+/// of a stripe are copied by whoever first needs them, either the first
+/// writer of the stripe after the snapshot, before it modifies the stripe, or
+/// the thread that reads the snapshot. A stripe is only saved with its lock
+/// stripe held, for writing by writers and at least for reading otherwise.
+typedef struct Snapshot {
+    struct Snapshot *next;  // Next active snapshot, see operations.c
+    atomic_int failed;      // Set if a stripe could not be copied
+    uint64_t wal_offset;    // wal_position when it was taken
+    size_t num_stripes;
+    SnapshotStripe stripes[];
+} Snapshot;
+
+/// Creates a snapshot with no stripe saved yet.
+/// @param num_stripes Number of lock stripes of the table.
+/// @return Newly created snapshot, NULL on failure.
+Snapshot *snapshot_create(size_t num_stripes);
+
+/// Saves a stripe unless it already was, copying its pairs. If the copy
+/// cannot be allocated the stripe is still marked as saved, so that writers
+/// can go on, and the snapshot as failed.
+/// @param snapshot Snapshot to fill.
+/// @param stripe Index of the stripe.
+/// @param pairs Pairs of the stripe, which the snapshot copies.
+/// @param count Number of pairs.
+/// @return 0 if the stripe is saved, 1 if the copy could not be allocated.
+int snapshot_save(Snapshot *snapshot, size_t stripe, const KvsPair *pairs,
+                  size_t count);
+
+/// Marks a stripe as saved without copying it, leaving its pairs out of the
+/// snapshot. Must be called before any other thread may save the stripe.
+/// @param snapshot Snapshot to fill.
+/// @param stripe Index of the stripe.
+void snapshot_skip(Snapshot *snapshot, size_t stripe);
+
+/// Lists the pairs of a snapshot whose stripes are all saved. The caller
+/// checks failed first.
+/// @param snapshot Snapshot to list.
+/// @param pairs Pointer to store the array of pairs in, pointing into the
+/// snapshot and to be freed by the caller. NULL if empty.
+/// @param count Pointer to store the number of pairs in.
+/// @return 0 on success, 1 if the array could not be allocated.
+int snapshot_pairs(const Snapshot *snapshot, KvsPair **pairs, size_t *count);
+
+/// Frees a snapshot and its copies.
+/// @param snapshot Snapshot to free.
+void snapshot_free(Snapshot *snapshot);
+
+#endif  // KVS_SNAPSHOT_H
@@ -0,0 +1,112 @@
+#ifndef KVS_SPLITORDER_H
+#define KVS_SPLITORDER_H
+
+// Buckets per segment of the bucket directory
+#define SO_SEGMENT_SIZE 1024
+
+// Segments of the bucket directory, the table stops doubling its bucket
+// count at SO_SEGMENT_SIZE * SO_SEGMENTS buckets
+#define SO_SEGMENTS 4096
+
+// The bucket count doubles when the table holds more than SO_LOAD_FACTOR
+// keys per bucket
+#define SO_LOAD_FACTOR 2
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+
+// Multi-key write. Its values stay invisible to readers until it commits.
+typedef struct SoBatch {
+    atomic_int committed;
+} SoBatch;
+
+// Value of a key. Values are never modified once published, a write
+// installs a new one with a CAS on the node.
+typedef struct SoValue {
+    // Uncommitted batch that installed the value, NULL once committed
+    _Atomic(SoBatch *) batch;
+    // Value readers see while batch is uncommitted, NULL if the key was
+    // absent
+    struct SoValue *prev;
+    char value[MAX_STRING_SIZE];
+} SoValue;
+
+// Node of the split-ordered list. Nodes are sorted by so_key, the bit
+// reversed hash, so that the nodes of a bucket stay contiguous when the
+// bucket is split. Each bucket starts with a sentinel node, which has an
+// even so_key and no value.
+typedef struct SoNode {
+    // Next node, with the low bit set once this node is deleted
+    _Atomic(uintptr_t) next;
+    size_t so_key;
+    _Atomic(SoValue *) value;
+    char key[MAX_STRING_SIZE];
+} SoNode;
+
+typedef struct SoTable {
+    // Sentinels of the initialized buckets, segments allocated on demand
+    _Atomic(_Atomic(SoNode *) *) segments[SO_SEGMENTS];
+    atomic_size_t size;  // Number of buckets, a power of two
+    atomic_size_t count;
+    SoNode head;  // Sentinel of bucket 0, start of the list
+} SoTable;
+
+/// Creates a new empty table.
+/// @return Newly created table, NULL on failure.
+SoTable *so_create_table();
+
+/// Writes a pair, replacing the value if the key already exists. Lock-free
+/// unless the key is part of an uncommitted batch, which is waited for.
+/// @param st Table to be modified.
+/// @param key Key of the pair, shorter than MAX_STRING_SIZE.
+/// @param value Value of the pair, shorter than MAX_STRING_SIZE.
+/// @return 0 if the pair was written successfully, 1 otherwise.
+int so_write_pair(SoTable *st, const char *key, const char *value);
+
+/// Writes several pairs so that readers see either none or all of them.
+/// The values are installed in so_key order as invisible to readers, then
+/// made visible at once by committing the batch. Writers that meet a value
+/// of an uncommitted batch wait for it, and since every batch installs in
+/// the same order no two batches wait for each other.
+/// @param st Table to be modified.
+/// @param num_pairs Number of pairs, at most MAX_WRITE_SIZE.
+/// @param keys Keys of the pairs, a later duplicate key wins.
+/// @param values Values of the pairs.
+/// @return 0 if every pair was written, 1 if none was.
+int so_write_batch(SoTable *st, size_t num_pairs,
+                   char keys[][MAX_STRING_SIZE],
+                   char values[][MAX_STRING_SIZE]);
+
+/// Reads the value of a key. The caller must be inside an epoch.
+/// @param st Table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value to be freed with slab_free, NULL if the key does
+/// not exist.
+char *so_read_pair(SoTable *st, const char *key);
+
+/// Deletes a key. Lock-free unless the key is part of an uncommitted batch.
+/// @param st Table to delete from.
+/// @param key Key of the pair to be deleted.
+/// @return 0 if the key was deleted, 1 if it did not exist.
+int so_delete_pair(SoTable *st, const char *key);
+
+/// Lists every pair of the table, sorted by so_key. No write may run
+/// concurrently.
+/// @param st Table to list.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *so_list_pairs(SoTable *st, size_t *count);
+
+/// Frees the table and every node.
+/// @param st Table to be deleted.
+void so_free_table(SoTable *st);
+
+/// Frees the table but not its nodes, which are released by slab_destroy.
+/// @param st Table to be deleted.
+void so_drop_table(SoTable *st);
+
+#endif  // KVS_SPLITORDER_H
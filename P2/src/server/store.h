@@ -0,0 +1,68 @@
+#ifndef KVS_STORE_H
+#define KVS_STORE_H
+
+// Bounds of the chunks a backup is split into. A chunk ends where the gear
+// hash of the bytes before it has STORE_CHUNK_BITS zero bits, so chunks are
+// about 1 << STORE_CHUNK_BITS bytes and a change only moves the boundaries
+// around it.
+#define STORE_MIN_CHUNK (16 << 10)
+#define STORE_MAX_CHUNK (256 << 10)
+#define STORE_CHUNK_BITS 16
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A backup file in a store is a manifest: a line "KVSCHUNKS <size>
+// <chunks>", a line with the absolute path of the store, and a line
+// "<sha256> <size>" per chunk, in order. The chunks are the files
+// chunks/<sha256> of the store, and the manifests manifests/<sha256>,
+// named by the SHA-256 of their content, so that identical backups are hard
+// links to one manifest.
+#define STORE_MAGIC "KVSCHUNKS "
+
+// Counters of store_backup
+typedef struct StoreStats {
+    uint64_t bytes;        // Size of the backup
+    size_t chunks;         // Chunks it was split into
+    size_t new_chunks;     // Chunks the store did not hold yet
+    uint64_t new_bytes;    // Bytes of those chunks
+    int new_manifest;      // Whether no identical backup was stored before
+} StoreStats;
+
+/// Creates the directories of a store, if they do not exist.
+/// @param dir Directory of the store.
+/// @return 0 on success, 1 otherwise.
+int store_init(const char *dir);
+
+/// Splits a backup file into chunks and adds those that are not in the
+/// store yet, then adds its manifest, syncing each file and directory.
+/// @param dir Directory of the store.
+/// @param fd File descriptor of the backup, read with pread.
+/// @param manifest Buffer to store the path of the manifest in.
+/// @param stats Pointer to store the counters in, may be NULL.
+/// @return 0 on success, 1 otherwise.
+int store_backup(const char *dir, int fd, char manifest[PATH_MAX],
+                 StoreStats *stats);
+
+/// Replaces a file by a hard link to a manifest, atomically.
+/// @param manifest Path returned by store_backup.
+/// @param path Path of the backup file.
+/// @return 0 on success, 1 otherwise.
+int store_link(const char *manifest, const char *path);
+
+/// Checks if a file starts with STORE_MAGIC.
+/// @param fd File descriptor of the file.
+/// @return 1 if the file is a manifest, 0 otherwise.
+int store_is_manifest(int fd);
+
+/// Reads the backup of a manifest into memory, checking the SHA-256 of every
+/// chunk.
+/// @param fd File descriptor of the manifest.
+/// @param limit Stop once this many bytes are read, SIZE_MAX for the whole
+/// backup.
+/// @param size Pointer to store the number of bytes read in.
+/// @return Buffer to be freed by the caller, NULL on failure.
+char *store_read(int fd, size_t limit, size_t *size);
+
+#endif  // KVS_STORE_H
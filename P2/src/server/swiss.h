@@ -0,0 +1,82 @@
+#ifndef KVS_SWISS_H
+#define KVS_SWISS_H
+
+// Number of slots whose metadata bytes are compared at once
+#define SWISS_GROUP_SIZE 16
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "engine.h"
+#include "kvs.h"
+
+// Slot of the table, key and value are stored inline
+typedef struct SwissSlot {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];
+} SwissSlot;
+
+// Open addressing table of the keys of one lock stripe. Each slot has one
+// metadata byte in ctrl: SWISS_EMPTY, SWISS_DELETED or, for a used slot, the
+// low 7 bits of the hash of its key.
+typedef struct SwissShard {
+    int8_t *ctrl;
+    SwissSlot *slots;
+    size_t capacity;  // Multiple of SWISS_GROUP_SIZE, power of two
+    size_t count;
+    size_t deleted;  // Number of SWISS_DELETED slots
+} SwissShard;
+
+// One shard per lock stripe, so that a shard is only ever modified by the
+// holder of its stripe. The low bits of the hash select the shard and the
+// remaining ones are used inside it.
+typedef struct SwissTable {
+    size_t num_shards;   // Number of lock stripes, a power of two
+    unsigned int shift;  // log2(num_shards)
+    SwissShard shards[];
+} SwissTable;
+
+/// Creates a new empty table. Shards are allocated on first write.
+/// @param stripes Number of lock stripes, a power of two.
+/// @return Newly created table, NULL on failure.
+SwissTable *swiss_create_table(size_t stripes);
+
+/// Writes a pair, replacing the value in place if the key already exists.
+/// @param st Table to be modified.
+/// @param key Key of the pair, shorter than MAX_STRING_SIZE.
+/// @param value Value of the pair, shorter than MAX_STRING_SIZE.
+/// @return 0 if the pair was written successfully, 1 otherwise.
+int swiss_write_pair(SwissTable *st, const char *key, const char *value);
+
+/// Reads the value of a key.
+/// @param st Table to read from.
+/// @param key Key of the pair to read.
+/// @return Copy of the value to be freed with slab_free, NULL if the key does
+/// not exist.
+char *swiss_read_pair(SwissTable *st, const char *key);
+
+/// Deletes a key.
+/// @param st Table to delete from.
+/// @param key Key of the pair to be deleted.
+/// @return 0 if the key was deleted, 1 if it did not exist.
+int swiss_delete_pair(SwissTable *st, const char *key);
+
+/// Lists every pair of the table, in no particular order.
+/// @param st Table to list.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *swiss_list_pairs(SwissTable *st, size_t *count);
+
+/// Lists the pairs of the shard of a lock stripe, in no particular order.
+/// @param st Table to list.
+/// @param lock Index of the lock stripe.
+/// @param count Pointer to store the number of pairs in.
+/// @return Array of pairs, to be freed by the caller. NULL if empty.
+KvsPair *swiss_list_stripe(SwissTable *st, size_t lock, size_t *count);
+
+/// Frees the table.
+/// @param st Table to be deleted.
+void swiss_free_table(SwissTable *st);
+
+#endif  // KVS_SWISS_H
@@ -0,0 +1,531 @@
+// syscall is a GNU extension
+#define _GNU_SOURCE
+
+#include "sync.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// PrefRwlock.state while a writer holds the lock
+#define PREF_WRITER INT_MAX
+
+// Sleeps while *word holds value, or yields where futexes are not available
+static void futex_wait(atomic_int *word, int value) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+    (void)word;
+    (void)value;
+    sched_yield();
+#endif
+}
+
+// Wakes up to count threads sleeping on word, or every thread if count is
+// INT_MAX
+static void futex_wake(atomic_int *word, int count) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    (void)word;
+    (void)count;
+#endif
+}
+
+// Hint to the core that the thread is spinning
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Spins on a busy lock for a while, then yields the core at each poll
+static inline void spin_wait(int *spins) {
+    if (*spins < SYNC_SPIN) {
+        (*spins)++;
+        cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+/*
+ * pthread
+ */
+
+static int pthread_mutex_init_default(KvsMutex *mutex) {
+    return pthread_mutex_init(&mutex->pthread, NULL);
+}
+
+static int pthread_mutex_lock_wrapper(KvsMutex *mutex) {
+    return pthread_mutex_lock(&mutex->pthread);
+}
+
+static int pthread_mutex_trylock_wrapper(KvsMutex *mutex) {
+    return pthread_mutex_trylock(&mutex->pthread);
+}
+
+static int pthread_mutex_unlock_wrapper(KvsMutex *mutex) {
+    return pthread_mutex_unlock(&mutex->pthread);
+}
+
+static int pthread_mutex_destroy_wrapper(KvsMutex *mutex) {
+    return pthread_mutex_destroy(&mutex->pthread);
+}
+
+static int pthread_rwl_init(KvsRwlock *rwl) {
+    return pthread_rwlock_init(&rwl->pthread, NULL);
+}
+
+static int pthread_rwl_rdlock(KvsRwlock *rwl) {
+    return pthread_rwlock_rdlock(&rwl->pthread);
+}
+
+static int pthread_rwl_wrlock(KvsRwlock *rwl) {
+    return pthread_rwlock_wrlock(&rwl->pthread);
+}
+
+static int pthread_rwl_trywrlock(KvsRwlock *rwl) {
+    return pthread_rwlock_trywrlock(&rwl->pthread);
+}
+
+static int pthread_rwl_unlock(KvsRwlock *rwl) {
+    return pthread_rwlock_unlock(&rwl->pthread);
+}
+
+static int pthread_rwl_destroy(KvsRwlock *rwl) {
+    return pthread_rwlock_destroy(&rwl->pthread);
+}
+
+/*
+ * Adaptive futex mutex, after "Futexes Are Tricky" (Drepper)
+ */
+
+static int futex_mutex_init(KvsMutex *mutex) {
+    atomic_init(&mutex->futex.state, 0);
+    return 0;
+}
+
+static int futex_mutex_trylock(KvsMutex *mutex) {
+    int expected = 0;
+    return atomic_compare_exchange_strong(&mutex->futex.state, &expected, 1)
+               ? 0
+               : EBUSY;
+}
+
+static int futex_mutex_lock(KvsMutex *mutex) {
+    atomic_int *state = &mutex->futex.state;
+    for (int spins = 0; spins < SYNC_SPIN; spins++) {
+        if (atomic_load_explicit(state, memory_order_relaxed) == 0 &&
+            futex_mutex_trylock(mutex) == 0) {
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    // Mark the mutex as contended, so that unlock wakes a sleeper
+    while (atomic_exchange(state, 2) != 0) {
+        futex_wait(state, 2);
+    }
+    return 0;
+}
+
+static int futex_mutex_unlock(KvsMutex *mutex) {
+    if (atomic_exchange(&mutex->futex.state, 0) == 2) {
+        futex_wake(&mutex->futex.state, 1);
+    }
+    return 0;
+}
+
+static int noop_mutex_destroy(KvsMutex *mutex) {
+    (void)mutex;
+    return 0;
+}
+
+/*
+ * Ticket lock
+ */
+
+static int ticket_init(KvsMutex *mutex) {
+    atomic_init(&mutex->ticket.next, 0);
+    atomic_init(&mutex->ticket.owner, 0);
+    return 0;
+}
+
+static int ticket_trylock(KvsMutex *mutex) {
+    unsigned int owner = atomic_load(&mutex->ticket.owner);
+    unsigned int expected = owner;
+    return atomic_compare_exchange_strong(&mutex->ticket.next, &expected,
+                                          owner + 1)
+               ? 0
+               : EBUSY;
+}
+
+static int ticket_lock(KvsMutex *mutex) {
+    unsigned int ticket = atomic_fetch_add(&mutex->ticket.next, 1);
+    int spins = 0;
+    while (atomic_load_explicit(&mutex->ticket.owner, memory_order_acquire) !=
+           ticket) {
+        spin_wait(&spins);
+    }
+    return 0;
+}
+
+static int ticket_unlock(KvsMutex *mutex) {
+    unsigned int owner =
+        atomic_load_explicit(&mutex->ticket.owner, memory_order_relaxed);
+    atomic_store_explicit(&mutex->ticket.owner, owner + 1,
+                          memory_order_release);
+    return 0;
+}
+
+/*
+ * MCS queue lock (Mellor-Crummey and Scott)
+ */
+
+static _Thread_local McsNode mcs_nodes[SYNC_MCS_NODES];
+static _Thread_local McsNode *mcs_free = NULL;
+static _Thread_local size_t mcs_unused = 0;  // Nodes never handed out
+
+static McsNode *get_mcs_node() {
+    McsNode *node;
+    if (mcs_free != NULL) {
+        node = mcs_free;
+        mcs_free = atomic_load_explicit(&node->next, memory_order_relaxed);
+    } else if (mcs_unused < SYNC_MCS_NODES) {
+        node = &mcs_nodes[mcs_unused++];
+    } else {
+        node = malloc(sizeof(McsNode));
+        if (node == NULL) return NULL;
+        node->heap = 1;
+    }
+    atomic_init(&node->next, NULL);
+    atomic_init(&node->locked, 1);
+    return node;
+}
+
+static void put_mcs_node(McsNode *node) {
+    if (node->heap) {
+        free(node);
+        return;
+    }
+    atomic_store_explicit(&node->next, mcs_free, memory_order_relaxed);
+    mcs_free = node;
+}
+
+static int mcs_init(KvsMutex *mutex) {
+    atomic_init(&mutex->mcs.tail, NULL);
+    mutex->mcs.owner = NULL;
+    return 0;
+}
+
+static int mcs_trylock(KvsMutex *mutex) {
+    McsNode *node = get_mcs_node();
+    if (node == NULL) return ENOMEM;
+
+    McsNode *expected = NULL;
+    if (!atomic_compare_exchange_strong(&mutex->mcs.tail, &expected, node)) {
+        put_mcs_node(node);
+        return EBUSY;
+    }
+    mutex->mcs.owner = node;
+    return 0;
+}
+
+static int mcs_lock(KvsMutex *mutex) {
+    McsNode *node = get_mcs_node();
+    if (node == NULL) return ENOMEM;
+
+    McsNode *prev = atomic_exchange(&mutex->mcs.tail, node);
+    if (prev != NULL) {
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+        int spins = 0;
+        while (atomic_load_explicit(&node->locked, memory_order_acquire)) {
+            spin_wait(&spins);
+        }
+    }
+    mutex->mcs.owner = node;
+    return 0;
+}
+
+static int mcs_unlock(KvsMutex *mutex) {
+    McsNode *node = mutex->mcs.owner;
+    McsNode *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL) {
+        McsNode *expected = node;
+        if (atomic_compare_exchange_strong(&mutex->mcs.tail, &expected,
+                                           NULL)) {
+            put_mcs_node(node);
+            return 0;
+        }
+
+        // A thread is queueing behind this node but has not linked it yet
+        int spins = 0;
+        while ((next = atomic_load_explicit(&node->next,
+                                            memory_order_acquire)) == NULL) {
+            spin_wait(&spins);
+        }
+    }
+
+    atomic_store_explicit(&next->locked, 0, memory_order_release);
+    put_mcs_node(node);
+    return 0;
+}
+
+/*
+ * Readers-writer lock on a mutex of the backend (adaptive, ticket and MCS)
+ */
+
+static int mutex_rwl_init(KvsRwlock *rwl) {
+    atomic_init(&rwl->mutex.readers, 0);
+    atomic_init(&rwl->mutex.writer, 0);
+    atomic_init(&rwl->mutex.writer_waiting, 0);
+    return sync_backend->mutex_init(&rwl->mutex.order);
+}
+
+static int mutex_rwl_rdlock(KvsRwlock *rwl) {
+    int err = sync_backend->mutex_lock(&rwl->mutex.order);
+    if (err != 0) return err;
+    atomic_fetch_add(&rwl->mutex.readers, 1);
+    return sync_backend->mutex_unlock(&rwl->mutex.order);
+}
+
+// Waits for the readers to leave, with the mutex held so no new one enters
+static void wait_readers(MutexRwlock *rwl) {
+    atomic_store(&rwl->writer_waiting, 1);
+    for (int spins = 0;;) {
+        int readers = atomic_load(&rwl->readers);
+        if (readers == 0) break;
+        if (spins < SYNC_SPIN) {
+            spins++;
+            cpu_relax();
+        } else {
+            futex_wait(&rwl->readers, readers);
+        }
+    }
+    atomic_store(&rwl->writer_waiting, 0);
+    atomic_store_explicit(&rwl->writer, 1, memory_order_relaxed);
+}
+
+static int mutex_rwl_wrlock(KvsRwlock *rwl) {
+    int err = sync_backend->mutex_lock(&rwl->mutex.order);
+    if (err != 0) return err;
+    wait_readers(&rwl->mutex);
+    return 0;
+}
+
+static int mutex_rwl_trywrlock(KvsRwlock *rwl) {
+    int err = sync_backend->mutex_trylock(&rwl->mutex.order);
+    if (err != 0) return err;
+
+    if (atomic_load(&rwl->mutex.readers) != 0) {
+        sync_backend->mutex_unlock(&rwl->mutex.order);
+        return EBUSY;
+    }
+    atomic_store_explicit(&rwl->mutex.writer, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int mutex_rwl_unlock(KvsRwlock *rwl) {
+    // Readers never hold the lock with a writer, so the flag tells which of
+    // them is unlocking
+    if (atomic_load_explicit(&rwl->mutex.writer, memory_order_relaxed)) {
+        atomic_store_explicit(&rwl->mutex.writer, 0, memory_order_relaxed);
+        return sync_backend->mutex_unlock(&rwl->mutex.order);
+    }
+
+    if (atomic_fetch_sub(&rwl->mutex.readers, 1) == 1 &&
+        atomic_load(&rwl->mutex.writer_waiting)) {
+        futex_wake(&rwl->mutex.readers, 1);
+    }
+    return 0;
+}
+
+static int mutex_rwl_destroy(KvsRwlock *rwl) {
+    return sync_backend->mutex_destroy(&rwl->mutex.order);
+}
+
+/*
+ * Writer-preferring readers-writer lock
+ */
+
+static int pref_rwl_init(KvsRwlock *rwl) {
+    atomic_init(&rwl->pref.state, 0);
+    atomic_init(&rwl->pref.writers_waiting, 0);
+    atomic_init(&rwl->pref.seq, 0);
+    return 0;
+}
+
+static int pref_rwl_rdlock(KvsRwlock *rwl) {
+    PrefRwlock *pref = &rwl->pref;
+    for (int spins = 0;;) {
+        int seq = atomic_load(&pref->seq);
+        int state = atomic_load(&pref->state);
+        // New readers wait behind a waiting writer
+        if (state != PREF_WRITER && atomic_load(&pref->writers_waiting) == 0 &&
+            atomic_compare_exchange_weak(&pref->state, &state, state + 1)) {
+            return 0;
+        }
+
+        if (spins < SYNC_SPIN) {
+            spins++;
+            cpu_relax();
+        } else {
+            futex_wait(&pref->seq, seq);
+        }
+    }
+}
+
+static int pref_rwl_trywrlock(KvsRwlock *rwl) {
+    int expected = 0;
+    return atomic_compare_exchange_strong(&rwl->pref.state, &expected,
+                                          PREF_WRITER)
+               ? 0
+               : EBUSY;
+}
+
+static int pref_rwl_wrlock(KvsRwlock *rwl) {
+    PrefRwlock *pref = &rwl->pref;
+    atomic_fetch_add(&pref->writers_waiting, 1);
+    for (int spins = 0;;) {
+        int seq = atomic_load(&pref->seq);
+        if (pref_rwl_trywrlock(rwl) == 0) break;
+
+        if (spins < SYNC_SPIN) {
+            spins++;
+            cpu_relax();
+        } else {
+            futex_wait(&pref->seq, seq);
+        }
+    }
+    atomic_fetch_sub(&pref->writers_waiting, 1);
+    return 0;
+}
+
+// Lets the waiting threads try again
+static void pref_wake(PrefRwlock *pref) {
+    atomic_fetch_add(&pref->seq, 1);
+    futex_wake(&pref->seq, INT_MAX);
+}
+
+static int pref_rwl_unlock(KvsRwlock *rwl) {
+    PrefRwlock *pref = &rwl->pref;
+    if (atomic_load_explicit(&pref->state, memory_order_relaxed) ==
+        PREF_WRITER) {
+        atomic_store(&pref->state, 0);
+        pref_wake(pref);
+    } else if (atomic_fetch_sub(&pref->state, 1) == 1 &&
+               atomic_load(&pref->writers_waiting) > 0) {
+        pref_wake(pref);
+    }
+    return 0;
+}
+
+static int noop_rwl_destroy(KvsRwlock *rwl) {
+    (void)rwl;
+    return 0;
+}
+
+static const SyncBackend pthread_backend = {
+    .name = "pthread",
+    .mutex_init = pthread_mutex_init_default,
+    .mutex_lock = pthread_mutex_lock_wrapper,
+    .mutex_trylock = pthread_mutex_trylock_wrapper,
+    .mutex_unlock = pthread_mutex_unlock_wrapper,
+    .mutex_destroy = pthread_mutex_destroy_wrapper,
+    .rwl_init = pthread_rwl_init,
+    .rwl_rdlock = pthread_rwl_rdlock,
+    .rwl_wrlock = pthread_rwl_wrlock,
+    .rwl_trywrlock = pthread_rwl_trywrlock,
+    .rwl_unlock = pthread_rwl_unlock,
+    .rwl_destroy = pthread_rwl_destroy,
+};
+
+static const SyncBackend adaptive_backend = {
+    .name = "adaptive",
+    .mutex_init = futex_mutex_init,
+    .mutex_lock = futex_mutex_lock,
+    .mutex_trylock = futex_mutex_trylock,
+    .mutex_unlock = futex_mutex_unlock,
+    .mutex_destroy = noop_mutex_destroy,
+    .rwl_init = mutex_rwl_init,
+    .rwl_rdlock = mutex_rwl_rdlock,
+    .rwl_wrlock = mutex_rwl_wrlock,
+    .rwl_trywrlock = mutex_rwl_trywrlock,
+    .rwl_unlock = mutex_rwl_unlock,
+    .rwl_destroy = mutex_rwl_destroy,
+};
+
+static const SyncBackend ticket_backend = {
+    .name = "ticket",
+    .mutex_init = ticket_init,
+    .mutex_lock = ticket_lock,
+    .mutex_trylock = ticket_trylock,
+    .mutex_unlock = ticket_unlock,
+    .mutex_destroy = noop_mutex_destroy,
+    .rwl_init = mutex_rwl_init,
+    .rwl_rdlock = mutex_rwl_rdlock,
+    .rwl_wrlock = mutex_rwl_wrlock,
+    .rwl_trywrlock = mutex_rwl_trywrlock,
+    .rwl_unlock = mutex_rwl_unlock,
+    .rwl_destroy = mutex_rwl_destroy,
+};
+
+static const SyncBackend mcs_backend = {
+    .name = "mcs",
+    .mutex_init = mcs_init,
+    .mutex_lock = mcs_lock,
+    .mutex_trylock = mcs_trylock,
+    .mutex_unlock = mcs_unlock,
+    .mutex_destroy = noop_mutex_destroy,
+    .rwl_init = mutex_rwl_init,
+    .rwl_rdlock = mutex_rwl_rdlock,
+    .rwl_wrlock = mutex_rwl_wrlock,
+    .rwl_trywrlock = mutex_rwl_trywrlock,
+    .rwl_unlock = mutex_rwl_unlock,
+    .rwl_destroy = mutex_rwl_destroy,
+};
+
+// Writer-preferring readers-writer locks, with pthread mutexes
+static const SyncBackend rwpref_backend = {
+    .name = "rwpref",
+    .mutex_init = pthread_mutex_init_default,
+    .mutex_lock = pthread_mutex_lock_wrapper,
+    .mutex_trylock = pthread_mutex_trylock_wrapper,
+    .mutex_unlock = pthread_mutex_unlock_wrapper,
+    .mutex_destroy = pthread_mutex_destroy_wrapper,
+    .rwl_init = pref_rwl_init,
+    .rwl_rdlock = pref_rwl_rdlock,
+    .rwl_wrlock = pref_rwl_wrlock,
+    .rwl_trywrlock = pref_rwl_trywrlock,
+    .rwl_unlock = pref_rwl_unlock,
+    .rwl_destroy = noop_rwl_destroy,
+};
+
+static const SyncBackend *const backends[] = {
+    &pthread_backend, &adaptive_backend, &ticket_backend, &mcs_backend,
+    &rwpref_backend};
+
+const SyncBackend *sync_backend = &pthread_backend;
+
+const SyncBackend *get_sync_backend(const char *name) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+const SyncBackend *const *list_sync_backends(size_t *count) {
+    *count = sizeof(backends) / sizeof(backends[0]);
+    return backends;
+}
@@ -0,0 +1,40 @@
+#ifndef KVS_THROTTLE_H
+#define KVS_THROTTLE_H
+
+// Tokens the bucket holds at most, as milliseconds of the rate, so that idle
+// backups do not save up a burst that would then saturate the disk
+#define THROTTLE_BURST_MS 100
+
+// Backups count as competing with the jobs for this long after a job thread
+// last ran a command
+#define THROTTLE_BUSY_MS 50
+
+// Divisor of the rate while the jobs are busy
+#define THROTTLE_BUSY_SHARE 4
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Sets the rate shared by every thread that writes a backup file.
+/// @param bytes_per_second Bytes the backups may write per second, 0 for no
+/// limit.
+void throttle_init(uint64_t bytes_per_second);
+
+/// Takes tokens for a write to a backup file from a token bucket shared by
+/// all the backup writers, sleeping until the bucket has refilled enough
+/// when it is empty. The bucket refills at the configured rate, divided by
+/// THROTTLE_BUSY_SHARE while the jobs are busy (see throttle_foreground).
+/// Writes larger than the bucket are let through once it is empty, leaving
+/// the next ones to wait out the debt.
+/// @param size Number of bytes about to be written.
+void throttle_backup(size_t size);
+
+/// Marks the job threads as busy, which slows the backups down for the next
+/// THROTTLE_BUSY_MS milliseconds. Does nothing if there is no limit.
+void throttle_foreground();
+
+/// Time the backup writers slept in throttle_backup, summed over threads.
+/// @return The time in seconds.
+double throttle_seconds();
+
+#endif  // KVS_THROTTLE_H
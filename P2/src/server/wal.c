@@ -0,0 +1,614 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "utils.h"
+
+// A record is a header followed by its payload: the command type (1 byte),
+// the number of keys (2 bytes) and, for each key, its length (2 bytes) and
+// bytes, then for a WRITE the length and bytes of the value. Integers are
+// stored in the byte order of the machine.
+typedef struct WalHeader {
+    uint32_t size;  // Size of the payload
+    uint32_t crc;   // CRC-32C of the payload
+} WalHeader;
+
+// Largest payload of a command
+#define WAL_MAX_PAYLOAD (3 + MAX_WRITE_SIZE * 2 * (2 + MAX_STRING_SIZE))
+
+typedef struct WalBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+} WalBuffer;
+
+static int wal_fd = -1;
+static int wal_sync_ms;
+static off_t wal_start;  // Size of the log when it was opened
+
+// Protects every field below. Appends go to buffer while the group leader
+// writes spare, then the two are swapped.
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+static WalBuffer buffer;
+static WalBuffer spare;
+static unsigned long long appended;  // Bytes appended since wal_open
+static unsigned long long durable;   // Bytes written (and synced) so far
+static int flushing;                 // Set while a leader writes
+static int failed;                   // Set once a write or sync failed
+
+// Thread that syncs every wal_sync_ms milliseconds
+static pthread_t syncer;
+static int syncer_running;
+static int stopping;
+static pthread_cond_t syncer_cond = PTHREAD_COND_INITIALIZER;
+
+// Writes the buffer as the leader of a group commit, releasing wal_mutex
+// during the write so that other threads keep appending
+static void flush_locked(int sync) {
+    flushing = 1;
+    WalBuffer pending = buffer;
+    buffer = spare;
+    buffer.len = 0;
+    unsigned long long end = appended;
+    pthread_mutex_unlock(&wal_mutex);
+
+    int error = write_fully(wal_fd, pending.data, pending.len) != 0 ||
+                (sync && fdatasync(wal_fd) != 0);
+
+    pthread_mutex_lock(&wal_mutex);
+    spare = pending;
+    if (error) {
+        perror("Failed to write the WAL");
+        failed = 1;
+    } else {
+        durable = end;
+    }
+    flushing = 0;
+    pthread_cond_broadcast(&wal_flushed);
+}
+
+static void *syncer_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal_mutex);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wal_sync_ms / 1000;
+        deadline.tv_nsec += (long)(wal_sync_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&syncer_cond, &wal_mutex, &deadline);
+
+        if (!flushing && durable < appended && !failed) flush_locked(1);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    return NULL;
+}
+
+static uint16_t read_u16(const unsigned char *bytes) {
+    uint16_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Decodes a payload into keys and values
+// @return Number of keys, 0 if the payload is malformed.
+static size_t decode(const unsigned char *payload, size_t size, WalOp *op,
+                     char keys[][MAX_STRING_SIZE],
+                     char values[][MAX_STRING_SIZE]) {
+    if (size < 3 || (payload[0] != WAL_WRITE && payload[0] != WAL_DELETE)) {
+        return 0;
+    }
+    *op = (WalOp)payload[0];
+    size_t num_pairs = read_u16(payload + 1);
+    if (num_pairs == 0 || num_pairs > MAX_WRITE_SIZE) return 0;
+
+    size_t pos = 3;
+    for (size_t i = 0; i < num_pairs; i++) {
+        for (int field = 0; field < (*op == WAL_WRITE ? 2 : 1); field++) {
+            if (pos + 2 > size) return 0;
+            size_t len = read_u16(payload + pos);
+            pos += 2;
+            if (len >= MAX_STRING_SIZE || pos + len > size) return 0;
+
+            char *dest = field == 0 ? keys[i] : values[i];
+            memcpy(dest, payload + pos, len);
+            dest[len] = '\0';
+            pos += len;
+        }
+    }
+    return pos == size ? num_pairs : 0;
+}
+
+// Buffered reader of the records of a log
+typedef struct LogReader {
+    int fd;
+    char *data;
+    size_t start;  // First byte of data not consumed yet
+    size_t end;    // End of the bytes read into data
+    off_t offset;  // Position in the log of data[start]
+} LogReader;
+
+// Size of the buffer of a LogReader, which holds at least one whole record
+#define READER_SIZE (1 << 20)
+
+_Static_assert(READER_SIZE >= sizeof(WalHeader) + WAL_MAX_PAYLOAD,
+               "a record must fit in the buffer of a LogReader");
+
+// Pairs of a log queued for a replay thread: the parts of consecutive
+// commands whose keys belong to the thread, each stored contiguously
+#define BLOCK_PAIRS 1024
+
+typedef struct ReplayBlock {
+    size_t num_pairs;
+    size_t num_commands;
+    struct {
+        WalOp op;
+        size_t num_pairs;
+    } commands[BLOCK_PAIRS];
+    char keys[BLOCK_PAIRS][MAX_STRING_SIZE];
+    char values[BLOCK_PAIRS][MAX_STRING_SIZE];
+    struct ReplayBlock *next;
+} ReplayBlock;
+
+// Full blocks a replay thread may have queued before the reader waits
+#define QUEUED_BLOCKS 4
+
+// Replay thread and its queue of blocks, protected by mutex
+typedef struct Partition {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;  // Signaled when a block is queued or at the end
+    pthread_cond_t space;  // Signaled when a block is freed
+    ReplayBlock *head;     // Full blocks, oldest first
+    ReplayBlock *tail;
+    size_t queued;
+    ReplayBlock *unused;  // Blocks already applied
+    int done;           // Set once every block is queued
+    ReplayBlock *current;  // Block being filled by the reader
+    size_t added;          // Pairs of the command being dispatched
+    WalApply apply;
+    atomic_int *stopped;  // Set once a command fails
+} Partition;
+
+// Makes at least need bytes available after start, unless the log ends first
+static void fill_reader(LogReader *reader, size_t need) {
+    if (reader->end - reader->start >= need) return;
+    memmove(reader->data, reader->data + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+    while (reader->end < need) {
+        ssize_t got = read(reader->fd, reader->data + reader->end,
+                           READER_SIZE - reader->end);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return;
+        reader->end += (size_t)got;
+    }
+}
+
+// Reads the next record of a log, checking its CRC-32C if check is set
+// @return Its payload, in the buffer of the reader until the next call, NULL
+// at the end of the log or at an incomplete or corrupted record.
+static const unsigned char *next_record(LogReader *reader, int check,
+                                        size_t *size) {
+    WalHeader header;
+    fill_reader(reader, sizeof(header));
+    if (reader->end - reader->start < sizeof(header)) return NULL;
+    memcpy(&header, reader->data + reader->start, sizeof(header));
+    if (header.size > WAL_MAX_PAYLOAD) return NULL;
+
+    size_t record = sizeof(header) + header.size;
+    fill_reader(reader, record);
+    if (reader->end - reader->start < record) return NULL;
+    const unsigned char *payload =
+        (unsigned char *)reader->data + reader->start + sizeof(header);
+    if (check && crc32c(0, payload, header.size) != header.crc) return NULL;
+
+    reader->start += record;
+    reader->offset += (off_t)record;
+    *size = header.size;
+    return payload;
+}
+
+// Position of the log from which a replay starts: offset if a record starts
+// there, otherwise the start of the log, which replays commands the snapshot
+// already holds but leaves the same state
+static off_t find_start(LogReader *reader, uint64_t offset) {
+    if (offset == 0) return 0;
+    size_t size;
+    while (reader->offset < (off_t)offset &&
+           next_record(reader, 0, &size) != NULL) {
+    }
+    if (reader->offset == (off_t)offset) return reader->offset;
+    fprintf(stderr,
+            "No WAL record at position %llu of the snapshot, replaying the "
+            "whole WAL\n",
+            (unsigned long long)offset);
+    return 0;
+}
+
+static void *replay_thread(void *arg) {
+    Partition *part = arg;
+    pthread_mutex_lock(&part->mutex);
+    for (;;) {
+        while (part->head == NULL && !part->done) {
+            pthread_cond_wait(&part->ready, &part->mutex);
+        }
+        ReplayBlock *block = part->head;
+        if (block == NULL) break;
+        part->head = block->next;
+        if (part->head == NULL) part->tail = NULL;
+        part->queued--;
+        pthread_mutex_unlock(&part->mutex);
+
+        // After a failure the blocks are only drained, so the reader is not
+        // left waiting
+        size_t first = 0;
+        for (size_t i = 0; i < block->num_commands; i++) {
+            WalOp op = block->commands[i].op;
+            size_t count = block->commands[i].num_pairs;
+            if (!atomic_load(part->stopped) &&
+                part->apply(op, count, block->keys + first,
+                            op == WAL_WRITE ? block->values + first : NULL)) {
+                atomic_store(part->stopped, 1);
+            }
+            first += count;
+        }
+
+        pthread_mutex_lock(&part->mutex);
+        block->next = part->unused;
+        part->unused = block;
+        pthread_cond_signal(&part->space);
+    }
+    pthread_mutex_unlock(&part->mutex);
+    return NULL;
+}
+
+// Queues the block the reader fills for a replay thread, waiting while the
+// thread is QUEUED_BLOCKS behind, and takes an empty one
+// @return 0 on success, 1 if no block could be allocated.
+static int queue_block(Partition *part) {
+    pthread_mutex_lock(&part->mutex);
+    ReplayBlock *block = part->current;
+    if (block != NULL && block->num_commands > 0) {
+        while (part->queued >= QUEUED_BLOCKS) {
+            pthread_cond_wait(&part->space, &part->mutex);
+        }
+        block->next = NULL;
+        if (part->tail != NULL) {
+            part->tail->next = block;
+        } else {
+            part->head = block;
+        }
+        part->tail = block;
+        part->queued++;
+        pthread_cond_signal(&part->ready);
+        block = NULL;
+    }
+    if (block == NULL && part->unused != NULL) {
+        block = part->unused;
+        part->unused = block->next;
+    }
+    pthread_mutex_unlock(&part->mutex);
+
+    if (block == NULL) block = malloc(sizeof(ReplayBlock));
+    part->current = block;
+    if (block == NULL) return 1;
+    block->num_pairs = 0;
+    block->num_commands = 0;
+    return 0;
+}
+
+// Splits a command between the replay threads by the partitions of its keys,
+// keeping the order of the keys of each thread
+// @return 0 on success, 1 if no block could be allocated.
+static int dispatch(Partition *parts, size_t num_threads,
+                    WalPartition partition, WalOp op, size_t num_pairs,
+                    char keys[][MAX_STRING_SIZE],
+                    char values[][MAX_STRING_SIZE]) {
+    for (size_t t = 0; t < num_threads; t++) {
+        parts[t].added = 0;
+        if (parts[t].current->num_pairs + num_pairs > BLOCK_PAIRS &&
+            queue_block(&parts[t]) != 0) {
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        Partition *part = &parts[partition(keys[i]) % num_threads];
+        ReplayBlock *block = part->current;
+        size_t pos = block->num_pairs + part->added++;
+        memcpy(block->keys[pos], keys[i], MAX_STRING_SIZE);
+        if (op == WAL_WRITE) {
+            memcpy(block->values[pos], values[i], MAX_STRING_SIZE);
+        }
+    }
+
+    for (size_t t = 0; t < num_threads; t++) {
+        ReplayBlock *block = parts[t].current;
+        if (parts[t].added == 0) continue;
+        block->commands[block->num_commands].op = op;
+        block->commands[block->num_commands].num_pairs = parts[t].added;
+        block->num_commands++;
+        block->num_pairs += parts[t].added;
+    }
+    return 0;
+}
+
+// Starts the replay threads, num_threads of them, each with an empty block
+// @return Number of threads started, which stop once done is set.
+static size_t start_partitions(Partition *parts, size_t num_threads,
+                               WalApply apply, atomic_int *stopped) {
+    size_t started = 0;
+    while (started < num_threads) {
+        Partition *part = &parts[started];
+        *part = (Partition){.apply = apply, .stopped = stopped};
+        pthread_mutex_init(&part->mutex, NULL);
+        pthread_cond_init(&part->ready, NULL);
+        pthread_cond_init(&part->space, NULL);
+        if (queue_block(part) != 0 ||
+            pthread_create(&part->thread, NULL, replay_thread, part) != 0) {
+            free(part->current);
+            pthread_mutex_destroy(&part->mutex);
+            pthread_cond_destroy(&part->ready);
+            pthread_cond_destroy(&part->space);
+            break;
+        }
+        started++;
+    }
+    return started;
+}
+
+// Queues the last blocks, waits for the replay threads and frees them
+static void stop_partitions(Partition *parts, size_t num_threads) {
+    for (size_t t = 0; t < num_threads; t++) {
+        Partition *part = &parts[t];
+        if (part->current != NULL) queue_block(part);
+        pthread_mutex_lock(&part->mutex);
+        part->done = 1;
+        pthread_cond_signal(&part->ready);
+        pthread_mutex_unlock(&part->mutex);
+    }
+    for (size_t t = 0; t < num_threads; t++) {
+        Partition *part = &parts[t];
+        pthread_join(part->thread, NULL);
+        free(part->current);
+        while (part->unused != NULL) {
+            ReplayBlock *next = part->unused->next;
+            free(part->unused);
+            part->unused = next;
+        }
+        pthread_mutex_destroy(&part->mutex);
+        pthread_cond_destroy(&part->ready);
+        pthread_cond_destroy(&part->space);
+    }
+}
+
+long wal_replay(const char *path, uint64_t offset, size_t num_threads,
+                WalPartition partition, WalApply apply) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;
+        perror("Failed to open the WAL");
+        return -1;
+    }
+
+    LogReader reader = {.fd = fd, .data = malloc(READER_SIZE)};
+    char(*keys)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+    char(*values)[MAX_STRING_SIZE] = malloc(MAX_WRITE_SIZE * MAX_STRING_SIZE);
+    Partition *parts = num_threads > 1 ? malloc(num_threads * sizeof(Partition))
+                                       : NULL;
+    if (reader.data == NULL || keys == NULL || values == NULL ||
+        (num_threads > 1 && parts == NULL)) {
+        free(reader.data);
+        free(keys);
+        free(values);
+        free(parts);
+        close(fd);
+        return -1;
+    }
+
+    off_t start = find_start(&reader, offset);
+    reader = (LogReader){.fd = fd, .data = reader.data, .offset = start};
+    long replayed = lseek(fd, start, SEEK_SET) == start ? 0 : -1;
+
+    // With several threads each applies the keys of its partitions, in the
+    // order they were logged, while this thread reads the log
+    atomic_int stopped;
+    atomic_init(&stopped, 0);
+    size_t started = 0;
+    if (parts != NULL && replayed == 0) {
+        started = start_partitions(parts, num_threads, apply, &stopped);
+    }
+
+    while (replayed >= 0 && !atomic_load(&stopped)) {
+        size_t size;
+        const unsigned char *payload = next_record(&reader, 1, &size);
+        if (payload == NULL) break;
+
+        WalOp op;
+        size_t num_pairs = decode(payload, size, &op, keys, values);
+        if (num_pairs == 0) {
+            // Not consumed, so that the log is truncated before it
+            reader.offset -= (off_t)(sizeof(WalHeader) + size);
+            break;
+        }
+        int error = started > 0
+                        ? dispatch(parts, started, partition, op, num_pairs,
+                                   keys, values)
+                        : apply(op, num_pairs, keys,
+                                op == WAL_WRITE ? values : NULL);
+        if (error) atomic_store(&stopped, 1);
+        replayed++;
+    }
+    if (started > 0) stop_partitions(parts, started);
+    if (atomic_load(&stopped)) replayed = -1;
+
+    off_t valid = reader.offset;  // End of the last complete record
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (replayed >= 0 && end > valid) {
+        fprintf(stderr, "Discarding %lld bytes of incomplete WAL records\n",
+                (long long)(end - valid));
+        if (ftruncate(fd, valid) != 0) {
+            perror("Failed to truncate the WAL");
+            replayed = -1;
+        }
+    }
+
+    free(reader.data);
+    free(keys);
+    free(values);
+    free(parts);
+    close(fd);
+    return replayed;
+}
+
+int wal_open(const char *path, int sync_ms) {
+    wal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (wal_fd == -1) {
+        perror("Failed to open the WAL");
+        return 1;
+    }
+
+    wal_start = lseek(wal_fd, 0, SEEK_END);
+    if (wal_start < 0) wal_start = 0;
+    wal_sync_ms = sync_ms;
+    buffer = (WalBuffer){NULL, 0, 0};
+    spare = (WalBuffer){NULL, 0, 0};
+    appended = 0;
+    durable = 0;
+    flushing = 0;
+    failed = 0;
+    stopping = 0;
+    syncer_running = 0;
+
+    if (sync_ms > 0) {
+        if (pthread_create(&syncer, NULL, syncer_thread, NULL) != 0) {
+            fprintf(stderr, "Failed to start the WAL sync thread\n");
+            close(wal_fd);
+            wal_fd = -1;
+            return 1;
+        }
+        syncer_running = 1;
+    }
+    return 0;
+}
+
+int wal_enabled() { return wal_fd != -1; }
+
+uint64_t wal_position() {
+    if (wal_fd == -1) return 0;
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t position = (uint64_t)wal_start + appended;
+    pthread_mutex_unlock(&wal_mutex);
+    return position;
+}
+
+void wal_append(WalOp op, size_t num_pairs, char keys[][MAX_STRING_SIZE],
+                char values[][MAX_STRING_SIZE]) {
+    if (wal_fd == -1 || num_pairs == 0) return;
+
+    char record[sizeof(WalHeader) + WAL_MAX_PAYLOAD];
+    char *payload = record + sizeof(WalHeader);
+    size_t pos = 0;
+    payload[pos++] = (char)op;
+    uint16_t count = (uint16_t)num_pairs;
+    memcpy(payload + pos, &count, sizeof(count));
+    pos += sizeof(count);
+
+    for (size_t i = 0; i < num_pairs; i++) {
+        for (int field = 0; field < (values != NULL ? 2 : 1); field++) {
+            const char *str = field == 0 ? keys[i] : values[i];
+            uint16_t len = (uint16_t)strnlen(str, MAX_STRING_SIZE - 1);
+            memcpy(payload + pos, &len, sizeof(len));
+            memcpy(payload + pos + sizeof(len), str, len);
+            pos += sizeof(len) + len;
+        }
+    }
+
+    WalHeader header = {(uint32_t)pos, crc32c(0, payload, pos)};
+    memcpy(record, &header, sizeof(header));
+    size_t size = sizeof(header) + pos;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (buffer.len + size > buffer.cap) {
+        size_t cap = buffer.cap > 0 ? buffer.cap * 2 : 65536;
+        while (cap < buffer.len + size) cap *= 2;
+        char *grown = realloc(buffer.data, cap);
+        if (grown == NULL) {
+            fprintf(stderr, "Failed to grow the WAL buffer\n");
+            failed = 1;
+            pthread_mutex_unlock(&wal_mutex);
+            return;
+        }
+        buffer.data = grown;
+        buffer.cap = cap;
+    }
+    memcpy(buffer.data + buffer.len, record, size);
+    buffer.len += size;
+    appended += size;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+int wal_commit() {
+    if (wal_fd == -1) return 0;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (wal_sync_ms > 0) {
+        int result = failed;
+        pthread_mutex_unlock(&wal_mutex);
+        return result;
+    }
+
+    // Whoever finds no write in progress leads the next one, which covers
+    // every command appended until then
+    unsigned long long target = appended;
+    while (durable < target && !failed) {
+        if (flushing) {
+            pthread_cond_wait(&wal_flushed, &wal_mutex);
+        } else {
+            flush_locked(wal_sync_ms == WAL_SYNC_ALWAYS);
+        }
+    }
+    int result = failed;
+    pthread_mutex_unlock(&wal_mutex);
+    return result;
+}
+
+void wal_close() {
+    if (wal_fd == -1) return;
+
+    if (syncer_running) {
+        pthread_mutex_lock(&wal_mutex);
+        stopping = 1;
+        pthread_cond_signal(&syncer_cond);
+        pthread_mutex_unlock(&wal_mutex);
+        pthread_join(syncer, NULL);
+    }
+
+    pthread_mutex_lock(&wal_mutex);
+    while (flushing) pthread_cond_wait(&wal_flushed, &wal_mutex);
+    if (durable < appended && !failed) {
+        flush_locked(wal_sync_ms != WAL_SYNC_NEVER);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+
+    close(wal_fd);
+    wal_fd = -1;
+    free(buffer.data);
+    free(spare.data);
+}